@@ -24,6 +24,7 @@ namespace Behaviors
         Condition_BatteryState,
         Condition_Idle,
         Condition_Rolled,
+        Condition_Count
     };
 
     /// <summary>
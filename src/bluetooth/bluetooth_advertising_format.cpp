@@ -0,0 +1,45 @@
+#include "bluetooth_advertising_format.h"
+#include <string.h>
+
+namespace Bluetooth::AdvertisingFormat
+{
+    void clearRollHistory(CustomManufacturerData& data) {
+        data.rollCounter = 0;
+        memset(data.rollHistory, ADV_ROLL_HISTORY_EMPTY, sizeof(data.rollHistory));
+    }
+
+    void addRoll(CustomManufacturerData& data, uint8_t face) {
+        // So scanners can tell identical consecutive rolls apart and notice missed ones
+        data.rollCounter++;
+        memmove(data.rollHistory + 1, data.rollHistory, ADV_ROLL_HISTORY_SIZE - 1);
+        data.rollHistory[0] = face;
+    }
+
+    bool decode(const uint8_t* data, uint16_t size, DieState& outState) {
+        if (size != BaseDataSize && size != BroadcastDataSize) {
+            return false;
+        }
+        CustomManufacturerData custom;
+        memset(&custom, 0, sizeof(custom));
+        memcpy(&custom, data, size);
+
+        outState.ledCount = custom.ledCount;
+        outState.dieType = custom.designAndColor >> 4;
+        outState.colorway = custom.designAndColor & 0x0F;
+        outState.rollState = custom.rollState;
+        outState.currentFace = custom.currentFace;
+        outState.batteryLevelPercent = custom.batteryLevelAndCharging & 0x7F;
+        outState.charging = (custom.batteryLevelAndCharging & 0x80) != 0;
+        outState.hasRollHistory = size == BroadcastDataSize;
+        outState.rollCounter = custom.rollCounter;
+        memcpy(outState.rollHistory, custom.rollHistory, sizeof(outState.rollHistory));
+        return true;
+    }
+
+    uint8_t countNewRolls(const DieState& previous, const DieState& current) {
+        if (!previous.hasRollHistory || !current.hasRollHistory) {
+            return 0;
+        }
+        return (uint8_t)(current.rollCounter - previous.rollCounter);
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Format of the custom manufacturer data the die advertises. It has no SDK dependency
+// so scanners and host tools can build it and decode the data the same way the die encodes it.
+
+#define ADV_ROLL_HISTORY_SIZE 3
+#define ADV_ROLL_HISTORY_EMPTY 0xFF     // History entry before that many rolls happened
+
+namespace Bluetooth::AdvertisingFormat
+{
+#pragma pack( push, 1)
+    // Custom advertising data, so the Pixel app can identify dice before they're even connected
+    struct CustomManufacturerData
+    {
+        uint8_t ledCount;
+        uint8_t designAndColor; // Die type in the high nibble, colorway in the low one
+        uint8_t rollState; // Accelerometer::RollState, indicates whether the dice is being shaken
+        uint8_t currentFace; // Which face is currently up
+        uint8_t batteryLevelAndCharging; // Charge level in percent, MSB is charging
+
+        // Only advertised in broadcast mode, for scanners that track dice without connecting
+        uint8_t rollCounter; // Incremented on each roll result, wraps around
+        uint8_t rollHistory[ADV_ROLL_HISTORY_SIZE]; // Faces of the last roll results, most recent first
+    };
+#pragma pack(pop)
+
+    // Size of the data outside and in broadcast mode
+    const uint16_t BaseDataSize = offsetof(CustomManufacturerData, rollCounter);
+    const uint16_t BroadcastDataSize = sizeof(CustomManufacturerData);
+
+    /// <summary>
+    /// What a scanner gets out of the advertised data
+    /// </summary>
+    struct DieState
+    {
+        uint8_t ledCount;
+        uint8_t dieType;
+        uint8_t colorway;
+        uint8_t rollState;
+        uint8_t currentFace;
+        uint8_t batteryLevelPercent;
+        bool charging;
+        bool hasRollHistory; // Broadcast mode, the fields below are valid
+        uint8_t rollCounter;
+        uint8_t rollHistory[ADV_ROLL_HISTORY_SIZE];
+    };
+
+    void clearRollHistory(CustomManufacturerData& data);
+    void addRoll(CustomManufacturerData& data, uint8_t face);
+
+    // Decodes the manufacturer data (past the company identifier), returns false if the size doesn't match
+    bool decode(const uint8_t* data, uint16_t size, DieState& outState);
+
+    // Number of roll results between two broadcasts, the faces of the last ADV_ROLL_HISTORY_SIZE
+    // of them are in the current roll history. Wraps after 255 rolls.
+    uint8_t countNewRolls(const DieState& previous, const DieState& current);
+}
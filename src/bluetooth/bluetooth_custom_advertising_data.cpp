@@ -1,44 +1,76 @@
 #include "bluetooth_stack.h"
 #include "bluetooth_message_service.h"
 #include "bluetooth_custom_advertising_data.h"
+#include "bluetooth_advertising_format.h"
 #include "modules/accelerometer.h"
 #include "modules/battery_controller.h"
 #include "config/board_config.h"
 #include "config/dice_variants.h"
+#include "config/settings.h"
 #include "die.h"
+#include "drivers_nrf/timers.h"
 #include "ble_advdata.h"
 #include "ble_advertising.h"
 
 using namespace Config;
 using namespace Modules;
+using namespace DriversNRF;
+
+#define ADV_DATA_MIN_UPDATE_INTERVAL_MS 250     // Don't reconfigure the advertising data more often than this
+#define ADV_IDLE_DELAY_MS 30000                 // Advertise less often after this long without the roll state changing
 
 namespace Bluetooth::CustomAdvertisingDataHandler
 {
-#pragma pack( push, 1)
-    // Custom advertising data, so the Pixel app can identify dice before they're even connected
-    struct CustomManufacturerData
-    {
-        uint8_t ledCount;
-        uint8_t designAndColor;
-        Accelerometer::RollState rollState; // Indicates whether the dice is being shaken, 8 bits
-        uint8_t currentFace; // Which face is currently up
-        uint8_t batteryLevelAndCharging; // Charge level in percent, MSB is charging
-    };
-#pragma pack(pop)
+    using namespace AdvertisingFormat;
 
     // Global custom manufacturer and service data
     static CustomManufacturerData customManufacturerData;
 
+    // Changes are coalesced, the advertising data is only updated once in a while
+    static bool started = false;
+    static bool dirty = false;
+    static bool flushPending = false;
+    static int lastUpdateTime = 0;
+
+    static bool broadcastMode = false;
+
     void onRollStateChange(void* param, Accelerometer::RollState prevState, int prevFace, Accelerometer::RollState newState, int newFace);
     void onBatteryStateChange(void *param, BatteryController::BatteryState state);
     void onBatteryLevelChange(void *param, uint8_t levelPercent);
     void updateCustomAdvertisingDataState(Accelerometer::RollState newState, int newFace);
     void updateCustomAdvertisingDataBattery(uint8_t batteryValue, uint8_t mask);
+    void requestUpdate(bool immediate);
+    void flushCallback(void* param);
+    void idleCallback(void* param);
+    void setBroadcastModeHandler(const Message* msg);
+    uint16_t getCustomManufacturerDataSize();
 
     void init() {
         // Set custom advertising data values to 0
         // Actual values will be updated on start()
         memset(&customManufacturerData, 0, sizeof(customManufacturerData));
+        clearRollHistory(customManufacturerData);
+        broadcastMode = SettingsManager::getBroadcastMode();
+
+        MessageService::RegisterMessageHandler(Message::MessageType_SetBroadcastMode, setBroadcastModeHandler);
+    }
+
+    uint16_t getCustomManufacturerDataSize() {
+        return broadcastMode ? BroadcastDataSize : BaseDataSize;
+    }
+
+    void setBroadcastModeHandler(const Message* msg) {
+        auto message = (const MessageSetBroadcastMode*)msg;
+        broadcastMode = message->enabled != 0;
+        NRF_LOG_INFO("Broadcast mode: %d", broadcastMode);
+
+        // Picked up the next time the advertising data is updated, i.e. once disconnected.
+        // The SDK shortens the advertised name to what room is left.
+        static int16_t sequence;
+        sequence = MessageService::getHandledSequence();
+        SettingsManager::programBroadcastMode(broadcastMode, [](bool success) {
+            MessageService::SendReply(Message::MessageType_SetBroadcastModeAck, sequence);
+        });
     }
 
     bool isChargingOrDone(BatteryController::BatteryState state) {
@@ -50,29 +82,84 @@ namespace Bluetooth::CustomAdvertisingDataHandler
         customManufacturerData.ledCount = Config::BoardManager::getBoard()->ledCount;
         customManufacturerData.designAndColor = (SettingsManager::getDieType() << 4) | SettingsManager::getColorway();
         customManufacturerData.currentFace = Accelerometer::currentFace();
-        customManufacturerData.rollState = Accelerometer::currentRollState();
+        customManufacturerData.rollState = (uint8_t)Accelerometer::currentRollState();
         customManufacturerData.batteryLevelAndCharging =
             (BatteryController::getLevelPercent() & 0x7F)
             | (isChargingOrDone(BatteryController::getBatteryState()) ? 0x80 : 0);
 
         Bluetooth::Stack::updateCustomAdvertisingData(
-            (uint8_t *)&customManufacturerData, sizeof(customManufacturerData));
+            (uint8_t *)&customManufacturerData, getCustomManufacturerDataSize());
+        dirty = false;
+        lastUpdateTime = Timers::millis();
+
+        // Advertising restarts in fast mode after a burst, so we may already be started
+        if (!started) {
+            started = true;
 
-        // Register to be notified of accelerometer changes
-        Accelerometer::hookRollState(onRollStateChange, nullptr);
+            // Register to be notified of accelerometer changes
+            Accelerometer::hookRollState(onRollStateChange, nullptr);
 
-        // And battery events too
-        BatteryController::hookBatteryState(onBatteryStateChange, nullptr);
-        BatteryController::hookLevel(onBatteryLevelChange, nullptr);
+            // And battery events too
+            BatteryController::hookBatteryState(onBatteryStateChange, nullptr);
+            BatteryController::hookLevel(onBatteryLevelChange, nullptr);
+
+            Timers::setDelayedCallback(idleCallback, nullptr, ADV_IDLE_DELAY_MS);
+        }
     }
 
     void stop() {
+        if (!started) {
+            return;
+        }
+        started = false;
+        dirty = false;
+
         // Unhook from accelerometer events, we don't need them
         Accelerometer::unHookRollState(onRollStateChange);
 
         // Unhook battery events too
         BatteryController::unHookBatteryState(onBatteryStateChange);
         BatteryController::unHookLevel(onBatteryLevelChange);
+
+        if (flushPending) {
+            flushPending = false;
+            Timers::cancelDelayedCallback(flushCallback);
+        }
+        Timers::cancelDelayedCallback(idleCallback);
+
+        NRF_LOG_INFO("Advertising reconfigurations: %d", Bluetooth::Stack::getAdvertisingReconfigurationCount());
+    }
+
+    /// <summary>
+    /// Pushes the custom data to the SoftDevice if it changed, no more often than
+    /// ADV_DATA_MIN_UPDATE_INTERVAL_MS unless immediate is set
+    /// </summary>
+    void requestUpdate(bool immediate) {
+        dirty = true;
+        int elapsed = Timers::millis() - lastUpdateTime;
+        if (immediate || elapsed >= ADV_DATA_MIN_UPDATE_INTERVAL_MS) {
+            if (flushPending) {
+                flushPending = false;
+                Timers::cancelDelayedCallback(flushCallback);
+            }
+            flushCallback(nullptr);
+        } else if (!flushPending) {
+            // Coalesce with whatever else changes until then
+            flushPending = Timers::setDelayedCallback(flushCallback, nullptr, ADV_DATA_MIN_UPDATE_INTERVAL_MS - elapsed);
+        }
+    }
+
+    void flushCallback(void* param) {
+        flushPending = false;
+        if (started && dirty) {
+            dirty = false;
+            lastUpdateTime = Timers::millis();
+            Bluetooth::Stack::updateCustomAdvertisingData((uint8_t*)&customManufacturerData, getCustomManufacturerDataSize());
+        }
+    }
+
+    void idleCallback(void* param) {
+        Bluetooth::Stack::idleAdvertising();
     }
 
     void onBatteryStateChange(void *param, BatteryController::BatteryState state) {
@@ -85,18 +172,36 @@ namespace Bluetooth::CustomAdvertisingDataHandler
 
     void onRollStateChange(void* param, Accelerometer::RollState prevState, int prevFace, Accelerometer::RollState newState, int newFace) {
         updateCustomAdvertisingDataState(newState, newFace);
+
+        // Start over the countdown to idle advertising
+        Timers::cancelDelayedCallback(idleCallback);
+        Timers::setDelayedCallback(idleCallback, nullptr, ADV_IDLE_DELAY_MS);
+
+        if (newState == Accelerometer::RollState_Rolled || newState == Accelerometer::RollState_Crooked) {
+            // Advertise the result quickly for a little while, this also restarts
+            // advertising with the data that was just updated
+            Bluetooth::Stack::burstAdvertising();
+        } else {
+            Bluetooth::Stack::resumeAdvertising();
+        }
     }
 
     void updateCustomAdvertisingDataBattery(uint8_t batteryValue, uint8_t mask) {
         customManufacturerData.batteryLevelAndCharging &= mask;
         customManufacturerData.batteryLevelAndCharging |= batteryValue;
-        Bluetooth::Stack::updateCustomAdvertisingData((uint8_t*)&customManufacturerData, sizeof(customManufacturerData));
+        requestUpdate(false);
     }
 
     void updateCustomAdvertisingDataState(Accelerometer::RollState newState, int newFace) {
         // Update manufacturer specific advertising data
         customManufacturerData.currentFace = newFace;
         customManufacturerData.rollState = newState;
-        Bluetooth::Stack::updateCustomAdvertisingData((uint8_t*)&customManufacturerData, sizeof(customManufacturerData));
+        if (newState == Accelerometer::RollState_Rolled) {
+            addRoll(customManufacturerData, newFace);
+        }
+
+        // Make sure the final state is advertised right away once the die settles
+        bool settled = newState != Accelerometer::RollState_Rolling && newState != Accelerometer::RollState_Handling;
+        requestUpdate(settled);
     }
 }
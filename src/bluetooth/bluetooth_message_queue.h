@@ -9,18 +9,38 @@ namespace Bluetooth
 
     /// <summary>
     /// Simple FIFO queue template, with a fixed max size so it doesn't allocate
-    /// This version stores the size of items added, and shifts the entire buffer
-    /// down on a dequeue for simplicity.
+    /// This version stores variable size records in a circular buffer. Messages are
+    /// read in place and the critical sections only cover index updates, copying a
+    /// message in happens outside of it.
+    /// Any number of producers may enqueue, there must be a single consumer.
     /// </summary>
     template <int Size>
     class MessageQueue
     {
         // The data structure inside the buffer is as follows:
-        // [size|message][size|message][..]
-        // size is a uint16_t
+        // [size|message][size|message][wrap]..[size|message]
+        // size is a uint16_t and records are padded to keep sizes aligned.
+        // A wrap marker (or less than a size worth of space) at the end of the buffer
+        // means the next record is at the start.
+        static_assert(Size % sizeof(uint16_t) == 0, "Queue size must be a multiple of 2");
+
+        static const uint16_t WrapMarker = 0xFFFF;
+        static const uint16_t PendingFlag = 0x8000; // Set while the record is being copied in
+
         uint8_t buffer[Size];
         int _count;
-        int _end;
+        int _head; // Offset of the oldest record
+        int _tail; // Offset of the next record
+
+        uint16_t* sizeAt(int offset)
+        {
+            return (uint16_t*)(void*)(buffer + offset);
+        }
+
+        static int recordSize(uint16_t size)
+        {
+            return (sizeof(uint16_t) + size + 1) & ~1;
+        }
 
     public:
         /// <summary>
@@ -28,7 +48,8 @@ namespace Bluetooth
         /// </summary>
         MessageQueue()
             : _count(0)
-            , _end(0)
+            , _head(0)
+            , _tail(0)
         {
         }
 
@@ -38,22 +59,78 @@ namespace Bluetooth
         /// </summary>
         bool tryEnqueue(const Message* msg,  uint16_t size)
         {
-            bool ret = false;
+            int needed = recordSize(size);
+            int offset = -1;
             CRITICAL_REGION_ENTER();
-            // Is there enough room?
-            ret = _end + size + sizeof(uint16_t) < Size;
-            if (ret) {
-                // Yes, go ahead and allocate
-                auto sizeptr = (uint16_t*)(void*)(buffer + _end);
-                *sizeptr = size;
-
-                auto queueMsg = (Message*)(void*)(buffer + _end + sizeof(uint16_t));
-                memcpy(queueMsg, msg, size);
-                _end += size + sizeof(uint16_t);
+            if (_count == 0) {
+                // Start over from the beginning, so we get the most contiguous room
+                _head = 0;
+                _tail = 0;
+            }
+            if (_tail > _head || _count == 0) {
+                // Free space is from tail to the end, and from the start to head
+                if (_tail + needed <= Size) {
+                    offset = _tail;
+                } else if (needed <= _head) {
+                    if (Size - _tail >= (int)sizeof(uint16_t)) {
+                        *sizeAt(_tail) = WrapMarker;
+                    }
+                    offset = 0;
+                }
+            } else if (_tail + needed <= _head) {
+                // Free space is between tail and head
+                offset = _tail;
+            }
+            if (offset >= 0) {
+                // Reserve the record, the consumer skips it until the copy is done
+                *sizeAt(offset) = size | PendingFlag;
+                _tail = offset + needed;
+                if (_tail == Size) {
+                    _tail = 0;
+                }
                 _count++;
             }
             CRITICAL_REGION_EXIT();
-            return ret;
+
+            if (offset < 0) {
+                return false;
+            }
+            memcpy(buffer + offset + sizeof(uint16_t), msg, size);
+            *sizeAt(offset) = size;
+            return true;
+        }
+
+        /// <summary>
+        /// Returns the oldest message without removing it, or nullptr if there is none
+        /// (or if it is still being copied in). Only the consumer may call this.
+        /// </summary>
+        const Message* peek(uint16_t* outSize)
+        {
+            if (_count == 0) {
+                return nullptr;
+            }
+            // Only the consumer moves the head, so no need for a critical section here
+            if (Size - _head < (int)sizeof(uint16_t) || *sizeAt(_head) == WrapMarker) {
+                _head = 0;
+            }
+            uint16_t size = *sizeAt(_head);
+            if (size & PendingFlag) {
+                return nullptr;
+            }
+            *outSize = size;
+            return (const Message*)(void*)(buffer + _head + sizeof(uint16_t));
+        }
+
+        /// <summary>
+        /// Removes the message returned by the last call to peek()
+        /// </summary>
+        void pop()
+        {
+            int next = _head + recordSize(*sizeAt(_head));
+            CRITICAL_REGION_ENTER();
+            _head = next == Size ? 0 : next;
+            _count--;
+            CRITICAL_REGION_EXIT();
         }
 
         typedef bool(*TryDequeueFunctor)(const Message* msg, uint16_t msgSize);
@@ -65,28 +142,12 @@ namespace Bluetooth
         /// </summary>
         bool tryDequeue(TryDequeueFunctor functor)
         {
-            bool ret = false;
-            CRITICAL_REGION_ENTER();
-            ret = _count > 0;
-            if (ret)
-            {
-                auto sizeptr = (uint16_t*)(void*)(buffer);
-                uint16_t msgSize = *sizeptr;
-                uint16_t bufferSize = msgSize + sizeof(uint16_t);
-                auto msg = (const Message*)(void*)(buffer + sizeof(uint16_t));
-                ret = functor(msg, msgSize);
-                if (ret)
-                {
-                    // Shift everything down
-                    auto nextItemPtr = (uint8_t*)(void*)(buffer + bufferSize);
-                    memcpy(buffer, nextItemPtr, _end - bufferSize);
-
-                    // Update counts
-                    _end -= bufferSize;
-                    _count--;
-                }
+            uint16_t msgSize;
+            auto msg = peek(&msgSize);
+            bool ret = msg != nullptr && functor(msg, msgSize);
+            if (ret) {
+                pop();
             }
-            CRITICAL_REGION_EXIT();
             return ret;
         }
 
@@ -96,7 +157,8 @@ namespace Bluetooth
         void clear()
         {
             CRITICAL_REGION_ENTER();
-            _end = 0;
+            _head = 0;
+            _tail = 0;
             _count = 0;
             CRITICAL_REGION_EXIT();
         }
@@ -14,10 +14,16 @@
 #include "drivers_nrf/scheduler.h"
 #include "drivers_nrf/power_manager.h"
 #include "drivers_nrf/timers.h"
+#include "connection_profiles.h"
 
 #include "core/queue.h"
 
 #define MESSAGE_QUEUE_SIZE 160
+#define MAX_BATCH_SIZE (NRF_SDH_BLE_GATT_MAX_MTU_SIZE - 3) // Max notification payload
+#define MAX_RECEIVED_MESSAGES (MESSAGE_QUEUE_SIZE / 4) // The smallest record in the queue takes 4 bytes
+#define FAST_HANDLER_BUDGET_US 1000
+#define FAST_HANDLER_MAX_OVERRUNS 3 // Overruns, minus the calls within budget, before a fast handler is queued
+#define LATENCY_HISTOGRAM_FIRST_BUCKET_US 250
 
 using namespace DriversNRF;
 using namespace Core;
@@ -36,17 +42,52 @@ namespace Bluetooth::MessageService
     ble_gatts_char_handles_t tx_handles;
 
     MessageHandler messageHandlers[Message::MessageType_Count];
+    uint32_t fastHandlers[(Message::MessageType_Count + 31) / 32]; // One bit per message type
+    uint8_t fastOverruns[Message::MessageType_Count];
+
+    // Info about the messages in ReceiveQueue, in the same order
+    struct ReceivedMessageInfo
+    {
+        uint32_t time;
+        int16_t sequence; // MESSAGE_NO_SEQUENCE if the message wasn't sequenced
+    };
+    Queue<ReceivedMessageInfo, MAX_RECEIVED_MESSAGES> receivedInfos;
+
+    // Sequence of the message being handled, echoed in the messages sent meanwhile
+    static int16_t currentSequence = MESSAGE_NO_SEQUENCE;
+    static_assert(Message::MessageType_Count <= MESSAGE_SEQUENCE_FLAG, "Message types must leave room for the sequence flag");
+
+    // Receive to handler latencies
+    static uint16_t queuedLatencies[LATENCY_HISTOGRAM_BUCKET_COUNT];
+    static uint16_t fastLatencies[LATENCY_HISTOGRAM_BUCKET_COUNT];
+
+    // Outgoing batch, only used once the app has enabled batching.
+    // The data structure is [type=Batch][size|message][size|message][..]
+    static bool batchingEnabled = false;
+    static uint8_t batch[MAX_BATCH_SIZE];
+    static uint16_t batchSize = 0;
+
+    static uint16_t handledMessageSize = 0;
 
     Stack::SendResult send(const uint8_t* data, uint16_t size);
+    bool sendOrQueue(const Message* msg, int msgSize);
+    void flushBatch();
+    void setBatchingHandler(const Message* msg);
+    void requestLatencyHistogramsHandler(const Message* msg);
+    void onConnectionEvent(void* param, bool connected);
     bool SendMessage(Message::MessageType msgType);
     bool SendMessage(const Message* msg, int msgSize);
+    bool SendReply(const Message* msg, int msgSize, int16_t sequence);
 
     void onMessageReceived(const uint8_t* data, uint16_t len);
+    void dispatchMessage(const Message* msg, uint16_t len, int16_t sequence);
     void update();
 
     void init() {
         // Clear message handle array
         memset(messageHandlers, 0, sizeof(MessageHandler) * Message::MessageType_Count);
+        memset(fastHandlers, 0, sizeof(fastHandlers));
+        memset(fastOverruns, 0, sizeof(fastOverruns));
 
         ret_code_t            err_code;
         ble_uuid_t            ble_uuid;
@@ -99,6 +140,11 @@ namespace Bluetooth::MessageService
         err_code = characteristic_add(service_handle, &add_char_params, &tx_handles);
         APP_ERROR_CHECK(err_code);
 
+        // Batching is opt-in, so older apps keep getting one message per notification
+        RegisterMessageHandler(Message::MessageType_SetBatching, setBatchingHandler);
+        RegisterMessageHandler(Message::MessageType_RequestLatencyHistograms, requestLatencyHistogramsHandler);
+        Stack::hook(onConnectionEvent, nullptr);
+
         NRF_LOG_DEBUG("Message Service init");
     }
 
@@ -107,17 +153,67 @@ namespace Bluetooth::MessageService
     }
 
     bool needUpdate() {
-        return ReceiveQueue.count() + SendQueue.count() > 0;
+        return ReceiveQueue.count() + SendQueue.count() > 0 || batchSize > 0;
+    }
+
+    void recordLatency(uint16_t* histogram, uint32_t receiveTime) {
+        uint32_t latencyUs = Timers::ticksToMicros(Timers::ticks() - receiveTime);
+        int bucket = 0;
+        while (bucket < LATENCY_HISTOGRAM_BUCKET_COUNT - 1 && latencyUs >= (LATENCY_HISTOGRAM_FIRST_BUCKET_US << bucket)) {
+            bucket++;
+        }
+        if (histogram[bucket] < UINT16_MAX) {
+            histogram[bucket]++;
+        }
+    }
+
+    bool isRegisteredFast(Message::MessageType msgType) {
+        return (fastHandlers[msgType / 32] & (1 << (msgType % 32))) != 0;
+    }
+
+    bool isFast(Message::MessageType msgType) {
+        return isRegisteredFast(msgType) && fastOverruns[msgType] < FAST_HANDLER_MAX_OVERRUNS;
+    }
+
+    /// <summary>
+    /// A handler can't be stopped once called, so the budget only decides where the next calls go.
+    /// Calls within budget take back overruns, from either path, so a handler that was slow
+    /// for a while is called right away again once it is quick.
+    /// </summary>
+    void checkFastHandlerTime(Message::MessageType msgType, uint32_t startTime) {
+        if (!isRegisteredFast(msgType)) {
+            return;
+        }
+        uint32_t durationUs = Timers::ticksToMicros(Timers::ticks() - startTime);
+        if (durationUs > FAST_HANDLER_BUDGET_US) {
+            if (fastOverruns[msgType] < FAST_HANDLER_MAX_OVERRUNS) {
+                fastOverruns[msgType]++;
+            }
+            NRF_LOG_WARNING("Fast handler for message %d took %dus, %d overruns", msgType, durationUs, fastOverruns[msgType]);
+        } else if (fastOverruns[msgType] > 0) {
+            fastOverruns[msgType]--;
+        }
     }
 
     void update() {
         // Process received messages if possible
         while (ReceiveQueue.tryDequeue([] (const Message* msg, uint16_t msgSize) {
+            ReceivedMessageInfo info;
+            info.sequence = MESSAGE_NO_SEQUENCE;
+            if (receivedInfos.tryDequeue(info)) {
+                recordLatency(queuedLatencies, info.time);
+            }
+
             // Cast the data
             auto handler = messageHandlers[(int)msg->type];
             if (handler != nullptr) {
                 NRF_LOG_DEBUG("Calling message handler %08x", handler);
+                handledMessageSize = msgSize;
+                currentSequence = info.sequence;
+                uint32_t startTime = Timers::ticks();
                 handler(msg);
+                currentSequence = MESSAGE_NO_SEQUENCE;
+                checkFastHandlerTime(msg->type, startTime);
             }
             return true;
         })) {
@@ -142,6 +238,9 @@ namespace Bluetooth::MessageService
                 });
             }
         }
+
+        // Send whatever was batched during this pass
+        flushBatch();
     }
 
     void BLEObserver(ble_evt_t const * p_ble_evt, void * p_context) {
@@ -181,8 +280,98 @@ namespace Bluetooth::MessageService
     }
 
     bool SendMessage(const Message* msg, int msgSize) {
+        return SendReply(msg, msgSize, currentSequence);
+    }
+
+    bool SendReply(Message::MessageType msgType, int16_t sequence) {
+        Message msg(msgType);
+        return SendReply(&msg, sizeof(Message), sequence);
+    }
+
+    bool SendReply(const Message* msg, int msgSize, int16_t sequence) {
+        // Replies to a sequenced request carry its sequence, see MESSAGE_SEQUENCE_FLAG,
+        // unless the sequence byte would make them too big to be sent
+        uint8_t sequenced[MAX_BATCH_SIZE];
+        if (sequence != MESSAGE_NO_SEQUENCE && msgSize + MESSAGE_SEQUENCE_SIZE <= MIN(Stack::getMaxPayloadSize(), MAX_BATCH_SIZE)) {
+            sequenced[0] = msg->type | MESSAGE_SEQUENCE_FLAG;
+            sequenced[1] = (uint8_t)sequence;
+            memcpy(&sequenced[2], (const uint8_t*)msg + sizeof(Message), msgSize - sizeof(Message));
+            msg = (const Message*)sequenced;
+            msgSize += MESSAGE_SEQUENCE_SIZE;
+        } else if (sequence != MESSAGE_NO_SEQUENCE) {
+            NRF_LOG_WARNING("Message %d too big to carry sequence %d", msg->type, sequence);
+        }
+
+        if (batchingEnabled) {
+            uint16_t capacity = MIN(Stack::getMaxPayloadSize(), MAX_BATCH_SIZE);
+            if (sizeof(Message) + 1 + msgSize <= capacity) {
+                // Make room if needed, then append the message to the current batch
+                if (batchSize + 1 + msgSize > capacity) {
+                    flushBatch();
+                }
+                CRITICAL_REGION_ENTER();
+                if (batchSize == 0) {
+                    batch[0] = Message::MessageType_Batch;
+                    batchSize = sizeof(Message);
+                }
+                batch[batchSize] = (uint8_t)msgSize;
+                memcpy(&batch[batchSize + 1], msg, msgSize);
+                batchSize += 1 + msgSize;
+                CRITICAL_REGION_EXIT();
+                // update() will flush the batch at the end of this frame
+                return true;
+            } else {
+                // Too big to be batched, keep messages in order
+                flushBatch();
+            }
+        }
+        return sendOrQueue(msg, msgSize);
+    }
+
+    /// <summary>
+    /// Sends the pending batch, if any. A batch of a single message is sent as that message.
+    /// </summary>
+    void flushBatch() {
+        uint8_t data[MAX_BATCH_SIZE];
+        uint16_t size;
+        CRITICAL_REGION_ENTER();
+        size = batchSize;
+        memcpy(data, batch, size);
+        batchSize = 0;
+        CRITICAL_REGION_EXIT();
+
+        if (size > sizeof(Message)) {
+            uint16_t firstSize = data[sizeof(Message)];
+            if (sizeof(Message) + 1 + firstSize == size) {
+                sendOrQueue((const Message*)&data[sizeof(Message) + 1], firstSize);
+            } else {
+                sendOrQueue((const Message*)data, size);
+            }
+        }
+    }
+
+    void setBatchingHandler(const Message* msg) {
+        auto setMsg = (const MessageSetBatching*)msg;
+        flushBatch();
+        batchingEnabled = setMsg->enable != 0;
+        NRF_LOG_INFO("Message batching %s", batchingEnabled ? "enabled" : "disabled");
+
+        MessageSetBatchingAck ackMsg;
+        ackMsg.enabled = batchingEnabled ? 1 : 0;
+        ackMsg.maxBatchSize = (uint8_t)MIN(Stack::getMaxPayloadSize(), MAX_BATCH_SIZE);
+        SendMessage(&ackMsg);
+    }
+
+    void onConnectionEvent(void* param, bool connected) {
+        // Each app has to opt in again
+        batchingEnabled = false;
+        batchSize = 0;
+    }
+
+    bool sendOrQueue(const Message* msg, int msgSize) {
         bool ret = false;
-        auto res = send((const uint8_t*)msg, msgSize);
+        // Don't overtake the messages still waiting for the stack
+        auto res = SendQueue.count() > 0 ? Stack::SendResult_Busy : send((const uint8_t*)msg, msgSize);
         switch (res) {
             case Stack::SendResult_Ok:
                 NRF_LOG_HEXDUMP_DEBUG((const void*)msg, msgSize);
@@ -232,27 +421,106 @@ namespace Bluetooth::MessageService
         }
     }
 
+    void RegisterFastMessageHandler(Message::MessageType msgType, MessageHandler handler) {
+        RegisterMessageHandler(msgType, handler);
+        if (messageHandlers[msgType] == handler) {
+            fastHandlers[msgType / 32] |= 1 << (msgType % 32);
+        }
+    }
+
     void UnregisterMessageHandler(Message::MessageType msgType) {
         messageHandlers[msgType] = nullptr;
+        fastHandlers[msgType / 32] &= ~(1 << (msgType % 32));
+        fastOverruns[msgType] = 0;
+    }
+
+    uint16_t getHandledMessageSize() {
+        return handledMessageSize;
+    }
+
+    int16_t getHandledSequence() {
+        return currentSequence;
+    }
+
+    /// <summary>
+    /// Calls the handler right away, SoftDevice events are dispatched from the scheduler
+    /// so we're not in an interrupt but we may be ahead of update() by a whole loop
+    /// </summary>
+    void callFastHandler(const Message* msg, uint16_t len, const ReceivedMessageInfo& info) {
+        auto handler = messageHandlers[(int)msg->type];
+        recordLatency(fastLatencies, info.time);
+
+        // The handler may itself check the handled size, restore it for the queued path
+        uint16_t previousHandledSize = handledMessageSize;
+        handledMessageSize = len;
+        currentSequence = info.sequence;
+        uint32_t startTime = Timers::ticks();
+        handler(msg);
+        handledMessageSize = previousHandledSize;
+        currentSequence = MESSAGE_NO_SEQUENCE;
+        checkFastHandlerTime(msg->type, startTime);
+    }
+
+    void requestLatencyHistogramsHandler(const Message* msg) {
+        MessageLatencyHistograms histogramsMsg;
+        memcpy(histogramsMsg.queued, queuedLatencies, sizeof(queuedLatencies));
+        memcpy(histogramsMsg.fast, fastLatencies, sizeof(fastLatencies));
+        SendMessage(&histogramsMsg);
     }
 
     void onMessageReceived(const uint8_t* data, uint16_t len) {
         if (len >= sizeof(Message)) {
             auto msg = reinterpret_cast<const Message*>(data);
-            if (msg->type >= Message::MessageType_WhoAreYou && msg->type < Message::MessageType_Count) {
-                if (!ReceiveQueue.tryEnqueue(msg, len)) {
-                    NRF_LOG_ERROR("Message of type %d NOT HANDLED (Scheduler full)", msg->type);
+            if (msg->type == Message::MessageType_Batch) {
+                // Unpack the batch, sub messages can't be batches themselves
+                uint16_t offset = sizeof(Message);
+                while (offset < len) {
+                    uint16_t subLen = data[offset];
+                    if (offset + 1 + subLen > len || (subLen > 0 && data[offset + 1] == Message::MessageType_Batch)) {
+                        NRF_LOG_ERROR("Bad batch at offset %d", offset);
+                        break;
+                    }
+                    onMessageReceived(&data[offset + 1], subLen);
+                    offset += 1 + subLen;
+                }
+            } else if (msg->type & MESSAGE_SEQUENCE_FLAG) {
+                // Strip the sequence byte, the handlers get the message as usual
+                uint8_t unsequenced[NRF_SDH_BLE_GATT_MAX_MTU_SIZE];
+                if (len >= sizeof(Message) + 1 && len <= sizeof(unsequenced)) {
+                    unsequenced[0] = msg->type & ~MESSAGE_SEQUENCE_FLAG;
+                    memcpy(&unsequenced[sizeof(Message)], &data[sizeof(Message) + 1], len - sizeof(Message) - 1);
+                    dispatchMessage((const Message*)unsequenced, len - 1, data[sizeof(Message)]);
                 } else {
-                    // update() will be called on the next frame
+                    NRF_LOG_ERROR("Bad sequenced message length %d", len);
                 }
             } else {
-                NRF_LOG_ERROR("Bad message type %d", msg->type);
+                dispatchMessage(msg, len, MESSAGE_NO_SEQUENCE);
             }
         } else {
             NRF_LOG_ERROR("Bad message length %d", len);
         }
     }
 
+    void dispatchMessage(const Message* msg, uint16_t len, int16_t sequence) {
+        if (msg->type >= Message::MessageType_WhoAreYou && msg->type < Message::MessageType_Count) {
+            ReceivedMessageInfo info;
+            info.time = Timers::ticks();
+            info.sequence = sequence;
+            ConnectionProfiles::notifyActivity();
+            if (isFast(msg->type) && ReceiveQueue.count() == 0) {
+                // Only when nothing is waiting, so that messages are still handled in order
+                callFastHandler(msg, len, info);
+            } else if (!ReceiveQueue.tryEnqueue(msg, len)) {
+                NRF_LOG_ERROR("Message of type %d NOT HANDLED (Scheduler full)", msg->type);
+            } else {
+                // update() will be called on the next frame
+                receivedInfos.enqueue(info);
+            }
+        } else {
+            NRF_LOG_ERROR("Bad message type %d", msg->type);
+        }
+    }
+
     static NotifyUserCallback currentCallback = nullptr;
     void NotifyUser(const char* text, bool ok, bool cancel, uint8_t timeout_s, NotifyUserCallback callback) {
         MessageNotifyUser notifyMsg;
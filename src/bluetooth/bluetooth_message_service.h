@@ -27,12 +27,34 @@ namespace Bluetooth::MessageService
         return SendMessage(msg, sizeof(Msg));
     }
 
+    // SendMessage() tags what is sent while a sequenced message is handled with its sequence.
+    // Handlers that reply later, from a callback, keep getHandledSequence() and reply with SendReply().
+    bool SendReply(Message::MessageType msgType, int16_t sequence);
+    bool SendReply(const Message* msg, int msgSize, int16_t sequence);
+
+    template <typename Msg>
+    bool SendReply(const Msg* msg, int16_t sequence) {
+        return SendReply(msg, sizeof(Msg), sequence);
+    }
+
     // Our bluetooth message handlers
     typedef void (*MessageHandler)(const Message* message);
 
     void RegisterMessageHandler(Message::MessageType msgType, MessageHandler handler);
+
+    // Fast handlers are called as soon as the message is received rather than from update(),
+    // unless other messages are waiting to be handled, so that messages stay in order.
+    // They must be short: one that keeps running over its time budget is called from update()
+    // until its calls are short again.
+    void RegisterFastMessageHandler(Message::MessageType msgType, MessageHandler handler);
     void UnregisterMessageHandler(Message::MessageType msgType);
 
+    // Size of the message being handled, lets handlers accept older (shorter) versions of a message
+    uint16_t getHandledMessageSize();
+
+    // Sequence of the message being handled, MESSAGE_NO_SEQUENCE if it has none
+    int16_t getHandledSequence();
+
     typedef void (*NotifyUserCallback)(bool result);
     void NotifyUser(const char* text, bool ok, bool cancel, uint8_t timeout_s, NotifyUserCallback callback);
 
@@ -79,6 +79,40 @@ namespace Bluetooth
             return "TransferTestAck";
         case MessageType_TransferTestFinished:
             return "TransferTestFinished";
+        case MessageType_RequestRollTraces:
+            return "RequestRollTraces";
+        case MessageType_RollTraces:
+            return "RollTraces";
+        case MessageType_Batch:
+            return "Batch";
+        case MessageType_SetBatching:
+            return "SetBatching";
+        case MessageType_SetBatchingAck:
+            return "SetBatchingAck";
+        case MessageType_RequestDataSetManifest:
+            return "RequestDataSetManifest";
+        case MessageType_DataSetManifest:
+            return "DataSetManifest";
+        case MessageType_TransferAnimSetPatch:
+            return "TransferAnimSetPatch";
+        case MessageType_TransferAnimSetPatchFinished:
+            return "TransferAnimSetPatchFinished";
+        case MessageType_TelemetryStream:
+            return "TelemetryStream";
+        case MessageType_RequestLatencyHistograms:
+            return "RequestLatencyHistograms";
+        case MessageType_LatencyHistograms:
+            return "LatencyHistograms";
+        case MessageType_SetBroadcastMode:
+            return "SetBroadcastMode";
+        case MessageType_SetBroadcastModeAck:
+            return "SetBroadcastModeAck";
+        case MessageType_RequestConnectionProfileStats:
+            return "RequestConnectionProfileStats";
+        case MessageType_ConnectionProfileStats:
+            return "ConnectionProfileStats";
+        case MessageType_ProvisionalRoll:
+            return "ProvisionalRoll";
         default:
             return "<missing>";
     }
@@ -19,6 +19,13 @@
 // Maximum size for messages (sort of)
 #define MAX_DATA_SIZE 100
 
+// Largest bulk data chunk, what's left of the largest notification (MTU minus the ATT header)
+// once the MessageBulkData header is added, rounded down so flash writes stay word aligned
+#define MAX_BULK_DATA_SIZE ((NRF_SDH_BLE_GATT_MAX_MTU_SIZE - 3 - 4) & ~3)
+
+// Largest payload of a telemetry stream message, past its 7 bytes header
+#define MAX_TELEMETRY_STREAM_DATA_SIZE (NRF_SDH_BLE_GATT_MAX_MTU_SIZE - 3 - 7)
+
 #pragma pack(push, 1)
 
 namespace Bluetooth
@@ -33,6 +40,13 @@ using BatteryControllerMode = Modules::BatteryController::ControllerOverrideMode
 using RunMode = Pixel::RunMode;
 using UserMode = Modules::UserModeController::UserMode;
 
+// Set in the type byte when it is followed by a sequence byte. The die strips it before
+// calling the handler, and echoes the sequence in the messages sent while handling it,
+// so the app may have several requests in flight and still match the replies.
+#define MESSAGE_SEQUENCE_FLAG 0x80
+#define MESSAGE_SEQUENCE_SIZE 1 // Added to a message by the sequence byte
+#define MESSAGE_NO_SEQUENCE -1  // For messages sent without a sequence byte
+
 /// <summary>
 ///  Base class for messages from the die to the app
 /// </summary>
@@ -126,6 +140,39 @@ struct Message
         MessageType_SetLEDToColor,
         MessageType_PrintAnimControllerState,
 
+        // Roll traces
+        MessageType_RequestRollTraces,
+        MessageType_RollTraces,
+
+        // Batching
+        MessageType_Batch,                  // Several messages, each prefixed with its size on one byte
+        MessageType_SetBatching,
+        MessageType_SetBatchingAck,
+
+        // Dataset delta updates
+        MessageType_RequestDataSetManifest,
+        MessageType_DataSetManifest,
+        MessageType_TransferAnimSetPatch,
+        MessageType_TransferAnimSetPatchFinished,
+
+        // Batched telemetry
+        MessageType_TelemetryStream,
+
+        // Message handling latency
+        MessageType_RequestLatencyHistograms,
+        MessageType_LatencyHistograms,
+
+        // Connectionless roll broadcast
+        MessageType_SetBroadcastMode,
+        MessageType_SetBroadcastModeAck,
+
+        // Connection parameters
+        MessageType_RequestConnectionProfileStats,
+        MessageType_ConnectionProfileStats,
+
+        // Early roll results
+        MessageType_ProvisionalRoll,
+
         MessageType_Count,
     };
 
@@ -252,6 +299,19 @@ struct MessageRollState
     MessageRollState() : Message(Message::MessageType_RollState) {}
 };
 
+/// <summary>
+/// Sent when the die predicts the face it is settling on while still rolling, and then
+/// when that prediction is confirmed (a RollState message follows) or retracted
+/// </summary>
+struct MessageProvisionalRoll
+    : Message
+{
+    uint8_t event; // See Accelerometer::ProvisionalRollEvent
+    uint8_t face;
+
+    MessageProvisionalRoll() : Message(Message::MessageType_ProvisionalRoll) {}
+};
+
 /// <summary>
 /// Describes an acceleration readings message (for telemetry)
 /// </summary>
@@ -294,28 +354,127 @@ struct MessageTelemetry
     MessageTelemetry() : Message(Message::MessageType_Telemetry) {}
 };
 
+/// <summary>
+/// Asks the die to send the roll traces it recorded, with a bulk transfer
+/// </summary>
+struct MessageRequestRollTraces
+    : Message
+{
+    uint8_t clear; // Non zero to discard the traces once they've been sent
+
+    MessageRequestRollTraces() : Message(Message::MessageType_RequestRollTraces) {}
+};
+
+/// <summary>
+/// Sent in response to MessageRequestRollTraces, right before the bulk transfer
+/// (no bulk transfer follows if size is zero)
+/// </summary>
+struct MessageRollTraces
+    : Message
+{
+    uint16_t size;
+    uint8_t traceCount;
+
+    MessageRollTraces() : Message(Message::MessageType_RollTraces) {}
+};
+
+#define LATENCY_HISTOGRAM_BUCKET_COUNT 10
+
+/// <summary>
+/// Number of received messages by time between their reception and the call to their handler,
+/// bucket i counts latencies under 250us << i, the last bucket counts everything above.
+/// Fast handlers are called as soon as the message is received, the others once dequeued.
+/// </summary>
+struct MessageLatencyHistograms
+    : Message
+{
+    uint16_t queued[LATENCY_HISTOGRAM_BUCKET_COUNT];
+    uint16_t fast[LATENCY_HISTOGRAM_BUCKET_COUNT];
+
+    MessageLatencyHistograms() : Message(Message::MessageType_LatencyHistograms) {}
+};
+
+/// <summary>
+/// Number of switches to each connection profile and time spent in them since boot,
+/// indexed by ConnectionProfiles::Profile (interactive, transfer, idle)
+/// </summary>
+struct MessageConnectionProfileStats
+    : Message
+{
+    uint8_t currentProfile;
+    uint16_t switchCounts[3];
+    uint32_t durationsMs[3];
+
+    MessageConnectionProfileStats() : Message(Message::MessageType_ConnectionProfileStats) {}
+};
+
+/// <summary>
+/// Asks the die to pack small messages together in MessageType_Batch notifications,
+/// apps that don't send this message only ever get individual messages
+/// </summary>
+struct MessageSetBatching
+    : Message
+{
+    uint8_t enable;
+
+    MessageSetBatching() : Message(Message::MessageType_SetBatching) {}
+};
+
+struct MessageSetBatchingAck
+    : Message
+{
+    uint8_t enabled;
+    uint8_t maxBatchSize; // Size of the largest batch the die will send, in bytes
+
+    MessageSetBatchingAck() : Message(Message::MessageType_SetBatchingAck) {}
+};
+
 struct MessageBulkSetup
     : Message
 {
     uint16_t size;
+    uint8_t windowSize; // Chunks the sender may have in flight, 0 (or missing) for stop-and-wait
+    uint8_t chunkSize;  // Largest chunk the sender can send, a multiple of 4 (MAX_DATA_SIZE if missing)
 
     MessageBulkSetup() : Message(Message::MessageType_BulkSetup) {}
 };
 
+/// <summary>
+/// Reply to MessageBulkSetup, a receiver that doesn't support windowed transfers
+/// only sends the message type
+/// </summary>
+struct MessageBulkSetupAck
+    : Message
+{
+    uint8_t windowSize; // Accepted window size, never larger than the requested one
+    uint8_t chunkSize;  // Size of all chunks but the last one, never larger than the requested one
+
+    MessageBulkSetupAck() : Message(Message::MessageType_BulkSetupAck) {}
+};
+
+/// <summary>
+/// Variable length message, only the first size bytes of data are sent
+/// </summary>
 struct MessageBulkData
     : Message
 {
     uint8_t size;
     uint16_t offset;
-    uint8_t data[MAX_DATA_SIZE];
+    uint8_t data[MAX_BULK_DATA_SIZE];
 
     MessageBulkData() : Message(Message::MessageType_BulkData) {}
 };
 
+/// <summary>
+/// For stop-and-wait transfers, offset is the offset of the chunk received and the mask is omitted.
+/// For windowed transfers, offset is the end of the data received without gaps (cumulative ack),
+/// and bit i of the mask is set if the chunk i + 1 chunks after offset was received (selective ack).
+/// </summary>
 struct MessageBulkDataAck
     : Message
 {
     uint16_t offset;
+    uint16_t receivedMask;
 
     MessageBulkDataAck() : Message(Message::MessageType_BulkDataAck) {}
 };
@@ -339,6 +498,7 @@ struct MessageTransferAnimSet
     uint16_t ruleCount;
 
     uint8_t brightness;
+    uint8_t compressed; // Data is sent compressed with Utils::lz77_compress (0 if missing)
 
     MessageTransferAnimSet() : Message(Message::MessageType_TransferAnimSet) {}
 };
@@ -351,6 +511,47 @@ struct MessageTransferAnimSetAck
     MessageTransferAnimSetAck() : Message(Message::MessageType_TransferAnimSetAck) {}
 };
 
+/// <summary>
+/// Sent in response to MessageType_RequestDataSetManifest, right before the bulk transfer
+/// of the block CRCs (one CRC-16-CCITT per block of the dataset data, as uint16_t)
+/// </summary>
+struct MessageDataSetManifest
+    : Message
+{
+    uint32_t dataSize;
+    uint32_t dataHash;
+    uint16_t blockSize;
+    uint16_t blockCount;
+
+    MessageDataSetManifest() : Message(Message::MessageType_DataSetManifest) {}
+};
+
+/// <summary>
+/// Same as MessageTransferAnimSet but only the blocks that differ from the current data are sent.
+/// The bulk transfer that follows is a list of records made of the block index (uint16_t) and
+/// the block data, in increasing block order. Blocks are DataSetManifest::blockSize bytes,
+/// except for the last one of the data. Blocks that aren't sent are kept from the current data.
+/// The die replies with a MessageTransferAnimSetAck, a result of 0 means the patch can't be
+/// applied (for instance the patched data doesn't fit in RAM) and the dataset should be sent whole.
+/// </summary>
+struct MessageTransferAnimSetPatch
+    : MessageTransferAnimSet
+{
+    uint16_t patchSize; // Size of the bulk transfer
+    uint32_t dataHash;  // Hash of the patched data, checked before it replaces the current data
+    uint32_t dataCrc;   // Utils::computeCrc32() of the patched data, checked before and after programming
+
+    MessageTransferAnimSetPatch() { type = Message::MessageType_TransferAnimSetPatch; compressed = 0; }
+};
+
+struct MessageTransferAnimSetPatchFinished
+    : Message
+{
+    uint8_t result;
+
+    MessageTransferAnimSetPatchFinished() : Message(Message::MessageType_TransferAnimSetPatchFinished) {}
+};
+
 struct MessageDebugLog
     : Message
 {
@@ -402,17 +603,60 @@ enum TelemetryRequestMode : uint8_t
     TelemetryRequestMode_Off = 0,
     TelemetryRequestMode_Once = 1,
     TelemetryRequestMode_Repeat = 2,
+    TelemetryRequestMode_Stream = 3,    // Every frame, batched in MessageTelemetryStream
 };
 
 struct MessageRequestTelemetry
     : Message
 {
     TelemetryRequestMode requestMode;
-    uint16_t minInterval; // Milliseconds, 0 for no cap on rate
+    uint16_t minInterval; // Milliseconds, 0 for no cap on rate (stream mode: longest a frame may wait, 0 for no limit)
 
     MessageRequestTelemetry() : Message(Message::MessageType_RequestTelemetry) {}
 };
 
+// Slow changing telemetry fields, sent in a MessageTelemetryStream only when they change
+enum TelemetryStreamField : uint8_t
+{
+    TelemetryStreamField_Battery     = 1 << 0, // batteryLevelPercent, batteryState, batteryControllerState, voltageTimes50, internalChargeState, batteryControllerMode
+    TelemetryStreamField_Coil        = 1 << 1, // vCoilTimes50, vCoilMinTimes50, vCoilMaxTimes50
+    TelemetryStreamField_Rssi        = 1 << 2, // rssi, channelIndex
+    TelemetryStreamField_Temperature = 1 << 3, // mcuTempTimes100, batteryTempTimes100 (int16_t each)
+    TelemetryStreamField_LedCurrent  = 1 << 4, // ledCurrent
+};
+
+// Flags in the low bits of a stream frame time delta
+enum TelemetryStreamFrameFlags : uint8_t
+{
+    TelemetryStreamFrameFlags_FaceChanged       = 1 << 0, // Followed by face and rollState
+    TelemetryStreamFrameFlags_ConfidenceChanged = 1 << 1, // Followed by the zigzag varint confidence delta
+    TelemetryStreamFrameFlags_Count             = 2,      // Number of flag bits
+};
+
+/// <summary>
+/// Accelerometer frames batched together, sent in TelemetryRequestMode_Stream.
+/// Variable length, data starts with the slow fields listed in fieldMask, in bit order,
+/// followed by frameCount frames, each one being:
+/// - varint of the time delta from the previous frame shifted left by TelemetryStreamFrameFlags_Count,
+///   or'ed with TelemetryStreamFrameFlags
+/// - zigzag varints of the acceleration deltas from the previous frame (x, y and z)
+/// - the fields given by the flags
+/// The first frame is relative to baseTime, zero acceleration and zero confidence,
+/// and always has both flags, so that each message can be decoded on its own.
+/// A new message is started when a time delta would take more than 3 bytes. Slow fields
+/// that changed but don't fit next to the first frame are sent with a later message.
+/// </summary>
+struct MessageTelemetryStream
+    : Message
+{
+    uint32_t baseTime;
+    uint8_t frameCount;
+    uint8_t fieldMask;
+    uint8_t data[MAX_TELEMETRY_STREAM_DATA_SIZE];
+
+    MessageTelemetryStream() : Message(Message::MessageType_TelemetryStream) {}
+};
+
 struct MessageBlink
     : Message
 {
@@ -557,6 +801,19 @@ struct MessageStoreValueAck
     MessageStoreValueAck() : Message(Message::MessageType_StoreValueAck) {}
 };
 
+/// <summary>
+/// Adds a roll counter and the last roll results to the advertising data, so a scanner
+/// can follow the rolls without staying connected. The mode is stored and kept across reboots,
+/// the advertised name gets whatever room is left. See bluetooth_advertising_format.h for the format.
+/// </summary>
+struct MessageSetBroadcastMode
+    : Message
+{
+    uint8_t enabled;
+
+    MessageSetBroadcastMode() : Message(MessageType_SetBroadcastMode) {}
+};
+
 struct MessageSetUserMode
     : Message
 {
@@ -22,6 +22,7 @@
 
 #include "pixel.h"
 #include "bluetooth_custom_advertising_data.h"
+#include "connection_profiles.h"
 
 using namespace Config;
 using namespace DriversNRF;
@@ -31,6 +32,9 @@ namespace Bluetooth::Stack
 {
     #define APP_ADV_INTERVAL                300                                     /**< The advertising interval (in units of 0.625 ms. This value corresponds to 187.5 ms). */
     #define APP_ADV_DURATION                BLE_GAP_ADV_TIMEOUT_GENERAL_UNLIMITED   /**< The advertising duration (180 seconds) in units of 10 milliseconds. */
+    #define APP_ADV_BURST_INTERVAL          64                                      /**< Advertising interval right after startup or a roll result (40 ms). */
+    #define APP_ADV_BURST_DURATION          200                                     /**< Duration of the burst before going back to APP_ADV_INTERVAL (2 seconds), in units of 10 ms. */
+    #define APP_ADV_IDLE_INTERVAL           1600                                    /**< Advertising interval when nothing is happening (1 second). */
 
     #define APP_BLE_OBSERVER_PRIO           3                                       /**< Application's BLE observer priority. You shouldn't need to modify this value. */
     #define APP_BLE_CONN_CFG_TAG            1                                       /**< A tag identifying the SoftDevice BLE configuration. */
@@ -53,6 +57,8 @@ namespace Bluetooth::Stack
     #define SEC_PARAM_MIN_KEY_SIZE          7                                       /**< Minimum encryption key size. */
     #define SEC_PARAM_MAX_KEY_SIZE          16                                      /**< Maximum encryption key size. */
 
+    #define ATT_NOTIFICATION_HEADER_SIZE    3                                       /**< Opcode and attribute handle. */
+
     #define MAX_CLIENTS 8
     #define MAX_RSSI_CLIENTS 2
 
@@ -66,6 +72,9 @@ namespace Bluetooth::Stack
     BLE_ADVERTISING_DEF(advertisingModule);                                         /**< Advertising module instance. */
 
     static bool connected = false;
+    static bool advertising = false;
+    static bool advertisingIdle = false;
+    static uint32_t advertisingReconfigurationCount = 0;                           /**< Number of times the SoftDevice advertising data or parameters were changed. */
     static bool resetOnDisconnectPending = false;
     static bool sleepOnDisconnectPending = false;
 
@@ -144,6 +153,7 @@ namespace Bluetooth::Stack
                 // err_code = nrf_ble_qwr_conn_handle_assign(&nrfQwr, connectionHandle);
                 // APP_ERROR_CHECK(err_code);
                 connected = true;
+                advertising = false;
                 for (int i = 0; i < clients.Count(); ++i) {
                     clients[i].handler(clients[i].token, true);
                 }
@@ -237,14 +247,22 @@ namespace Bluetooth::Stack
         {
             case BLE_ADV_EVT_FAST: {
                 NRF_LOG_INFO("Fast adv.");
+                advertising = true;
                 ret_code_t err_code = ble_advertising_advdata_update(&advertisingModule, &advertisementPacket, &scanResponsePacket);
                 APP_ERROR_CHECK(err_code);
+                advertisingReconfigurationCount++;
                 CustomAdvertisingDataHandler::start();
             }
             break;
 
+            case BLE_ADV_EVT_SLOW:
+                NRF_LOG_INFO("Slow adv.");
+                advertising = true;
+                break;
+
             case BLE_ADV_EVT_IDLE:
                 NRF_LOG_INFO("Adv. idle");
+                advertising = false;
                 CustomAdvertisingDataHandler::stop();
                 break;
 
@@ -266,6 +284,17 @@ namespace Bluetooth::Stack
         APP_ERROR_HANDLER(nrf_error);
     }
 
+    /**@brief Function for handling a Connection Parameters event.
+     *
+     * @param[in] p_evt  Event received from the Connection Parameters module.
+     */
+    void on_conn_params_evt(ble_conn_params_evt_t * p_evt) {
+        if (p_evt->evt_type == BLE_CONN_PARAMS_EVT_FAILED) {
+            // The central didn't accept the parameters, stay connected with whatever it picked
+            ConnectionProfiles::onParametersRefused();
+        }
+    }
+
     /**@brief Function for handling Peer Manager events.
      *
      * @param[in] p_evt  Peer Manager event.
@@ -278,9 +307,31 @@ namespace Bluetooth::Stack
     void advertising_config_get(ble_adv_modes_config_t * p_config) {
         memset(p_config, 0, sizeof(ble_adv_modes_config_t));
 
+        // Fast mode is a short burst, after which the module switches to slow mode on its own
         p_config->ble_adv_fast_enabled  = true;
-        p_config->ble_adv_fast_interval = APP_ADV_INTERVAL;
-        p_config->ble_adv_fast_timeout  = APP_ADV_DURATION;
+        p_config->ble_adv_fast_interval = APP_ADV_BURST_INTERVAL;
+        p_config->ble_adv_fast_timeout  = APP_ADV_BURST_DURATION;
+        p_config->ble_adv_slow_enabled  = true;
+        p_config->ble_adv_slow_interval = advertisingIdle ? APP_ADV_IDLE_INTERVAL : APP_ADV_INTERVAL;
+        p_config->ble_adv_slow_timeout  = APP_ADV_DURATION;
+    }
+
+    /// <summary>
+    /// Restarts advertising in the given mode, picking up the current modes config
+    /// </summary>
+    void restartAdvertising(ble_adv_mode_t mode) {
+        ret_code_t err_code = sd_ble_gap_adv_stop(advertisingModule.adv_handle);
+        if (err_code != NRF_ERROR_INVALID_STATE) {
+            APP_ERROR_CHECK(err_code);
+        }
+
+        ble_adv_modes_config_t config;
+        advertising_config_get(&config);
+        ble_advertising_modes_config_set(&advertisingModule, &config);
+
+        err_code = ble_advertising_start(&advertisingModule, mode);
+        APP_ERROR_CHECK(err_code);
+        advertisingReconfigurationCount++;
     }
 
     void init() {
@@ -361,7 +412,8 @@ namespace Bluetooth::Stack
         cp_init.next_conn_params_update_delay  = NEXT_CONN_PARAMS_UPDATE_DELAY;
         cp_init.max_conn_params_update_count   = MAX_CONN_PARAMS_UPDATE_COUNT;
         cp_init.start_on_notify_cccd_handle    = BLE_GATT_HANDLE_INVALID;
-        cp_init.disconnect_on_fail             = true; // Disconnect on a failed connection parameters update, use evt_handler to add a custom behavior
+        cp_init.disconnect_on_fail             = false; // Connection profiles fall back to the interactive one instead
+        cp_init.evt_handler                    = on_conn_params_evt;
         cp_init.error_handler                  = conn_params_error_handler;
 
         err_code = ble_conn_params_init(&cp_init);
@@ -381,7 +433,7 @@ namespace Bluetooth::Stack
         BLE_GAP_CONN_SEC_MODE_SET_OPEN(&sec_mode);
 
         // Generate our name
-        auto name = SettingsManager::getSettings()->name;
+        auto name = SettingsManager::getName();
         err_code = sd_ble_gap_device_name_set(&sec_mode, (const uint8_t *)name, strlen(name));
         APP_ERROR_CHECK(err_code);
 
@@ -393,6 +445,35 @@ namespace Bluetooth::Stack
         advertisedManufData.data.size = size;
         ret_code_t err_code = ble_advertising_advdata_update(&advertisingModule, &advertisementPacket, &scanResponsePacket);
         APP_ERROR_CHECK(err_code);
+        advertisingReconfigurationCount++;
+    }
+
+    void burstAdvertising() {
+        if (advertising && !connected) {
+            NRF_LOG_DEBUG("Adv. burst");
+            advertisingIdle = false;
+            restartAdvertising(BLE_ADV_MODE_FAST);
+        }
+    }
+
+    void idleAdvertising() {
+        if (advertising && !connected && !advertisingIdle) {
+            NRF_LOG_DEBUG("Adv. idle interval");
+            advertisingIdle = true;
+            restartAdvertising(BLE_ADV_MODE_SLOW);
+        }
+    }
+
+    void resumeAdvertising() {
+        if (advertising && !connected && advertisingIdle) {
+            NRF_LOG_DEBUG("Adv. normal interval");
+            advertisingIdle = false;
+            restartAdvertising(BLE_ADV_MODE_SLOW);
+        }
+    }
+
+    uint32_t getAdvertisingReconfigurationCount() {
+        return advertisingReconfigurationCount;
     }
 
     void disconnectLink(uint16_t conn_handle, void * p_context) {
@@ -415,12 +496,18 @@ namespace Bluetooth::Stack
     }
 
     void startAdvertising() {
+        advertisingIdle = false;
+        ble_adv_modes_config_t config;
+        advertising_config_get(&config);
+        ble_advertising_modes_config_set(&advertisingModule, &config);
+
         ret_code_t err_code = ble_advertising_advdata_update(&advertisingModule, &advertisementPacket, &scanResponsePacket);
         APP_ERROR_CHECK(err_code);
+        advertisingReconfigurationCount++;
 
         err_code = ble_advertising_start(&advertisingModule, BLE_ADV_MODE_FAST);
         APP_ERROR_CHECK(err_code);
-        NRF_LOG_INFO("Adv. with name=%s and deviceId=0x%x", SettingsManager::getSettings()->name, customServiceData.deviceId);
+        NRF_LOG_INFO("Adv. with name=%s and deviceId=0x%x", SettingsManager::getName(), customServiceData.deviceId);
     }
 
     void disableAdvertisingOnDisconnect() {
@@ -477,6 +564,11 @@ namespace Bluetooth::Stack
         }
     }
 
+    uint16_t getMaxPayloadSize() {
+        uint16_t mtu = connected ? nrf_ble_gatt_eff_mtu_get(&nrfGatt, connectionHandle) : BLE_GATT_ATT_MTU_DEFAULT;
+        return mtu - ATT_NOTIFICATION_HEADER_SIZE;
+    }
+
     void slowAdvertising() {
         ret_code_t err_code = ble_advertising_start(&advertisingModule, BLE_ADV_MODE_SLOW);
         APP_ERROR_CHECK(err_code);
@@ -485,6 +577,7 @@ namespace Bluetooth::Stack
     void stopAdvertising() {
         ret_code_t err_code = sd_ble_gap_adv_stop(advertisingModule.adv_handle);
         APP_ERROR_CHECK(err_code);
+        advertising = false;
         CustomAdvertisingDataHandler::stop();
     }
 
@@ -492,6 +585,10 @@ namespace Bluetooth::Stack
         return connected;
     }
 
+    uint16_t getConnectionHandle() {
+        return connectionHandle;
+    }
+
     void hook(ConnectionEventMethod method, void* param) {
         if (!clients.Register(param, method)) {
             NRF_LOG_ERROR("Too many connection state hooks registered.");
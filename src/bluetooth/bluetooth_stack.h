@@ -12,6 +12,7 @@ namespace Bluetooth::Stack
     void disableAdvertisingOnDisconnect();
     void enableAdvertisingOnDisconnect();
     bool isConnected();
+    uint16_t getConnectionHandle();
     void resetOnDisconnect();
     void sleepOnDisconnect();
 
@@ -25,9 +26,21 @@ namespace Bluetooth::Stack
     };
 
     SendResult send(uint16_t handle, const uint8_t* data, uint16_t len);
+
+    // Largest notification payload for the current connection (negotiated ATT MTU minus header)
+    uint16_t getMaxPayloadSize();
     void slowAdvertising();
     void stopAdvertising();
 
+    // Advertising rate, a short burst of fast advertising (after a roll result),
+    // a slower interval when the die is idle and back to the normal interval
+    void burstAdvertising();
+    void idleAdvertising();
+    void resumeAdvertising();
+
+    // Number of advertising data or parameters updates, for measurements
+    uint32_t getAdvertisingReconfigurationCount();
+
     typedef void(*ConnectionEventMethod)(void* param, bool connected);
     void hook(ConnectionEventMethod method, void* param);
     void unHook(ConnectionEventMethod client);
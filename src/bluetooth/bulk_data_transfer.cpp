@@ -1,19 +1,78 @@
 #include "bulk_data_transfer.h"
 #include "bluetooth_messages.h"
 #include "bluetooth_message_service.h"
+#include "bluetooth_stack.h"
+#include "connection_profiles.h"
 #include "drivers_nrf/timers.h"
 #include "malloc.h"
 #include "drivers_nrf/flash.h"
+#include "utils/utils.h"
+#include <stddef.h>
 
 #define RETRY_MS (10000) // ms
 #define TIMEOUT_MS (3000) // ms
-#define BLOCK_SIZE (MAX_DATA_SIZE)
+#define LEGACY_CHUNK_SIZE (MAX_DATA_SIZE) // Chunk size when the peer doesn't negotiate one
 #define MAX_RETRY_COUNT (5)
+#define MIN_STAGING_BLOCK_SIZE (256)  // Must be at least MAX_BULK_DATA_SIZE, chunks span two blocks at most
+
+// Windowed transfers
+#define MAX_WINDOW_SIZE (8)             // Chunks in flight, must fit in the selective ack mask
+#define INITIAL_RETRY_MS (1000)         // ms, retransmit timeout until we have a round trip estimate
+#define MIN_RETRY_MS (100)              // ms
+#define FAST_RETRANSMIT_ACK_COUNT (2)   // Acks reporting the same gap before we resend the missing chunk
 
 using namespace DriversNRF;
 
 namespace Bluetooth
 {
+    /// <summary>
+    /// Largest chunk that fits in a single notification with the current MTU,
+    /// with room for the sequence byte when sent while handling a sequenced request
+    /// </summary>
+    uint8_t getMaxChunkSize() {
+        int payloadSize = Stack::getMaxPayloadSize() - MESSAGE_SEQUENCE_SIZE - offsetof(MessageBulkData, data);
+        return MIN(payloadSize, MAX_BULK_DATA_SIZE) & ~3;
+    }
+
+    /// <summary>
+    /// Keeps track of the chunks received during a windowed transfer.
+    /// The first chunks are received without gaps, the mask tells which
+    /// of the chunks following them were received out of order.
+    /// </summary>
+    struct ReceiveWindow
+    {
+        uint16_t receivedChunks;    // Number of chunks received without gaps
+        uint16_t receivedMask;      // Bit i set if chunk receivedChunks + 1 + i was received
+
+        void reset() {
+            receivedChunks = 0;
+            receivedMask = 0;
+        }
+
+        bool isReceived(uint16_t chunk) const {
+            return chunk < receivedChunks ||
+                (chunk > receivedChunks && chunk - receivedChunks <= 16 && (receivedMask & (1 << (chunk - receivedChunks - 1))));
+        }
+
+        bool isInWindow(uint16_t chunk, int windowSize) const {
+            return chunk >= receivedChunks && chunk < receivedChunks + windowSize;
+        }
+
+        void markReceived(uint16_t chunk) {
+            if (chunk == receivedChunks) {
+                // Fill the gap and move past any chunk we already had
+                receivedChunks++;
+                while (receivedMask & 1) {
+                    receivedMask >>= 1;
+                    receivedChunks++;
+                }
+                receivedMask >>= 1;
+            } else if (chunk > receivedChunks) {
+                receivedMask |= 1 << (chunk - receivedChunks - 1);
+            }
+        }
+    };
+
     namespace SendBulkData
     {
         // The buffer we want to send over and its size
@@ -29,7 +88,21 @@ namespace Bluetooth
         };
 
         State currentState;
-        uint16_t currentOffset;
+
+        // Window state, a stop-and-wait transfer is a window of 1 chunk
+        bool windowed;
+        int windowSize;
+        uint16_t chunkSize;
+        uint16_t ackedOffset;   // Everything before this offset was acknowledged
+        uint16_t ackedMask;     // Chunks acknowledged after ackedOffset, see MessageBulkDataAck
+        uint16_t nextOffset;    // Offset of the next chunk to send for the first time
+        int gapAckCount;
+
+        // Retransmit timeout, adapted to the measured round trip time of windowed transfers
+        int retryMs;
+        int smoothedRoundTripMs;
+        int chunkSendTimes[MAX_WINDOW_SIZE];
+        uint32_t retransmittedChunks;   // Bit set for chunks of the window that were sent more than once
 
         int retryCount;
         sendResultCallback callback;
@@ -45,20 +118,113 @@ namespace Bluetooth
             // Then send the message
             MessageBulkSetup setupMsg;
             setupMsg.size = size;
+            setupMsg.windowSize = MAX_WINDOW_SIZE;
+            setupMsg.chunkSize = getMaxChunkSize();
             MessageService::SendMessage(&setupMsg);
         }
 
-        void sendCurrentChunk() {
-            NRF_LOG_DEBUG("Sending Chunk (offset: %d)", currentOffset);
-            // Start the timeout timer before anything else
-            Timers::startTimer(timeoutTimer, RETRY_MS);
-
-            // Then send the data chunk
+        bool sendChunk(uint16_t offset) {
+            NRF_LOG_DEBUG("Sending Chunk (offset: %d)", offset);
             MessageBulkData dataMsg;
-            dataMsg.size = MIN(size - currentOffset, BLOCK_SIZE);
-            dataMsg.offset = currentOffset;
-            memcpy(dataMsg.data, &data[currentOffset], dataMsg.size);
-            MessageService::SendMessage(&dataMsg);
+            dataMsg.size = MIN(size - offset, chunkSize);
+            dataMsg.offset = offset;
+            memcpy(dataMsg.data, &data[offset], dataMsg.size);
+            ConnectionProfiles::notifyTransfer();
+            return MessageService::SendMessage(&dataMsg, offsetof(MessageBulkData, data) + dataMsg.size);
+        }
+
+        void restartTimer() {
+            Timers::stopTimer(timeoutTimer);
+            Timers::startTimer(timeoutTimer, retryMs);
+        }
+
+        /// <summary>
+        /// Sends new chunks until the window is full, or the stack can't take any more
+        /// (we'll try again on the next ack or timeout)
+        /// </summary>
+        void fillWindow() {
+            while (nextOffset < size && nextOffset < ackedOffset + windowSize * chunkSize) {
+                if (!sendChunk(nextOffset)) {
+                    break;
+                }
+                int chunk = nextOffset / chunkSize;
+                chunkSendTimes[chunk % MAX_WINDOW_SIZE] = Timers::millis();
+                retransmittedChunks &= ~(1 << (chunk % MAX_WINDOW_SIZE));
+                nextOffset += chunkSize;
+            }
+        }
+
+        /// <summary>
+        /// Resends the chunks that were sent but not acknowledged
+        /// </summary>
+        void resendMissingChunks(bool firstOnly) {
+            for (uint16_t offset = ackedOffset; offset < nextOffset; offset += chunkSize) {
+                int index = (offset - ackedOffset) / chunkSize;
+                if (index > 0 && (ackedMask & (1 << (index - 1)))) {
+                    continue;
+                }
+                if (!sendChunk(offset)) {
+                    break;
+                }
+                retransmittedChunks |= 1 << ((offset / chunkSize) % MAX_WINDOW_SIZE);
+                if (firstOnly) {
+                    break;
+                }
+            }
+        }
+
+        void onDataAck(const Message* message) {
+            auto ack = (const MessageBulkDataAck*)message;
+            NRF_LOG_DEBUG("Received Ack for Chunk (offset: %d)", ack->offset);
+
+            // Convert stop-and-wait acks (offset of the received chunk) to cumulative acks
+            uint16_t offset = ack->offset;
+            uint16_t mask = 0;
+            if (windowed) {
+                mask = ack->receivedMask;
+            } else if (offset == ackedOffset) {
+                offset += chunkSize;
+            } else {
+                // Ignore this ack, we've probably already gotten it!
+                return;
+            }
+
+            if (offset > ackedOffset) {
+                if (windowed) {
+                    // Round trip estimate from the last chunk acknowledged, unless it was resent
+                    int chunk = (offset - 1) / chunkSize;
+                    if (!(retransmittedChunks & (1 << (chunk % MAX_WINDOW_SIZE)))) {
+                        int roundTripMs = Timers::millis() - chunkSendTimes[chunk % MAX_WINDOW_SIZE];
+                        smoothedRoundTripMs = smoothedRoundTripMs == 0 ? roundTripMs : (7 * smoothedRoundTripMs + roundTripMs) / 8;
+                    }
+                    // The data is moving again, drop the timeout back off
+                    if (smoothedRoundTripMs > 0) {
+                        retryMs = MAX(2 * smoothedRoundTripMs, MIN_RETRY_MS);
+                    }
+                }
+                ackedOffset = MIN(offset, size);
+                ackedMask = mask;
+                gapAckCount = 0;
+                retryCount = 0;
+
+                if (ackedOffset >= size) {
+                    // Done!
+                    Timers::stopTimer(timeoutTimer);
+                    currentState = State_Done;
+                    MessageService::UnregisterMessageHandler(Message::MessageType_BulkDataAck);
+                    callback(context, true, data, size);
+                    return;
+                }
+                restartTimer();
+            } else if (offset == ackedOffset && mask != 0) {
+                // Later chunks made it but not the first one, resend it without waiting for the timeout
+                ackedMask = mask;
+                if (++gapAckCount == FAST_RETRANSMIT_ACK_COUNT) {
+                    resendMissingChunks(true);
+                }
+            }
+
+            fillWindow();
         }
 
         /// <summary>
@@ -68,7 +234,6 @@ namespace Bluetooth
         {
             data = theData;
             size = theSize;
-            currentOffset = 0;
             retryCount = 0;
             callback = theCallback;
             context = theContext;
@@ -102,6 +267,25 @@ namespace Bluetooth
                     // Stop listening for ack
                     MessageService::UnregisterMessageHandler(Message::MessageType_BulkSetupAck);
 
+                    // Older receivers only send the message type and expect stop-and-wait with 100 bytes chunks
+                    auto ack = (const MessageBulkSetupAck*)message;
+                    uint16_t ackSize = MessageService::getHandledMessageSize();
+                    windowed = ackSize > offsetof(MessageBulkSetupAck, windowSize) && ack->windowSize > 0;
+                    windowSize = windowed ? MIN(ack->windowSize, MAX_WINDOW_SIZE) : 1;
+                    chunkSize = ackSize >= sizeof(MessageBulkSetupAck) ? MIN(ack->chunkSize, MAX_BULK_DATA_SIZE) & ~3 : LEGACY_CHUNK_SIZE;
+                    if (chunkSize == 0) {
+                        chunkSize = LEGACY_CHUNK_SIZE;
+                    }
+                    retryMs = windowed ? INITIAL_RETRY_MS : RETRY_MS;
+                    smoothedRoundTripMs = 0;
+                    ackedOffset = 0;
+                    ackedMask = 0;
+                    nextOffset = 0;
+                    gapAckCount = 0;
+                    retransmittedChunks = 0;
+                    retryCount = 0;
+                    NRF_LOG_DEBUG("Window size: %d, chunk size: %d", windowSize, chunkSize);
+
                     // Start sending data, wait for timeout or ack
                     Timers::createTimer(&timeoutTimer, APP_TIMER_MODE_SINGLE_SHOT, [](void* context) {
                         if (currentState == State_WaitingForDataAck) {
@@ -112,38 +296,23 @@ namespace Bluetooth
                                 MessageService::UnregisterMessageHandler(Message::MessageType_BulkDataAck);
                                 callback(context, false, data, size);
                             } else {
-                                // Try again
-                                sendCurrentChunk();
+                                // Back off and try again
+                                if (windowed) {
+                                    retryMs = MIN(2 * retryMs, RETRY_MS);
+                                }
+                                resendMissingChunks(false);
+                                fillWindow();
+                                restartTimer();
                             }
                         }
                     });
 
                     // We register for a response first to be sure and not miss the ack
-                    MessageService::RegisterMessageHandler(Message::MessageType_BulkDataAck, [](const Message* message) {
-                        auto ack = (MessageBulkDataAck*)message;
-                        NRF_LOG_DEBUG("Received Ack for Chunk (offset: %d)", ack->offset);
-
-                        if (ack->offset == currentOffset)
-                        {
-                            // Cancel the timer first
-                            Timers::stopTimer(timeoutTimer);
-
-                            if (currentOffset + BLOCK_SIZE < size) {
-                                // Good, move onto the next chunk
-                                currentOffset += BLOCK_SIZE;
-                                sendCurrentChunk();
-                            } else {
-                                // Done!
-                                currentState = State_Done;
-                                MessageService::UnregisterMessageHandler(Message::MessageType_BulkDataAck);
-                                callback(context, true, data, size);
-                            }
-                        }
-                        // Else ignore this ack, we've probably already gotten it!
-                    });
+                    MessageService::RegisterMessageHandler(Message::MessageType_BulkDataAck, onDataAck);
 
                     currentState = State_WaitingForDataAck;
-                    sendCurrentChunk();
+                    fillWindow();
+                    restartTimer();
                 }
                 // Else ignore this ack, we've probably already gotten it!
             });
@@ -199,7 +368,12 @@ namespace Bluetooth
         };
 
         State currentState;
-        uint16_t currentOffset;
+
+        // Window state, a stop-and-wait transfer is a window of 1 chunk
+        bool windowed;
+        int windowSize;
+        uint16_t chunkSize;
+        ReceiveWindow window;
 
         int retryCount;
         receiveAllocator allocator;
@@ -207,9 +381,30 @@ namespace Bluetooth
         receiveToFlashResultCallback flashCallback;
         void* context;
 
+        // Chunks are copied into one of two staging blocks and acked right away. A block is
+        // written to flash once all its bytes are received, while chunks keep filling the other one.
+        // When decompressing, the staging buffer is a single block the decoder writes to instead.
+        // Either way it is only allocated for the duration of the transfer, as large as the heap allows.
+        uint8_t* stagingBuffer;
+        bool decompressing;
+        uint16_t blockSize;
+        uint16_t nextBlock;             // First block not handed to the flash yet
+        bool writingBlock;              // Whether block nextBlock - 1 is being written
+
+        // A chunk that arrived when its block wasn't available, it is staged (and acked)
+        // once the block being written is done, or a compressed chunk not decoded yet
         #pragma pack(push, 4)
-        uint8_t dataBuffer[132] __attribute__ ((aligned (4))); // data is 100 bytes so this should be enough
+        uint8_t inputBuffer[MAX_BULK_DATA_SIZE] __attribute__ ((aligned (4)));
         #pragma pack(pop)
+        uint16_t pendingChunkOffset;
+        uint8_t pendingChunkSize;       // 0 if no chunk is waiting
+
+        // Compressed transfers are decoded in order into the staging buffer, and written to flash when full
+        Utils::LZ77Decoder decoder;
+        uint32_t expectedUncompressedSize;
+        bool flushing;                  // Whether the staging buffer is being written
+        uint16_t pendingInputOffset;    // Compressed bytes in inputBuffer not decoded yet
+        uint16_t pendingInputSize;
 
         APP_TIMER_DEF(timeoutTimer);
 
@@ -219,18 +414,84 @@ namespace Bluetooth
             Timers::startTimer(timeoutTimer, RETRY_MS);
 
             // Then send the message
-            MessageService::SendMessage(Message::MessageType_BulkSetupAck);
+            if (windowed) {
+                MessageBulkSetupAck ackMsg;
+                ackMsg.windowSize = windowSize;
+                ackMsg.chunkSize = chunkSize;
+                MessageService::SendMessage(&ackMsg);
+            } else {
+                MessageService::SendMessage(Message::MessageType_BulkSetupAck);
+            }
         }
 
         void sendBulkAckMessage(uint16_t offset) {
-            NRF_LOG_DEBUG("Sending Bulk Ack Message, offset=%04x", offset);
-
-            // Then send the message
             MessageBulkDataAck ackMsg;
-            ackMsg.offset = offset;
-            MessageService::SendMessage(&ackMsg);
+            if (windowed) {
+                ackMsg.offset = MIN(window.receivedChunks * chunkSize, size);
+                ackMsg.receivedMask = window.receivedMask;
+                NRF_LOG_DEBUG("Sending Bulk Ack Message, offset=%04x, mask=%04x", ackMsg.offset, ackMsg.receivedMask);
+                MessageService::SendMessage(&ackMsg);
+            } else {
+                NRF_LOG_DEBUG("Sending Bulk Ack Message, offset=%04x", offset);
+                ackMsg.offset = offset;
+                MessageService::SendMessage(&ackMsg, offsetof(MessageBulkDataAck, receivedMask));
+            }
+        }
+
+        bool isComplete() {
+            return window.receivedChunks * chunkSize >= size;
         }
 
+        /// <summary>
+        /// Reads the window and chunk sizes requested in the setup message, older senders don't send them
+        /// </summary>
+        void setupWindow(const MessageBulkSetup* msg) {
+            uint16_t msgSize = MessageService::getHandledMessageSize();
+            int requested = msgSize > offsetof(MessageBulkSetup, windowSize) ? msg->windowSize : 0;
+            windowed = requested > 0;
+            windowSize = windowed ? MIN(requested, MAX_WINDOW_SIZE) : 1;
+            chunkSize = LEGACY_CHUNK_SIZE;
+            if (windowed && msgSize >= sizeof(MessageBulkSetup) && msg->chunkSize >= 4) {
+                chunkSize = MIN(msg->chunkSize, getMaxChunkSize()) & ~3;
+            }
+            window.reset();
+            NRF_LOG_INFO("Transfer size: 0x%04x, window size: %d, chunk size: %d", msg->size, windowSize, chunkSize);
+        }
+
+        /// <summary>
+        /// Checks that a data message fits the transfer and wasn't already received
+        /// Returns false if it should be ignored
+        /// </summary>
+        bool acceptChunk(const MessageBulkData* msg) {
+            uint16_t chunk = msg->offset / chunkSize;
+            if (msg->offset % chunkSize != 0 || msg->size > chunkSize || msg->offset + msg->size > size) {
+                NRF_LOG_WARNING("Bad chunk (offset: 0x%04x, length: %d)", msg->offset, msg->size);
+                return false;
+            }
+            ConnectionProfiles::notifyTransfer();
+            if (window.isReceived(chunk)) {
+                // Our ack was probably lost, send it again
+                sendBulkAckMessage(msg->offset);
+                return false;
+            }
+            return window.isInWindow(chunk, windowSize);
+        }
+
+        void ackFinishedTransfer(const Message* message) {
+            // Our last ack may have been lost, the sender keeps resending until it gets one
+            sendBulkAckMessage(((const MessageBulkData*)message)->offset);
+        }
+
+        /// <summary>
+        /// Stops accepting data once the transfer is complete, but keeps acking
+        /// the chunks the sender resends, until the next transfer starts
+        /// </summary>
+        void stopReceivingChunks(bool complete) {
+            MessageService::UnregisterMessageHandler(Message::MessageType_BulkData);
+            if (complete) {
+                MessageService::RegisterMessageHandler(Message::MessageType_BulkData, ackFinishedTransfer);
+            }
+        }
 
         /// <summary>
         /// Bulk data transfer
@@ -279,6 +540,7 @@ namespace Bluetooth
                         return;
                     }
 
+                    setupWindow(msg);
                     currentState = State_WaitingForData;
 
                     // Send Ack, and wait for data to come in, or timeout!
@@ -290,27 +552,41 @@ namespace Bluetooth
                                 currentState = State_Done;
                                 MessageService::UnregisterMessageHandler(Message::MessageType_BulkData);
                                 callback(context, false, nullptr, 0);
-                            } else {
+                            } else if (window.receivedChunks == 0 && window.receivedMask == 0) {
                                 // Try again...
                                 sendSetupAckMessage();
+                            } else {
+                                // Let the sender know what it should resend
+                                sendBulkAckMessage(0);
+                                Timers::startTimer(timeoutTimer, RETRY_MS);
                             }
                         }
                         // Else ignore
                     });
 
+                    // Replaces the handler still acking the previous transfer, if any
+                    MessageService::UnregisterMessageHandler(Message::MessageType_BulkData);
                     MessageService::RegisterMessageHandler(Message::MessageType_BulkData, [](const Message* message) {
+                        auto msg = (const MessageBulkData*)message;
+                        if (!acceptChunk(msg)) {
+                            return;
+                        }
 
                         // Cancel the timer first
                         Timers::stopTimer(timeoutTimer);
+                        retryCount = 0;
 
                         // Copy the data
-                        auto msg = (const MessageBulkData*)message;
                         memcpy(&data[msg->offset], msg->data, msg->size);
+                        window.markReceived(msg->offset / chunkSize);
 
-                        if (msg->offset + msg->size >= size) {
+                        if (isComplete()) {
                             // Done
-                            MessageService::UnregisterMessageHandler(Message::MessageType_BulkData);
+                            currentState = State_Done;
+                            stopReceivingChunks(true);
                             callback(context, true, data, size);
+                        } else {
+                            Timers::startTimer(timeoutTimer, RETRY_MS);
                         }
 
                         // And send an ack!
@@ -326,61 +602,250 @@ namespace Bluetooth
             currentState = State_WaitingForSetup;
         }
 
+        void releaseStagingBuffer() {
+            // The flash reads the data while writing it, so wait for the write in progress
+            if (stagingBuffer != nullptr && !writingBlock && !flushing) {
+                free(stagingBuffer);
+                stagingBuffer = nullptr;
+            }
+        }
+
+        void finishReceiveToFlash(bool result, uint16_t dataSize) {
+            releaseStagingBuffer();
+            if (flashCallback != nullptr) {
+                flashCallback(context, result, flashAddress, dataSize);
+            }
+        }
+
+        void endReceiveToFlash(bool result) {
+            currentState = State_Done;
+            Timers::stopTimer(timeoutTimer);
+            stopReceivingChunks(result);
+            finishReceiveToFlash(result, result ? size : 0);
+        }
+
+        uint8_t* getBlockBuffer(uint16_t block) {
+            return stagingBuffer + (block & 1) * blockSize;
+        }
+
+        /// <summary>
+        /// Whether the blocks the chunk falls in are available. Chunks aren't larger than a block
+        /// so they touch two blocks at most, and the block after the next one shares its buffer
+        /// with the block being written.
+        /// </summary>
+        bool canStageChunk(uint16_t offset, uint8_t length) {
+            uint16_t lastBlock = (offset + length - 1) / blockSize;
+            return lastBlock <= nextBlock + (writingBlock ? 0 : 1);
+        }
+
+        /// <summary>
+        /// Copies the chunk to its block(s) and acks it
+        /// </summary>
+        void stageChunk(uint16_t offset, const uint8_t* chunkData, uint8_t length) {
+            uint32_t copied = 0;
+            while (copied < length) {
+                uint32_t blockOffset = (offset + copied) % blockSize;
+                uint32_t copySize = MIN(length - copied, blockSize - blockOffset);
+                memcpy(getBlockBuffer((offset + copied) / blockSize) + blockOffset, &chunkData[copied], copySize);
+                copied += copySize;
+            }
+            window.markReceived(offset / chunkSize);
+            if (isComplete()) {
+                // Only the flash is left, the sender has nothing more to send
+                Timers::stopTimer(timeoutTimer);
+            }
+
+            // And send an ack!
+            sendBulkAckMessage(offset);
+        }
+
+        void onBlockWritten(void* context, bool result, uint32_t address, uint16_t s);
+
+        /// <summary>
+        /// Starts writing the next block if all its bytes are in, blocks are written in order
+        /// </summary>
+        void writeNextBlock() {
+            uint32_t blockStart = nextBlock * blockSize;
+            uint32_t blockEnd = MIN(blockStart + blockSize, size);
+            uint32_t receivedSize = MIN(window.receivedChunks * chunkSize, size);
+            if (writingBlock || blockStart >= size || receivedSize < blockEnd) {
+                return;
+            }
+
+            writingBlock = true;
+            uint8_t* buffer = getBlockBuffer(nextBlock);
+            nextBlock++;
+            NRF_LOG_DEBUG("Writing data to flash at 0x%08x", flashAddress + blockStart);
+
+            // Round up the size of the data to write, which is okay because blocks are a multiple of 4
+            Flash::write(nullptr, flashAddress + blockStart, buffer, Utils::roundUpTo4(blockEnd - blockStart), onBlockWritten);
+        }
+
+        void onBlockWritten(void* context, bool result, uint32_t address, uint16_t s) {
+            writingBlock = false;
+            if (currentState != State_WaitingForData) {
+                // The transfer failed while we were writing
+                releaseStagingBuffer();
+                return;
+            }
+            if (!result) {
+                NRF_LOG_ERROR("Error writing data to flash at 0x%08x", address);
+                endReceiveToFlash(false);
+                return;
+            }
+
+            // Stage the chunk that came in meanwhile, if any
+            if (pendingChunkSize > 0 && canStageChunk(pendingChunkOffset, pendingChunkSize)) {
+                uint8_t length = pendingChunkSize;
+                pendingChunkSize = 0;
+                stageChunk(pendingChunkOffset, inputBuffer, length);
+            }
+
+            writeNextBlock();
+
+            // Are we done?
+            if (!writingBlock && nextBlock * blockSize >= size) {
+                NRF_LOG_DEBUG("Done!");
+                endReceiveToFlash(true);
+            }
+        }
+
         void receiveChunk(const Message* message) {
             auto msg = (const MessageBulkData*)message;
+            NRF_LOG_DEBUG("Received Bulk Data (offset: 0x%04x, length: %d)", msg->offset, msg->size);
+            if (!acceptChunk(msg) || msg->size == 0 || (pendingChunkSize > 0 && msg->offset == pendingChunkOffset)) {
+                return;
+            }
+
+            bool canStage = canStageChunk(msg->offset, msg->size);
+            if (!canStage && pendingChunkSize > 0) {
+                // No room, the sender will resend this chunk
+                NRF_LOG_DEBUG("Dropping chunk, flash busy");
+                return;
+            }
+
             // Cancel the timer first
             Timers::stopTimer(timeoutTimer);
+            Timers::startTimer(timeoutTimer, RETRY_MS);
+            retryCount = 0;
 
-            // Ignore further messaged until we've programmed flash
-            MessageService::UnregisterMessageHandler(Message::MessageType_BulkData);
+            if (canStage) {
+                stageChunk(msg->offset, msg->data, msg->size);
+                writeNextBlock();
+            } else {
+                // Keep it until the block being written is done, it is only acked then
+                memcpy(inputBuffer, msg->data, msg->size);
+                pendingChunkOffset = msg->offset;
+                pendingChunkSize = msg->size;
+            }
+        }
 
-            // Program the data
-            NRF_LOG_DEBUG("Received Bulk Data (offset: 0x%04x, length: %d)", msg->offset, msg->size);
+        void endDecompression(bool result) {
+            if (!result) {
+                NRF_LOG_WARNING("Failed to decompress data");
+            }
+            size = result ? decoder.getUncompressedSize() : 0;
+            endReceiveToFlash(result);
+        }
 
-            // Copy the data to properly aligned buffer
-            memcpy(dataBuffer, msg->data, msg->size);
-            NRF_LOG_DEBUG("Writing data to flash at 0x%08x", flashAddress + msg->offset);
-            //NRF_LOG_HEXDUMP_INFO(dataBuffer, msg->size);
+        void flushStagingBuffer();
 
-            // Round up the size of the data to write, which should be okay because the
-            // temporary buffer is large enough
-            uint32_t flashWriteSize = 4 * ((msg->size + 3) / 4);
+        /// <summary>
+        /// Decodes the pending compressed bytes, as long as there is room in the staging buffer
+        /// </summary>
+        void decodePendingInput() {
+            while (pendingInputSize > 0 && !flushing) {
+                uint32_t used = decoder.decode(&inputBuffer[pendingInputOffset], pendingInputSize);
+                pendingInputOffset += used;
+                pendingInputSize -= used;
+                if (decoder.hasFailed() || (decoder.hasSize() && decoder.getUncompressedSize() != expectedUncompressedSize)) {
+                    endDecompression(false);
+                    return;
+                }
+                if (decoder.isOutputFull()) {
+                    flushStagingBuffer();
+                } else if (pendingInputSize > 0) {
+                    // Decoder is done but there is more data
+                    endDecompression(false);
+                    return;
+                }
+            }
 
-            // Go ahead
-            Flash::write(nullptr, flashAddress + msg->offset, dataBuffer, flashWriteSize,
-                [](void* context, bool result, uint32_t address, uint16_t s) {
+            if (pendingInputSize == 0 && !flushing && isComplete()) {
+                if (!decoder.isDone()) {
+                    endDecompression(false);
+                } else if (decoder.getOutputLength() > 0) {
+                    // Write the last bytes
+                    flushStagingBuffer();
+                } else {
+                    NRF_LOG_DEBUG("Done! Decompressed 0x%04x bytes", decoder.getUncompressedSize());
+                    endDecompression(true);
+                }
+            }
+        }
 
-                    uint16_t offset = (uint16_t)(address - flashAddress);
-                    if (offset + s < size) {
-                        // Be ready to receive the next message
-                        MessageService::RegisterMessageHandler(Message::MessageType_BulkData, receiveChunk);
-                    }
+        void onStagingBufferFlushed(void* context, bool result, uint32_t address, uint16_t s) {
+            flushing = false;
+            if (currentState != State_WaitingForData) {
+                releaseStagingBuffer();
+                return;
+            }
+            if (!result) {
+                endDecompression(false);
+                return;
+            }
+            decoder.setOutput(stagingBuffer, blockSize);
+            decodePendingInput();
+        }
 
-                    // And send an ack!
-                    sendBulkAckMessage(offset);
+        void flushStagingBuffer() {
+            flushing = true;
+            uint32_t address = flashAddress + decoder.getOutputOffset();
+            NRF_LOG_DEBUG("Writing decompressed data to flash at 0x%08x", address);
+            Flash::write(nullptr, address, stagingBuffer, Utils::roundUpTo4(decoder.getOutputLength()), onStagingBufferFlushed);
+        }
 
-                    // Are we done?
-                    if (offset + s >= size) {
-                        // Done
-                        NRF_LOG_DEBUG("Done!")
-                        if (flashCallback != nullptr) {
-                            flashCallback(context, true, flashAddress, size);
-                        }
-                    }
-                }
-            );
+        void receiveCompressedChunk(const Message* message) {
+            auto msg = (const MessageBulkData*)message;
+            NRF_LOG_DEBUG("Received Compressed Bulk Data (offset: 0x%04x, length: %d)", msg->offset, msg->size);
+            if (!acceptChunk(msg)) {
+                return;
+            }
+
+            // The data is decoded in order, and while the staging buffer is being written
+            // we only have room for one chunk, the sender will resend the others
+            if (msg->offset / chunkSize != window.receivedChunks || pendingInputSize > 0) {
+                NRF_LOG_DEBUG("Dropping chunk");
+                return;
+            }
+
+            // Cancel the timer first
+            Timers::stopTimer(timeoutTimer);
+            Timers::startTimer(timeoutTimer, RETRY_MS);
+            retryCount = 0;
+
+            memcpy(inputBuffer, msg->data, msg->size);
+            pendingInputOffset = 0;
+            pendingInputSize = msg->size;
+            window.markReceived(msg->offset / chunkSize);
+
+            // We have the data now, send an ack before decoding
+            sendBulkAckMessage(msg->offset);
+            decodePendingInput();
         }
 
-        /// <summary>
-        /// Bulk data transfer directly to flash, note that the flash area must already be erased
-        /// </summary>
-        void receiveToFlash(uint32_t theFlashAddress, void* theContext, receiveToFlashResultCallback theCallback)
+        void beginReceiveToFlash(uint32_t theFlashAddress, void* theContext, receiveToFlashResultCallback theCallback)
         {
             flashAddress = theFlashAddress;
             size = 0;
             retryCount = 0;
             flashCallback = theCallback;
             context = theContext;
+            nextBlock = 0;
+            writingBlock = false;
+            flushing = false;
+            pendingChunkSize = 0;
+            pendingInputSize = 0;
 
             currentState = State_Init;
 
@@ -392,7 +857,7 @@ namespace Bluetooth
                         NRF_LOG_WARNING("Timeout waiting for setup message");
                         currentState = State_Done;
                         MessageService::UnregisterMessageHandler(Message::MessageType_BulkSetup);
-                        flashCallback(context, false, flashAddress, 0);
+                        finishReceiveToFlash(false, 0);
                     }
                     // Else ignore
                 }
@@ -412,7 +877,7 @@ namespace Bluetooth
 
                         auto msg = (const MessageBulkSetup*)message;
                         size = msg->size;
-                        NRF_LOG_INFO("Transfer size: 0x%04x", size);
+                        setupWindow(msg);
                         currentState = State_WaitingForData;
 
                         // Send Ack, and wait for data to come in, or timeout!
@@ -425,17 +890,23 @@ namespace Bluetooth
                                         NRF_LOG_WARNING("Timeout waiting for next data message");
                                         currentState = State_Done;
                                         MessageService::UnregisterMessageHandler(Message::MessageType_BulkData);
-                                        flashCallback(context, false, flashAddress, 0);
-                                    } else {
+                                        finishReceiveToFlash(false, 0);
+                                    } else if (window.receivedChunks == 0 && window.receivedMask == 0) {
                                         // Try again...
                                         sendSetupAckMessage();
+                                    } else {
+                                        // Let the sender know what it should resend
+                                        sendBulkAckMessage(0);
+                                        Timers::startTimer(timeoutTimer, RETRY_MS);
                                     }
                                 }
                                 // Else ignore
                             }
                         );
 
-                        MessageService::RegisterMessageHandler(Message::MessageType_BulkData, receiveChunk);
+                        // Replaces the handler still acking the previous transfer, if any
+                        MessageService::UnregisterMessageHandler(Message::MessageType_BulkData);
+                        MessageService::RegisterMessageHandler(Message::MessageType_BulkData, decompressing ? receiveCompressedChunk : receiveChunk);
 
                         // Send Setup ack
                         sendSetupAckMessage();
@@ -447,6 +918,60 @@ namespace Bluetooth
             currentState = State_WaitingForSetup;
         }
 
+        /// <summary>
+        /// Allocates the staging buffer, a page or smaller if the heap is short (debug builds have
+        /// less than a page), halving the size until it fits. Returns the size allocated, 0 on failure.
+        /// </summary>
+        uint32_t allocateStagingBuffer(uint32_t minSize) {
+            uint32_t stagingSize = Flash::getPageSize();
+            stagingBuffer = (uint8_t*)malloc(stagingSize);
+            while (stagingBuffer == nullptr && stagingSize > minSize) {
+                stagingSize /= 2;
+                stagingBuffer = (uint8_t*)malloc(stagingSize);
+            }
+            return stagingBuffer != nullptr ? stagingSize : 0;
+        }
+
+        /// <summary>
+        /// Bulk data transfer directly to flash, note that the flash area must already be erased.
+        /// Chunks are acked once staged in RAM, the result callback is only called once all the data is written.
+        /// </summary>
+        void receiveToFlash(uint32_t theFlashAddress, void* theContext, receiveToFlashResultCallback theCallback)
+        {
+            // Two blocks
+            blockSize = allocateStagingBuffer(2 * MIN_STAGING_BLOCK_SIZE) / 2;
+            if (stagingBuffer == nullptr) {
+                NRF_LOG_ERROR("Not enough ram to allocate staging buffer");
+                theCallback(theContext, false, theFlashAddress, 0);
+                return;
+            }
+            decompressing = false;
+            beginReceiveToFlash(theFlashAddress, theContext, theCallback);
+        }
+
+        /// <summary>
+        /// Same as receiveToFlash() but the sender compressed the data with Utils::lz77_compress,
+        /// it is decompressed as it comes in. The transfer fails unless it decompresses to exactly
+        /// expectedSize bytes, the result callback gets that size.
+        /// </summary>
+        void receiveToFlashDecompressed(uint32_t theFlashAddress, uint32_t expectedSize, void* theContext, receiveToFlashResultCallback theCallback)
+        {
+            // One block, the decoder doesn't need the whole match distance in RAM
+            blockSize = allocateStagingBuffer(MIN_STAGING_BLOCK_SIZE);
+            if (stagingBuffer == nullptr) {
+                NRF_LOG_ERROR("Not enough ram to allocate decompression buffer");
+                theCallback(theContext, false, theFlashAddress, 0);
+                return;
+            }
+            decompressing = true;
+            expectedUncompressedSize = expectedSize;
+
+            // Matches reaching back before the staging buffer read the data already in flash
+            decoder.begin((const uint8_t*)theFlashAddress);
+            decoder.setOutput(stagingBuffer, blockSize);
+            beginReceiveToFlash(theFlashAddress, theContext, theCallback);
+        }
+
         #if DICE_SELFTEST && BULK_DATA_TRANSFER_SELFTEST
         void transferDone(void* context, bool result, uint8_t* data, uint16_t size) {
             if (result) {
@@ -31,6 +31,7 @@ namespace Bluetooth
         void receive(void* context, receiveAllocator allocator, receiveResultCallback callback);
         typedef void (*receiveToFlashResultCallback)(void* context, bool result, uint32_t address, uint16_t data_size);
         void receiveToFlash(uint32_t flashAddress, void* context, receiveToFlashResultCallback callback);
+        void receiveToFlashDecompressed(uint32_t flashAddress, uint32_t expectedSize, void* context, receiveToFlashResultCallback callback);
         void selfTest();
     };
 }
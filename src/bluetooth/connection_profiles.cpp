@@ -0,0 +1,213 @@
+#include "connection_profiles.h"
+#include "bluetooth_stack.h"
+#include "bluetooth_messages.h"
+#include "bluetooth_message_service.h"
+#include "drivers_nrf/timers.h"
+#include "ble.h"
+#include "ble_conn_params.h"
+#include "app_error.h"
+#include "nrf_log.h"
+
+using namespace DriversNRF;
+
+#define PROFILE_UPDATE_INTERVAL_MS 500      // How often we check whether to switch profiles
+#define TRANSFER_HOLD_MS 1000               // Stay in the transfer profile this long after the last chunk
+#define IDLE_TIMEOUT_MS 10000               // Switch to the idle profile after this long without messages
+
+namespace Bluetooth::ConnectionProfiles
+{
+    // Preferred connection parameters for each profile, in Profile order.
+    // The supervision timeout must stay above 2 * (1 + latency) * max interval.
+    static const ble_gap_conn_params_t profileParams[Profile_Count] = {
+        // Interactive: same as the parameters negotiated when connecting
+        {
+            .min_conn_interval = MSEC_TO_UNITS(15, UNIT_1_25_MS),
+            .max_conn_interval = MSEC_TO_UNITS(30, UNIT_1_25_MS),
+            .slave_latency     = 0,
+            .conn_sup_timeout  = MSEC_TO_UNITS(3000, UNIT_10_MS),
+        },
+        // Transfer: minimum interval, some centrals (iOS) will round it up to 15ms
+        {
+            .min_conn_interval = BLE_GAP_CP_MIN_CONN_INTVL_MIN, // 7.5ms
+            .max_conn_interval = MSEC_TO_UNITS(15, UNIT_1_25_MS),
+            .slave_latency     = 0,
+            .conn_sup_timeout  = MSEC_TO_UNITS(3000, UNIT_10_MS),
+        },
+        // Idle: the die may skip up to 4 connection events when it has nothing to send
+        {
+            .min_conn_interval = MSEC_TO_UNITS(100, UNIT_1_25_MS),
+            .max_conn_interval = MSEC_TO_UNITS(200, UNIT_1_25_MS),
+            .slave_latency     = 4,
+            .conn_sup_timeout  = MSEC_TO_UNITS(6000, UNIT_10_MS),
+        },
+    };
+
+    APP_TIMER_DEF(profileTimer);
+
+    static bool connected = false;
+    static bool fastPhyRequested = false;
+    static Profile currentProfile = Profile_Interactive;
+    static int lastTransferTime = 0;
+    static int lastActivityTime = 0;
+    static int interactiveHoldCount = 0;
+    static uint8_t refusedProfiles = 0; // Bit mask of the profiles the central refused on this connection
+
+    // Stats, since boot
+    static uint16_t switchCounts[Profile_Count];
+    static uint32_t profileDurationsMs[Profile_Count];
+    static int profileStartTime = 0;
+
+    void onConnectionEvent(void* param, bool connected);
+    void update(void* context);
+    void requestStatsHandler(const Message* msg);
+
+    void init() {
+        memset(switchCounts, 0, sizeof(switchCounts));
+        memset(profileDurationsMs, 0, sizeof(profileDurationsMs));
+
+        Timers::createTimer(&profileTimer, APP_TIMER_MODE_REPEATED, update);
+        Stack::hook(onConnectionEvent, nullptr);
+        MessageService::RegisterMessageHandler(Message::MessageType_RequestConnectionProfileStats, requestStatsHandler);
+
+        NRF_LOG_DEBUG("Connection profiles init");
+    }
+
+    void accumulateProfileDuration() {
+        int time = Timers::millis();
+        profileDurationsMs[currentProfile] += time - profileStartTime;
+        profileStartTime = time;
+    }
+
+    void requestFastPhy() {
+        // Only once per connection, the central keeps whatever it picked if it doesn't support 2M
+        if (!fastPhyRequested) {
+            fastPhyRequested = true;
+            ble_gap_phys_t const phys = {
+                .tx_phys = BLE_GAP_PHY_2MBPS,
+                .rx_phys = BLE_GAP_PHY_2MBPS,
+            };
+            ret_code_t err_code = sd_ble_gap_phy_update(Stack::getConnectionHandle(), &phys);
+            if (err_code != NRF_SUCCESS) {
+                NRF_LOG_WARNING("PHY update request failed, error 0x%x", err_code);
+            }
+        }
+    }
+
+    void switchTo(Profile profile) {
+        if (!connected || profile == currentProfile) {
+            return;
+        }
+        if (profile != Profile_Interactive && (refusedProfiles & (1 << profile)) != 0) {
+            // Asking again would only get refused again, the interactive profile is always tried though
+            return;
+        }
+
+        // Going through the conn params module so it doesn't try to renegotiate back
+        // to its preferred parameters, it then calls sd_ble_gap_conn_param_update()
+        ble_gap_conn_params_t params = profileParams[profile];
+        ret_code_t err_code = ble_conn_params_change_conn_params(Stack::getConnectionHandle(), &params);
+        if (err_code != NRF_SUCCESS) {
+            // Most likely an update is already in progress, try again on the next update
+            NRF_LOG_DEBUG("Could not switch to connection profile %d, error 0x%x", profile, err_code);
+            return;
+        }
+
+        NRF_LOG_INFO("Connection profile %d -> %d", currentProfile, profile);
+        accumulateProfileDuration();
+        currentProfile = profile;
+        switchCounts[profile]++;
+
+        if (profile == Profile_Transfer) {
+            // The data length is already extended by the GATT module when connecting
+            requestFastPhy();
+        }
+    }
+
+    Profile getWantedProfile() {
+        int time = Timers::millis();
+        if (lastTransferTime != 0 && time - lastTransferTime < TRANSFER_HOLD_MS) {
+            return Profile_Transfer;
+        } else if (interactiveHoldCount > 0 || time - lastActivityTime < IDLE_TIMEOUT_MS) {
+            return Profile_Interactive;
+        } else {
+            return Profile_Idle;
+        }
+    }
+
+    void update(void* context) {
+        switchTo(getWantedProfile());
+    }
+
+    void notifyTransfer() {
+        lastTransferTime = Timers::millis();
+        lastActivityTime = lastTransferTime;
+        if (currentProfile != Profile_Transfer) {
+            switchTo(Profile_Transfer);
+        }
+    }
+
+    void notifyActivity() {
+        lastActivityTime = Timers::millis();
+        if (currentProfile == Profile_Idle) {
+            switchTo(Profile_Interactive);
+        }
+    }
+
+    void holdInteractive() {
+        interactiveHoldCount++;
+        notifyActivity();
+    }
+
+    void releaseInteractive() {
+        if (interactiveHoldCount > 0) {
+            interactiveHoldCount--;
+        }
+    }
+
+    Profile getCurrentProfile() {
+        return currentProfile;
+    }
+
+    void onParametersRefused() {
+        if (!connected) {
+            return;
+        }
+        NRF_LOG_WARNING("Connection profile %d refused by the central", currentProfile);
+        refusedProfiles |= 1 << currentProfile;
+        if (currentProfile != Profile_Interactive) {
+            switchTo(Profile_Interactive);
+        }
+    }
+
+    void onConnectionEvent(void* param, bool isConnected) {
+        if (isConnected) {
+            // The connection starts with the default parameters
+            connected = true;
+            fastPhyRequested = false;
+            currentProfile = Profile_Interactive;
+            profileStartTime = Timers::millis();
+            lastActivityTime = profileStartTime;
+            lastTransferTime = 0;
+            refusedProfiles = 0;
+            Timers::startTimer(profileTimer, PROFILE_UPDATE_INTERVAL_MS);
+        } else if (connected) {
+            connected = false;
+            Timers::stopTimer(profileTimer);
+            accumulateProfileDuration();
+        }
+    }
+
+    void requestStatsHandler(const Message* msg) {
+        if (connected) {
+            accumulateProfileDuration();
+        }
+
+        MessageConnectionProfileStats statsMsg;
+        statsMsg.currentProfile = currentProfile;
+        for (int i = 0; i < Profile_Count; ++i) {
+            statsMsg.switchCounts[i] = switchCounts[i];
+            statsMsg.durationsMs[i] = profileDurationsMs[i];
+        }
+        MessageService::SendMessage(&statsMsg);
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "stdint.h"
+
+namespace Bluetooth::ConnectionProfiles
+{
+    enum Profile : uint8_t
+    {
+        Profile_Interactive = 0,    // Default, low latency for roll events and commands
+        Profile_Transfer,           // Shortest interval while bulk data is moving
+        Profile_Idle,               // High slave latency when nothing is happening
+        Profile_Count
+    };
+
+    void init();
+
+    // Bulk transfers call this for each chunk, the transfer profile is kept until they stop
+    void notifyTransfer();
+
+    // Any message from the app, postpones the switch to the idle profile
+    void notifyActivity();
+
+    // Prevents the idle profile while held, for instance while telemetry is on
+    void holdInteractive();
+    void releaseInteractive();
+
+    Profile getCurrentProfile();
+
+    // The central didn't accept the parameters of the current profile
+    void onParametersRefused();
+}
@@ -2,6 +2,7 @@
 #include "bluetooth_message_service.h"
 #include "bluetooth_messages.h"
 #include "bluetooth_stack.h"
+#include "connection_profiles.h"
 #include "app_error.h"
 #include "app_error_weak.h"
 #include "nrf_log.h"
@@ -19,6 +20,7 @@
 #include "utils/utils.h"
 #include "config/board_config.h"
 #include "modules/leds.h"
+#include <stddef.h>
 
 using namespace Modules;
 using namespace Bluetooth;
@@ -33,6 +35,22 @@ namespace Bluetooth::Telemetry
     static uint32_t minIntervalMs = 0;
     static uint32_t lastMessageMs = 0;
 
+    // Stream mode
+    #define SLOW_FIELD_GROUP_COUNT 5
+    #define SLOW_FIELDS_SIZE 16
+    #define MAX_ENCODED_FRAME_SIZE 27   // 5 varints of up to 5 bytes, plus face and roll state
+    #define MAX_FRAME_TIME_DELTA 0x7FFFF // Keeps the shifted time delta in 3 bytes
+    static const uint8_t slowFieldGroupSizes[SLOW_FIELD_GROUP_COUNT] = { 6, 3, 2, 4, 1 }; // In TelemetryStreamField order
+    static MessageTelemetryStream streamMessage;
+    static uint16_t streamDataSize;
+    static uint8_t lastSlowFields[SLOW_FIELDS_SIZE];
+    static uint8_t sentFieldMask;      // Slow field groups sent at least once since the stream started
+    static uint32_t previousTime;
+    static Core::int3 previousAcc;
+    static int16_t previousConfidence;
+    static uint8_t previousFace;
+    static RollState previousRollState;
+
     void onRequestTelemetryHandler(const Message* message);
 
     void init() {
@@ -52,7 +70,28 @@ namespace Bluetooth::Telemetry
         }
     }
 
+    void updateBatteryValues() {
+        // Update battery values
+        teleMessage.internalChargeState = DriversHW::Battery::checkCharging() ? 1 : 0;
+        teleMessage.batteryControllerMode = BatteryController::getControllerOverrideMode();
+        teleMessage.batteryLevelPercent = BatteryController::getLevelPercent();
+        teleMessage.batteryState = BatteryController::getBatteryState();
+        teleMessage.batteryControllerState = BatteryController::getState();
+
+        // Voltage and current
+        teleMessage.voltageTimes50 = BatteryController::getVoltageMilli() / 20;
+        teleMessage.vCoilTimes50 = Coil::getVCoilTimes1000() / 20;
+        teleMessage.vCoilMinTimes50 = Coil::getVCoilMinTimes1000() / 20;
+        teleMessage.vCoilMaxTimes50 = Coil::getVCoilMaxTimes1000() / 20;
+        teleMessage.ledCurrent = LEDs::computeCurrentEstimate();
+    }
+
     void trySend() {
+        // The stream sends these values along with the frames
+        if (requestMode == TelemetryRequestMode_Stream) {
+            return;
+        }
+
         // Check that we got the acceleration, RSSI and temperature data
         const bool allInit = teleMessage.time != 0 && teleMessage.rssi;
 
@@ -65,19 +104,7 @@ namespace Bluetooth::Telemetry
                     stop();
                 }
 
-                // Update battery values
-                teleMessage.internalChargeState = DriversHW::Battery::checkCharging() ? 1 : 0;
-                teleMessage.batteryControllerMode = BatteryController::getControllerOverrideMode();
-                teleMessage.batteryLevelPercent = BatteryController::getLevelPercent();
-                teleMessage.batteryState = BatteryController::getBatteryState();
-                teleMessage.batteryControllerState = BatteryController::getState();
-
-                // Voltage and current
-                teleMessage.voltageTimes50 = BatteryController::getVoltageMilli() / 20;
-                teleMessage.vCoilTimes50 = Coil::getVCoilTimes1000() / 20;
-                teleMessage.vCoilMinTimes50 = Coil::getVCoilMinTimes1000() / 20;
-                teleMessage.vCoilMaxTimes50 = Coil::getVCoilMaxTimes1000() / 20;
-                teleMessage.ledCurrent = LEDs::computeCurrentEstimate();
+                updateBatteryValues();
 
                 // Send the message
                 NRF_LOG_DEBUG("Sending telemetry: %d", teleMessage.time);
@@ -88,6 +115,140 @@ namespace Bluetooth::Telemetry
         }
     }
 
+    /// <summary>
+    /// Writes the slow changing fields, grouped the same way as TelemetryStreamField
+    /// </summary>
+    void writeSlowFields(uint8_t* out) {
+        out[0] = teleMessage.batteryLevelPercent;
+        out[1] = teleMessage.batteryState;
+        out[2] = teleMessage.batteryControllerState;
+        out[3] = teleMessage.voltageTimes50;
+        out[4] = teleMessage.internalChargeState;
+        out[5] = teleMessage.batteryControllerMode;
+        out[6] = teleMessage.vCoilTimes50;
+        out[7] = teleMessage.vCoilMinTimes50;
+        out[8] = teleMessage.vCoilMaxTimes50;
+        out[9] = (uint8_t)teleMessage.rssi;
+        out[10] = teleMessage.channelIndex;
+        memcpy(&out[11], &teleMessage.mcuTempTimes100, sizeof(int16_t));
+        memcpy(&out[13], &teleMessage.batteryTempTimes100, sizeof(int16_t));
+        out[15] = teleMessage.ledCurrent;
+    }
+
+    void sendStream() {
+        if (streamMessage.frameCount > 0) {
+            if (MessageService::isConnected()) {
+                NRF_LOG_DEBUG("Sending telemetry stream: %d frames, %d bytes", streamMessage.frameCount, streamDataSize);
+                MessageService::SendMessage(&streamMessage, offsetof(MessageTelemetryStream, data) + streamDataSize);
+            }
+            streamMessage.frameCount = 0;
+        }
+    }
+
+    /// <summary>
+    /// Starts a new stream message, its first frame is relative to the message
+    /// </summary>
+    void beginStreamMessage(uint32_t time) {
+        streamMessage.baseTime = time;
+        streamMessage.frameCount = 0;
+        streamMessage.fieldMask = 0;
+        streamDataSize = 0;
+        previousTime = time;
+        previousAcc = Core::int3(0, 0, 0);
+        previousConfidence = 0;
+    }
+
+    /// <summary>
+    /// Adds the slow fields that changed since they were last sent, as long as they fit in the
+    /// given size. The ones left out are sent with a later message.
+    /// </summary>
+    void addSlowFields(int maxSize) {
+        updateBatteryValues();
+        uint8_t slowFields[SLOW_FIELDS_SIZE];
+        writeSlowFields(slowFields);
+
+        int offset = 0;
+        for (int i = 0; i < SLOW_FIELD_GROUP_COUNT; ++i) {
+            int groupSize = slowFieldGroupSizes[i];
+            bool changed = !(sentFieldMask & (1 << i)) || memcmp(&slowFields[offset], &lastSlowFields[offset], groupSize) != 0;
+            if (changed && streamDataSize + groupSize <= maxSize) {
+                streamMessage.fieldMask |= 1 << i;
+                sentFieldMask |= 1 << i;
+                memcpy(&streamMessage.data[streamDataSize], &slowFields[offset], groupSize);
+                memcpy(&lastSlowFields[offset], &slowFields[offset], groupSize);
+                streamDataSize += groupSize;
+            }
+            offset += groupSize;
+        }
+    }
+
+    /// <summary>
+    /// Encodes the frame relative to the previous one of the message, returns the encoded size
+    /// </summary>
+    int encodeFrame(const Accelerometer::AccelFrame& frame, uint8_t* encoded) {
+        uint8_t flags = 0;
+        if (streamMessage.frameCount == 0 || frame.face != previousFace || frame.determinedRollState != previousRollState) {
+            flags |= TelemetryStreamFrameFlags_FaceChanged;
+        }
+        if (streamMessage.frameCount == 0 || frame.faceConfidenceTimes1000 != previousConfidence) {
+            flags |= TelemetryStreamFrameFlags_ConfidenceChanged;
+        }
+
+        uint32_t dt = frame.time - previousTime;
+        int size = writeVarint(encoded, (dt << TelemetryStreamFrameFlags_Count) | flags);
+        size += writeVarint(encoded + size, zigzag(frame.acc.xTimes1000 - previousAcc.xTimes1000));
+        size += writeVarint(encoded + size, zigzag(frame.acc.yTimes1000 - previousAcc.yTimes1000));
+        size += writeVarint(encoded + size, zigzag(frame.acc.zTimes1000 - previousAcc.zTimes1000));
+        if (flags & TelemetryStreamFrameFlags_FaceChanged) {
+            encoded[size++] = frame.face;
+            encoded[size++] = frame.determinedRollState;
+        }
+        if (flags & TelemetryStreamFrameFlags_ConfidenceChanged) {
+            size += writeVarint(encoded + size, zigzag(frame.faceConfidenceTimes1000 - previousConfidence));
+        }
+        return size;
+    }
+
+    void onAccDataStreamed(void* param, const Accelerometer::AccelFrame& frame) {
+        // Each message must fit in what the connection can take in one notification
+        int capacity = MIN(Stack::getMaxPayloadSize() - (int)offsetof(MessageTelemetryStream, data), MAX_TELEMETRY_STREAM_DATA_SIZE);
+
+        // A time gap too long for a delta starts a new message, which has its own base time
+        if (streamMessage.frameCount > 0 &&
+            (streamMessage.frameCount == 0xFF || frame.time - previousTime > MAX_FRAME_TIME_DELTA ||
+            (minIntervalMs > 0 && frame.time - streamMessage.baseTime >= minIntervalMs))) {
+            sendStream();
+        }
+
+        uint8_t encoded[MAX_ENCODED_FRAME_SIZE];
+        int size = 0;
+        if (streamMessage.frameCount > 0) {
+            size = encodeFrame(frame, encoded);
+            if (streamDataSize + size > capacity) {
+                sendStream();
+            }
+        }
+        if (streamMessage.frameCount == 0) {
+            beginStreamMessage(frame.time);
+            size = encodeFrame(frame, encoded);
+            if (size > capacity) {
+                // Only with large values and the smallest MTU
+                NRF_LOG_WARNING("Telemetry frame too large for the connection, dropped");
+                return;
+            }
+            addSlowFields(capacity - size);
+        }
+
+        memcpy(&streamMessage.data[streamDataSize], encoded, size);
+        streamDataSize += size;
+        streamMessage.frameCount++;
+        previousTime = frame.time;
+        previousAcc = frame.acc;
+        previousConfidence = frame.faceConfidenceTimes1000;
+        previousFace = frame.face;
+        previousRollState = frame.determinedRollState;
+    }
+
     void onAccDataReceived(void* param, const Accelerometer::AccelFrame& frame) {
         teleMessage.acc = frame.acc;
         teleMessage.faceConfidenceTimes1000 = frame.faceConfidenceTimes1000;
@@ -119,7 +280,9 @@ namespace Bluetooth::Telemetry
     void onRequestTelemetryHandler(const Message* message) {
         auto reqTelem = static_cast<const MessageRequestTelemetry *>(message);
         NRF_LOG_DEBUG("Received Telemetry Request, mode = %d, minInterval = %d", reqTelem->requestMode, reqTelem->minInterval);
-        if (reqTelem->requestMode != TelemetryRequestMode_Off) {
+        if (reqTelem->requestMode == TelemetryRequestMode_Stream) {
+            startStream(reqTelem->minInterval);
+        } else if (reqTelem->requestMode != TelemetryRequestMode_Off) {
             start(reqTelem->requestMode == TelemetryRequestMode_Repeat, reqTelem->minInterval);
         } else {
             stop();
@@ -127,6 +290,9 @@ namespace Bluetooth::Telemetry
     }
 
     void start(bool repeat, uint32_t minInterval) {
+        if (requestMode == TelemetryRequestMode_Stream) {
+            stop();
+        }
         minIntervalMs = minInterval;
 
         // Reset timestamp so next message is send on the first call to trySend()
@@ -146,6 +312,7 @@ namespace Bluetooth::Telemetry
 
             // Monitor connections status
             Bluetooth::Stack::hook(onConnectionEvent, nullptr);
+            ConnectionProfiles::holdInteractive();
 
             // Ask the acceleration controller to be notified when
             // new acceleration data comes in!
@@ -163,13 +330,53 @@ namespace Bluetooth::Telemetry
         }
     }
 
+    /// <summary>
+    /// Sends every accelerometer frame, batched and delta encoded in MessageTelemetryStream
+    /// </summary>
+    void startStream(uint32_t maxLatencyMs) {
+        if (requestMode != TelemetryRequestMode_Stream) {
+            stop();
+            NRF_LOG_INFO("Telemetry stream on, max latency %dms", maxLatencyMs);
+            requestMode = TelemetryRequestMode_Stream;
+
+            streamMessage.frameCount = 0;
+            sentFieldMask = 0;
+            teleMessage.rssi = 0;
+            teleMessage.channelIndex = 0;
+            teleMessage.mcuTempTimes100 = Temperature::getMCUTemperatureTimes100();
+            teleMessage.batteryTempTimes100 = Temperature::getNTCTemperatureTimes100();
+
+            // The slow fields are picked up when a message is started
+            Bluetooth::Stack::hook(onConnectionEvent, nullptr);
+            ConnectionProfiles::holdInteractive();
+            Accelerometer::hookFrameData(onAccDataStreamed, nullptr);
+            Stack::hookRssi(onRssiChanged, nullptr);
+            Temperature::hookTemperatureChange(onTemperatureChanged, nullptr);
+            Modules::BatteryController::setUpdateRate(BatteryController::UpdateRate_Fast);
+        }
+        minIntervalMs = maxLatencyMs;
+    }
+
     void stop() {
-        if (requestMode != TelemetryRequestMode_Off) {
+        if (requestMode == TelemetryRequestMode_Stream) {
+            NRF_LOG_INFO("Telemetry stream off");
+            requestMode = TelemetryRequestMode_Off;
+
+            // Send what we have
+            sendStream();
+            Bluetooth::Stack::unHook(onConnectionEvent);
+            ConnectionProfiles::releaseInteractive();
+            Accelerometer::unHookFrameData(onAccDataStreamed);
+            Stack::unHookRssi(onRssiChanged);
+            Temperature::unHookTemperatureChange(onTemperatureChanged);
+            Modules::BatteryController::setUpdateRate(BatteryController::UpdateRate_Normal);
+        } else if (requestMode != TelemetryRequestMode_Off) {
             NRF_LOG_INFO("Telemetry off");
             requestMode = TelemetryRequestMode_Off;
 
             // Stop being notified!
             Bluetooth::Stack::unHook(onConnectionEvent);
+            ConnectionProfiles::releaseInteractive();
             Accelerometer::unHookFrameData(onAccDataReceived);
             Stack::unHookRssi(onRssiChanged);
             Temperature::unHookTemperatureChange(onTemperatureChanged);
@@ -6,5 +6,6 @@ namespace Bluetooth::Telemetry
 {
     void init();
     void start(bool repeat, uint32_t maxRate);
+    void startStream(uint32_t maxLatencyMs);
     void stop();
 }
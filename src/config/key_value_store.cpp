@@ -0,0 +1,274 @@
+#include "key_value_store.h"
+#include "settings.h"
+#include "drivers_nrf/flash.h"
+#include "utils/utils.h"
+#include "nrf_log.h"
+#include "malloc.h"
+#include "string.h"
+
+#define RECORD_KEY_ERASED 0xFF
+#define RECORD_NONE 0xFFFF
+#define RECORD_MAX_DATA_SIZE (0xFF * 4)
+
+using namespace DriversNRF;
+using namespace Utils;
+
+namespace Config::KeyValueStore
+{
+    /// <summary>
+    /// Records are appended after the settings, in the same flash page:
+    /// [Settings][Record|Record|...][erased]
+    /// The header is a single word, which the flash writes in one go, so an interrupted
+    /// append leaves a record with a bad CRC that can still be skipped over.
+    /// When the page is full, the latest record of each key is copied to RAM and written
+    /// back along with the settings, which is the only time the page is erased. That only
+    /// happens once Flash has a copy to restore if the power is cut meanwhile.
+    /// </summary>
+    struct RecordHeader
+    {
+        uint8_t key;
+        uint8_t sizeInWords;
+        uint16_t crc;
+    };
+
+    // Offset of the latest record of each key, from the start of the records
+    static uint16_t recordOffsets[Key_Count];
+    static uint32_t writeOffset = 0;
+    static uint32_t compactionCount = 0;
+
+    // Only one write at a time
+    static uint8_t* writeBuffer = nullptr;
+    static WriteCallback writeCallback = nullptr;
+
+    void onProgrammingEvent(void* context, Flash::ProgrammingEventType evt, Flash::ProgrammingRegion region);
+
+    uint32_t getRecordsSize() {
+        return Flash::getSettingsEndAddress() - Flash::getSettingsRecordsAddress();
+    }
+
+    const RecordHeader* getRecord(uint32_t offset) {
+        return (const RecordHeader*)(Flash::getSettingsRecordsAddress() + offset);
+    }
+
+    uint32_t getRecordSize(const RecordHeader* header) {
+        return sizeof(RecordHeader) + header->sizeInWords * 4;
+    }
+
+    uint16_t computeRecordCrc(uint8_t key, const uint8_t* data, uint32_t size) {
+        return computeCrc16(data, size, computeCrc16(&key, 1));
+    }
+
+    void clearIndex() {
+        for (int i = 0; i < Key_Count; ++i) {
+            recordOffsets[i] = RECORD_NONE;
+        }
+    }
+
+    /// <summary>
+    /// Walks the records once and keeps the offset of the latest valid one for each key
+    /// </summary>
+    void buildIndex() {
+        clearIndex();
+        writeOffset = 0;
+
+        const uint32_t recordsSize = getRecordsSize();
+        if (!SettingsManager::checkValid()) {
+            // Whatever follows invalid settings can't be trusted, next write will start over
+            writeOffset = recordsSize;
+            return;
+        }
+
+        while (writeOffset + sizeof(RecordHeader) <= recordsSize) {
+            auto header = getRecord(writeOffset);
+            if (header->key == RECORD_KEY_ERASED) {
+                break;
+            }
+            const uint32_t recordSize = getRecordSize(header);
+            if (writeOffset + recordSize > recordsSize) {
+                // Can't be skipped, so treat the page as full
+                writeOffset = recordsSize;
+                break;
+            }
+            auto data = (const uint8_t*)(header + 1);
+            if (header->key < Key_Count && header->crc == computeRecordCrc(header->key, data, recordSize - sizeof(RecordHeader))) {
+                recordOffsets[header->key] = writeOffset;
+            } else {
+                NRF_LOG_WARNING("Skipping invalid record at offset 0x%x", writeOffset);
+            }
+            writeOffset += recordSize;
+        }
+    }
+
+    void init() {
+        buildIndex();
+        Flash::hookProgrammingEvent(onProgrammingEvent, nullptr);
+        NRF_LOG_INFO("Key value store init, %d/%d bytes used", writeOffset, getRecordsSize());
+    }
+
+    const void* read(Key key, uint16_t* outSize) {
+        if (key >= Key_Count || recordOffsets[key] == RECORD_NONE) {
+            return nullptr;
+        }
+        auto header = getRecord(recordOffsets[key]);
+        if (outSize != nullptr) {
+            *outSize = header->sizeInWords * 4;
+        }
+        return header + 1;
+    }
+
+    void finishWrite(bool success) {
+        free(writeBuffer);
+        writeBuffer = nullptr;
+        auto callbackCopy = writeCallback;
+        writeCallback = nullptr;
+        if (callbackCopy != nullptr) {
+            callbackCopy(success);
+        }
+    }
+
+    /// <summary>
+    /// Fills in a record for the given data, returns its size
+    /// </summary>
+    uint32_t setupRecord(uint8_t* outRecord, Key key, const void* data, uint16_t size) {
+        const uint32_t dataSize = roundUpTo4(size);
+        auto header = (RecordHeader*)outRecord;
+        auto recordData = outRecord + sizeof(RecordHeader);
+        memcpy(recordData, data, size);
+        memset(recordData + size, 0, dataSize - size);
+        header->key = key;
+        header->sizeInWords = dataSize / 4;
+        header->crc = computeRecordCrc(key, recordData, dataSize);
+        return sizeof(RecordHeader) + dataSize;
+    }
+
+    bool append(Key key, const void* data, uint16_t size) {
+        const uint32_t recordSize = sizeof(RecordHeader) + roundUpTo4(size);
+        writeBuffer = (uint8_t*)malloc(recordSize);
+        if (writeBuffer == nullptr) {
+            NRF_LOG_ERROR("Not enough ram to allocate record");
+            return false;
+        }
+        setupRecord(writeBuffer, key, data, size);
+
+        bool started = Flash::programWrite(Flash::getSettingsRecordsAddress() + writeOffset, writeBuffer, recordSize,
+            [](bool result) {
+                if (result) {
+                    auto header = (const RecordHeader*)writeBuffer;
+                    recordOffsets[header->key] = writeOffset;
+                    writeOffset += getRecordSize(header);
+                } else {
+                    NRF_LOG_ERROR("Error writing record");
+                    buildIndex();
+                }
+                finishWrite(result);
+            });
+        if (!started) {
+            free(writeBuffer);
+            writeBuffer = nullptr;
+        }
+        return started;
+    }
+
+    bool compact(Key key, const void* data, uint16_t size) {
+        auto settings = SettingsManager::getSettings();
+        if (settings == nullptr) {
+            NRF_LOG_ERROR("Can't compact records without valid settings");
+            return false;
+        }
+
+        // Only the latest record of the other keys is kept, followed by the new one
+        uint32_t totalSize = sizeof(RecordHeader) + roundUpTo4(size);
+        for (int i = 0; i < Key_Count; ++i) {
+            if (i != key && recordOffsets[i] != RECORD_NONE) {
+                totalSize += getRecordSize(getRecord(recordOffsets[i]));
+            }
+        }
+        if (totalSize > getRecordsSize()) {
+            NRF_LOG_ERROR("Records don't fit in settings page");
+            return false;
+        }
+        if (!Flash::canBackupSettings(totalSize)) {
+            // The copies are only erased with the dataset, past copies keep piling up until then
+            if (!Flash::hasSettingsBackup(*settings)) {
+                NRF_LOG_ERROR("No room to back up the settings, can't compact records");
+                return false;
+            }
+            NRF_LOG_WARNING("No room to back up the settings, the last copy is kept instead");
+        }
+        writeBuffer = (uint8_t*)malloc(totalSize);
+        if (writeBuffer == nullptr) {
+            NRF_LOG_ERROR("Not enough ram to compact records");
+            return false;
+        }
+        uint32_t offset = 0;
+        for (int i = 0; i < Key_Count; ++i) {
+            if (i != key && recordOffsets[i] != RECORD_NONE) {
+                auto header = getRecord(recordOffsets[i]);
+                memcpy(writeBuffer + offset, header, getRecordSize(header));
+                offset += getRecordSize(header);
+            }
+        }
+        setupRecord(writeBuffer + offset, key, data, size);
+
+        // The index is rebuilt from the programming event
+        NRF_LOG_INFO("Compacting records, %d bytes kept", totalSize);
+        bool started = Flash::programSettings(*settings, writeBuffer, totalSize, [](bool result) {
+            compactionCount++;
+            finishWrite(result);
+        });
+        if (!started) {
+            free(writeBuffer);
+            writeBuffer = nullptr;
+        }
+        return started;
+    }
+
+    bool write(Key key, const void* data, uint16_t size, WriteCallback callback) {
+        if (key >= Key_Count || size == 0 || size > RECORD_MAX_DATA_SIZE) {
+            NRF_LOG_ERROR("Invalid record, key: %d, size: %d", key, size);
+            return false;
+        }
+        if (writeBuffer != nullptr || Flash::isBusy()) {
+            NRF_LOG_WARNING("Flash busy, can't write record");
+            return false;
+        }
+
+        writeCallback = callback;
+        const uint32_t recordSize = sizeof(RecordHeader) + roundUpTo4(size);
+        bool started = writeOffset + recordSize <= getRecordsSize() ?
+            append(key, data, size) : compact(key, data, size);
+        if (!started) {
+            writeCallback = nullptr;
+        }
+        return started;
+    }
+
+    bool reset(const Settings& newSettings, WriteCallback callback) {
+        if (writeBuffer != nullptr) {
+            NRF_LOG_WARNING("Already writing a record");
+            return false;
+        }
+        writeCallback = callback;
+        bool started = Flash::programSettings(newSettings, nullptr, 0, finishWrite);
+        if (!started) {
+            writeCallback = nullptr;
+        }
+        return started;
+    }
+
+    uint32_t getCompactionCount() {
+        return compactionCount;
+    }
+
+    void onProgrammingEvent(void* context, Flash::ProgrammingEventType evt, Flash::ProgrammingRegion region) {
+        if (region != Flash::ProgrammingRegion_Settings) {
+            return;
+        }
+        if (evt == Flash::ProgrammingEventType_Begin) {
+            // The page is about to be erased
+            clearIndex();
+        } else {
+            buildIndex();
+        }
+    }
+}
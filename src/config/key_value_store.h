@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace Config
+{
+    struct Settings;
+}
+
+namespace Config::KeyValueStore
+{
+    // Values that change after the die left the factory, each stored in its own record
+    // so that updating one doesn't erase and rewrite the whole settings page
+    enum Key : uint8_t
+    {
+        Key_Name = 0,
+        Key_DesignAndColor,
+        Key_FaceNormals,
+        Key_BroadcastMode,
+        Key_RollThresholds,
+        Key_Count,
+    };
+
+    typedef void (*WriteCallback)(bool success);
+
+    // Builds the RAM index of the records found in flash
+    void init();
+
+    // Returns the latest value stored for the given key, or nullptr if there is none.
+    // The size is the record data size, rounded up to a multiple of 4 bytes.
+    const void* read(Key key, uint16_t* outSize = nullptr);
+
+    // Appends a new record for the given key, compacting the log first if it is full.
+    // Returns false if the write couldn't be started, the callback isn't called in that case.
+    bool write(Key key, const void* data, uint16_t size, WriteCallback callback);
+
+    // Erases the settings page and writes the given settings, dropping all the records
+    bool reset(const Settings& newSettings, WriteCallback callback);
+
+    uint32_t getCompactionCount();
+}
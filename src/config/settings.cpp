@@ -5,6 +5,7 @@
 #include "app_error_weak.h"
 #include "config/board_config.h"
 #include "config/value_store.h"
+#include "config/key_value_store.h"
 #include "bluetooth/bluetooth_messages.h"
 #include "bluetooth/bluetooth_stack.h"
 #include "bluetooth/bluetooth_message_service.h"
@@ -12,7 +13,6 @@
 #include "malloc.h"
 #include "config/dice_variants.h"
 #include "utils/utils.h"
-#include "data_set/data_set.h"
 #include "pixel.h"
 #include "app_error.h"
 
@@ -23,12 +23,18 @@ using namespace DriversNRF;
 using namespace Bluetooth;
 using namespace Config;
 using namespace Modules;
-using namespace DataSet;
 
 namespace Config::SettingsManager
 {
     static Settings const * settings = nullptr;
 
+    // Die type and colorway are written together
+    struct DesignAndColorRecord
+    {
+        DiceVariants::DieType dieType;
+        DiceVariants::Colorway colorway;
+    };
+
     void ProgramDefaultParametersHandler(const Message* msg);
     void SetDesignTypeAndColorHandler(const Message* msg);
     void SetNameHandler(const Message* msg);
@@ -39,8 +45,8 @@ namespace Config::SettingsManager
     void PrintNormals(const Message* msg) {
         auto m = static_cast<const MessagePrintNormals*>(msg);
         int i = m->face;
-        auto settings = getSettings();
-        BLE_LOG_INFO("Face %d: %d, %d, %d", i, (int)(settings->faceNormals[i].x * 100), (int)(settings->faceNormals[i].y * 100), (int)(settings->faceNormals[i].z * 100));
+        auto normals = getFaceNormals();
+        BLE_LOG_INFO("Face %d: %d, %d, %d", i, (int)(normals[i].x * 100), (int)(normals[i].y * 100), (int)(normals[i].z * 100));
     }
     #endif
 
@@ -49,6 +55,7 @@ namespace Config::SettingsManager
         _callback = callback;
 
         settings = (Settings const * const)Flash::getSettingsStartAddress();
+        KeyValueStore::init();
 
         auto finishInit = [](bool success) {
             APP_ERROR_CHECK(success ? NRF_SUCCESS : NRF_ERROR_INTERNAL);
@@ -72,7 +79,10 @@ namespace Config::SettingsManager
             }
         };
 
-        if (!checkValid()) {
+        if (Flash::restoreSettings(finishInit)) {
+            // The power was cut while the settings were programmed
+            NRF_LOG_WARNING("Restoring settings");
+        } else if (!checkValid()) {
             NRF_LOG_WARNING("Settings not found in flash, programming defaults");
             programDefaults(finishInit);
         } else {
@@ -94,6 +104,17 @@ namespace Config::SettingsManager
         }
     }
 
+    const char* getName() {
+        auto name = (const char*)KeyValueStore::read(KeyValueStore::Key_Name);
+        return name != nullptr ? name : settings->name;
+    }
+
+    const Core::int3* getFaceNormals() {
+        uint16_t size = 0;
+        auto normals = (const Core::int3*)KeyValueStore::read(KeyValueStore::Key_FaceNormals, &size);
+        return normals != nullptr && size >= sizeof(settings->faceNormals) ? normals : settings->faceNormals;
+    }
+
     DiceVariants::DieType getDieType() {
         // First check the data store
         const int dieTypeFromStore = ValueStore::readValue(ValueStore::ValueType_DieType);
@@ -102,7 +123,8 @@ namespace Config::SettingsManager
         } else {
             // then check settings
             if (checkValid()) {
-                return settings->dieType;
+                auto design = (const DesignAndColorRecord*)KeyValueStore::read(KeyValueStore::Key_DesignAndColor);
+                return design != nullptr ? design->dieType : settings->dieType;
             } else {
                 return DiceVariants::estimateDieTypeFromBoard();
             }
@@ -111,7 +133,12 @@ namespace Config::SettingsManager
 
     DiceVariants::Colorway getColorway() {
         const int colorWayFromStore = ValueStore::readValue(ValueStore::ValueType_Colorway);
-        return colorWayFromStore != -1 ? (DiceVariants::Colorway)colorWayFromStore : SettingsManager::getSettings()->colorway;
+        if (colorWayFromStore != -1) {
+            return (DiceVariants::Colorway)colorWayFromStore;
+        } else {
+            auto design = (const DesignAndColorRecord*)KeyValueStore::read(KeyValueStore::Key_DesignAndColor);
+            return design != nullptr ? design->colorway : SettingsManager::getSettings()->colorway;
+        }
     }
 
     DiceVariants::LEDLayoutType getLayoutType() {
@@ -177,10 +204,29 @@ namespace Config::SettingsManager
         outSettings.tailMarker = SETTINGS_VALID_KEY;
     }
 
+    /// <summary>
+    /// Writes the settings to their own flash pages, the dataset is left untouched.
+    /// This drops whatever was written to the key value store.
+    /// </summary>
+    void programSettings(const Settings& newSettings, SettingsWrittenCallback callback) {
+        if (!KeyValueStore::reset(newSettings, callback)) {
+            callback(false);
+        }
+    }
+
+    /// <summary>
+    /// Appends a record to the settings page, which is only erased once it is full
+    /// </summary>
+    void programRecord(KeyValueStore::Key key, const void* data, uint16_t size, SettingsWrittenCallback callback) {
+        if (!KeyValueStore::write(key, data, size, callback)) {
+            callback(false);
+        }
+    }
+
     void programDefaults(SettingsWrittenCallback callback) {
         Settings defaults;
         setDefaults(defaults);
-        DataSet::ProgramDefaultDataSet(defaults, callback);
+        programSettings(defaults, callback);
     }
 
     void programDefaultParameters(SettingsWrittenCallback callback) {
@@ -198,41 +244,34 @@ namespace Config::SettingsManager
         // setDefaultParameters(settingsCopy);
 
         // Reprogram settings
-        DataSet::ProgramDefaultDataSet(settingsCopy, callback);
+        programSettings(settingsCopy, callback);
     }
 
     void programCalibrationData(const Core::int3* newNormals, int count, SettingsWrittenCallback callback) {
 
-        // Grab current settings
-        Settings settingsCopy;
-
-        // Begin by resetting our new settings
-        setDefaults(settingsCopy);
-
-        // Copy over everything
-        memcpy(&settingsCopy, settings, sizeof(Settings));
+        // Always store the full array so the record is valid whatever the layout
+        Core::int3 normals[MAX_LED_COUNT];
+        memcpy(normals, getFaceNormals(), sizeof(normals));
 
         // Change normals
-        memcpy(&(settingsCopy.faceNormals[0]), newNormals, count * sizeof(Core::int3));
+        memcpy(normals, newNormals, count * sizeof(Core::int3));
 
-        // Reprogram settings
-        DataSet::ProgramDefaultDataSet(settingsCopy, callback);
+        programRecord(KeyValueStore::Key_FaceNormals, normals, sizeof(normals), callback);
     }
 
     void programDesignAndColor(DiceVariants::DieType dieType, DiceVariants::Colorway colorway, SettingsWrittenCallback callback) {
 
-        if (settings->dieType != dieType || settings->colorway != colorway) {
-
-            // Grab current settings
-            Settings settingsCopy;
-            memcpy(&settingsCopy, settings, sizeof(Settings));
+        auto design = (const DesignAndColorRecord*)KeyValueStore::read(KeyValueStore::Key_DesignAndColor);
+        auto currentDieType = design != nullptr ? design->dieType : settings->dieType;
+        auto currentColorway = design != nullptr ? design->colorway : settings->colorway;
+        if (currentDieType != dieType || currentColorway != colorway) {
 
             // Update design and color
-            settingsCopy.dieType = dieType;
-            settingsCopy.colorway = colorway;
+            DesignAndColorRecord newDesign;
+            newDesign.dieType = dieType;
+            newDesign.colorway = colorway;
 
-            // Reprogram settings
-            DataSet::ProgramDefaultDataSet(settingsCopy, callback);
+            programRecord(KeyValueStore::Key_DesignAndColor, &newDesign, sizeof(newDesign), callback);
         }
         else {
             NRF_LOG_DEBUG("DesignAndColor already set to dieType=%d and colorway=%d ", dieType, colorway);
@@ -242,21 +281,18 @@ namespace Config::SettingsManager
 
     void programName(const char* newName, SettingsWrittenCallback callback) {
 
-        if (strncmp(settings->name, newName, sizeof(settings->name) - 1)) {
-
-            // Grab current settings
-            Settings settingsCopy;
-            memcpy(&settingsCopy, settings, sizeof(Settings));
+        if (strncmp(getName(), newName, MAX_NAME_LENGTH)) {
 
             // Update name
-            strncpy(settingsCopy.name, newName, sizeof(settingsCopy.name) - 1);
-            settingsCopy.name[sizeof(settingsCopy.name) - 1] = '\0'; // Make sure we always have a null terminated string
-            NRF_LOG_INFO("Setting name to %s", settingsCopy.name);
+            char name[MAX_NAME_LENGTH + 1];
+            strncpy(name, newName, MAX_NAME_LENGTH);
+            name[MAX_NAME_LENGTH] = '\0'; // Make sure we always have a null terminated string
+            NRF_LOG_INFO("Setting name to %s", name);
 
-            // Reprogram settings
+            // Store name
             static SettingsWrittenCallback programNameCallback = nullptr;
             programNameCallback = callback;
-            DataSet::ProgramDefaultDataSet(settingsCopy, [] (bool success) {
+            programRecord(KeyValueStore::Key_Name, name, strlen(name) + 1, [] (bool success) {
                 // We want to reset once disconnected so to apply the name change
                 Bluetooth::Stack::resetOnDisconnect();
                 auto callback = programNameCallback;
@@ -271,32 +307,73 @@ namespace Config::SettingsManager
         }
     }
 
+    bool getBroadcastMode() {
+        auto enabled = (const uint8_t*)KeyValueStore::read(KeyValueStore::Key_BroadcastMode);
+        return enabled != nullptr && *enabled != 0;
+    }
+
+    void programBroadcastMode(bool enabled, SettingsWrittenCallback callback) {
+        if (getBroadcastMode() != enabled) {
+            uint8_t value = enabled ? 1 : 0;
+            programRecord(KeyValueStore::Key_BroadcastMode, &value, sizeof(value), callback);
+        }
+        else {
+            callback(true);
+        }
+    }
+
+    const RollThresholds* getRollThresholds() {
+        // Off until tuned against recorded rolls with test/roll_replay
+        static const RollThresholds defaultThresholds = { 0, 0, 0 };
+        uint16_t size = 0;
+        auto thresholds = (const RollThresholds*)KeyValueStore::read(KeyValueStore::Key_RollThresholds, &size);
+        return thresholds != nullptr && size >= sizeof(RollThresholds) ? thresholds : &defaultThresholds;
+    }
+
+    void programRollThresholds(const RollThresholds& thresholds, SettingsWrittenCallback callback) {
+        if (memcmp(getRollThresholds(), &thresholds, sizeof(RollThresholds)) != 0) {
+            programRecord(KeyValueStore::Key_RollThresholds, &thresholds, sizeof(RollThresholds), callback);
+        }
+        else {
+            callback(true);
+        }
+    }
+
+    // The acks are sent once the flash is written, tagged with the sequence of their request
     void ProgramDefaultParametersHandler(const Message* msg) {
+        static int16_t sequence;
+        sequence = MessageService::getHandledSequence();
         programDefaultParameters([] (bool result) {
             // Ignore result for now
-            Bluetooth::MessageService::SendMessage(Message::MessageType_ProgramDefaultParametersFinished);
+            Bluetooth::MessageService::SendReply(Message::MessageType_ProgramDefaultParametersFinished, sequence);
         });
     }
 
     void SetDesignTypeAndColorHandler(const Message* msg) {
         auto designMsg = (const MessageSetDesignAndColor*)msg;
         NRF_LOG_DEBUG("Received request to set die type to %d and colorway to %d", designMsg->dieType, designMsg->colorway);
+        static int16_t sequence;
+        sequence = MessageService::getHandledSequence();
         programDesignAndColor(designMsg->dieType, designMsg->colorway, [](bool result) {
-            MessageService::SendMessage(Message::MessageType_SetDesignAndColorAck);
+            MessageService::SendReply(Message::MessageType_SetDesignAndColorAck, sequence);
         });
     }
 
     void SetNameHandler(const Message* msg) {
         auto nameMsg = (const MessageSetName*)msg;
         NRF_LOG_DEBUG("Received request to rename die to %s", nameMsg->name);
+        static int16_t sequence;
+        sequence = MessageService::getHandledSequence();
         programName(nameMsg->name, [](bool result) {
-            MessageService::SendMessage(Message::MessageType_SetNameAck);
+            MessageService::SendReply(Message::MessageType_SetNameAck, sequence);
         });
     }
 
     void clearSettingsHandler(const Message* msg) {
+        static int16_t sequence;
+        sequence = MessageService::getHandledSequence();
         programDefaults([](bool ignore) {
-            MessageService::SendMessage(Bluetooth::Message::MessageType_ClearSettingsAck);
+            MessageService::SendReply(Bluetooth::Message::MessageType_ClearSettingsAck, sequence);
         });
     }
 
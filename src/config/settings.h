@@ -44,6 +44,17 @@ namespace Config
         uint32_t tailMarker;
     };
 
+    // Motion features over the last few readings that turn medium agitation into rolling:
+    // jerk RMS above its threshold, along with either the magnitude deviation or the
+    // orientation change (1000 minus the orientation stability) above theirs.
+    // A jerk RMS threshold of 0 disables the check.
+    struct RollThresholds
+    {
+        int jerkRmsTimes1000;
+        int magnitudeDeviationTimes1000;
+        int orientationChangeTimes1000;
+    };
+
     namespace SettingsManager
     {
         typedef void (*InitCallback)();
@@ -53,6 +64,12 @@ namespace Config
         bool checkValid();
         Config::Settings const * const getSettings();
 
+        // These return the latest value written to the key value store, if any
+        const char* getName();
+        const Core::int3* getFaceNormals();
+        bool getBroadcastMode(); // Only in the key value store, off by default
+        const RollThresholds* getRollThresholds(); // Only in the key value store, all 0 by default
+
         DiceVariants::DieType getDieType();
         DiceVariants::Colorway getColorway();
         DiceVariants::LEDLayoutType getLayoutType();
@@ -64,5 +81,7 @@ namespace Config
         void programCalibrationData(const Core::int3* newNormals, int count, SettingsWrittenCallback callback);
         void programDesignAndColor(DiceVariants::DieType dieType, DiceVariants::Colorway colorway, SettingsWrittenCallback callback);
         void programName(const char* newName, SettingsWrittenCallback callback);
+        void programBroadcastMode(bool enabled, SettingsWrittenCallback callback);
+        void programRollThresholds(const RollThresholds& thresholds, SettingsWrittenCallback callback);
     }
 }
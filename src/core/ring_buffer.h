@@ -56,6 +56,17 @@ namespace Core
             return data[dataIndex];
         }
 
+        /// <summary>
+        /// Returns the newest item, so it can be amended in place
+        /// </summary>
+        T& last()
+        {
+            int dataIndex = next - 1;
+            if (dataIndex == -1)
+                dataIndex = MaxCount - 1;
+            return data[dataIndex];
+        }
+
         /// <summary>
         /// Returns the number of items in the buffer
         /// </summary>
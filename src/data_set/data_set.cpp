@@ -19,6 +19,8 @@
 #include "nrf_delay.h"
 #include "app_error.h"
 
+#define DATA_SET_VERIFY_DELAY_MS 5000 // Checking the data CRC is deferred so it doesn't slow down boot
+
 using namespace Utils;
 using namespace DriversNRF;
 using namespace Bluetooth;
@@ -32,8 +34,11 @@ namespace DataSet
 {
     void ReceiveDataSetHandler(const Bluetooth::Message* msg);
     void ProgramDefaultAnimSetHandler(const Message* msg);
+    void RequestDataSetManifestHandler(const Message* msg);
+    void ReceiveDataSetPatchHandler(const Message* msg);
     uint32_t computeDataSetSize();
-    uint32_t computeDataSetHash();
+    void verifyDataSet(void* ignore);
+    void onProgrammingEvent(void* context, Flash::ProgrammingEventType evt, Flash::ProgrammingRegion region);
 
     // The animation set always points at a specific address in memory
     Data const * data = nullptr;
@@ -42,6 +47,12 @@ namespace DataSet
     uint32_t size = 0;
     uint32_t hash = 0;
 
+    // Rules of the behavior, followed in the same allocation by their indices sorted by condition type
+    RuleEntry* ruleEntries = nullptr;
+    uint16_t* ruleEntryIndices = nullptr;
+    uint16_t ruleEntryCount = 0;
+    uint16_t ruleEntryTypeStarts[Condition_Count + 1];
+
     uint32_t availableDataSize() {
         return Flash::getFlashEndAddress() - Flash::getDataSetDataAddress();
     }
@@ -76,11 +87,16 @@ namespace DataSet
         auto finishInit = [] (bool success) {
             APP_ERROR_CHECK(success ? NRF_SUCCESS : NRF_ERROR_INTERNAL);
 
-            size = computeDataSetSize();
-            hash = computeDataSetHash();
+            refreshSizeAndHash();
+
+            // Only trust the stored hash until the data is checked
+            Timers::setDelayedCallback(verifyDataSet, nullptr, DATA_SET_VERIFY_DELAY_MS);
 
             MessageService::RegisterMessageHandler(Message::MessageType_TransferAnimSet, ReceiveDataSetHandler);
             MessageService::RegisterMessageHandler(Message::MessageType_ProgramDefaultAnimSet, ProgramDefaultAnimSetHandler);
+            MessageService::RegisterMessageHandler(Message::MessageType_RequestDataSetManifest, RequestDataSetManifestHandler);
+            MessageService::RegisterMessageHandler(Message::MessageType_TransferAnimSetPatch, ReceiveDataSetPatchHandler);
+            Flash::hookProgrammingEvent(onProgrammingEvent, nullptr);
             NRF_LOG_INFO("DataSet init, size: 0x%x, hash: 0x%08x", size, hash);
             auto callBackCopy = _callback;
             _callback = nullptr;
@@ -90,9 +106,9 @@ namespace DataSet
         };
 
         //ProgramDefaultDataSet();
-        if (!CheckValid()) {
+        if (!validateData(data, Flash::getDataSetDataAddress())) {
             NRF_LOG_INFO("DataSet not valid!");
-            ProgramDefaultDataSet(*SettingsManager::getSettings(), finishInit);
+            ProgramDefaultDataSet(finishInit);
         } else {
             finishInit(true);
         }
@@ -118,18 +134,17 @@ namespace DataSet
         return createAnimationInstance(preset, DataSet::getAnimationBits());
     }
 
+    // The dataset is validated when loaded, so the accessors below only check the indices
+
     const Animation* getAnimation(int animationIndex) {
-        assert(CheckValid());
         return data->animationBits.getAnimation(animationIndex);
     }
 
     uint16_t getAnimationCount() {
-        assert(CheckValid());
         return data->animationBits.getAnimationCount();
     }
 
     const Condition* getCondition(int conditionIndex) {
-        assert(CheckValid());
         if (conditionIndex >= 0 && (uint32_t)conditionIndex < data->conditionCount) {
             auto conditionPtr = (const uint8_t *)data->conditions + data->conditionsOffsets[conditionIndex];
             return (const Condition*)conditionPtr;
@@ -138,12 +153,10 @@ namespace DataSet
     }
 
     uint16_t getConditionCount() {
-        assert(CheckValid());
         return data->conditionCount;
     }
 
     const Action* getAction(int actionIndex) {
-        assert(CheckValid());
         if (actionIndex >= 0 && (uint32_t)actionIndex < data->actionCount) {
             auto actionPtr = (const uint8_t*)data->actions + data->actionsOffsets[actionIndex];
             return (const Action*)actionPtr;
@@ -152,12 +165,10 @@ namespace DataSet
     }
 
     uint16_t getActionCount() {
-        assert(CheckValid());
         return data->actionCount;
     }
 
     const Rule* getRule(int ruleIndex) {
-        assert(CheckValid());
         if (ruleIndex >= 0 && (uint32_t)ruleIndex < data->ruleCount) {
             return &data->rules[ruleIndex];
         }
@@ -165,45 +176,95 @@ namespace DataSet
     }
 
     uint16_t getRuleCount() {
-        assert(CheckValid());
         return data->ruleCount;
     }
 
     // Behaviors
     const Behavior* getBehavior() {
-        assert(CheckValid());
         return data->behavior;
     }
 
-    uint8_t getBrightness() {
-        assert(CheckValid());
-        return data->brightness;
+    const RuleEntry* getRuleEntry(int behaviorRuleIndex) {
+        if (behaviorRuleIndex >= 0 && behaviorRuleIndex < ruleEntryCount) {
+            return &ruleEntries[behaviorRuleIndex];
+        }
+        return nullptr;
     }
 
-    int offset = 0;
+    uint16_t getRuleEntryCount() {
+        return ruleEntryCount;
+    }
 
-    void ReceiveDataSetHandler(const Message* msg) {
-		NRF_LOG_DEBUG("Received request to download new animation set");
-		const MessageTransferAnimSet* message = (const MessageTransferAnimSet*)msg;
+    const uint16_t* getRuleEntriesOfType(ConditionType type, uint16_t* outCount) {
+        if (type >= Condition_Count || ruleEntries == nullptr) {
+            *outCount = 0;
+            return nullptr;
+        }
+        *outCount = ruleEntryTypeStarts[type + 1] - ruleEntryTypeStarts[type];
+        return ruleEntryIndices + ruleEntryTypeStarts[type];
+    }
 
-        NRF_LOG_DEBUG("Animation Data to be received:");
-        NRF_LOG_DEBUG("Palette: %d * %d", message->paletteSize, sizeof(uint8_t));
-        NRF_LOG_DEBUG("RGB Keyframes: %d * %d", message->rgbKeyFrameCount, sizeof(RGBKeyframe));
-        NRF_LOG_DEBUG("RGB Tracks: %d * %d", message->rgbTrackCount, sizeof(RGBTrack));
-        NRF_LOG_DEBUG("Keyframes: %d * %d", message->keyFrameCount, sizeof(Keyframe));
-        NRF_LOG_DEBUG("Tracks: %d * %d", message->trackCount, sizeof(Track));
-        NRF_LOG_DEBUG("Animation Offsets: %d * %d", message->animationCount, sizeof(uint16_t));
-        NRF_LOG_DEBUG("Animations: %d", message->animationSize);
-        NRF_LOG_DEBUG("Conditions Offsets: %d * %d", message->conditionCount, sizeof(uint16_t));
-        NRF_LOG_DEBUG("Conditions: %d", message->conditionSize);
-        NRF_LOG_DEBUG("Actions Offsets: %d * %d", message->actionCount, sizeof(uint16_t));
-        NRF_LOG_DEBUG("Actions: %d", message->actionSize);
-        NRF_LOG_DEBUG("Rules: %d * %d", message->ruleCount, sizeof(Rule));
-        NRF_LOG_DEBUG("Behavior: %d", sizeof(Behavior));
+    void clearRuleIndex() {
+        free(ruleEntries);
+        ruleEntries = nullptr;
+        ruleEntryIndices = nullptr;
+        ruleEntryCount = 0;
+        memset(ruleEntryTypeStarts, 0, sizeof(ruleEntryTypeStarts));
+    }
 
-        // Store the address and size
-        NRF_LOG_DEBUG("Setting up pointers");
-        Data newData  __attribute__ ((aligned (4)));
+    /// <summary>
+    /// Resolves the rules of the behavior and groups them by condition type,
+    /// the dataset must have been validated
+    /// </summary>
+    void buildRuleIndex() {
+        clearRuleIndex();
+        if (!CheckValid() || data->behavior->rulesCount == 0) {
+            return;
+        }
+
+        const uint16_t count = data->behavior->rulesCount;
+        ruleEntries = (RuleEntry*)malloc(count * (sizeof(RuleEntry) + sizeof(uint16_t)));
+        if (ruleEntries == nullptr) {
+            NRF_LOG_ERROR("Not enough ram to allocate rule index");
+            return;
+        }
+        ruleEntryIndices = (uint16_t*)(ruleEntries + count);
+
+        for (int i = 0; i < count; ++i) {
+            auto rule = &data->rules[data->behavior->rulesOffset + i];
+            ruleEntries[i].rule = rule;
+            ruleEntries[i].condition = (const Condition*)((const uint8_t*)data->conditions + data->conditionsOffsets[rule->condition]);
+            ruleEntryTypeStarts[ruleEntries[i].condition->type + 1]++;
+        }
+
+        // Counting sort, which keeps the rule order for each type
+        for (int t = 0; t < Condition_Count; ++t) {
+            ruleEntryTypeStarts[t + 1] += ruleEntryTypeStarts[t];
+        }
+        uint16_t next[Condition_Count];
+        memcpy(next, ruleEntryTypeStarts, sizeof(next));
+        for (int i = 0; i < count; ++i) {
+            ruleEntryIndices[next[ruleEntries[i].condition->type]++] = i;
+        }
+        ruleEntryCount = count;
+    }
+
+    void onProgrammingEvent(void* context, Flash::ProgrammingEventType evt, Flash::ProgrammingRegion region) {
+        if (region == Flash::ProgrammingRegion_DataSet && evt == Flash::ProgrammingEventType_Begin) {
+            // Rule entries point to the data about to be erased
+            clearRuleIndex();
+        }
+    }
+
+    uint8_t getBrightness() {
+        return data->brightness;
+    }
+
+    /// <summary>
+    /// Fills the dataset header for the data described by the transfer message,
+    /// pointers are set to where the data goes in flash
+    /// </summary>
+    void setupDataLayout(Data& newData, const MessageTransferAnimSet* message) {
         newData.headMarker = ANIMATION_SET_VALID_KEY;
         newData.version = ANIMATION_SET_VERSION;
 
@@ -259,27 +320,74 @@ namespace DataSet
         newData.brightness = message->brightness;
 
         newData.tailMarker = ANIMATION_SET_VALID_KEY;
+    }
+
+    int offset = 0;
+
+    void ReceiveDataSetHandler(const Message* msg) {
+		NRF_LOG_DEBUG("Received request to download new animation set");
+		const MessageTransferAnimSet* message = (const MessageTransferAnimSet*)msg;
+
+        NRF_LOG_DEBUG("Animation Data to be received:");
+        NRF_LOG_DEBUG("Palette: %d * %d", message->paletteSize, sizeof(uint8_t));
+        NRF_LOG_DEBUG("RGB Keyframes: %d * %d", message->rgbKeyFrameCount, sizeof(RGBKeyframe));
+        NRF_LOG_DEBUG("RGB Tracks: %d * %d", message->rgbTrackCount, sizeof(RGBTrack));
+        NRF_LOG_DEBUG("Keyframes: %d * %d", message->keyFrameCount, sizeof(Keyframe));
+        NRF_LOG_DEBUG("Tracks: %d * %d", message->trackCount, sizeof(Track));
+        NRF_LOG_DEBUG("Animation Offsets: %d * %d", message->animationCount, sizeof(uint16_t));
+        NRF_LOG_DEBUG("Animations: %d", message->animationSize);
+        NRF_LOG_DEBUG("Conditions Offsets: %d * %d", message->conditionCount, sizeof(uint16_t));
+        NRF_LOG_DEBUG("Conditions: %d", message->conditionSize);
+        NRF_LOG_DEBUG("Actions Offsets: %d * %d", message->actionCount, sizeof(uint16_t));
+        NRF_LOG_DEBUG("Actions: %d", message->actionSize);
+        NRF_LOG_DEBUG("Rules: %d * %d", message->ruleCount, sizeof(Rule));
+        NRF_LOG_DEBUG("Behavior: %d", sizeof(Behavior));
+
+        // Store the address and size
+        NRF_LOG_DEBUG("Setting up pointers");
+        Data newData  __attribute__ ((aligned (4)));
+        setupDataLayout(newData, message);
+
+        // Older apps don't send the compressed flag
+        static bool compressed;
+        static uint32_t dataSetDataSize;
+        static int16_t sequence; // The acks are sent once the flash is erased and written
+        compressed = MessageService::getHandledMessageSize() >= sizeof(MessageTransferAnimSet) && message->compressed != 0;
+        dataSetDataSize = computeDataSetDataSize(&newData);
+        sequence = MessageService::getHandledSequence();
+        NRF_LOG_DEBUG("Compressed: %d", compressed);
 
         static auto receiveToFlash = [](Flash::ProgramFlashFuncCallback callback) {
             MessageTransferAnimSetAck ack;
             ack.result = 1;
-            MessageService::SendMessage(&ack);
+            MessageService::SendReply(&ack, sequence);
 
             // Transfer data
-            Bluetooth::ReceiveBulkData::receiveToFlash(Flash::getDataSetDataAddress(), nullptr, callback);
+            if (compressed) {
+                Bluetooth::ReceiveBulkData::receiveToFlashDecompressed(Flash::getDataSetDataAddress(), dataSetDataSize, nullptr, callback);
+            } else {
+                Bluetooth::ReceiveBulkData::receiveToFlash(Flash::getDataSetDataAddress(), nullptr, callback);
+            }
         };
 
         static auto onProgramFinished = [](bool result) {
-            size = computeDataSetSize();
-            hash = computeDataSetHash();
+            // An invalid dataset isn't committed, which leaves no dataset at all
+            refreshSizeAndHash();
+            if (!CheckValid()) {
+                NRF_LOG_ERROR("No valid dataset after upload, programming defaults");
+                ProgramDefaultDataSet([](bool result) {
+                    refreshSizeAndHash();
+                    MessageService::SendReply(Message::MessageType_TransferAnimSetFinished, sequence);
+                });
+                return;
+            }
 
             //printAnimationInfo();
-            NRF_LOG_INFO("Dataset size=0x%x, hash=0x%08x", size, hash);
             //NRF_LOG_INFO("Data addr: 0x%08x, data: 0x%08x", Flash::getDataSetAddress(), Flash::getDataSetDataAddress());
-            MessageService::SendMessage(Message::MessageType_TransferAnimSetFinished);
+            MessageService::SendReply(Message::MessageType_TransferAnimSetFinished, sequence);
         };
 
-        if (!Flash::programFlash(newData, *SettingsManager::getSettings(), receiveToFlash, onProgramFinished)) {
+        if (!Flash::programDataSet(newData, receiveToFlash, onProgramFinished)) {
             // Don't send data please
             MessageTransferAnimSetAck ack;
             ack.result = 0;
@@ -289,8 +397,11 @@ namespace DataSet
 
     void ProgramDefaultAnimSetHandler(const Message* msg) {
         // Reprogram the default dataset
-        ProgramDefaultDataSet(*SettingsManager::getSettings(), [](bool success) {
-            Bluetooth::MessageService::SendMessage(Message::MessageType_ProgramDefaultAnimSetFinished);
+        static int16_t sequence;
+        sequence = MessageService::getHandledSequence();
+        ProgramDefaultDataSet([](bool success) {
+            refreshSizeAndHash();
+            Bluetooth::MessageService::SendReply(Message::MessageType_ProgramDefaultAnimSetFinished, sequence);
         });
 
     }
@@ -331,13 +442,34 @@ namespace DataSet
         Timers::resume();
     }
 
+    void refreshSizeAndHash() {
+        // The header is written last, after the data was hashed
+        size = computeDataSetSize();
+        hash = CheckValid() ? data->dataHash : 0;
+        buildRuleIndex();
+        NRF_LOG_INFO("Dataset size=0x%x, hash=0x%08x", size, hash);
+    }
+
     uint32_t computeDataSetSize() {
         // Compute the size of the needed buffer to store all that data!
         return computeDataSetDataSize(data);
     }
 
-    uint32_t computeDataSetHash() {
-        return Utils::computeHash((const uint8_t*)Flash::getDataSetDataAddress(), size);
+    /// <summary>
+    /// Checks the data against the CRC stored in the header, called once some time after boot
+    /// </summary>
+    void verifyDataSet(void* ignore) {
+        if (Flash::isBusy()) {
+            // Try again later, the header is rewritten when programming is done anyway
+            Timers::setDelayedCallback(verifyDataSet, nullptr, DATA_SET_VERIFY_DELAY_MS);
+            return;
+        }
+        auto dataPtr = (const uint8_t*)Flash::getDataSetDataAddress();
+        if (CheckValid() && Utils::computeCrc32(dataPtr, size) != data->dataCrc) {
+            // Report the hash of what is really there so the app uploads its dataset again
+            hash = Utils::computeHash(dataPtr, size);
+            NRF_LOG_ERROR("Dataset CRC mismatch, hash=0x%08x", hash);
+        }
     }
 
 }
@@ -15,6 +15,7 @@
 #define MAX_COLOR_MAP_SIZE (1 << 7) // 128 colors!
 #define SPECIAL_COLOR_INDEX (MAX_COLOR_MAP_SIZE - 1)
 #define MAX_ANIMATIONS (64)
+#define DATA_SET_BLOCK_SIZE (256) // Granularity of the manifest CRCs and of patches
 
 namespace DataSet
 {
@@ -57,12 +58,27 @@ namespace DataSet
     // Behaviors
     const Behaviors::Behavior* getBehavior();
 
+    // The rules of the behavior with their condition, resolved once when the dataset is loaded
+    struct RuleEntry
+    {
+        const Behaviors::Rule* rule;
+        const Behaviors::Condition* condition;
+    };
+    const RuleEntry* getRuleEntry(int behaviorRuleIndex);
+    uint16_t getRuleEntryCount();
+
+    // Indices of the rule entries which condition has the given type, in rule order
+    const uint16_t* getRuleEntriesOfType(Behaviors::ConditionType type, uint16_t* outCount);
+
     // Brightness
     uint8_t getBrightness();
 
     uint32_t computeDataSetDataSize(const Data* newData);
+    bool validateData(const Data* data, uint32_t dataAddress);
+    void setupDataLayout(Data& newData, const Bluetooth::MessageTransferAnimSet* message);
+    void refreshSizeAndHash();
 
-    void ProgramDefaultDataSet(const Config::Settings& settingsPackAlong, DataSetWrittenCallback callback);
+    void ProgramDefaultDataSet(DataSetWrittenCallback callback);
 
     void printAnimationInfo();
 }
@@ -6,7 +6,7 @@
 #include "data_animation_bits.h"
 
 #define ANIMATION_SET_VALID_KEY (0x600DF00D) // Good Food ;)
-#define ANIMATION_SET_VERSION 3
+#define ANIMATION_SET_VERSION 4
 
 using namespace Animations;
 
@@ -46,6 +46,10 @@ namespace DataSet
         // Brightness to apply on top of animations
         uint8_t brightness;
 
+        // Computed from the data once it is written to flash, see Flash::programDataSet()
+        uint32_t dataHash; // Utils::computeHash(), reported to the app
+        uint32_t dataCrc;  // Utils::computeCrc32(), only used to check the data integrity
+
         // Indicates whether there is valid data
         uint32_t tailMarker;
     };
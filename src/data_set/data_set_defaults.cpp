@@ -9,8 +9,15 @@
 #include "utils/utils.h"
 #include "drivers_nrf/flash.h"
 #include "nrf_log.h"
+#include "malloc.h"
 #include "config/settings.h"
 
+#define DEFAULT_PALETTE_SIZE 12         // 4 colors
+#define DEFAULT_SIMPLE_ANIM_COUNT 8
+#define DEFAULT_ANIM_COUNT (DEFAULT_SIMPLE_ANIM_COUNT + 1)
+#define DEFAULT_RULE_COUNT 9            // One condition and one action per rule
+#define DEFAULT_OFFSET_COUNT 10         // Offset arrays are 4-byte aligned
+
 using namespace Utils;
 using namespace DriversNRF;
 using namespace Config;
@@ -18,447 +25,232 @@ using namespace Modules;
 using namespace Animations;
 using namespace Behaviors;
 
-//#define USE_BINARY_BUFFER_IMAGE
-
 namespace DataSet
 {
-    void ProgramDefaultDataSet(const Settings& settingsPackAlong, DataSetWrittenCallback callback) {
-        NRF_LOG_INFO("Programming default data set");
+    #pragma pack(push, 1)
+
+    /// <summary>
+    /// The default dataset data, laid out exactly as it is programmed in flash, see Data for the order.
+    /// It only stores offsets and indices, so the same image works wherever it is programmed.
+    /// </summary>
+    struct DefaultDataSetImage
+    {
+        uint8_t palette[DEFAULT_PALETTE_SIZE];
+        uint16_t animationOffsets[DEFAULT_OFFSET_COUNT];
+        AnimationSimple simpleAnimations[DEFAULT_SIMPLE_ANIM_COUNT];
+        AnimationRainbow rainbowAnimation;
+        uint16_t actionsOffsets[DEFAULT_OFFSET_COUNT];
+        ActionPlayAnimation actions[DEFAULT_RULE_COUNT];
+        uint16_t conditionsOffsets[DEFAULT_OFFSET_COUNT];
+        ConditionHelloGoodbye hello;
+        ConditionConnectionState connected;
+        ConditionRolling rolling;
+        ConditionRolled rolled;
+        ConditionBatteryState batteryStates[5];
+        Rule rules[DEFAULT_RULE_COUNT];
+        Behavior behavior;
+    };
+
+    #pragma pack(pop)
+
+    static_assert(sizeof(DefaultDataSetImage) % 4 == 0, "Default dataset image must be a multiple of 4 bytes");
+
+    constexpr void setSimpleAnimation(DefaultDataSetImage& image, int index, uint8_t count, uint16_t duration, uint16_t colorIndex, uint32_t faceMask) {
+        image.simpleAnimations[index].type = Animation_Simple;
+        image.simpleAnimations[index].animFlags = 0;
+        image.simpleAnimations[index].duration = duration;
+        image.simpleAnimations[index].faceMask = faceMask;
+        image.simpleAnimations[index].colorIndex = colorIndex;
+        image.simpleAnimations[index].count = count;
+        image.simpleAnimations[index].fade = 255;
+    }
 
-        static DataSetWrittenCallback _setWrittenCallback;
-        _setWrittenCallback = callback;
-#ifdef USE_BINARY_BUFFER_IMAGE
-        // Doesn't quite work yet...
-        static const uint8_t writeBuffer[] __attribute__ ((aligned (4))) = {
-            0x10, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00,
-            0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x00,
-            0x18, 0x00, 0x24, 0x00, 0x30, 0x00, 0x3C, 0x00,
-            0x48, 0x00, 0x54, 0x00, 0x01, 0x00, 0xB8, 0x0B,
-            0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x01, 0xFF,
-            0x01, 0x00, 0xD0, 0x07, 0x00, 0x00, 0x08, 0x00,
-            0x00, 0x00, 0x0A, 0xFF, 0x01, 0x00, 0xDC, 0x05,
-            0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x03, 0xFF,
-            0x01, 0x00, 0x88, 0x13, 0x00, 0x00, 0x08, 0x00,
-            0x01, 0x00, 0x01, 0x00, 0x01, 0x00, 0xE8, 0x03,
-            0xFF, 0xFF, 0xFF, 0xFF, 0x02, 0x00, 0x02, 0xFF,
-            0x01, 0x00, 0x64, 0x00, 0x00, 0x00, 0x08, 0x00,
-            0x7F, 0x00, 0x01, 0xFF, 0x01, 0x00, 0xB8, 0x0B,
-            0xFF, 0xFF, 0xFF, 0xFF, 0x7F, 0x00, 0x01, 0xFF,
-            0x02, 0x00, 0xD0, 0x07, 0xFF, 0xFF, 0xFF, 0xFF,
-            0x02, 0xC8, 0x01, 0x80, 0x00, 0x00, 0x04, 0x00,
-            0x08, 0x00, 0x0C, 0x00, 0x10, 0x00, 0x14, 0x00,
-            0x18, 0x00, 0x1C, 0x00, 0x01, 0x07, 0x13, 0x01,
-            0x01, 0x04, 0x00, 0x01, 0x01, 0x05, 0xFF, 0x01,
-            0x01, 0x06, 0xFF, 0x01, 0x01, 0x02, 0x00, 0x01,
-            0x01, 0x00, 0x13, 0x01, 0x01, 0x03, 0x13, 0x01,
-            0x01, 0x01, 0x13, 0x01, 0x00, 0x00, 0x04, 0x00,
-            0x08, 0x00, 0x0C, 0x00, 0x10, 0x00, 0x14, 0x00,
-            0x18, 0x00, 0x1C, 0x00, 0x01, 0x01, 0x00, 0x00,
-            0x06, 0x03, 0x00, 0x00, 0x03, 0x00, 0xF4, 0x01,
-            0x04, 0x00, 0x06, 0x00, 0x07, 0x02, 0x30, 0x75,
-            0x07, 0x04, 0x88, 0x13, 0x07, 0x88, 0xB8, 0x0B,
-            0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
-            0x01, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00,
-            0x02, 0x00, 0x02, 0x00, 0x01, 0x00, 0x00, 0x00,
-            0x03, 0x00, 0x03, 0x00, 0x01, 0x00, 0x00, 0x00,
-            0x04, 0x00, 0x04, 0x00, 0x01, 0x00, 0x00, 0x00,
-            0x05, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x00,
-            0x06, 0x00, 0x06, 0x00, 0x01, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x07, 0x00,
-        };
-        static const uint32_t bufferSize = sizeof(writeBuffer);
-
-        static const uint8_t dataBuffer[] __attribute__ ((aligned (4))) = {
-            0x0C, 0xF0, 0x0D, 0x60, 0x03, 0x00, 0x00, 0x00,
-            0xD0, 0xE1, 0x02, 0x00, 0x09, 0x00, 0x00, 0x00,
-            0xDC, 0xE1, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0xDC, 0xE1, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0xDC, 0xE1, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0xDC, 0xE1, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0xDC, 0xE1, 0x02, 0x00, 0x08, 0x00, 0x00, 0x00,
-            0xEC, 0xE1, 0x02, 0x00, 0x60, 0x00, 0x00, 0x00,
-            0x7C, 0xE2, 0x02, 0x00, 0x08, 0x00, 0x00, 0x00,
-            0x8C, 0xE2, 0x02, 0x00, 0x1C, 0x00, 0x00, 0x00,
-            0x4C, 0xE2, 0x02, 0x00, 0x08, 0x00, 0x00, 0x00,
-            0x5C, 0xE2, 0x02, 0x00, 0x20, 0x00, 0x00, 0x00,
-            0xA8, 0xE2, 0x02, 0x00, 0x07, 0x00, 0x00, 0x00,
-            0xE0, 0xE2, 0x02, 0x00, 0x0C, 0xF0, 0x0D, 0x60,
-        };
+    constexpr void setPlayAnimationAction(DefaultDataSetImage& image, int index, uint8_t animIndex, uint8_t faceIndex) {
+        image.actions[index].type = Action_PlayAnimation;
+        image.actions[index].animIndex = animIndex;
+        image.actions[index].faceIndex = faceIndex;
+        image.actions[index].loopCount = 1;
+    }
 
-        static const Data* newData = (const Data*)dataBuffer;
-#else
-        static void* writeBuffer;
-        static uint32_t bufferSize;
-        static Data* newData; 
-
-        int paletteCount = 4;
-        int paletteSize = Utils::roundUpTo4(paletteCount * 3);
-        int rgbKeyframeCount = 0;
-        int rgbTrackCount = 0;
-        int keyframeCount = 0;
-        int trackCount = 0;
-        int simpleAnimCount = 8;
-        int animCount = simpleAnimCount + 1;
-        int animOffsetSize = Utils::roundUpTo4(animCount * sizeof(uint16_t));
-        int animSize = sizeof(AnimationSimple) * simpleAnimCount + sizeof(AnimationRainbow);
-        int actionCount = 9;
-        int actionOffsetSize = Utils::roundUpTo4(actionCount * sizeof(uint16_t));
-        int actionSize = sizeof(ActionPlayAnimation) * actionCount;
-        int conditionCount = 9;
-        int conditionOffsetSize = Utils::roundUpTo4(conditionCount * sizeof(uint16_t));
-        uint32_t conditionsSize =
-            sizeof(ConditionHelloGoodbye) + 
-            sizeof(ConditionConnectionState) +
-            sizeof(ConditionRolling) +
-            sizeof(ConditionRolled) + 
-            sizeof(ConditionBatteryState) +
-            sizeof(ConditionBatteryState) +
-            sizeof(ConditionBatteryState) +
-            sizeof(ConditionBatteryState) +
-            sizeof(ConditionBatteryState);
-        int ruleCount = 9;
-        int behaviorCount = 1;
-
-        // Compute the size of the needed buffer to store all that data!
-        bufferSize =
-            paletteSize * sizeof(uint8_t) +
-            rgbKeyframeCount * sizeof(RGBKeyframe) +
-            rgbTrackCount * sizeof(RGBTrack) +
-            keyframeCount * sizeof(Keyframe) +
-            trackCount * sizeof(Track) +
-            animOffsetSize + animSize +
-            actionOffsetSize + actionSize +
-            conditionOffsetSize + conditionsSize + 
-            ruleCount * sizeof(Rule) +
-            behaviorCount * sizeof(Behavior);
-
-        uint32_t dataAddress = Flash::getDataSetDataAddress();
-
-        // Allocate a buffer for all the data we're about to create
-        // We'll write the data in the buffer and then program it into flash!
-        writeBuffer = malloc(bufferSize);
-        memset(writeBuffer, 0, bufferSize);
-        uint32_t writeBufferAddress = (uint32_t)writeBuffer;
-
-        // Allocate a new data object
-        // We need to fill it with pointers as if the data it points to is located in flash already.
-        // That means we have to compute addresses by hand, we can't just point to the data buffer We
-        // just created above. Instead we make the pointers point to where the data WILL be.
-        newData = (Data*)malloc(sizeof(Data));
-        
-        int currentOffset = 0;
-        newData->headMarker = ANIMATION_SET_VALID_KEY;
-        newData->version = ANIMATION_SET_VERSION;
-
-        newData->animationBits.palette = (const uint8_t*)(dataAddress + currentOffset);
-        auto writePalette = (uint8_t*)(writeBufferAddress + currentOffset);
-        currentOffset += paletteSize;
-        newData->animationBits.paletteSize = paletteCount * 3;
-
-        newData->animationBits.rgbKeyframes = (const RGBKeyframe*)(dataAddress + currentOffset);
-        //auto writeKeyframes = (RGBKeyframe*)(writeBufferAddress + currentOffset);
-        currentOffset += rgbKeyframeCount * sizeof(RGBKeyframe);
-        newData->animationBits.rgbKeyFrameCount = rgbKeyframeCount;
-
-        newData->animationBits.rgbTracks = (const RGBTrack*)(dataAddress + currentOffset);
-        //auto writeRGBTracks = (RGBTrack*)(writeBufferAddress + currentOffset);
-        currentOffset += rgbTrackCount * sizeof(RGBTrack);
-        newData->animationBits.rgbTrackCount = rgbTrackCount;
-
-        newData->animationBits.keyframes = (const Keyframe*)(dataAddress + currentOffset);
-        //auto writeKeyframes = (Keyframe*)(writeBufferAddress + currentOffset);
-        currentOffset += keyframeCount * sizeof(Keyframe);
-        newData->animationBits.keyFrameCount = keyframeCount;
-
-        newData->animationBits.tracks = (const Track*)(dataAddress + currentOffset);
-        //auto writeRGBTracks = (Track*)(writeBufferAddress + currentOffset);
-        currentOffset += trackCount * sizeof(Track);
-        newData->animationBits.trackCount = trackCount;
-
-        newData->animationBits.animationOffsets = (const uint16_t*)(dataAddress + currentOffset);
-        auto writeAnimationOffsets = (uint16_t*)(writeBufferAddress + currentOffset);
-        currentOffset += animOffsetSize;
-        newData->animationBits.animationCount = animCount;
-
-        newData->animationBits.animations = (const uint8_t*)(dataAddress + currentOffset);
-        auto writeSimpleAnimations = (AnimationSimple*)(writeBufferAddress + currentOffset);
-        auto writeRainbowAnimation = (AnimationRainbow*)(writeBufferAddress + currentOffset + sizeof(AnimationSimple) * simpleAnimCount);
-        currentOffset += animSize;
-        newData->animationBits.animationsSize = animSize;
-        
-        newData->actionsOffsets = (const uint16_t*)(dataAddress + currentOffset);
-        auto writeActionsOffsets = (uint16_t*)(writeBufferAddress + currentOffset);
-        currentOffset += actionOffsetSize;
-        newData->actionCount = actionCount;
-        
-        newData->actions = (const Action*)(dataAddress + currentOffset);
-        auto writeActions = (ActionPlayAnimation*)(writeBufferAddress + currentOffset);
-        currentOffset += actionSize;
-        newData->actionsSize = actionSize;
-        
-        newData->conditionsOffsets = (const uint16_t*)(dataAddress + currentOffset);
-        auto writeConditionsOffsets = (uint16_t*)(writeBufferAddress + currentOffset);
-        currentOffset += conditionOffsetSize;
-        newData->conditionCount = conditionCount;
-        
-        newData->conditions = (const Condition*)(dataAddress + currentOffset);
-        auto writeConditions = (Condition*)(writeBufferAddress + currentOffset);
-        currentOffset += conditionsSize;
-        newData->conditionsSize = conditionsSize;
-        
-        newData->rules = (const Rule*)(dataAddress + currentOffset);
-        auto writeRules = (Rule*)(writeBufferAddress + currentOffset);
-        currentOffset += ruleCount * sizeof(Rule);
-        newData->ruleCount = ruleCount;
-        
-        newData->behavior = (const Behavior*)(dataAddress + currentOffset);
-        auto writeBehaviors = (Behavior*)(writeBufferAddress + currentOffset);
-        currentOffset += sizeof(Behavior);
-
-        newData->brightness = 255;
-
-        newData->tailMarker = ANIMATION_SET_VALID_KEY;
-
-        // Cute way to create Red Green Blue colors in palette
-        writePalette[0] = 8;
-        writePalette[1] = 0;
-        writePalette[2] = 0;
-        writePalette[3] = 0;
-        writePalette[4] = 8;
-        writePalette[5] = 0;
-        writePalette[6] = 0;
-        writePalette[7] = 0;
-        writePalette[8] = 8;
-        writePalette[9] = 6;
-        writePalette[10] = 6;
-        writePalette[11] = 0;
-
-        // Create animations
-        for (int c = 0; c < simpleAnimCount; ++c) {
-            writeSimpleAnimations[c].type = Animation_Simple;
-            writeSimpleAnimations[c].animFlags = 0;
-            writeSimpleAnimations[c].fade = 255;
+    constexpr void setBatteryStateCondition(DefaultDataSetImage& image, int index, uint8_t flags, uint16_t repeatPeriodMs) {
+        image.batteryStates[index].type = Condition_BatteryState;
+        image.batteryStates[index].flags = flags;
+        image.batteryStates[index].repeatPeriodMs = repeatPeriodMs;
+    }
+
+    /// <summary>
+    /// Builds the default dataset data at compile time. The top face depends on the die layout,
+    /// it is left to 0 here and filled in by applyLayout().
+    /// </summary>
+    constexpr DefaultDataSetImage makeDefaultDataSetImage() {
+        DefaultDataSetImage image {};
+
+        // Red, Green, Blue and Yellow
+        image.palette[0] = 8;
+        image.palette[4] = 8;
+        image.palette[8] = 8;
+        image.palette[9] = 6;
+        image.palette[10] = 6;
+
+        setSimpleAnimation(image, 0, 1, 3000, 0, 0);                                    // Charging, red on top face
+        setSimpleAnimation(image, 1, 10, 2000, 0, ANIM_FACEMASK_ALL_LEDS);              // Charging problem
+        setSimpleAnimation(image, 2, 3, 1500, 0, 0);                                    // Low battery, red on top face
+        setSimpleAnimation(image, 3, 1, 3000, 1, 0);                                    // Fully charged, green on top face
+        setSimpleAnimation(image, 4, 2, 1000, 2, ANIM_FACEMASK_ALL_LEDS);               // Connection, blue
+        setSimpleAnimation(image, 5, 1, 100, PALETTE_COLOR_FROM_FACE, 0);               // Rolling, on top face
+        setSimpleAnimation(image, 6, 1, 3000, PALETTE_COLOR_FROM_FACE, ANIM_FACEMASK_ALL_LEDS); // On face
+        setSimpleAnimation(image, 7, 1, 1000, 3, 0);                                    // Error while charging (temperature), yellow
+
+        image.rainbowAnimation.type = Animation_Rainbow;
+        image.rainbowAnimation.animFlags = AnimationFlags_Traveling;
+        image.rainbowAnimation.duration = 2000;
+        image.rainbowAnimation.faceMask = ANIM_FACEMASK_ALL_LEDS;
+        image.rainbowAnimation.count = 2;
+        image.rainbowAnimation.fade = 200;
+        image.rainbowAnimation.intensity = 0x80;
+        image.rainbowAnimation.cyclesTimes10 = 10;
+
+        for (int i = 0; i < DEFAULT_ANIM_COUNT; ++i) {
+            image.animationOffsets[i] = i * sizeof(AnimationSimple);
         }
 
-        uint32_t topFaceMask = SettingsManager::getLayout()->getTopFaceMask();
-        uint8_t topFace = SettingsManager::getLayout()->getTopFace();
-
-        // 0 Charging
-        writeSimpleAnimations[0].count = 1;
-        writeSimpleAnimations[0].duration = 3000;
-        writeSimpleAnimations[0].colorIndex = 0; // Red
-        writeSimpleAnimations[0].faceMask = topFaceMask;
-
-        // 1 Charging Problem
-        writeSimpleAnimations[1].count = 10;
-        writeSimpleAnimations[1].duration = 2000;
-        writeSimpleAnimations[1].colorIndex = 0; // Red
-        writeSimpleAnimations[1].faceMask = ANIM_FACEMASK_ALL_LEDS;
-
-        // 2 Low battery
-        writeSimpleAnimations[2].count = 3;
-        writeSimpleAnimations[2].duration = 1500;
-        writeSimpleAnimations[2].colorIndex = 0; // Red
-        writeSimpleAnimations[2].faceMask = topFaceMask;
-
-        // 3 Fully charged
-        writeSimpleAnimations[3].count = 1;
-        writeSimpleAnimations[3].duration = 3000;
-        writeSimpleAnimations[3].colorIndex = 1; // Green
-        writeSimpleAnimations[3].faceMask = topFaceMask;
-
-        // 4 Connection
-        writeSimpleAnimations[4].count = 2;
-        writeSimpleAnimations[4].duration = 1000;
-        writeSimpleAnimations[4].colorIndex = 2; // Blue
-        writeSimpleAnimations[4].faceMask = ANIM_FACEMASK_ALL_LEDS;
-
-        // 5 Rolling
-        writeSimpleAnimations[5].count = 1;
-        writeSimpleAnimations[5].duration = 100;
-        writeSimpleAnimations[5].colorIndex = PALETTE_COLOR_FROM_FACE; // We'll override based on face
-        writeSimpleAnimations[5].faceMask = topFaceMask;
-
-        // 6 On Face
-        writeSimpleAnimations[6].count = 1;
-        writeSimpleAnimations[6].duration = 3000;
-        writeSimpleAnimations[6].colorIndex = PALETTE_COLOR_FROM_FACE; // We'll override based on face
-        writeSimpleAnimations[6].faceMask = ANIM_FACEMASK_ALL_LEDS;
-
-        // 7 error while charging (temperature)
-        writeSimpleAnimations[7].count = 1;
-        writeSimpleAnimations[7].duration = 1000;
-        writeSimpleAnimations[7].colorIndex = 3; // yellow
-        writeSimpleAnimations[7].faceMask = topFaceMask;
-
-        // 8 Rainbow
-        writeRainbowAnimation->type = Animation_Rainbow;
-        writeRainbowAnimation->animFlags = AnimationFlags_Traveling;
-        writeRainbowAnimation->duration = 2000;
-        writeRainbowAnimation->faceMask = ANIM_FACEMASK_ALL_LEDS;
-        writeRainbowAnimation->count = 2;
-        writeRainbowAnimation->fade = 200;
-        writeRainbowAnimation->intensity = 0x80;
-        writeRainbowAnimation->cyclesTimes10 = 10;
-
-        // Create offsets
-        for (int i = 0; i < simpleAnimCount; ++i) {
-            writeAnimationOffsets[i] = i * sizeof(AnimationSimple);
+        // Conditions, each with its matching action
+        image.hello.type = Condition_HelloGoodbye;
+        image.hello.flags = ConditionHelloGoodbye_Hello;
+        setPlayAnimationAction(image, 0, 8, FACE_INDEX_CURRENT_FACE);   // Rainbow
+
+        image.connected.type = Condition_ConnectionState;
+        image.connected.flags = ConditionConnectionState_Connected | ConditionConnectionState_Disconnected;
+        setPlayAnimationAction(image, 1, 4, 0);                         // All LEDs blue
+
+        image.rolling.type = Condition_Rolling;
+        image.rolling.repeatPeriodMs = 500;
+        setPlayAnimationAction(image, 2, 5, FACE_INDEX_CURRENT_FACE);   // Face color
+
+        image.rolled.type = Condition_Rolled;
+        image.rolled.faceMask = ANIM_FACEMASK_ALL_LEDS;
+        setPlayAnimationAction(image, 3, 6, FACE_INDEX_CURRENT_FACE);   // Face color
+
+        setBatteryStateCondition(image, 0, ConditionBatteryState_Low, 30000);
+        setPlayAnimationAction(image, 4, 2, 0);
+        setBatteryStateCondition(image, 1, ConditionBatteryState_Charging, 5000);
+        setPlayAnimationAction(image, 5, 0, 0);
+        setBatteryStateCondition(image, 2, ConditionBatteryState_Done, 5000);
+        setPlayAnimationAction(image, 6, 3, 0);
+        setBatteryStateCondition(image, 3, ConditionBatteryState_BadCharging, 0);
+        setPlayAnimationAction(image, 7, 1, 0);
+        setBatteryStateCondition(image, 4, ConditionBatteryState_Error, 1500);
+        setPlayAnimationAction(image, 8, 7, 0);
+
+        uint16_t conditionOffsets[] = {
+            0,
+            sizeof(ConditionHelloGoodbye),
+            sizeof(ConditionHelloGoodbye) + sizeof(ConditionConnectionState),
+            sizeof(ConditionHelloGoodbye) + sizeof(ConditionConnectionState) + sizeof(ConditionRolling),
+        };
+        for (int i = 0; i < DEFAULT_RULE_COUNT; ++i) {
+            image.conditionsOffsets[i] = i < 4 ? conditionOffsets[i] :
+                conditionOffsets[3] + sizeof(ConditionRolled) + (i - 4) * sizeof(ConditionBatteryState);
+            image.actionsOffsets[i] = i * sizeof(ActionPlayAnimation);
+            image.rules[i].condition = i;
+            image.rules[i].actionOffset = i;
+            image.rules[i].actionCount = 1;
         }
 
-        // Offset for rainbow anim
-        writeAnimationOffsets[simpleAnimCount] = simpleAnimCount * sizeof(AnimationSimple);
-
-        // Create conditions
-        uint32_t address = reinterpret_cast<uint32_t>(writeConditions);
-        uint16_t offset = 0;
-
-        // Add Hello condition (index 0)
-        ConditionHelloGoodbye* hello = reinterpret_cast<ConditionHelloGoodbye*>(address);
-        hello->type = Condition_HelloGoodbye;
-        hello->flags = ConditionHelloGoodbye_Hello;
-        writeConditionsOffsets[0] = offset;
-        offset += sizeof(ConditionHelloGoodbye);
-        address += sizeof(ConditionHelloGoodbye);
-        // And matching action
-        writeActions[0].type = Action_PlayAnimation;
-        writeActions[0].animIndex = 8; // Rainbow
-        writeActions[0].faceIndex = FACE_INDEX_CURRENT_FACE; // doesn't really matter
-        writeActions[0].loopCount = 1;
-
-        // Add New Connection condition (index 1)
-        ConditionConnectionState* connected = reinterpret_cast<ConditionConnectionState*>(address);
-        connected->type = Condition_ConnectionState;
-        connected->flags = ConditionConnectionState_Connected | ConditionConnectionState_Disconnected;
-        writeConditionsOffsets[1] = offset;
-        offset += sizeof(ConditionConnectionState);
-        address += sizeof(ConditionConnectionState);
-        // And matching action
-        writeActions[1].type = Action_PlayAnimation;
-        writeActions[1].animIndex = 4; // All LEDs blue
-        writeActions[1].faceIndex = 0; // doesn't matter
-        writeActions[1].loopCount = 1;
-
-        // Add Rolling condition (index 2)
-        ConditionRolling* rolling = reinterpret_cast<ConditionRolling*>(address);
-        rolling->type = Condition_Rolling;
-        rolling->repeatPeriodMs = 500;
-        writeConditionsOffsets[2] = offset;
-        offset += sizeof(ConditionRolling);
-        address += sizeof(ConditionRolling);
-        // And matching action
-        writeActions[2].type = Action_PlayAnimation;
-        writeActions[2].animIndex = 5; // face based on color
-        writeActions[2].faceIndex = FACE_INDEX_CURRENT_FACE;
-        writeActions[2].loopCount = 1;
-
-        // Add Rolled condition (index 3)
-        ConditionRolled* rolled = reinterpret_cast<ConditionRolled*>(address);
-        rolled->type = Condition_Rolled;
-        rolled->faceMask = ANIM_FACEMASK_ALL_LEDS;
-        writeConditionsOffsets[3] = offset;
-        offset += sizeof(ConditionRolled);
-        address += sizeof(ConditionRolled);
-        // And matching action
-        writeActions[3].type = Action_PlayAnimation;
-        writeActions[3].animIndex = 6; // face led green
-        writeActions[3].faceIndex = FACE_INDEX_CURRENT_FACE; // Doesn't actually matter
-        writeActions[3].loopCount = 1;
-
-        // Add Low Battery condition (index 4)
-        ConditionBatteryState* low_batt = reinterpret_cast<ConditionBatteryState*>(address);
-        low_batt->type = Condition_BatteryState;
-        low_batt->flags = ConditionBatteryState_Flags::ConditionBatteryState_Low;
-        low_batt->repeatPeriodMs = 30000; // 30s
-        writeConditionsOffsets[4] = offset;
-        offset += sizeof(ConditionBatteryState);
-        address += sizeof(ConditionBatteryState);
-        // And matching action
-        writeActions[4].type = Action_PlayAnimation;
-        writeActions[4].animIndex = 2; // face led red
-        writeActions[4].faceIndex = 0;
-        writeActions[4].loopCount = 1;
-
-        // Add Charging condition (index 5)
-        ConditionBatteryState* charge_batt = reinterpret_cast<ConditionBatteryState*>(address);
-        charge_batt->type = Condition_BatteryState;
-        charge_batt->flags = ConditionBatteryState_Flags::ConditionBatteryState_Charging;
-        charge_batt->repeatPeriodMs = 5000; //s
-        writeConditionsOffsets[5] = offset;
-        offset += sizeof(ConditionBatteryState);
-        address += sizeof(ConditionBatteryState);
-        // And matching action
-        writeActions[5].type = Action_PlayAnimation;
-        writeActions[5].animIndex = 0; // face led red
-        writeActions[5].faceIndex = topFace;
-        writeActions[5].loopCount = 1;
-
-        // Add Done charging condition (index 6)
-        ConditionBatteryState* done_charge = reinterpret_cast<ConditionBatteryState*>(address);
-        done_charge->type = Condition_BatteryState;
-        done_charge->flags = ConditionBatteryState_Done;
-        done_charge->repeatPeriodMs = 5000; //s
-        writeConditionsOffsets[6] = offset;
-        offset += sizeof(ConditionBatteryState);
-        address += sizeof(ConditionBatteryState);
-        // And matching action
-        writeActions[6].type = Action_PlayAnimation;
-        writeActions[6].animIndex = 3; // face led green
-        writeActions[6].faceIndex = topFace;
-        writeActions[6].loopCount = 1;
-
-        // Add Bad charging condition (index 7)
-        ConditionBatteryState* bad_charge = reinterpret_cast<ConditionBatteryState*>(address);
-        bad_charge->type = Condition_BatteryState;
-        bad_charge->flags = ConditionBatteryState_BadCharging;
-        writeConditionsOffsets[7] = offset;
-        offset += sizeof(ConditionBatteryState);
-        address += sizeof(ConditionBatteryState);
-        // And matching action
-        writeActions[7].type = Action_PlayAnimation;
-        writeActions[7].animIndex = 1; // face led red
-        writeActions[7].faceIndex = topFace;
-        writeActions[7].loopCount = 1;
-
-        // Add error during charging (usually temperature) condition (index 8)
-        ConditionBatteryState* error_charge = reinterpret_cast<ConditionBatteryState*>(address);
-        error_charge->type = Condition_BatteryState;
-        error_charge->flags = ConditionBatteryState_Error;
-        error_charge->repeatPeriodMs = 1500; //s
-        writeConditionsOffsets[8] = offset;
-        offset += sizeof(ConditionBatteryState);
-        address += sizeof(ConditionBatteryState);
-        // And matching action
-        writeActions[8].type = Action_PlayAnimation;
-        writeActions[8].animIndex = 7; // face led red fast
-        writeActions[8].faceIndex = topFace;
-        writeActions[8].loopCount = 1;
-
-        // Create action offsets
-        for (int i = 0; i < actionCount; ++i) {
-            writeActionsOffsets[i] = i * sizeof(ActionPlayAnimation);
+        image.behavior.rulesOffset = 0;
+        image.behavior.rulesCount = DEFAULT_RULE_COUNT;
+        return image;
+    }
+
+    static constexpr DefaultDataSetImage defaultDataSetImage __attribute__ ((aligned (4))) = makeDefaultDataSetImage();
+
+    /// <summary>
+    /// Points the animations and actions meant for the top face to the top face of the die
+    /// </summary>
+    void applyLayout(DefaultDataSetImage* image, const DiceVariants::Layout* layout) {
+        uint32_t topFaceMask = layout->getTopFaceMask();
+        uint8_t topFace = layout->getTopFace();
+        const int topFaceAnimations[] = { 0, 2, 3, 5, 7 };
+        for (int anim : topFaceAnimations) {
+            image->simpleAnimations[anim].faceMask = topFaceMask;
+        }
+        // Battery state actions
+        for (int i = 5; i < DEFAULT_RULE_COUNT; ++i) {
+            image->actions[i].faceIndex = topFace;
         }
+    }
+
+    void ProgramDefaultDataSet(DataSetWrittenCallback callback) {
+        NRF_LOG_INFO("Programming default data set");
 
-        // Add Rules
-        for (int i = 0; i < ruleCount; ++i) {
-            writeRules[i].condition = i;
-            writeRules[i].actionOffset = i;
-            writeRules[i].actionCount = 1;
+        static DataSetWrittenCallback _setWrittenCallback;
+        static DefaultDataSetImage* writeBuffer;
+        _setWrittenCallback = callback;
+
+        // The image only needs the top face of the die before being programmed as is
+        writeBuffer = (DefaultDataSetImage*)malloc(sizeof(DefaultDataSetImage));
+        if (writeBuffer == nullptr) {
+            NRF_LOG_ERROR("Not enough ram to allocate default dataset");
+            callback(false);
+            return;
         }
+        memcpy(writeBuffer, &defaultDataSetImage, sizeof(DefaultDataSetImage));
+        applyLayout(writeBuffer, SettingsManager::getLayout());
 
-        // Add Behavior
-        writeBehaviors[0].rulesOffset = 0;
-        writeBehaviors[0].rulesCount = ruleCount;
+        // Point to where the data WILL be in flash, programDataSet() makes a copy of the header
+        const uint32_t dataAddress = Flash::getDataSetDataAddress();
+        auto toFlash = [dataAddress](const void* ptr) {
+            return dataAddress + ((uint32_t)ptr - (uint32_t)writeBuffer);
+        };
+
+        Data newData = {};
+        newData.headMarker = ANIMATION_SET_VALID_KEY;
+        newData.version = ANIMATION_SET_VERSION;
+
+        newData.animationBits.palette = (const uint8_t*)toFlash(writeBuffer->palette);
+        newData.animationBits.paletteSize = DEFAULT_PALETTE_SIZE;
+        newData.animationBits.rgbKeyframes = (const RGBKeyframe*)toFlash(writeBuffer->animationOffsets);
+        newData.animationBits.rgbKeyFrameCount = 0;
+        newData.animationBits.rgbTracks = (const RGBTrack*)toFlash(writeBuffer->animationOffsets);
+        newData.animationBits.rgbTrackCount = 0;
+        newData.animationBits.keyframes = (const Keyframe*)toFlash(writeBuffer->animationOffsets);
+        newData.animationBits.keyFrameCount = 0;
+        newData.animationBits.tracks = (const Track*)toFlash(writeBuffer->animationOffsets);
+        newData.animationBits.trackCount = 0;
+        newData.animationBits.animationOffsets = (const uint16_t*)toFlash(writeBuffer->animationOffsets);
+        newData.animationBits.animationCount = DEFAULT_ANIM_COUNT;
+        newData.animationBits.animations = (const uint8_t*)toFlash(writeBuffer->simpleAnimations);
+        newData.animationBits.animationsSize = sizeof(writeBuffer->simpleAnimations) + sizeof(AnimationRainbow);
+
+        newData.actionsOffsets = (const uint16_t*)toFlash(writeBuffer->actionsOffsets);
+        newData.actionCount = DEFAULT_RULE_COUNT;
+        newData.actions = (const Action*)toFlash(writeBuffer->actions);
+        newData.actionsSize = sizeof(writeBuffer->actions);
+
+        newData.conditionsOffsets = (const uint16_t*)toFlash(writeBuffer->conditionsOffsets);
+        newData.conditionCount = DEFAULT_RULE_COUNT;
+        newData.conditions = (const Condition*)toFlash(&writeBuffer->hello);
+        newData.conditionsSize = (uint32_t)writeBuffer->rules - (uint32_t)&writeBuffer->hello;
+
+        newData.rules = (const Rule*)toFlash(writeBuffer->rules);
+        newData.ruleCount = DEFAULT_RULE_COUNT;
+        newData.behavior = (const Behavior*)toFlash(&writeBuffer->behavior);
+        newData.brightness = 255;
+        newData.tailMarker = ANIMATION_SET_VALID_KEY;
 
-        // NRF_LOG_INFO("Default Dataset Buffer size: %d bytes", bufferSize);
-        // NRF_LOG_HEXDUMP_INFO(writeBuffer, bufferSize);
-        // NRF_LOG_INFO("Dataset size: %d bytes", sizeof(Data));
-        // NRF_LOG_HEXDUMP_INFO(newData, sizeof(Data));
-#endif
         static auto programDefaultsToFlash = [](Flash::ProgramFlashFuncCallback callback) {
-            Flash::write(nullptr, Flash::getDataSetDataAddress(), writeBuffer, bufferSize, callback);
+            Flash::write(nullptr, Flash::getDataSetDataAddress(), writeBuffer, sizeof(DefaultDataSetImage), callback);
         };
 
-        Flash::programFlash(*newData, settingsPackAlong, programDefaultsToFlash, _setWrittenCallback);
+        bool started = Flash::programDataSet(newData, programDefaultsToFlash, [](bool result) {
+            free(writeBuffer);
+            writeBuffer = nullptr;
+            _setWrittenCallback(result);
+        });
+        if (!started) {
+            free(writeBuffer);
+            writeBuffer = nullptr;
+            _setWrittenCallback(false);
+        }
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,255 @@
+#include "data_set.h"
+#include "data_set_data.h"
+#include "utils/utils.h"
+#include "drivers_nrf/flash.h"
+#include "bluetooth/bluetooth_messages.h"
+#include "bluetooth/bluetooth_message_service.h"
+#include "bluetooth/bulk_data_transfer.h"
+#include "malloc.h"
+#include "nrf_log.h"
+
+using namespace Utils;
+using namespace DriversNRF;
+using namespace Bluetooth;
+
+namespace DataSet
+{
+    // Block CRCs being sent to the app
+    uint16_t* manifest = nullptr;
+
+    /// <summary>
+    /// Sends the CRC of each block of the dataset data, so the app can tell which blocks
+    /// it needs to send for an update
+    /// </summary>
+    void RequestDataSetManifestHandler(const Message* msg) {
+        if (manifest != nullptr) {
+            NRF_LOG_WARNING("Already sending manifest");
+            return;
+        }
+
+        const uint8_t* dataPtr = (const uint8_t*)Flash::getDataSetDataAddress();
+        uint32_t size = dataSize();
+        uint16_t blockCount = (size + DATA_SET_BLOCK_SIZE - 1) / DATA_SET_BLOCK_SIZE;
+        if (blockCount > 0) {
+            manifest = (uint16_t*)malloc(blockCount * sizeof(uint16_t));
+            if (manifest == nullptr) {
+                NRF_LOG_ERROR("Not enough ram to allocate manifest");
+                blockCount = 0;
+            }
+        }
+        for (int i = 0; i < blockCount; ++i) {
+            uint32_t offset = i * DATA_SET_BLOCK_SIZE;
+            manifest[i] = computeCrc16(dataPtr + offset, MIN(DATA_SET_BLOCK_SIZE, size - offset));
+        }
+
+        MessageDataSetManifest manifestMsg;
+        manifestMsg.dataSize = size;
+        manifestMsg.dataHash = dataHash();
+        manifestMsg.blockSize = DATA_SET_BLOCK_SIZE;
+        manifestMsg.blockCount = blockCount;
+        MessageService::SendMessage(&manifestMsg);
+
+        if (blockCount > 0) {
+            SendBulkData::send((const uint8_t*)manifest, blockCount * sizeof(uint16_t), nullptr,
+                [](void* context, bool result, const uint8_t* data, uint16_t size) {
+                    NRF_LOG_DEBUG("Manifest sent, result: %d", result);
+                    free(manifest);
+                    manifest = nullptr;
+                });
+        }
+    }
+
+    /// <summary>
+    /// State of a patch, only allocated while it is applied.
+    /// programDataSet() erases the current data before anything is written, so the patched
+    /// data is assembled in RAM, from the received blocks and the current data,
+    /// and only programmed once both its hash and CRC check out. Datasets too large for the heap
+    /// can't be patched, the app sends them whole instead.
+    /// </summary>
+    struct PatchState
+    {
+        Data newData;
+        uint32_t newSize;
+        uint32_t newHash;
+        uint32_t newCrc;
+        uint16_t patchSize;
+        uint8_t* buffer;    // Patched data, followed by the received block records
+        int16_t sequence;   // Of the patch request, the finished message is sent later
+        Flash::ProgramFlashFuncCallback programCallback;
+    };
+
+    PatchState* patch = nullptr;
+
+    void finishPatch(bool result) {
+        NRF_LOG_INFO("Dataset patch finished, result: %d", result);
+        int16_t sequence = patch->sequence;
+        free(patch->buffer);
+        free(patch);
+        patch = nullptr;
+
+        MessageTransferAnimSetPatchFinished finishedMsg;
+        finishedMsg.result = result ? 1 : 0;
+        MessageService::SendReply(&finishedMsg, sequence);
+    }
+
+    uint8_t* getRecords() {
+        return patch->buffer + roundUpTo4(patch->newSize);
+    }
+
+    /// <summary>
+    /// Fills the buffer with the patched data, each block either from the received records
+    /// or from the current data. Returns false if the records don't describe the new data.
+    /// </summary>
+    bool assemblePatch() {
+        const uint8_t* records = getRecords();
+        uint32_t recordOffset = 0;
+        uint16_t blockCount = (patch->newSize + DATA_SET_BLOCK_SIZE - 1) / DATA_SET_BLOCK_SIZE;
+        for (uint16_t blockIndex = 0; blockIndex < blockCount; ++blockIndex) {
+            uint32_t offset = blockIndex * DATA_SET_BLOCK_SIZE;
+            uint32_t length = MIN(DATA_SET_BLOCK_SIZE, patch->newSize - offset);
+            uint16_t recordIndex = 0xFFFF;
+            if (recordOffset + sizeof(uint16_t) <= patch->patchSize) {
+                memcpy(&recordIndex, records + recordOffset, sizeof(uint16_t));
+            }
+
+            const uint8_t* source = nullptr;
+            if (recordIndex == blockIndex) {
+                // Block was sent
+                source = records + recordOffset + sizeof(uint16_t);
+                recordOffset += sizeof(uint16_t) + length;
+                if (recordOffset > patch->patchSize) {
+                    NRF_LOG_WARNING("Truncated patch record");
+                    return false;
+                }
+            } else if (recordIndex < blockIndex) {
+                NRF_LOG_WARNING("Patch records out of order");
+                return false;
+            } else if (offset + length <= dataSize()) {
+                // Block is unchanged
+                source = (const uint8_t*)(Flash::getDataSetDataAddress() + offset);
+            } else {
+                NRF_LOG_WARNING("Missing block %d in patch", blockIndex);
+                return false;
+            }
+            memcpy(patch->buffer + offset, source, length);
+        }
+
+        // All the records should have been used
+        if (recordOffset != patch->patchSize) {
+            NRF_LOG_WARNING("Unused patch records");
+            return false;
+        }
+        return true;
+    }
+
+    void commitPatch() {
+        if (!assemblePatch()) {
+            finishPatch(false);
+            return;
+        }
+        if (computeHash(patch->buffer, patch->newSize) != patch->newHash) {
+            NRF_LOG_WARNING("Patched dataset hash mismatch");
+            finishPatch(false);
+            return;
+        }
+        if (computeCrc32(patch->buffer, patch->newSize) != patch->newCrc) {
+            NRF_LOG_WARNING("Patched dataset CRC mismatch");
+            finishPatch(false);
+            return;
+        }
+
+        // The same way as a full transfer, except that the data comes from RAM
+        bool started = Flash::programDataSet(patch->newData,
+            [](Flash::ProgramFlashFuncCallback callback) {
+                patch->programCallback = callback;
+                Flash::write(nullptr, Flash::getDataSetDataAddress(), patch->buffer, roundUpTo4(patch->newSize),
+                    [](void* context, bool result, uint32_t address, uint16_t size) {
+                        // Check what was really written before it gets committed
+                        auto dataPtr = (const uint8_t*)Flash::getDataSetDataAddress();
+                        if (result && computeCrc32(dataPtr, patch->newSize) != patch->newCrc) {
+                            NRF_LOG_ERROR("Programmed dataset CRC mismatch");
+                            result = false;
+                        }
+                        patch->programCallback(nullptr, result, Flash::getDataSetDataAddress(), patch->newSize);
+                    });
+            },
+            [](bool result) {
+                refreshSizeAndHash();
+                if (!CheckValid()) {
+                    NRF_LOG_ERROR("No valid dataset after patch, programming defaults");
+                    ProgramDefaultDataSet([](bool ignore) {
+                        refreshSizeAndHash();
+                        finishPatch(false);
+                    });
+                    return;
+                }
+                finishPatch(result);
+            });
+        if (!started) {
+            finishPatch(false);
+        }
+    }
+
+    void ReceiveDataSetPatchHandler(const Message* msg) {
+        NRF_LOG_DEBUG("Received request to patch animation set");
+        auto message = (const MessageTransferAnimSetPatch*)msg;
+
+        MessageTransferAnimSetAck ack;
+        ack.result = 0;
+        if (patch != nullptr || Flash::isBusy()) {
+            NRF_LOG_WARNING("Already patching or programming dataset");
+            MessageService::SendMessage(&ack);
+            return;
+        }
+
+        patch = (PatchState*)malloc(sizeof(PatchState));
+        if (patch == nullptr) {
+            NRF_LOG_ERROR("Not enough ram to allocate patch state");
+            MessageService::SendMessage(&ack);
+            return;
+        }
+
+        setupDataLayout(patch->newData, message);
+        patch->newSize = computeDataSetDataSize(&patch->newData);
+        patch->newHash = message->dataHash;
+        patch->newCrc = message->dataCrc;
+        patch->patchSize = message->patchSize;
+        patch->buffer = nullptr;
+        patch->sequence = MessageService::getHandledSequence();
+        if (patch->newSize > 0 && patch->newSize < availableDataSize()) {
+            patch->buffer = (uint8_t*)malloc(roundUpTo4(patch->newSize) + patch->patchSize);
+        }
+        if (patch->buffer == nullptr) {
+            // The app sends the whole dataset instead
+            NRF_LOG_ERROR("Can't patch dataset of size 0x%x", patch->newSize);
+            free(patch);
+            patch = nullptr;
+            MessageService::SendMessage(&ack);
+            return;
+        }
+
+        // Flash is written by words
+        memset(patch->buffer + patch->newSize, 0, roundUpTo4(patch->newSize) - patch->newSize);
+
+        NRF_LOG_INFO("Patching dataset, new size: 0x%x, patch size: 0x%x", patch->newSize, patch->patchSize);
+        ack.result = 1;
+        MessageService::SendMessage(&ack);
+
+        if (patch->patchSize > 0) {
+            ReceiveBulkData::receive(nullptr,
+                [](void* context, uint16_t size) -> uint8_t* {
+                    return size == patch->patchSize ? getRecords() : nullptr;
+                },
+                [](void* context, bool result, uint8_t* data, uint16_t size) {
+                    if (result) {
+                        commitPatch();
+                    } else {
+                        finishPatch(false);
+                    }
+                });
+        } else {
+            // Only the layout changed
+            commitPatch();
+        }
+    }
+}
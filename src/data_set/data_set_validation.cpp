@@ -0,0 +1,320 @@
+#include "data_set.h"
+#include "data_set_data.h"
+#include "animations/animation_keyframed.h"
+#include "animations/animation_gradientpattern.h"
+#include "animations/animation_gradient.h"
+#include "animations/animation_noise.h"
+#include "animations/animation_cycle.h"
+#include "animations/animation_normals.h"
+#include "animations/animation_sequence.h"
+#include "animations/animation_worm.h"
+#include "animations/animation_simple.h"
+#include "animations/animation_rainbow.h"
+#include "animations/animation_blinkid.h"
+#include "nrf_log.h"
+#include "malloc.h"
+#include "string.h"
+
+using namespace Animations;
+using namespace Behaviors;
+
+namespace DataSet
+{
+    /// <summary>
+    /// Checks that an array of the dataset lies within the dataset data
+    /// </summary>
+    bool checkRange(const void* ptr, uint32_t size, uint32_t dataAddress, uint32_t dataSize) {
+        uint32_t address = (uint32_t)ptr;
+        return address >= dataAddress && address <= dataAddress + dataSize && size <= dataAddress + dataSize - address;
+    }
+
+    /// <summary>
+    /// Checks that an object of the given size fits at the offset in a buffer, and that
+    /// the offset is aligned the way the object is accessed
+    /// </summary>
+    bool checkOffset(uint32_t offset, uint32_t objectSize, uint32_t bufferSize) {
+        return (offset & 1) == 0 && offset <= bufferSize && objectSize <= bufferSize - offset;
+    }
+
+    bool checkRGBTrackIndex(const AnimationBits& bits, uint16_t index) {
+        return index < bits.rgbTrackCount;
+    }
+
+    uint32_t getAnimationSize(AnimationType type) {
+        switch (type) {
+            case Animation_Simple: return sizeof(AnimationSimple);
+            case Animation_Rainbow: return sizeof(AnimationRainbow);
+            case Animation_Keyframed: return sizeof(AnimationKeyframed);
+            case Animation_GradientPattern: return sizeof(AnimationGradientPattern);
+            case Animation_Gradient: return sizeof(AnimationGradient);
+            case Animation_Noise: return sizeof(AnimationNoise);
+            case Animation_Cycle: return sizeof(AnimationCycle);
+            case Animation_BlinkId: return sizeof(AnimationBlinkId);
+            case Animation_Normals: return sizeof(AnimationNormals);
+            case Animation_Sequence: return sizeof(AnimationSequence);
+            case Animation_Worm: return sizeof(AnimationWorm);
+            default: return 0;
+        }
+    }
+
+    bool checkAnimation(const AnimationBits& bits, uint32_t offset) {
+        if (!checkOffset(offset, sizeof(Animation), bits.animationsSize)) {
+            return false;
+        }
+        auto anim = (const Animation*)(bits.animations + offset);
+        uint32_t size = getAnimationSize(anim->type);
+        if (size == 0 || !checkOffset(offset, size, bits.animationsSize)) {
+            NRF_LOG_WARNING("Invalid animation type %d", anim->type);
+            return false;
+        }
+
+        // Check references to tracks and other animations
+        switch (anim->type) {
+            case Animation_Keyframed:
+                {
+                    auto keyframed = (const AnimationKeyframed*)anim;
+                    return keyframed->tracksOffset + keyframed->trackCount <= bits.rgbTrackCount;
+                }
+            case Animation_GradientPattern:
+                {
+                    auto pattern = (const AnimationGradientPattern*)anim;
+                    return pattern->tracksOffset + pattern->trackCount <= bits.trackCount &&
+                        checkRGBTrackIndex(bits, pattern->gradientTrackOffset);
+                }
+            case Animation_Gradient:
+                return checkRGBTrackIndex(bits, ((const AnimationGradient*)anim)->gradientTrackOffset);
+            case Animation_Noise:
+                {
+                    auto noise = (const AnimationNoise*)anim;
+                    return checkRGBTrackIndex(bits, noise->overallGradientTrackOffset) &&
+                        checkRGBTrackIndex(bits, noise->individualGradientTrackOffset);
+                }
+            case Animation_Cycle:
+                return checkRGBTrackIndex(bits, ((const AnimationCycle*)anim)->gradientTrackOffset);
+            case Animation_Normals:
+                {
+                    auto normals = (const AnimationNormals*)anim;
+                    return checkRGBTrackIndex(bits, normals->gradientOverTime) &&
+                        checkRGBTrackIndex(bits, normals->gradientAlongAxis) &&
+                        checkRGBTrackIndex(bits, normals->gradientAlongAngle);
+                }
+            case Animation_Sequence:
+                {
+                    auto sequence = (const AnimationSequence*)anim;
+                    if (sequence->animationCount > MAX_SEQ_ANIMATIONS) {
+                        return false;
+                    }
+                    for (int i = 0; i < sequence->animationCount; ++i) {
+                        if (sequence->animations[i].animationIndex >= bits.animationCount) {
+                            return false;
+                        }
+                    }
+                    return true;
+                }
+            case Animation_Worm:
+                return checkRGBTrackIndex(bits, ((const AnimationWorm*)anim)->gradientTrackOffset);
+            default:
+                return true;
+        }
+    }
+
+    const AnimationSequence* getSequence(const AnimationBits& bits, uint32_t index) {
+        auto anim = (const Animation*)(bits.animations + bits.animationOffsets[index]);
+        return anim->type == Animation_Sequence ? (const AnimationSequence*)anim : nullptr;
+    }
+
+    /// <summary>
+    /// Sequences play other animations, sequences included, so one that ends up playing itself
+    /// would keep triggering animations forever. Animations are marked once everything they
+    /// play is known to end, a pass at a time, and any sequence left unmarked is in a cycle.
+    /// Expects the animations to be checked already.
+    /// </summary>
+    bool checkSequences(const AnimationBits& bits) {
+        if (bits.animationCount == 0) {
+            return true;
+        }
+        uint8_t* ends = (uint8_t*)malloc((bits.animationCount + 7) / 8);
+        if (ends == nullptr) {
+            NRF_LOG_ERROR("Not enough ram to check sequences");
+            return false;
+        }
+        memset(ends, 0, (bits.animationCount + 7) / 8);
+
+        uint32_t remaining = 0;
+        for (uint32_t i = 0; i < bits.animationCount; ++i) {
+            if (getSequence(bits, i) == nullptr) {
+                ends[i / 8] |= 1 << (i % 8);
+            } else {
+                remaining++;
+            }
+        }
+        bool marked = true;
+        while (remaining > 0 && marked) {
+            marked = false;
+            for (uint32_t i = 0; i < bits.animationCount; ++i) {
+                if (ends[i / 8] & (1 << (i % 8))) {
+                    continue;
+                }
+                auto sequence = getSequence(bits, i);
+                bool allEnd = true;
+                for (int j = 0; j < sequence->animationCount && allEnd; ++j) {
+                    uint16_t index = sequence->animations[j].animationIndex;
+                    allEnd = (ends[index / 8] & (1 << (index % 8))) != 0;
+                }
+                if (allEnd) {
+                    ends[i / 8] |= 1 << (i % 8);
+                    remaining--;
+                    marked = true;
+                }
+            }
+        }
+        free(ends);
+        return remaining == 0;
+    }
+
+    bool checkCondition(const Data* data, uint32_t offset) {
+        auto condition = (const Condition*)((const uint8_t*)data->conditions + offset);
+        if (!checkOffset(offset, sizeof(Condition), data->conditionsSize)) {
+            return false;
+        }
+
+        uint32_t size = 0;
+        switch (condition->type) {
+            case Condition_HelloGoodbye:
+                size = sizeof(ConditionHelloGoodbye);
+                break;
+            case Condition_Handling:
+                size = sizeof(ConditionHandling);
+                break;
+            case Condition_Rolling:
+                size = sizeof(ConditionRolling);
+                break;
+            case Condition_Crooked:
+                size = sizeof(ConditionCrooked);
+                break;
+            case Condition_ConnectionState:
+                size = sizeof(ConditionConnectionState);
+                break;
+            case Condition_BatteryState:
+                size = sizeof(ConditionBatteryState);
+                break;
+            case Condition_Idle:
+                size = sizeof(ConditionIdle);
+                break;
+            case Condition_Rolled:
+                size = sizeof(ConditionRolled);
+                break;
+            default:
+                NRF_LOG_WARNING("Invalid condition type %d", condition->type);
+                return false;
+        }
+        return checkOffset(offset, size, data->conditionsSize);
+    }
+
+    bool checkAction(const Data* data, uint32_t offset) {
+        auto action = (const Action*)((const uint8_t*)data->actions + offset);
+        if (!checkOffset(offset, sizeof(Action), data->actionsSize)) {
+            return false;
+        }
+
+        switch (action->type) {
+            case Action_PlayAnimation:
+                return checkOffset(offset, sizeof(ActionPlayAnimation), data->actionsSize) &&
+                    ((const ActionPlayAnimation*)action)->animIndex < data->animationBits.animationCount;
+            case Action_RunOnDevice:
+                return checkOffset(offset, sizeof(ActionRunOnDevice), data->actionsSize);
+            default:
+                NRF_LOG_WARNING("Invalid action type %d", action->type);
+                return false;
+        }
+    }
+
+    /// <summary>
+    /// Checks every pointer, offset, type and index of a dataset which data is at the given address,
+    /// so that it can then be accessed without any check. Keyframe and palette indices are clamped
+    /// when evaluated so they aren't checked here.
+    /// </summary>
+    bool validateData(const Data* data, uint32_t dataAddress) {
+        if (data->headMarker != ANIMATION_SET_VALID_KEY ||
+            data->version != ANIMATION_SET_VERSION ||
+            data->tailMarker != ANIMATION_SET_VALID_KEY) {
+            return false;
+        }
+
+        const uint32_t dataSize = computeDataSetDataSize(data);
+        if (dataSize > availableDataSize()) {
+            NRF_LOG_WARNING("Dataset too big: 0x%x", dataSize);
+            return false;
+        }
+
+        // All the arrays must lie within the data
+        auto& bits = data->animationBits;
+        if (!checkRange(bits.palette, bits.paletteSize, dataAddress, dataSize) ||
+            !checkRange(bits.rgbKeyframes, bits.rgbKeyFrameCount * sizeof(RGBKeyframe), dataAddress, dataSize) ||
+            !checkRange(bits.rgbTracks, bits.rgbTrackCount * sizeof(RGBTrack), dataAddress, dataSize) ||
+            !checkRange(bits.keyframes, bits.keyFrameCount * sizeof(Keyframe), dataAddress, dataSize) ||
+            !checkRange(bits.tracks, bits.trackCount * sizeof(Track), dataAddress, dataSize) ||
+            !checkRange(bits.animationOffsets, bits.animationCount * sizeof(uint16_t), dataAddress, dataSize) ||
+            !checkRange(bits.animations, bits.animationsSize, dataAddress, dataSize) ||
+            !checkRange(data->conditionsOffsets, data->conditionCount * sizeof(uint16_t), dataAddress, dataSize) ||
+            !checkRange(data->conditions, data->conditionsSize, dataAddress, dataSize) ||
+            !checkRange(data->actionsOffsets, data->actionCount * sizeof(uint16_t), dataAddress, dataSize) ||
+            !checkRange(data->actions, data->actionsSize, dataAddress, dataSize) ||
+            !checkRange(data->rules, data->ruleCount * sizeof(Rule), dataAddress, dataSize) ||
+            !checkRange(data->behavior, sizeof(Behavior), dataAddress, dataSize)) {
+            NRF_LOG_WARNING("Dataset array out of bounds");
+            return false;
+        }
+
+        // Tracks must refer to existing keyframes
+        for (uint32_t i = 0; i < bits.rgbTrackCount; ++i) {
+            if (bits.rgbTracks[i].keyframesOffset + bits.rgbTracks[i].keyFrameCount > bits.rgbKeyFrameCount) {
+                NRF_LOG_WARNING("Invalid RGB track %d", i);
+                return false;
+            }
+        }
+        for (uint32_t i = 0; i < bits.trackCount; ++i) {
+            if (bits.tracks[i].keyframesOffset + bits.tracks[i].keyFrameCount > bits.keyFrameCount) {
+                NRF_LOG_WARNING("Invalid track %d", i);
+                return false;
+            }
+        }
+
+        for (uint32_t i = 0; i < bits.animationCount; ++i) {
+            if (!checkAnimation(bits, bits.animationOffsets[i])) {
+                NRF_LOG_WARNING("Invalid animation %d", i);
+                return false;
+            }
+        }
+        if (!checkSequences(bits)) {
+            NRF_LOG_WARNING("Animation sequences play themselves");
+            return false;
+        }
+        for (uint32_t i = 0; i < data->conditionCount; ++i) {
+            if (!checkCondition(data, data->conditionsOffsets[i])) {
+                NRF_LOG_WARNING("Invalid condition %d", i);
+                return false;
+            }
+        }
+        for (uint32_t i = 0; i < data->actionCount; ++i) {
+            if (!checkAction(data, data->actionsOffsets[i])) {
+                NRF_LOG_WARNING("Invalid action %d", i);
+                return false;
+            }
+        }
+
+        // Rules must refer to existing conditions and actions
+        for (uint32_t i = 0; i < data->ruleCount; ++i) {
+            auto& rule = data->rules[i];
+            if (rule.condition >= data->conditionCount || rule.actionOffset + rule.actionCount > data->actionCount) {
+                NRF_LOG_WARNING("Invalid rule %d", i);
+                return false;
+            }
+        }
+        if (data->behavior->rulesOffset + data->behavior->rulesCount > data->ruleCount) {
+            NRF_LOG_WARNING("Invalid behavior");
+            return false;
+        }
+        return true;
+    }
+}
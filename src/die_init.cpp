@@ -30,6 +30,7 @@
 #include "bluetooth/bluetooth_custom_advertising_data.h"
 #include "bluetooth/bluetooth_message_service.h"
 #include "bluetooth/bulk_data_transfer.h"
+#include "bluetooth/connection_profiles.h"
 #include "bluetooth/telemetry.h"
 
 #include "animations/animation_cycle.h"
@@ -56,6 +57,7 @@
 #include "modules/attract_mode_controller.h"
 #include "modules/user_mode_controller.h"
 #include "modules/discharge_controller.h"
+#include "modules/roll_trace_recorder.h"
 
 #include "utils/Utils.h"
 
@@ -224,6 +226,9 @@ namespace Die
                             // Telemetry depends on accelerometer
                             Telemetry::init();
 
+                            // So does the roll trace recorder
+                            RollTraceRecorder::init();
+
                             // Animation controller relies on animation set
                             AnimController::init();
 
@@ -237,6 +242,9 @@ namespace Die
                             // Initialize custom advertising data handler
                             CustomAdvertisingDataHandler::init();
 
+                            // Switches connection parameters depending on what the connection is used for
+                            ConnectionProfiles::init();
+
                             auto runMode = Pixel::getCurrentRunMode();
                             if (runMode == Pixel::RunMode_User) {
                                 // Want to prevent sleep mode due to animations while not in validation
@@ -131,12 +131,10 @@ namespace AccelChip
         }, nullptr, 3);
     }
 
-    void read(Core::int3* outAccel) {
-
-        // Read accelerometer data
-        uint8_t accBuffer[6];
-        I2C::readRegisters(devAddress, OUT_X_L, accBuffer, 6);
-
+    /// <summary>
+    /// Converts the raw 12 bits output registers to acceleration in thousandths of g
+    /// </summary>
+    void convertSample(const uint8_t* accBuffer, Core::int3* outAccel) {
         // Convert acc (12 bits)
         int16_t cx = (((int16_t)accBuffer[1] << 8) | accBuffer[0]) >> 4;
         if (cx & 0x0800) cx |= 0xF000;
@@ -150,6 +148,14 @@ namespace AccelChip
         outAccel->zTimes1000 = cz * 1000 / (1 << 11) * scaleMult;
     }
 
+    void read(Core::int3* outAccel) {
+
+        // Read accelerometer data
+        uint8_t accBuffer[6];
+        I2C::readRegisters(devAddress, OUT_X_L, accBuffer, 6);
+        convertSample(accBuffer, outAccel);
+    }
+
     void standby()
     {
         uint8_t c = I2C::readRegister(devAddress, CTRL_REG1);
@@ -243,14 +249,22 @@ namespace AccelChip
     }
 
 
+    // Raw sample registers, filled by the TWI peripheral while the CPU does something else
+    static uint8_t sampleBuffer[6];
+    static volatile bool sampleReadPending = false;
+
     /// <summary>
-    /// Interrupt handler when data is ready
+    /// Called from the TWI interrupt once the sample registers have been read
     /// </summary>
-    void dataInterruptHandler(uint32_t pin, nrf_gpiote_polarity_t action) {
+    void onSampleRead(void* context, bool result) {
+        sampleReadPending = false;
+        if (!result) {
+            NRF_LOG_WARNING("KXTJ3 - Failed to read sample");
+            return;
+        }
 
-        //I2C::readRegister(devAddress, STATUS_REG);
         Core::int3 acc;
-        read(&acc);
+        convertSample(sampleBuffer, &acc);
 
         // // DEBUG
         // accCount++;
@@ -268,6 +282,21 @@ namespace AccelChip
         //clearInterrupt();
     }
 
+    /// <summary>
+    /// Interrupt handler when data is ready
+    /// </summary>
+    void dataInterruptHandler(uint32_t pin, nrf_gpiote_polarity_t action) {
+
+        // Don't wait for the bus, the sample is processed on completion.
+        // Skip this sample if the previous read hasn't completed yet (it would share the buffer).
+        if (!sampleReadPending) {
+            sampleReadPending = true;
+            if (!I2C::readRegistersAsync(devAddress, OUT_X_L, sampleBuffer, sizeof(sampleBuffer), onSampleRead, nullptr)) {
+                sampleReadPending = false;
+            }
+        }
+    }
+
     /// <summary>
     /// Enable Data ready interrupt
     /// </summary>
@@ -14,6 +14,7 @@
 #include "data_set/data_set.h"
 #include "data_set/data_set_data.h"
 #include "behaviors/behavior.h"
+#include "utils/utils.h"
 #include "malloc.h"
 
 using namespace DriversNRF;
@@ -22,6 +23,9 @@ using namespace DataSet;
 using namespace Behaviors;
 
 #define MAX_PROG_CLIENTS 8
+#define ERASED_WORD (0xFFFFFFFF)
+#define SETTINGS_BACKUP_PENDING (0x5E77BAC0)
+#define SETTINGS_BACKUP_DONE (0)
 
 namespace DriversNRF::Flash
 {
@@ -199,113 +203,403 @@ namespace DriversNRF::Flash
     }
 
 
-    bool programFlash(
-        const Data& newData,
-        const Settings& newSettings,
-        ProgramFlashFunc programFlashFunc,
-        ProgramFlashNotification onProgramFinished) {
+    // Programming state, only one region may be programmed at a time
+    static bool programming = false;
+    static ProgrammingRegion programmingRegion;
+    static Data* _newData = nullptr;
+    static Settings* _newSettings = nullptr;
+    static const void* _newRecords = nullptr;
+    static uint32_t _newRecordsSize = 0;
+    static ProgramFlashFunc _programDataFunc;
+    static ProgramFlashNotification _onProgramFinished;
 
-        static Data* _newData = nullptr;
-        static Settings* _newSettings = nullptr;
-        static ProgramFlashFunc _programDataFunc;
-        static ProgramFlashNotification _onProgramFinished;
+    void notifyProgrammingClients(ProgrammingEventType evt) {
+        for (int i = 0; i < programmingClients.Count(); ++i)
+        {
+            programmingClients[i].handler(programmingClients[i].token, evt, programmingRegion);
+        }
+    }
 
-        static auto beginProgramming = []() {
-            // Notify clients
-            for (int i = 0; i < programmingClients.Count(); ++i)
-            {
-                programmingClients[i].handler(programmingClients[i].token, ProgrammingEventType_Begin);
+    void beginProgramming(ProgrammingRegion region) {
+        programming = true;
+        programmingRegion = region;
+        notifyProgrammingClients(ProgrammingEventType_Begin);
+    }
+
+    void finishProgramming(bool result) {
+        free(_newSettings);
+        _newSettings = nullptr;
+        _newRecords = nullptr;
+        _newRecordsSize = 0;
+        free(_newData);
+        _newData = nullptr;
+        programming = false;
+
+        notifyProgrammingClients(ProgrammingEventType_End);
+        _onProgramFinished(result);
+    }
+
+    /// <summary>
+    /// The settings page is the only copy of the settings and records, so before it is erased,
+    /// the new content is written to the erased space at the end of the dataset region, followed
+    /// by this footer. If the power is cut before the settings page is rewritten, the copy is still
+    /// pending on the next boot and restoreSettings() programs it again. Copies are stacked downward
+    /// from the end of the flash, each marked done once used, and they go away with the dataset.
+    /// Once there is no room left, the last used copy stands in for the new one, see hasSettingsBackup().
+    /// </summary>
+    struct SettingsBackupFooter
+    {
+        uint32_t size;      // Of the copy right below the footer, settings followed by records
+        uint32_t crc;
+        uint32_t marker;    // Written last, then cleared once the settings page is rewritten
+    };
+
+    static uint32_t _backupAddress = 0; // Copy of the settings being programmed, 0 if there is none
+
+    const SettingsBackupFooter* getBackupFooter(uint32_t backupAddress) {
+        return (const SettingsBackupFooter*)(backupAddress + sizeof(Settings) + _newRecordsSize);
+    }
+
+    bool isDataSetHeaderValid(const Data* header) {
+        return header->headMarker == ANIMATION_SET_VALID_KEY &&
+            header->version == ANIMATION_SET_VERSION &&
+            header->tailMarker == ANIMATION_SET_VALID_KEY;
+    }
+
+    /// <summary>
+    /// Walks the copies down from the end of the flash. Returns the pending one if any,
+    /// otherwise where the next copy should end, or 0 if the space there isn't usable.
+    /// The last copy that was used is returned as well, if its content is intact.
+    /// </summary>
+    const SettingsBackupFooter* findSettingsBackup(uint32_t* outFreeEnd, const SettingsBackupFooter** outLastUsed = nullptr) {
+        *outFreeEnd = 0;
+        if (outLastUsed != nullptr) {
+            *outLastUsed = nullptr;
+        }
+        uint32_t end = getFlashEndAddress();
+        while (end >= getDataSetAddress() + sizeof(SettingsBackupFooter)) {
+            auto footer = (const SettingsBackupFooter*)(end - sizeof(SettingsBackupFooter));
+            if (footer->marker == ERASED_WORD) {
+                *outFreeEnd = end;
+                break;
             }
-        };
+            if (footer->marker != SETTINGS_BACKUP_PENDING && footer->marker != SETTINGS_BACKUP_DONE) {
+                break;
+            }
+            if (footer->size < sizeof(Settings) || footer->size % 4 != 0 || footer->size > (uint32_t)footer - getDataSetAddress()) {
+                break;
+            }
+            uint32_t start = (uint32_t)footer - footer->size;
+            bool intact = footer->crc == Utils::computeCrc32((const uint8_t*)start, footer->size);
+            if (footer->marker == SETTINGS_BACKUP_PENDING && intact) {
+                return footer;
+            }
+            if (outLastUsed != nullptr) {
+                *outLastUsed = footer->marker == SETTINGS_BACKUP_DONE && intact ? footer : nullptr;
+            }
+            end = start;
+        }
+        return nullptr;
+    }
 
-        static auto finishProgramming = []() {
-            free(_newSettings);
-                _newSettings = nullptr;
-            free(_newData);
-                _newData = nullptr;
+    /// <summary>
+    /// Returns where a copy of the given size can be written, 0 if there is no erased space for it
+    /// </summary>
+    uint32_t findSettingsBackupAddress(uint32_t size) {
+        uint32_t end;
+        if (findSettingsBackup(&end) != nullptr || end == 0) {
+            return 0;
+        }
+        // Never below the dataset, erased words of its data included
+        uint32_t bottom = getDataSetAddress();
+        auto header = (const Data*)getDataSetAddress();
+        if (isDataSetHeaderValid(header)) {
+            bottom = getDataSetDataAddress() + Utils::roundUpTo4(DataSet::computeDataSetDataSize(header));
+        }
+        if (end < bottom + size + sizeof(SettingsBackupFooter)) {
+            return 0;
+        }
+        uint32_t start = end - sizeof(SettingsBackupFooter) - size;
+        for (uint32_t address = start; address < end; address += 4) {
+            if (*(const uint32_t*)address != ERASED_WORD) {
+                return 0;
+            }
+        }
+        return start;
+    }
 
-            // Notify clients
-            for (int i = 0; i < programmingClients.Count(); ++i)
-            {
-                programmingClients[i].handler(programmingClients[i].token, ProgrammingEventType_End);
+    bool canBackupSettings(uint32_t recordsSize) {
+        return findSettingsBackupAddress(sizeof(Settings) + recordsSize) != 0;
+    }
+
+    bool hasSettingsBackup(const Settings& settings) {
+        uint32_t freeEnd;
+        const SettingsBackupFooter* lastUsed;
+        if (findSettingsBackup(&freeEnd, &lastUsed) != nullptr || lastUsed == nullptr) {
+            return false;
+        }
+        return memcmp((const uint8_t*)lastUsed - lastUsed->size, &settings, sizeof(Settings)) == 0;
+    }
+
+    /// <summary>
+    /// Writes the records at the given address, if any, then the new settings before them.
+    /// The settings go last so that valid settings in the settings page always come with all their records.
+    /// </summary>
+    void writeSettings(uint32_t address, FlashCallback callback) {
+        static FlashCallback _callback;
+        static uint32_t _address;
+        _callback = callback;
+        _address = address;
+        auto writeSettingsOnly = [](void* context, bool result, uint32_t address, uint16_t data_size) {
+            if (!result) {
+                _callback(context, result, address, data_size);
+            } else {
+                Flash::write(nullptr, _address, _newSettings, sizeof(Settings), _callback);
             }
         };
+        if (_newRecordsSize == 0) {
+            writeSettingsOnly(nullptr, true, address, 0);
+        } else {
+            Flash::write(nullptr, address + sizeof(Settings), _newRecords, _newRecordsSize, writeSettingsOnly);
+        }
+    }
 
-        _newData = (Data*)malloc(sizeof(Data));
-        if (_newData == nullptr) {
-            NRF_LOG_ERROR("Not enough ram to allocate copy of new data");
+    void finishSettings(bool result) {
+        uint32_t backupAddress = _backupAddress;
+        _backupAddress = 0;
+        if (!result || backupAddress == 0) {
+            // A pending copy is programmed again on the next boot
+            finishProgramming(result);
+            return;
+        }
+        // A word may be written twice between erases, clearing the marker is the second time
+        static const uint32_t doneMarker = SETTINGS_BACKUP_DONE;
+        Flash::write(nullptr, (uint32_t)&getBackupFooter(backupAddress)->marker, &doneMarker, sizeof(doneMarker),
+            [](void* context, bool result, uint32_t address, uint16_t data_size) {
+                finishProgramming(result);
+            });
+    }
+
+    void eraseAndWriteSettings() {
+        Flash::erase(nullptr, getSettingsStartAddress(), Flash::bytesToPages(sizeof(Settings)), [](void* context, bool result, uint32_t address, uint16_t data_size) {
+            NRF_LOG_INFO("Erased %d settings pages", data_size);
+            if (!result) {
+                NRF_LOG_ERROR("Error erasing settings");
+                finishSettings(false);
+                return;
+            }
+            writeSettings(getSettingsStartAddress(), [](void* context, bool result, uint32_t address, uint16_t data_size) {
+                if (result) {
+                    NRF_LOG_INFO("Settings and %d bytes of records flashed", _newRecordsSize);
+                } else {
+                    NRF_LOG_ERROR("Error flashing settings");
+                }
+                finishSettings(result);
+            });
+        });
+    }
+
+    bool beginSettings(
+        const Settings& newSettings,
+        const void* records,
+        uint32_t recordsSize,
+        ProgramFlashNotification onProgramFinished) {
+
+        if (programming) {
+            NRF_LOG_ERROR("Already programming flash");
             return false;
         }
         _newSettings = (Settings*)malloc(sizeof(Settings));
         if (_newSettings == nullptr) {
             NRF_LOG_ERROR("Not enough ram to allocate copy of new settings");
-            free(_newData);
-            _newData = nullptr;
             return false;
         }
-        memcpy(_newData, &newData, sizeof(Data));
         memcpy(_newSettings, &newSettings, sizeof(Settings));
-        _programDataFunc = programFlashFunc;
+        _newRecords = records;
+        _newRecordsSize = recordsSize;
         _onProgramFinished = onProgramFinished;
+        beginProgramming(ProgrammingRegion_Settings);
+        return true;
+    }
 
-        uint32_t bufferSize = DataSet::computeDataSetDataSize(_newData);
-        if (availableDataSize() > bufferSize) {
-            beginProgramming();
+    bool programSettings(
+        const Settings& newSettings,
+        const void* records,
+        uint32_t recordsSize,
+        ProgramFlashNotification onProgramFinished) {
 
-            uint32_t totalSize = bufferSize + sizeof(Data) + sizeof(Settings);
-            uint32_t flashSize = Flash::getFlashByteSize(totalSize);
-            uint32_t pageAddress = Flash::getFlashStartAddress();
-            uint32_t pageCount = Flash::bytesToPages(flashSize);
+        uint32_t freeEnd;
+        if (findSettingsBackup(&freeEnd) != nullptr) {
+            // Programming it later would undo these settings
+            NRF_LOG_ERROR("Settings backup pending, restore it first");
+            return false;
+        }
+        if (!beginSettings(newSettings, records, recordsSize, onProgramFinished)) {
+            return false;
+        }
 
-            // Start by erasing the flash
-            Flash::erase(nullptr, pageAddress, pageCount, [](void* context, bool result, uint32_t address, uint16_t data_size) {
-                NRF_LOG_INFO("Erased %d pages", data_size);
-                if (result) {
-                    // Program settings
-                    Flash::write(nullptr, getSettingsStartAddress(), _newSettings, sizeof(Settings), [](void* context, bool result, uint32_t address, uint16_t data_size) {
-                        if (result) {
-                            NRF_LOG_INFO("Settings flashed");
-                            // Receive all the buffers directly to flash
-                            _programDataFunc([](void* context, bool result, uint32_t address, uint16_t data_size) {
-                                if (result) {
-                                    // Program the animation set itself
-                                    NRF_LOG_INFO("DataSet data flashed");
-                                    Flash::write(nullptr, getDataSetAddress(), _newData, sizeof(Data),
-                                        [](void* context, bool result, uint32_t address, uint16_t data_size) {
-                                            if (result) {
-                                                NRF_LOG_INFO("DataSet flashed");
-                                            } else {
-                                                NRF_LOG_ERROR("Error flashing dataset");
-                                            }
-                                            finishProgramming();
-                                            _onProgramFinished(result);
-                                    });
-                                } else {
-                                    NRF_LOG_ERROR("Error flashing DataSet data");
-                                    finishProgramming();
-                                    _onProgramFinished(false);
-                                }
-                            });
-                        } else {
-                            NRF_LOG_ERROR("Error flashing settings");
-                            finishProgramming();
-                            _onProgramFinished(false);
-                        }
-                    });
-                } else {
-                    NRF_LOG_ERROR("Error erasing flash");
-                    finishProgramming();
-                    _onProgramFinished(false);
-                }
-            });
+        _backupAddress = findSettingsBackupAddress(sizeof(Settings) + recordsSize);
+        if (_backupAddress == 0) {
+            NRF_LOG_WARNING("No room to back up the settings");
+            eraseAndWriteSettings();
             return true;
+        }
+
+        // Copy first, then switch
+        writeSettings(_backupAddress, [](void* context, bool result, uint32_t address, uint16_t data_size) {
+            if (!result) {
+                NRF_LOG_ERROR("Error backing up settings");
+                _backupAddress = 0;
+                finishProgramming(false);
+                return;
+            }
+            static SettingsBackupFooter footer;
+            footer.size = sizeof(Settings) + _newRecordsSize;
+            footer.crc = Utils::computeCrc32((const uint8_t*)_backupAddress, footer.size);
+            footer.marker = SETTINGS_BACKUP_PENDING;
+            Flash::write(nullptr, (uint32_t)getBackupFooter(_backupAddress), &footer, sizeof(footer),
+                [](void* context, bool result, uint32_t address, uint16_t data_size) {
+                    if (result) {
+                        eraseAndWriteSettings();
+                    } else {
+                        NRF_LOG_ERROR("Error backing up settings");
+                        _backupAddress = 0;
+                        finishProgramming(false);
+                    }
+                });
+        });
+        return true;
+    }
+
+    bool restoreSettings(ProgramFlashNotification onProgramFinished) {
+        uint32_t freeEnd;
+        const SettingsBackupFooter* lastUsed;
+        auto footer = findSettingsBackup(&freeEnd, &lastUsed);
+        if (footer == nullptr) {
+            // Settings are written last, their tail marker is still erased if the programming was cut
+            auto settings = (const Settings*)getSettingsStartAddress();
+            if (lastUsed == nullptr || settings->tailMarker != ERASED_WORD) {
+                return false;
+            }
+            NRF_LOG_WARNING("Settings programming was interrupted, restoring the last copy");
         } else {
+            NRF_LOG_WARNING("Settings programming was interrupted, restoring them");
+        }
+        auto copy = footer != nullptr ? footer : lastUsed;
+        uint32_t backupAddress = (uint32_t)copy - copy->size;
+        auto backupSettings = (const Settings*)backupAddress;
+        if (!beginSettings(*backupSettings, backupSettings + 1, copy->size - sizeof(Settings), onProgramFinished)) {
+            return false;
+        }
+        // A used copy is already marked done
+        _backupAddress = footer != nullptr ? backupAddress : 0;
+        eraseAndWriteSettings();
+        return true;
+    }
+
+    bool programWrite(uint32_t address, const void* data, uint32_t size, ProgramFlashNotification onProgramFinished) {
+        if (programming) {
+            NRF_LOG_ERROR("Already programming flash");
+            return false;
+        }
+        programming = true;
+        _onProgramFinished = onProgramFinished;
+        Flash::write(nullptr, address, data, size, [](void* context, bool result, uint32_t address, uint16_t data_size) {
+            // Nothing was erased, clients aren't notified
+            programming = false;
+            _onProgramFinished(result);
+        });
+        return true;
+    }
+
+    bool programErased(ProgramFlashFunc programFlashFunc, ProgramFlashNotification onProgramFinished) {
+        if (programming) {
+            NRF_LOG_ERROR("Already programming flash");
+            return false;
+        }
+        programming = true;
+        _programDataFunc = programFlashFunc;
+        _onProgramFinished = onProgramFinished;
+        _programDataFunc([](void* context, bool result, uint32_t address, uint16_t data_size) {
+            programming = false;
+            _onProgramFinished(result);
+        });
+        return true;
+    }
+
+    bool programDataSet(
+        const Data& newData,
+        ProgramFlashFunc programFlashFunc,
+        ProgramFlashNotification onProgramFinished) {
+
+        if (programming) {
+            NRF_LOG_ERROR("Already programming flash");
+            return false;
+        }
+        uint32_t bufferSize = DataSet::computeDataSetDataSize(&newData);
+        if (availableDataSize() <= bufferSize) {
             NRF_LOG_ERROR("Not enough available flash");
             return false;
         }
+        _newData = (Data*)malloc(sizeof(Data));
+        if (_newData == nullptr) {
+            NRF_LOG_ERROR("Not enough ram to allocate copy of new data");
+            return false;
+        }
+        memcpy(_newData, &newData, sizeof(Data));
+        _programDataFunc = programFlashFunc;
+        _onProgramFinished = onProgramFinished;
+
+        beginProgramming(ProgrammingRegion_DataSet);
+
+        // Start by erasing the whole region, along with whatever was stored after the previous
+        // dataset, settings are left alone
+        uint32_t pageCount = (getFlashEndAddress() - getDataSetAddress()) / getPageSize();
+        Flash::erase(nullptr, getDataSetAddress(), pageCount, [](void* context, bool result, uint32_t address, uint16_t data_size) {
+            NRF_LOG_INFO("Erased %d dataset pages", data_size);
+            if (result) {
+                // Receive all the buffers directly to flash
+                _programDataFunc([](void* context, bool result, uint32_t address, uint16_t data_size) {
+                    if (result) {
+                        // Never commit data that would crash later on
+                        NRF_LOG_INFO("DataSet data flashed");
+                        if (!DataSet::validateData(_newData, getDataSetDataAddress())) {
+                            NRF_LOG_ERROR("Invalid dataset, not committed");
+                            finishProgramming(false);
+                            return;
+                        }
+
+                        // Hash what was actually written, so it doesn't have to be recomputed on boot
+                        auto dataPtr = (const uint8_t*)getDataSetDataAddress();
+                        uint32_t dataSize = DataSet::computeDataSetDataSize(_newData);
+                        _newData->dataHash = Utils::computeHash(dataPtr, dataSize);
+                        _newData->dataCrc = Utils::computeCrc32(dataPtr, dataSize);
+
+                        // Program the animation set itself, this is what makes the dataset valid
+                        Flash::write(nullptr, getDataSetAddress(), _newData, sizeof(Data),
+                            [](void* context, bool result, uint32_t address, uint16_t data_size) {
+                                if (result) {
+                                    NRF_LOG_INFO("DataSet flashed");
+                                } else {
+                                    NRF_LOG_ERROR("Error flashing dataset");
+                                }
+                                finishProgramming(result);
+                        });
+                    } else {
+                        NRF_LOG_ERROR("Error flashing DataSet data");
+                        finishProgramming(false);
+                    }
+                });
+            } else {
+                NRF_LOG_ERROR("Error erasing flash");
+                finishProgramming(false);
+            }
+        });
+        return true;
     }
 
     uint32_t getDataSetAddress() {
+        // The dataset starts on the page after the settings
         return getSettingsEndAddress();
     }
 
@@ -316,10 +610,18 @@ namespace DriversNRF::Flash
     uint32_t getSettingsStartAddress() {
         return (uint32_t)Flash::getFlashStartAddress();
     }
-    uint32_t getSettingsEndAddress() {
+    uint32_t getSettingsRecordsAddress() {
+        // Settings size is a multiple of 4, as required for flash writes
         return getSettingsStartAddress() + sizeof(Settings);
     }
+    uint32_t getSettingsEndAddress() {
+        // The dataset starts on the next page, so either can be erased without the other
+        return getSettingsStartAddress() + getFlashByteSize(sizeof(Settings));
+    }
 
+    bool isBusy() {
+        return programming || nrf_fstorage_is_busy(&fstorage);
+    }
 
     void hookProgrammingEvent(ProgrammingEventMethod client, void* param)
     {
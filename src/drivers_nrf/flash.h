@@ -34,21 +34,60 @@ namespace DriversNRF
         uint32_t bytesToPages(uint32_t size);
         uint32_t getFlashByteSize(uint32_t totalDataByteSize);
 
+        // Flash is split in page aligned regions, each programmed on its own:
+        // [Settings|Key value records][DataSet]
+        // The records need the rest of the settings page, so the dataset can't start right after
+        // the settings anymore. With the 2 pages of the release layout (0x26000-0x28000) that
+        // leaves one page, about 4KB, for the dataset instead of about 7.7KB. The app reads that
+        // limit from availableFlash in the IAmADie message and must fit its profiles to it.
         uint32_t getDataSetAddress();
         uint32_t getDataSetDataAddress();
         uint32_t getSettingsStartAddress();
+        uint32_t getSettingsRecordsAddress();
         uint32_t getSettingsEndAddress();
 
+        // Whether a flash operation or a programming sequence is in progress
+        bool isBusy();
+
         typedef void (*ProgramFlashNotification)(bool result);
         typedef void (*ProgramFlashFuncCallback)(void* context, bool result, uint32_t address, uint16_t size);
         typedef void (*ProgramFlashFunc)(ProgramFlashFuncCallback callback);
 
-        bool programFlash(
-            const DataSet::Data& newData,
+        // Only erases and rewrites the settings pages, the records (if any) are written
+        // right after the settings and must stay valid until programming is finished.
+        // The new content is first copied to the end of the dataset region when there is room,
+        // see canBackupSettings(), so that an interrupted programming can be restored on boot.
+        bool programSettings(
             const Config::Settings& newSettings,
-            ProgramFlashFunc programFlashFunc,
+            const void* records,
+            uint32_t recordsSize,
             ProgramFlashNotification onProgramFinished);
 
+        // Whether programSettings() will back up settings followed by records of the given size
+        bool canBackupSettings(uint32_t recordsSize);
+
+        // Whether the last copy used by programSettings() is intact and holds the given settings.
+        // If programming without a new copy is interrupted, that copy is restored on boot instead,
+        // with the records it was made with.
+        bool hasSettingsBackup(const Config::Settings& settings);
+
+        // Programs the settings again if their programming was interrupted, returns false if it wasn't
+        bool restoreSettings(ProgramFlashNotification onProgramFinished);
+
+        // Writes to erased flash without erasing anything, so programming clients aren't notified,
+        // but still not while a region is programmed. The data must stay valid until it is finished.
+        bool programWrite(uint32_t address, const void* data, uint32_t size, ProgramFlashNotification onProgramFinished);
+
+        // Same as programWrite() for a sequence of writes, programFlashFunc may take its time
+        // (i.e. receive the data) and calls back once it's done, nothing else is programmed meanwhile
+        bool programErased(ProgramFlashFunc programFlashFunc, ProgramFlashNotification onProgramFinished);
+
+        // Erases the dataset region, programFlashFunc writes the data at getDataSetDataAddress()
+        // and the header is written last, once the data is validated
+        bool programDataSet(
+            const DataSet::Data& newData,
+            ProgramFlashFunc programFlashFunc,
+            ProgramFlashNotification onProgramFinished);
 
         enum ProgrammingEventType
         {
@@ -56,7 +95,13 @@ namespace DriversNRF
             ProgrammingEventType_End
         };
 
-        typedef void (*ProgrammingEventMethod)(void* param, ProgrammingEventType evt);
+        enum ProgrammingRegion
+        {
+            ProgrammingRegion_Settings = 0,
+            ProgrammingRegion_DataSet,
+        };
+
+        typedef void (*ProgrammingEventMethod)(void* param, ProgrammingEventType evt, ProgrammingRegion region);
         void hookProgrammingEvent(ProgrammingEventMethod client, void* param);
         void unhookProgrammingEvent(ProgrammingEventMethod client);
 
@@ -2,34 +2,68 @@
 #include "nrf_drv_twi.h"
 #include "app_error.h"
 #include "app_error_weak.h"
+#include "app_util_platform.h"
+#include "string.h"
 #include "config/board_config.h"
 #include "nrf_log.h"
 #include "drivers_nrf/gpiote.h"
+#include "drivers_nrf/scheduler.h"
 
 namespace DriversNRF::I2C
 {
+    #define MAX_TRANSACTIONS 4      // Queued transfers, the accelerometer only ever needs one or two
+    #define MAX_TX_SIZE 2           // Register address + one data byte
+    #define MAX_FAST_MODE_ERRORS 2  // Transfer errors at 400kHz before falling back to 100kHz
+    #define TWI_IRQ_PRIORITY APP_IRQ_PRIORITY_HIGH
+    #define TWI_IRQn SPIM0_SPIS0_TWIM0_TWIS0_SPI0_TWI0_IRQn
+    #define TWI_IRQHandler SPIM0_SPIS0_TWIM0_TWIS0_SPI0_TWI0_IRQHandler
+
     /* TWI instance. */
     static const nrf_drv_twi_t m_twi = NRF_DRV_TWI_INSTANCE(0);
 
+    // A single queued transfer, optionally a write followed by a read (with repeated start)
+    struct Transaction
+    {
+        uint8_t device;
+        uint8_t flags;
+        uint8_t txSize;
+        uint8_t txData[MAX_TX_SIZE]; // EasyDMA can only read from RAM, so small writes are copied here
+        const uint8_t* txPtr;
+        uint8_t* rxPtr;
+        size_t rxSize;
+        TransactionCallback callback;
+        void* context;
+        bool retried;
+    };
+
+    static Transaction transactions[MAX_TRANSACTIONS];
+    static volatile int transactionsHead = 0;
+    static volatile int transactionsCount = 0;
+    static volatile bool transferInProgress = false;
+
+    static nrf_drv_twi_frequency_t frequency = NRF_DRV_TWI_FREQ_400K;
+    static int fastModeErrors = 0;
+    static volatile bool fallbackPending = false; // No transfer is started until the bus is reinitialized
+
     // Test
     void scanBus(); 
 
+    void twiEventHandler(nrf_drv_twi_evt_t const* p_event, void* p_context);
+    extern "C" void TWI_IRQHandler(void);
+    void startNextTransaction();
 
-    void init()
-    {
+    void initTWI() {
         auto board = Config::BoardManager::getBoard();
 
-        nrf_drv_twi_frequency_t freq = NRF_DRV_TWI_FREQ_100K;
-
         const nrf_drv_twi_config_t twi_config = {
             .scl                = board->i2cClockPin,
             .sda                = board->i2cDataPin,
-            .frequency          = freq,
-            .interrupt_priority = APP_IRQ_PRIORITY_HIGH,
+            .frequency          = frequency,
+            .interrupt_priority = TWI_IRQ_PRIORITY,
             .clear_bus_init     = false
         };
 
-        auto err = nrf_drv_twi_init(&m_twi, &twi_config, NULL, NULL);
+        auto err = nrf_drv_twi_init(&m_twi, &twi_config, twiEventHandler, nullptr);
         if (err != NRF_SUCCESS) {
             NRF_LOG_ERROR("I2C Initialization Failed, err=0x%x", err);
         }
@@ -37,10 +71,22 @@ namespace DriversNRF::I2C
         // Enable the interface
         // No return value to check
         nrf_drv_twi_enable(&m_twi);
+    }
+
+    void init()
+    {
+        transactionsHead = 0;
+        transactionsCount = 0;
+        transferInProgress = false;
+        fastModeErrors = 0;
+        fallbackPending = false;
+        frequency = NRF_DRV_TWI_FREQ_400K;
+
+        initTWI();
 
         //scanBus();
 
-        NRF_LOG_INFO("I2C init freq: %d", (int)freq);
+        NRF_LOG_INFO("I2C init, 400kHz");
     }
 
     void deinit()
@@ -49,6 +95,183 @@ namespace DriversNRF::I2C
         nrf_drv_twi_disable(&m_twi);
     }
 
+    /// <summary>
+    /// Reinitialize the bus at 100kHz after too many errors at 400kHz. The driver can't be
+    /// reinitialized from its own event handler, so this runs from the scheduler (or from
+    /// a blocking transfer waiting on the queue), once the transfer in progress is over.
+    /// </summary>
+    void fallbackToStandardMode()
+    {
+        bool apply = false;
+        CRITICAL_REGION_ENTER();
+        apply = fallbackPending && !transferInProgress;
+        CRITICAL_REGION_EXIT();
+
+        if (apply) {
+            NRF_LOG_WARNING("I2C errors at 400kHz, falling back to 100kHz");
+            nrf_drv_twi_disable(&m_twi);
+            nrf_drv_twi_uninit(&m_twi);
+            frequency = NRF_DRV_TWI_FREQ_100K;
+            initTWI();
+            fallbackPending = false;
+            startNextTransaction();
+        }
+    }
+
+    /// <summary>
+    /// Kick off the transfer at the head of the queue, if any and if the bus is free
+    /// </summary>
+    void startNextTransaction()
+    {
+        bool start = false;
+        CRITICAL_REGION_ENTER();
+        start = !transferInProgress && !fallbackPending && transactionsCount > 0;
+        if (start) {
+            transferInProgress = true;
+        }
+        CRITICAL_REGION_EXIT();
+
+        if (start) {
+            auto& t = transactions[transactionsHead];
+            ret_code_t err;
+            if (t.txSize > 0 && t.rxSize > 0) {
+                nrf_drv_twi_xfer_desc_t desc = NRF_DRV_TWI_XFER_DESC_TXRX(t.device, (uint8_t*)t.txPtr, t.txSize, t.rxPtr, t.rxSize);
+                err = nrf_drv_twi_xfer(&m_twi, &desc, t.flags);
+            } else if (t.txSize > 0) {
+                nrf_drv_twi_xfer_desc_t desc = NRF_DRV_TWI_XFER_DESC_TX(t.device, (uint8_t*)t.txPtr, t.txSize);
+                err = nrf_drv_twi_xfer(&m_twi, &desc, t.flags);
+            } else {
+                nrf_drv_twi_xfer_desc_t desc = NRF_DRV_TWI_XFER_DESC_RX(t.device, t.rxPtr, t.rxSize);
+                err = nrf_drv_twi_xfer(&m_twi, &desc, t.flags);
+            }
+            if (err != NRF_SUCCESS) {
+                // Transfer didn't start, fake the completion event so the queue keeps going
+                NRF_LOG_ERROR("I2C Transfer Error 0x%x", err);
+                nrf_drv_twi_evt_t evt;
+                evt.type = NRF_DRV_TWI_EVT_ADDRESS_NACK;
+                twiEventHandler(&evt, nullptr);
+            }
+        }
+    }
+
+    void twiEventHandler(nrf_drv_twi_evt_t const* p_event, void* p_context)
+    {
+        auto& t = transactions[transactionsHead];
+        bool result = p_event->type == NRF_DRV_TWI_EVT_DONE;
+        if (!result) {
+            NRF_LOG_ERROR("I2C Transfer Error, event %d", p_event->type);
+            if (frequency == NRF_DRV_TWI_FREQ_400K && !fallbackPending && ++fastModeErrors >= MAX_FAST_MODE_ERRORS) {
+                fallbackPending = true;
+                Scheduler::push(nullptr, 0, [](void* data, uint16_t size) {
+                    fallbackToStandardMode();
+                });
+            }
+
+            // Give each transaction a second chance
+            if (!t.retried) {
+                t.retried = true;
+                transferInProgress = false;
+                startNextTransaction();
+                return;
+            }
+        }
+
+        // Pop the transaction before notifying, the callback may queue another one
+        auto callback = t.callback;
+        auto context = t.context;
+        CRITICAL_REGION_ENTER();
+        transactionsHead = (transactionsHead + 1) % MAX_TRANSACTIONS;
+        transactionsCount--;
+        transferInProgress = false;
+        CRITICAL_REGION_EXIT();
+
+        if (callback != nullptr) {
+            callback(context, result);
+        }
+
+        startNextTransaction();
+    }
+
+    /// <summary>
+    /// Add a transaction to the queue and start it if the bus is idle
+    /// txData is copied when small enough, otherwise it must stay valid until completion
+    /// </summary>
+    bool enqueue(uint8_t device, const uint8_t* txData, size_t txSize, uint8_t* rxData, size_t rxSize, uint8_t flags, TransactionCallback callback, void* context)
+    {
+        bool ret = false;
+        CRITICAL_REGION_ENTER();
+        ret = transactionsCount < MAX_TRANSACTIONS;
+        if (ret) {
+            auto& t = transactions[(transactionsHead + transactionsCount) % MAX_TRANSACTIONS];
+            t.device = device;
+            t.flags = flags;
+            t.txSize = (uint8_t)txSize;
+            if (txSize <= MAX_TX_SIZE) {
+                memcpy(t.txData, txData, txSize);
+                t.txPtr = t.txData;
+            } else {
+                t.txPtr = txData;
+            }
+            t.rxPtr = rxData;
+            t.rxSize = rxSize;
+            t.callback = callback;
+            t.context = context;
+            t.retried = false;
+            transactionsCount++;
+        }
+        CRITICAL_REGION_EXIT();
+
+        if (ret) {
+            startNextTransaction();
+        } else {
+            NRF_LOG_ERROR("I2C transaction queue full");
+        }
+        return ret;
+    }
+
+    /// <summary>
+    /// Whether the TWI interrupt can preempt the caller. It can't from an interrupt of the same
+    /// or higher priority, nor with interrupts masked or inside a critical region.
+    /// </summary>
+    bool canWaitForInterrupt()
+    {
+        return current_int_priority_get() > TWI_IRQ_PRIORITY && __get_PRIMASK() == 0 && NVIC_GetEnableIRQ(TWI_IRQn);
+    }
+
+    /// <summary>
+    /// Queue a transaction and busy-wait until it completes. When the TWI interrupt
+    /// can't preempt the caller, its handler is polled instead.
+    /// </summary>
+    bool transferBlocking(uint8_t device, const uint8_t* txData, size_t txSize, uint8_t* rxData, size_t rxSize, uint8_t flags)
+    {
+        struct Completion
+        {
+            volatile bool done;
+            volatile bool result;
+        };
+        Completion completion = { false, false };
+        if (!enqueue(device, txData, txSize, rxData, rxSize, flags, [](void* context, bool result) {
+            auto c = (Completion*)context;
+            c->result = result;
+            c->done = true;
+        }, &completion)) {
+            return false;
+        }
+
+        const bool polled = !canWaitForInterrupt();
+        while (!completion.done) {
+            if (fallbackPending) {
+                // The scheduler won't run while we wait
+                fallbackToStandardMode();
+            }
+            if (polled && NVIC_GetPendingIRQ(TWI_IRQn)) {
+                NVIC_ClearPendingIRQ(TWI_IRQn);
+                TWI_IRQHandler();
+            }
+        }
+        return completion.result;
+    }
+
     bool write(uint8_t device, uint8_t value, bool no_stop)
     {
         return write(device, &value, 1, no_stop);
@@ -56,11 +279,7 @@ namespace DriversNRF::I2C
 
     bool write(uint8_t device, const uint8_t* data, size_t size, bool no_stop)
     {
-        auto err = nrf_drv_twi_tx(&m_twi, device, data, size, no_stop);
-        if (err != NRF_SUCCESS) {
-            NRF_LOG_ERROR("I2C Write Error 0x%x", err);
-        }
-        return err == NRF_SUCCESS;
+        return transferBlocking(device, data, size, nullptr, 0, no_stop ? NRF_DRV_TWI_FLAG_TX_NO_STOP : 0);
     }
 
     bool read(uint8_t device, uint8_t* value)
@@ -70,11 +289,12 @@ namespace DriversNRF::I2C
 
     bool read(uint8_t device, uint8_t* data, size_t size)
     {
-        auto err = nrf_drv_twi_rx(&m_twi, device, data, size);
-        if (err != NRF_SUCCESS) {
-            NRF_LOG_ERROR("I2C Read Error 0x%x", err);
-        }
-        return err == NRF_SUCCESS;
+        return transferBlocking(device, nullptr, 0, data, size, 0);
+    }
+
+    bool readRegistersAsync(uint8_t device, uint8_t reg, uint8_t* buffer, uint8_t len, TransactionCallback callback, void* context)
+    {
+        return enqueue(device, &reg, 1, buffer, len, 0, callback, context);
     }
 
     /// <summary>
@@ -95,9 +315,8 @@ namespace DriversNRF::I2C
     /// </summary>
     uint8_t readRegister(uint8_t device, uint8_t reg)
     {
-        write(device, reg, true);
         uint8_t ret = 0;
-        read(device, &ret, 1);
+        transferBlocking(device, &reg, 1, &ret, 1, 0);
         return ret;
     }
 
@@ -108,8 +327,7 @@ namespace DriversNRF::I2C
     /// </summary>
     void readRegisters(uint8_t device, uint8_t reg, uint8_t *buffer, uint8_t len)
     {
-        write(device, reg, true);
-        read(device, buffer, len);
+        transferBlocking(device, &reg, 1, buffer, len, 0);
     }
 
     /// <summary>
@@ -141,7 +359,6 @@ namespace DriversNRF::I2C
     }
 
     void scanBus() {
-        ret_code_t err_code;
         uint8_t address;
         uint8_t sample_data;
 
@@ -151,8 +368,7 @@ namespace DriversNRF::I2C
             for (address = 1; address <= 127; address++)
             {
                 NRF_LOG_INFO("Testing address 0x%x.", address);
-                err_code = nrf_drv_twi_rx(&m_twi, address, &sample_data, sizeof(sample_data));
-                if (err_code == NRF_SUCCESS)
+                if (read(address, &sample_data, sizeof(sample_data)))
                 {
                     detected_device = true;
                     NRF_LOG_INFO("I2C device detected at address 0x%x.", address);
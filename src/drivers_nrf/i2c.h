@@ -7,6 +7,8 @@ namespace DriversNRF
 {
     /// <summary>
     /// Wrapper for the Wire library that is set to use the Die pins
+    /// Transfers are queued and run by the TWIM peripheral (EasyDMA), the blocking
+    /// functions simply wait for their own transaction to complete.
     /// </summary>
     namespace I2C
     {
@@ -23,6 +25,10 @@ namespace DriversNRF
         void readRegisters(uint8_t device, uint8_t reg, uint8_t *buffer, uint8_t len);
         int16_t readRegisterInt16(uint8_t device, uint8_t reg);
         uint16_t readRegisterUInt16(uint8_t device, uint8_t reg);
+
+        // Non-blocking transactions, the callback is invoked from the TWI interrupt
+        // once the transfer is over. Callbacks must not use the blocking functions above.
+        typedef void (*TransactionCallback)(void* context, bool result);
+        bool readRegistersAsync(uint8_t device, uint8_t reg, uint8_t* buffer, uint8_t len, TransactionCallback callback, void* context);
     }
 }
-
@@ -101,6 +101,16 @@ namespace DriversNRF::Timers
         return APP_TIMER_MS(ticks);
     }
 
+    uint32_t ticks()
+    {
+        return (uint32_t)get_now();
+    }
+
+    uint32_t ticksToMicros(uint32_t ticks)
+    {
+        return (uint32_t)ROUNDED_DIV((uint64_t)ticks * 1000000 * (APP_TIMER_CONFIG_RTC_FREQUENCY + 1), (uint64_t)APP_TIMER_CLOCK_FREQ);
+    }
+
     void delayedCallbacksTimerCallback(void* ignore) {
         int time = millis();
         do
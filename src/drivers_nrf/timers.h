@@ -17,6 +17,8 @@ namespace DriversNRF
         void resume(void);
         void selfTest();
         int millis();
+        uint32_t ticks(); // RTC ticks, finer grained than millis() for measuring short durations
+        uint32_t ticksToMicros(uint32_t ticks);
 
         typedef void (*DelayedCallback)(void* param);
         bool setDelayedCallback(DelayedCallback callback, void* param, int periodMs);
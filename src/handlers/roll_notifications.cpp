@@ -11,11 +11,13 @@ namespace Handlers::RollNotifications
 {
     void requestRollStateHandler(const Message *message);
     void onRollStateChange(void *token, Accelerometer::RollState prevRollState, int prevFace, Accelerometer::RollState newRollState, int newFace);
+    void onProvisionalRoll(void *token, Accelerometer::ProvisionalRollEvent event, int face);
 
     void init() {
         // We always send roll events over Bluetooth when connected
         MessageService::RegisterMessageHandler(Message::MessageType_RequestRollState, requestRollStateHandler);
         Accelerometer::hookRollState(onRollStateChange, nullptr);
+        Accelerometer::hookProvisionalRoll(onProvisionalRoll, nullptr);
 
         NRF_LOG_DEBUG("Roll notifications init");
     }
@@ -40,4 +42,16 @@ namespace Handlers::RollNotifications
     void onRollStateChange(void *token, Accelerometer::RollState prevRollState, int prevFace, Accelerometer::RollState newRollState, int newFace) {
         sendRollState(newRollState, newFace);
     }
+
+    void onProvisionalRoll(void *token, Accelerometer::ProvisionalRollEvent event, int face) {
+        // Lets the app show the result a sample early, it must wait for the confirmation
+        // (followed by the Rolled state) before treating it as final
+        if (MessageService::isConnected()) {
+            NRF_LOG_DEBUG("Sending provisional roll event: %d, face: %d", event, face);
+            MessageProvisionalRoll provisionalRollMsg;
+            provisionalRollMsg.event = (uint8_t)event;
+            provisionalRollMsg.face = (uint8_t)face;
+            MessageService::SendMessage(&provisionalRollMsg);
+        }
+    }
 }
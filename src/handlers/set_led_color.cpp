@@ -28,8 +28,8 @@ namespace Handlers::SetLEDColor
     void BlinkIdHandler(const Message *msg);
 
     void init() {
-        MessageService::RegisterMessageHandler(Message::MessageType_SetLEDToColor, SetLEDToColorHandler);
-        MessageService::RegisterMessageHandler(Message::MessageType_SetAllLEDsToColor, SetAllLEDsToColorHandler);
+        MessageService::RegisterFastMessageHandler(Message::MessageType_SetLEDToColor, SetLEDToColorHandler);
+        MessageService::RegisterFastMessageHandler(Message::MessageType_SetAllLEDsToColor, SetAllLEDsToColorHandler);
         MessageService::RegisterMessageHandler(Message::MessageType_LightUpFace, LightUpFaceHandler);
         MessageService::RegisterMessageHandler(Message::MessageType_Blink, BlinkLEDsHandler);
         MessageService::RegisterMessageHandler(Message::MessageType_BlinkId, BlinkIdHandler);
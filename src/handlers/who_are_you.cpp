@@ -31,7 +31,6 @@ namespace Handlers::WhoAreYou
         msg.dieType = SettingsManager::getDieType();
 #else
         // Die info
-        auto settings = SettingsManager::getSettings();
         msg.dieInfo.pixelId = Pixel::getDeviceID();
         msg.dieInfo.chipModel = ChipModel_nRF52810;
         msg.dieInfo.dieType = SettingsManager::getDieType();
@@ -40,12 +39,12 @@ namespace Handlers::WhoAreYou
         msg.dieInfo.runMode = Pixel::getCurrentRunMode();
         memset(msg.customDesignAndColorName.name, 0, sizeof(msg.customDesignAndColorName.name));
         memset(msg.dieName.name, 0, sizeof(msg.dieName.name));
-        strncpy(msg.dieName.name, settings->name, sizeof(msg.dieName.name)); // No need to add the null terminator
+        strncpy(msg.dieName.name, SettingsManager::getName(), sizeof(msg.dieName.name)); // No need to add the null terminator
 
         // Settings info
         msg.settingsInfo.profileDataHash = DataSet::dataHash();
         msg.settingsInfo.availableFlash = DataSet::availableDataSize();
-        msg.settingsInfo.totalUsableFlash = Flash::getUsableBytes();
+        msg.settingsInfo.totalUsableFlash = Flash::getFlashEndAddress() - Flash::getDataSetDataAddress(); // The settings page can't hold profile data
 
         // Status info
         msg.statusInfo.batteryLevelPercent = BatteryController::getLevelPercent();
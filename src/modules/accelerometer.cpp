@@ -19,6 +19,7 @@
 #include "drivers_nrf/flash.h"
 #include "drivers_nrf/scheduler.h"
 #include "leds.h"
+#include "motion_features.h"
 #include "validation_manager.h"
 #include "malloc.h"
 
@@ -31,19 +32,51 @@ using namespace Config;
 using namespace Bluetooth;
 
 // This defines how frequently we try to read the accelerometer
-#define MAX_FRAMEDATA_CLIENTS 1
+#define MAX_FRAMEDATA_CLIENTS 2 // Roll trace recorder + telemetry
 #define MAX_ACC_CLIENTS 8
-#define MAX_ACCELERATION_FRAMES 3
+#ifndef MAX_ACCELERATION_FRAMES
+#define MAX_ACCELERATION_FRAMES 3   // The counts below keep the cost per frame the same for larger windows
+#endif
+#define ROLLING_MIN_FRAMES (MAX_ACCELERATION_FRAMES - 1) // Rolling frames needed to consider we're rolling
 
 #define ABS(x) ((x) < 0 ? -(x) : (x))
+#define MAX_PROVISIONAL_ROLL_CLIENTS 1 // Roll notifications
+
+// Settle prediction parameters
+#define SETTLE_CONE_COS_TIMES1000 940       // Gravity must be within ~20 degrees of the face normal...
+#define SETTLE_MAGNITUDE_TOLERANCE_TIMES1000 150 // ...with a magnitude close to 1g...
+#define SETTLE_TIME_MS 150                  // ...for at least this long, i.e. on the second sample in the
+                                            // cone at 6.25Hz. Rolled needs 3 still samples, so on a clean
+                                            // landing the prediction comes one sample (160ms) earlier.
 
 namespace Modules::Accelerometer
 {
-    // This stores a few frames of acceleration data
-    static AccelFrame frames[MAX_ACCELERATION_FRAMES];
+    // This stores a few frames of acceleration data, oldest first
+    static RingBuffer<AccelFrame, MAX_ACCELERATION_FRAMES> frames;
+
+    // Running counts of the estimated states in the frames above,
+    // updated as frames enter and leave the window
+    struct FrameCounts
+    {
+        int onFace;
+        int handling;
+        int rolling;
+        int agitated;
+    };
+    static FrameCounts counts;
 
     static DelegateArray<FrameDataClientMethod, MAX_FRAMEDATA_CLIENTS> frameDataClients;
     static DelegateArray<RollStateClientMethod, MAX_ACC_CLIENTS> rollStateClients;
+    static DelegateArray<ProvisionalRollClientMethod, MAX_PROVISIONAL_ROLL_CLIENTS> provisionalRollClients;
+
+    // Settle prediction state
+    struct SettlePrediction
+    {
+        int coneFace;           // Face whose cone the gravity vector is in, -1 if none
+        uint32_t coneEntryTime; // When gravity entered that cone
+        int predictedFace;      // Face of the pending prediction, -1 if none
+    };
+    static SettlePrediction prediction = { -1, 0, -1 };
 
     enum State {
         State_Unknown = 0,
@@ -56,7 +89,7 @@ namespace Modules::Accelerometer
 
     void calibrateHandler(const Message *msg);
     void calibrateFaceHandler(const Message *msg);
-    void onSettingsProgrammingEvent(void *context, Flash::ProgrammingEventType evt);
+    void onSettingsProgrammingEvent(void *context, Flash::ProgrammingEventType evt, Flash::ProgrammingRegion region);
     void readAccelerometer(int3 *acc);
     void accHandler(const int3 &acc);
     void update(void *context);
@@ -70,6 +103,83 @@ namespace Modules::Accelerometer
         return(MAX(abs_diffs.xTimes1000, MAX(abs_diffs.yTimes1000, abs_diffs.zTimes1000)));
     }
 
+    // Adds (delta = 1) or removes (delta = -1) a frame from the running counts, using the
+    // states it was given when it entered the window, whatever the settings are now
+    void countFrame(const AccelFrame& frame, int delta) {
+        switch (frame.estimatedRollState) {
+            case EstimatedRollState_OnFace:
+                counts.onFace += delta;
+                break;
+            case EstimatedRollState_Handling:
+                counts.handling += delta;
+                break;
+            case EstimatedRollState_Rolling:
+                counts.rolling += delta;
+                break;
+            default:
+                break;
+        }
+        if (frame.agitated) {
+            counts.agitated += delta;
+        }
+    }
+
+    void notifyProvisionalRoll(ProvisionalRollEvent event, int face) {
+        for (int i = 0; i < provisionalRollClients.Count(); ++i) {
+            provisionalRollClients[i].handler(provisionalRollClients[i].token, event, face);
+        }
+    }
+
+    // Predicts the roll result before the state machine has seen enough still frames,
+    // and confirms or retracts that prediction once it has decided
+    void updateSettlePrediction(const AccelFrame& frame) {
+        auto settings = SettingsManager::getSettings();
+        int magDiffTimes1000 = frame.acc.magnitudeTimes1000() - 1000;
+        bool inCone = frame.faceConfidenceTimes1000 >= SETTLE_CONE_COS_TIMES1000 &&
+            magDiffTimes1000 < SETTLE_MAGNITUDE_TOLERANCE_TIMES1000 &&
+            magDiffTimes1000 > -SETTLE_MAGNITUDE_TOLERANCE_TIMES1000 &&
+            frame.agitationTimes1000 < settings->middleThresholdTimes1000;
+        if (!inCone) {
+            prediction.coneFace = -1;
+        } else if (prediction.coneFace != frame.face) {
+            prediction.coneFace = frame.face;
+            prediction.coneEntryTime = frame.time;
+        }
+
+        if (prediction.predictedFace >= 0) {
+            int face = prediction.predictedFace;
+            if (frame.determinedRollState == RollState_Rolled && frame.face == face) {
+                prediction.predictedFace = -1;
+                notifyProvisionalRoll(ProvisionalRollEvent_Confirmed, face);
+            } else if (frame.determinedRollState != RollState_Rolling || prediction.coneFace != face) {
+                prediction.predictedFace = -1;
+                notifyProvisionalRoll(ProvisionalRollEvent_Retracted, face);
+            }
+        } else if (frame.determinedRollState == RollState_Rolling && prediction.coneFace >= 0 &&
+            frame.time - prediction.coneEntryTime >= SETTLE_TIME_MS) {
+            prediction.predictedFace = prediction.coneFace;
+            notifyProvisionalRoll(ProvisionalRollEvent_Predicted, prediction.predictedFace);
+        }
+    }
+
+    // Fills the whole history with the given frame
+    void resetFrames(const AccelFrame& frame) {
+        MotionFeatures::reset(frame.acc);
+        memset(&counts, 0, sizeof(counts));
+
+        // History is gone, so is any pending prediction
+        prediction.coneFace = -1;
+        if (prediction.predictedFace >= 0) {
+            int face = prediction.predictedFace;
+            prediction.predictedFace = -1;
+            notifyProvisionalRoll(ProvisionalRollEvent_Retracted, face);
+        }
+        for (int i = 0; i < MAX_ACCELERATION_FRAMES; ++i) {
+            frames.push(frame);
+            countFrame(frame, 1);
+        }
+    }
+
     void init(InitCallback callback) {
         static InitCallback _callback; // Don't initialize this static inline because it would only do it on first call!
         _callback = callback;
@@ -107,7 +217,7 @@ namespace Modules::Accelerometer
 
         // Use calibrated normals, not canonical ones
         auto settings = SettingsManager::getSettings();
-        auto &normals = settings->faceNormals;
+        auto normals = SettingsManager::getFaceNormals();
 
         // First check that the acceleration is not too low
         int accMagTimes1000 = acc.magnitudeTimes1000();
@@ -140,96 +250,95 @@ namespace Modules::Accelerometer
 
     void accHandler(void *param, const int3 &acc) {
         auto settings = SettingsManager::getSettings();
+        const AccelFrame& prevFrame = frames.last();
 
-        // Shift acceleration data back
-        for (int i = MAX_ACCELERATION_FRAMES-1; i >= 1; --i) {
-            frames[i] = frames[i-1];
-        }
+        // Update the motion features with the new reading
+        MotionFeatures::Features features;
+        MotionFeatures::update(acc, &features);
 
-        // Now frame 0 will receive the new data
-        frames[0].time = DriversNRF::Timers::millis();
-        frames[0].acc = acc;
-        frames[0].agitationTimes1000 = agitation(acc, frames[1].acc);
-        frames[0].face = determineFace(acc, &frames[0].faceConfidenceTimes1000, frames[1].face);
+        // Build the new frame from the previous one
+        AccelFrame newFrame;
+        newFrame.time = DriversNRF::Timers::millis();
+        newFrame.acc = acc;
+        newFrame.agitationTimes1000 = agitation(acc, prevFrame.acc);
+        newFrame.agitated = newFrame.agitationTimes1000 > settings->upperThresholdTimes1000;
+        newFrame.face = determineFace(acc, &newFrame.faceConfidenceTimes1000, prevFrame.face);
 
-        bool onFace = frames[0].faceConfidenceTimes1000 > settings->faceThresholdTimes1000
+        bool onFace = newFrame.faceConfidenceTimes1000 > settings->faceThresholdTimes1000
             || SettingsManager::getDieType() != DiceVariants::DieType_D4;
+
+        // Over the window, a roll shows sustained jerk along with bumps in magnitude (impacts)
+        // or a tumbling orientation, whereas handling mostly keeps both steady
+        auto rollThresholds = SettingsManager::getRollThresholds();
+        bool rollingMotion = rollThresholds->jerkRmsTimes1000 > 0 &&
+            features.jerkRmsTimes1000 >= rollThresholds->jerkRmsTimes1000 &&
+            (features.magnitudeDeviationTimes1000 >= rollThresholds->magnitudeDeviationTimes1000 ||
+            1000 - features.orientationStabilityTimes1000 >= rollThresholds->orientationChangeTimes1000);
+
         // Calculate the estimated roll state
-        if (frames[0].agitationTimes1000 < settings->lowerThresholdTimes1000) {
-            frames[0].estimatedRollState = EstimatedRollState_OnFace;
-        } else if (frames[0].agitationTimes1000 >= settings->lowerThresholdTimes1000 && frames[0].agitationTimes1000 < settings->middleThresholdTimes1000) {
+        if (newFrame.agitationTimes1000 < settings->lowerThresholdTimes1000) {
+            newFrame.estimatedRollState = EstimatedRollState_OnFace;
+        } else if (newFrame.agitationTimes1000 < settings->middleThresholdTimes1000 && !rollingMotion) {
             // Medium amount of agitation... we're handling (or finishing to roll)
-            if (frames[1].estimatedRollState != EstimatedRollState_Rolling) {
-                frames[0].estimatedRollState = EstimatedRollState_Handling;
+            if (prevFrame.estimatedRollState != EstimatedRollState_Rolling) {
+                newFrame.estimatedRollState = EstimatedRollState_Handling;
             } else {
-                frames[0].estimatedRollState = EstimatedRollState_Rolling;
+                newFrame.estimatedRollState = EstimatedRollState_Rolling;
             }
         } else {
-            frames[0].estimatedRollState = EstimatedRollState_Rolling;
+            newFrame.estimatedRollState = EstimatedRollState_Rolling;
         }
         
         // If the time between the last and current time is zero, log it
-        if(frames[0].time - frames[1].time == 0) {
-            NRF_LOG_WARNING("Time diff between frames is 0, time: %d", frames[0].time);
+        if(newFrame.time - prevFrame.time == 0) {
+            NRF_LOG_WARNING("Time diff between frames is 0, time: %d", newFrame.time);
         }      
 
-        // Count how many onface states we estimated in the last 3 frames, same with handling and rolling
-        int onFaceCount = 0;
-        int handlingCount = 0;
-        int rollingCount = 0;
-        int agitationCount = 0;
-        for (int i = 0; i < MAX_ACCELERATION_FRAMES; ++i) {
-            switch (frames[i].estimatedRollState) {
-                case EstimatedRollState_OnFace:
-                    onFaceCount++;
-                    break;
-                case EstimatedRollState_Handling:
-                    handlingCount++;
-                    break;
-                case EstimatedRollState_Rolling:
-                    rollingCount++;
-                    break;
-                default:
-                    break;
-            }
-            if (frames[i].agitationTimes1000 > settings->upperThresholdTimes1000) {
-                agitationCount++;
-            }
-        }
+        // Update how many onface, handling and rolling states we estimated in the window:
+        // the oldest frame leaves the window and the new one enters it
+        countFrame(frames.first(), -1);
+        countFrame(newFrame, 1);
 
-        frames[0].determinedRollState = frames[1].determinedRollState;
-        if (onFaceCount == 3) {
+        const RollState prevRollState = prevFrame.determinedRollState;
+        const int prevFace = prevFrame.face;
+        newFrame.determinedRollState = prevRollState;
+        if (counts.onFace == MAX_ACCELERATION_FRAMES) {
             // Are we on a valid face?
             if (onFace) {
                 // Is it a valid roll?
-                if (frames[1].determinedRollState == RollState_Rolling) {
+                if (prevRollState == RollState_Rolling) {
                     // We were rolling, and now we're on face, so we rolled
-                    frames[0].determinedRollState = RollState_Rolled;
+                    newFrame.determinedRollState = RollState_Rolled;
                 } else {
-                    frames[0].determinedRollState = RollState_OnFace;
+                    newFrame.determinedRollState = RollState_OnFace;
                 }
             } else {
-                frames[0].determinedRollState = RollState_Crooked;
+                newFrame.determinedRollState = RollState_Crooked;
             }
-        } else if (handlingCount == 3) {
-            frames[0].determinedRollState = RollState_Handling;
-        } else if ((rollingCount >= 2) && (agitationCount > 0)) {
-            frames[0].determinedRollState = RollState_Rolling;
+        } else if (counts.handling == MAX_ACCELERATION_FRAMES) {
+            newFrame.determinedRollState = RollState_Handling;
+        } else if ((counts.rolling >= ROLLING_MIN_FRAMES) && (counts.agitated > 0)) {
+            newFrame.determinedRollState = RollState_Rolling;
         }
 
-        bool faceChanged = frames[0].face != frames[1].face;
-        bool stateChanged = frames[0].determinedRollState != frames[1].determinedRollState &&
+        // Store the new frame, this replaces the oldest one
+        frames.push(newFrame);
+
+        updateSettlePrediction(newFrame);
+
+        bool faceChanged = newFrame.face != prevFace;
+        bool stateChanged = newFrame.determinedRollState != prevRollState &&
                             // Avoid notifying onface just after a valid roll on the same face
-                            (frames[0].determinedRollState != RollState_OnFace || frames[1].determinedRollState != RollState_Rolled);
+                            (newFrame.determinedRollState != RollState_OnFace || prevRollState != RollState_Rolled);
         if (faceChanged || stateChanged) {
             for (int i = 0; i < rollStateClients.Count(); ++i) {
-                rollStateClients[i].handler(rollStateClients[i].token, frames[1].determinedRollState, frames[1].face, frames[0].determinedRollState, frames[0].face);
+                rollStateClients[i].handler(rollStateClients[i].token, prevRollState, prevFace, newFrame.determinedRollState, newFrame.face);
             }
         }
 
         // Notify frame data clients
         for (int i = 0; i < frameDataClients.Count(); ++i) {
-            frameDataClients[i].handler(frameDataClients[i].token, frames[0]);
+            frameDataClients[i].handler(frameDataClients[i].token, frames.last());
         }
     }
 
@@ -244,13 +353,14 @@ namespace Modules::Accelerometer
                     NRF_LOG_DEBUG("Starting accelerometer");
 
                     // Initialize the acceleration data
-                    readAccelerometer(&frames[0].acc);
-                    frames[0].face = determineFace(frames[0].acc, &frames[0].faceConfidenceTimes1000, 0);
-                    frames[0].time = DriversNRF::Timers::millis();
-                    frames[0].agitationTimes1000 = 0;
-                    frames[0].estimatedRollState = EstimatedRollState_OnFace;
-                    memcpy(&frames[1], &frames[0], sizeof(AccelFrame));
-                    memcpy(&frames[2], &frames[0], sizeof(AccelFrame));
+                    AccelFrame frame = frames.last();
+                    readAccelerometer(&frame.acc);
+                    frame.face = determineFace(frame.acc, &frame.faceConfidenceTimes1000, 0);
+                    frame.time = DriversNRF::Timers::millis();
+                    frame.agitationTimes1000 = 0;
+                    frame.agitated = false;
+                    frame.estimatedRollState = EstimatedRollState_OnFace;
+                    resetFrames(frame);
 
                     // Unhook first to avoid being hooked more than once if start() is called multiple times
                     AccelChip::unHook(accHandler);
@@ -305,11 +415,11 @@ namespace Modules::Accelerometer
         start();
 
         // Force override the roll state, since we most likely just woke up from motion
-        frames[0].determinedRollState = RollState_Handling;
+        frames.last().determinedRollState = RollState_Handling;
 
         // Notify frame data clients
         for (int i = 0; i < frameDataClients.Count(); ++i) {
-            frameDataClients[i].handler(frameDataClients[i].token, frames[0]);
+            frameDataClients[i].handler(frameDataClients[i].token, frames.last());
         }
     }
 
@@ -318,15 +428,15 @@ namespace Modules::Accelerometer
     /// Returns the currently stored up face!
     /// </summary>
     int currentFace() {
-        return frames[0].face;
+        return frames.last().face;
     }
 
     int currentFaceConfidenceTimes1000() {
-        return frames[0].faceConfidenceTimes1000;
+        return frames.last().faceConfidenceTimes1000;
     }
 
     RollState currentRollState() {
-        return frames[0].determinedRollState;
+        return frames.last().determinedRollState;
     }
 
     const char *getRollStateString(RollState state) {
@@ -389,6 +499,20 @@ namespace Modules::Accelerometer
         rollStateClients.UnregisterWithToken(param);
     }
 
+    void hookProvisionalRoll(ProvisionalRollClientMethod method, void *param) {
+        if (!provisionalRollClients.Register(param, method)) {
+            NRF_LOG_ERROR("Too many accelerometer hooks registered.");
+        }
+    }
+
+    void unHookProvisionalRoll(ProvisionalRollClientMethod client) {
+        provisionalRollClients.UnregisterWithHandler(client);
+    }
+
+    void unHookProvisionalRollWithParam(void *param) {
+        provisionalRollClients.UnregisterWithToken(param);
+    }
+
     struct CalibrationNormals
     {
         int3 face1;
@@ -503,7 +627,7 @@ namespace Modules::Accelerometer
         auto l = SettingsManager::getLayout();
         int normalCount = l->faceCount;
         int3 calibratedNormalsCopy[normalCount];
-        memcpy(calibratedNormalsCopy, SettingsManager::getSettings()->faceNormals, normalCount * sizeof(int3));
+        memcpy(calibratedNormalsCopy, SettingsManager::getFaceNormals(), normalCount * sizeof(int3));
 
         // Replace the face's normal with what we measured
         readAccelerometer(&calibratedNormalsCopy[face]);
@@ -515,7 +639,11 @@ namespace Modules::Accelerometer
 
 #pragma GCC diagnostic pop "-Wstack-usage="
 
-    void onSettingsProgrammingEvent(void *context, Flash::ProgrammingEventType evt) {
+    void onSettingsProgrammingEvent(void *context, Flash::ProgrammingEventType evt, Flash::ProgrammingRegion region) {
+        if (region != Flash::ProgrammingRegion_Settings) {
+            // We only read the calibration data from flash
+            return;
+        }
         if (evt == Flash::ProgrammingEventType_Begin) {
             NRF_LOG_DEBUG("Stopping axel from programming event");
             stop();
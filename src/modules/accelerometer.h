@@ -29,26 +29,23 @@ namespace Modules::Accelerometer
         EstimatedRollState_Rolling,     // Currently being rolled
     };
 
-    #pragma pack(push, 1)
-
     /// <summary>
     /// Small struct holding a single frame of accelerometer data
     /// used for both face detection (not that kind) and telemetry
-    /// Size is 50-bytes
+    /// Members are ordered so the struct is naturally aligned, size is 20 bytes
     /// </summary>
     struct AccelFrame
     {
         uint32_t time;
-        int3 acc;
         int agitationTimes1000;
+        int3 acc;
+        int16_t faceConfidenceTimes1000;
         EstimatedRollState estimatedRollState;
         uint8_t face;
-        int16_t faceConfidenceTimes1000;
         RollState determinedRollState;
+        bool agitated;      // Agitation was above the upper threshold when the frame was added
     };
 
-    #pragma pack(pop)
-
     typedef void (*InitCallback)(bool result);
     void init(InitCallback callback);
     void start();
@@ -78,4 +75,20 @@ namespace Modules::Accelerometer
     void hookRollState(RollStateClientMethod method, void* param);
     void unHookRollState(RollStateClientMethod client);
     void unHookRollStateWithParam(void* param);
+
+    // Early roll results: while rolling, a face is predicted as soon as the die looks settled on it,
+    // which usually happens one sample (160ms) before the roll state switches to Rolled,
+    // more if the die rocks a little before settling.
+    // Each prediction is followed by exactly one confirmation or retraction.
+    enum ProvisionalRollEvent : uint8_t
+    {
+        ProvisionalRollEvent_Predicted = 0,
+        ProvisionalRollEvent_Confirmed,     // Roll state switched to Rolled on the predicted face
+        ProvisionalRollEvent_Retracted,     // Die moved again or settled differently
+    };
+
+    typedef void(*ProvisionalRollClientMethod)(void* param, ProvisionalRollEvent event, int face);
+    void hookProvisionalRoll(ProvisionalRollClientMethod method, void* param);
+    void unHookProvisionalRoll(ProvisionalRollClientMethod client);
+    void unHookProvisionalRollWithParam(void* param);
 }
@@ -45,7 +45,7 @@ namespace Modules::AnimController
     // Some local functions
     void update(int ms);
     uint32_t getColorForAnim(void* token, uint32_t colorIndex);
-    void onProgrammingEvent(void* context, Flash::ProgrammingEventType evt);
+    void onProgrammingEvent(void* context, Flash::ProgrammingEventType evt, Flash::ProgrammingRegion region);
     void printAnimControllerStateHandler(const Message *msg);
     void playLEDAnimHandler(const Message* msg);
     void stopLEDAnimHandler(const Message* msg);
@@ -70,8 +70,8 @@ namespace Modules::AnimController
         currentState = State_Initializing;
         Flash::hookProgrammingEvent(onProgrammingEvent, nullptr);
         MessageService::RegisterMessageHandler(Message::MessageType_PrintAnimControllerState, printAnimControllerStateHandler);
-        MessageService::RegisterMessageHandler(Message::MessageType_PlayAnim, playLEDAnimHandler);
-        MessageService::RegisterMessageHandler(Message::MessageType_StopAnim, stopLEDAnimHandler);
+        MessageService::RegisterFastMessageHandler(Message::MessageType_PlayAnim, playLEDAnimHandler);
+        MessageService::RegisterFastMessageHandler(Message::MessageType_StopAnim, stopLEDAnimHandler);
         MessageService::RegisterMessageHandler(Message::MessageType_StopAllAnims, stopAllLEDAnimsHandler);
         Timers::createTimer(&animControllerTimer, APP_TIMER_MODE_REPEATED, animationControllerUpdate);
 
@@ -312,7 +312,11 @@ namespace Modules::AnimController
         animationCount--;
     }
 
-    void onProgrammingEvent(void* context, Flash::ProgrammingEventType evt){
+    void onProgrammingEvent(void* context, Flash::ProgrammingEventType evt, Flash::ProgrammingRegion region){
+        if (region != Flash::ProgrammingRegion_DataSet) {
+            // Animations only live in the dataset
+            return;
+        }
         if (evt == Flash::ProgrammingEventType_Begin) {
             stop();
         } else {
@@ -95,28 +95,23 @@ namespace Modules::BehaviorController
 
     void onPixelInitialized() {
 
-        // Do we have a hello goodbye condition
-        auto bhv = DataSet::getBehavior();
-
         if (!forceCheckBatteryState()) {
-            // Iterate the rules and look for one!
-            for (int i = 0; i < bhv->rulesCount; ++i) {
-                auto rule = DataSet::getRule(bhv->rulesOffset + i);
-                auto condition = DataSet::getCondition(rule->condition);
-                if (condition->type == Behaviors::Condition_HelloGoodbye) {
-                    // This is the right kind of condition, check it!
-                    auto cond = static_cast<const Behaviors::ConditionHelloGoodbye*>(condition);
-                    if (cond->checkTrigger(true)) {
-                        // Go on, do the thing!
-                        if (PowerManager::checkFromSysOff()) 
-                        {
-                            NRF_LOG_DEBUG("Skipping HelloGoodbye Condition");
-                        }
-                        else
-                        {
-                            NRF_LOG_DEBUG("Triggering a HelloGoodbye Condition");
-                            Behaviors::triggerActions(rule->actionOffset, rule->actionCount, Animations::AnimationTag_Status);
-                        }
+            // Iterate the hello goodbye rules
+            uint16_t count = 0;
+            auto indices = DataSet::getRuleEntriesOfType(Behaviors::Condition_HelloGoodbye, &count);
+            for (int i = 0; i < count; ++i) {
+                auto entry = DataSet::getRuleEntry(indices[i]);
+                auto cond = static_cast<const Behaviors::ConditionHelloGoodbye*>(entry->condition);
+                if (cond->checkTrigger(true)) {
+                    // Go on, do the thing!
+                    if (PowerManager::checkFromSysOff()) 
+                    {
+                        NRF_LOG_DEBUG("Skipping HelloGoodbye Condition");
+                    }
+                    else
+                    {
+                        NRF_LOG_DEBUG("Triggering a HelloGoodbye Condition");
+                        Behaviors::triggerActions(entry->rule->actionOffset, entry->rule->actionCount, Animations::AnimationTag_Status);
                     }
                 }
             }
@@ -134,21 +129,16 @@ namespace Modules::BehaviorController
     }
 
     void onConnectionEvent(void* param, bool connected) {
-        // Do we have a connection event condition?
-        auto bhv = DataSet::getBehavior();
-
-        // Iterate the rules and look for one!
-        for (int i = 0; i < bhv->rulesCount; ++i) {
-            auto rule = DataSet::getRule(bhv->rulesOffset + i);
-            auto condition = DataSet::getCondition(rule->condition);
-            if (condition->type == Behaviors::Condition_ConnectionState) {
-                // This is the right kind of condition, check it!
-                auto cond = static_cast<const Behaviors::ConditionConnectionState*>(condition);
-                if (cond->checkTrigger(connected)) {
-                    NRF_LOG_DEBUG("Triggering a Connection State Condition");
-                    // Go on, do the thing!
-                    Behaviors::triggerActions(rule->actionOffset, rule->actionCount, Animations::AnimationTag_BluetoothNotification);
-                }
+        // Iterate the connection event rules
+        uint16_t count = 0;
+        auto indices = DataSet::getRuleEntriesOfType(Behaviors::Condition_ConnectionState, &count);
+        for (int i = 0; i < count; ++i) {
+            auto entry = DataSet::getRuleEntry(indices[i]);
+            auto cond = static_cast<const Behaviors::ConditionConnectionState*>(entry->condition);
+            if (cond->checkTrigger(connected)) {
+                NRF_LOG_DEBUG("Triggering a Connection State Condition");
+                // Go on, do the thing!
+                Behaviors::triggerActions(entry->rule->actionOffset, entry->rule->actionCount, Animations::AnimationTag_BluetoothNotification);
             }
         }
     }
@@ -162,12 +152,15 @@ namespace Modules::BehaviorController
     }
 
     bool processBatteryStateRule(int ruleIndex, BatteryController::BatteryState newState) {
-        auto rule = DataSet::getRule(ruleIndex);
-        auto condition = DataSet::getCondition(rule->condition);
-        ASSERT(condition->type == Behaviors::Condition_BatteryState);
+        // The dataset may have changed since the check was scheduled
+        auto entry = DataSet::getRuleEntry(ruleIndex);
+        if (entry == nullptr || entry->condition->type != Behaviors::Condition_BatteryState) {
+            return false;
+        }
 
         // This is the right kind of condition, check it!
-        auto cond = static_cast<const Behaviors::ConditionBatteryState*>(condition);
+        auto rule = entry->rule;
+        auto cond = static_cast<const Behaviors::ConditionBatteryState*>(entry->condition);
         bool ret = cond->checkTrigger(newState);
         if (ret) {
             NRF_LOG_DEBUG("Triggering a Battery State Condition");
@@ -188,29 +181,22 @@ namespace Modules::BehaviorController
     }
 
     void onBatteryStateChange(void* param, BatteryController::BatteryState newState) {
-        // Do we have a battery event condition?
-        auto bhv = DataSet::getBehavior();
-
-        // Iterate the rules and look for one!
-        for (int i = 0; i < bhv->rulesCount; ++i) {
-            auto rule = DataSet::getRule(bhv->rulesOffset + i);
-            auto condition = DataSet::getCondition(rule->condition);
-            if (condition->type == Behaviors::Condition_BatteryState) {
-
-                processBatteryStateRule(i, newState);
-            }
+        // Iterate the battery event rules
+        uint16_t count = 0;
+        auto indices = DataSet::getRuleEntriesOfType(Behaviors::Condition_BatteryState, &count);
+        for (int i = 0; i < count; ++i) {
+            processBatteryStateRule(indices[i], newState);
         }
     }
 
     void onRollStateChange(void* param, Accelerometer::RollState prevState, int prevFace, Accelerometer::RollState newState, int newFace) {
 
-        // Do we have a roll state event condition?
-        auto bhv = DataSet::getBehavior();
-
-        // Iterate the rules and look for one!
-        for (int i = 0; i < bhv->rulesCount; ++i) {
-            auto rule = DataSet::getRule(bhv->rulesOffset + i);
-            auto condition = DataSet::getCondition(rule->condition);
+        // Iterate all the rules, in order as several kinds of conditions may trigger
+        int count = DataSet::getRuleEntryCount();
+        for (int i = 0; i < count; ++i) {
+            auto entry = DataSet::getRuleEntry(i);
+            auto rule = entry->rule;
+            auto condition = entry->condition;
 
             // This is the right kind of condition, check it!
             bool conditionTriggered = false;
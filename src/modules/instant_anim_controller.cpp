@@ -1,9 +1,12 @@
 #include "instant_anim_controller.h"
 #include "animations/animation.h"
 #include "data_set/data_animation_bits.h"
+#include "data_set/data_set.h"
+#include "data_set/data_set_data.h"
 #include "bluetooth/bluetooth_messages.h"
 #include "bluetooth/bluetooth_message_service.h"
 #include "bluetooth/bulk_data_transfer.h"
+#include "drivers_nrf/flash.h"
 #include "anim_controller.h"
 #include "behaviors/action.h"
 #include "accelerometer.h"
@@ -11,142 +14,352 @@
 #include "malloc.h"
 #include "nrf_log.h"
 
+#define INSTANT_ANIM_SET_VALID_KEY (0x1A57A5E7) // INSTASET, more or less
+#define INSTANT_ANIM_SET_PENDING_KEY (0x9A57A5E7) // Only clears bits when overwritten by the valid key
+#define ERASED_WORD (0xFFFFFFFF)
+
 using namespace Bluetooth;
 using namespace DataSet;
+using namespace DriversNRF;
 
 namespace Modules::InstantAnimationController
 {
+    /// <summary>
+    /// Instant animation sets are kept in flash when there is room for them, appended to the
+    /// erased space that follows the dataset data, in its last page. They are looked up by hash
+    /// so they survive a reboot, and they are only erased along with the dataset.
+    /// The sizes and a pending marker are written before the data, and the marker is overwritten
+    /// with the valid key once the data is, so an interrupted transfer leaves a set that is skipped.
+    /// A set that doesn't fit is downloaded to RAM instead.
+    /// </summary>
+    struct CachedAnimSet
+    {
+        uint32_t headMarker;    // Erased if there are no more sets, pending until the data is written
+        uint32_t hash;          // Written along with the valid key
+        uint16_t paletteSize;
+        uint16_t rgbKeyFrameCount;
+        uint16_t rgbTrackCount;
+        uint16_t keyFrameCount;
+        uint16_t trackCount;
+        uint16_t animationCount;
+        uint16_t animationSize;
+        uint16_t dataSize;      // Size of the data following the header, a multiple of 4
+    };
+
     static AnimationBits animationBits;
-    static void *animationsData = nullptr;
+    static const void *animationsData = nullptr;
+    static bool animationsDataInFlash;
     static uint32_t animationsDataSize;
     static uint32_t animationsDataHash;
 
+    // Header of the set being downloaded to flash, and where it goes (0 if none)
+    static CachedAnimSet newSet;
+    static uint32_t newSetAddress = 0;
+    static Flash::ProgramFlashFuncCallback newSetProgrammed = nullptr;
+    static int16_t transferSequence = MESSAGE_NO_SEQUENCE; // Of the transfer request, its acks may be sent later
+
     void ReceiveInstantAnimSetHandler(const Message *msg);
     void PlayInstantAnimHandler(const Message *msg);
+    void onProgrammingEvent(void* context, Flash::ProgrammingEventType evt, Flash::ProgrammingRegion region);
 
     void clearData()
     {
-        free(animationsData);
+        if (!animationsDataInFlash) {
+            free((void*)animationsData);
+        }
         animationsData = nullptr;
+        animationsDataInFlash = false;
         animationsDataSize = 0;
         animationsDataHash = 0;
     }
 
+    void stopAnimations()
+    {
+        // Stop playing animations as we are about to delete their data
+        for (uint32_t i = 0; i < animationBits.animationCount; ++i) {
+            AnimController::stop(animationBits.getAnimation(i), 255);
+        }
+    }
+
     void init()
     {
         MessageService::RegisterMessageHandler(Message::MessageType_TransferInstantAnimSet, ReceiveInstantAnimSetHandler);
         MessageService::RegisterMessageHandler(Message::MessageType_PlayInstantAnim, PlayInstantAnimHandler);
+        Flash::hookProgrammingEvent(onProgrammingEvent, nullptr);
         clearData();
 
         NRF_LOG_DEBUG("Instant Animation Controller init");
     }
 
-    void ReceiveInstantAnimSetHandler(const Message *msg)
+    uint32_t computeDataSize(const CachedAnimSet& set)
     {
-        NRF_LOG_INFO("Received request to download instant animation");
-        const MessageTransferInstantAnimSet *message = (const MessageTransferInstantAnimSet *)msg;
+        return Utils::roundUpTo4(set.paletteSize) +
+            set.rgbKeyFrameCount * sizeof(RGBKeyframe) +
+            set.rgbTrackCount * sizeof(RGBTrack) +
+            set.keyFrameCount * sizeof(Keyframe) +
+            set.trackCount * sizeof(Track) +
+            Utils::roundUpTo4(set.animationCount * 2) +
+            set.animationSize;
+    }
+
+    void setupAnimationBits(const CachedAnimSet& set, const void* data)
+    {
+        uint32_t address = (uint32_t)data;
+        animationBits.palette = (const uint8_t*)address;
+        animationBits.paletteSize = set.paletteSize;
+        address += Utils::roundUpTo4(set.paletteSize);
+
+        animationBits.rgbKeyframes = (const RGBKeyframe*)address;
+        animationBits.rgbKeyFrameCount = set.rgbKeyFrameCount;
+        address += set.rgbKeyFrameCount * sizeof(RGBKeyframe);
+
+        animationBits.rgbTracks = (const RGBTrack*)address;
+        animationBits.rgbTrackCount = set.rgbTrackCount;
+        address += set.rgbTrackCount * sizeof(RGBTrack);
+
+        animationBits.keyframes = (const Keyframe*)address;
+        animationBits.keyFrameCount = set.keyFrameCount;
+        address += set.keyFrameCount * sizeof(Keyframe);
+
+        animationBits.tracks = (const Track*)address;
+        animationBits.trackCount = set.trackCount;
+        address += set.trackCount * sizeof(Track);
+
+        animationBits.animationOffsets = (const uint16_t*)address;
+        animationBits.animationCount = set.animationCount;
+        address += Utils::roundUpTo4(set.animationCount * 2);
+
+        animationBits.animations = (const uint8_t*)address;
+        animationBits.animationsSize = set.animationSize;
+    }
+
+    void useCachedSet(const CachedAnimSet* set)
+    {
+        animationsData = set + 1;
+        animationsDataInFlash = true;
+        animationsDataSize = set->dataSize;
+        animationsDataHash = set->hash;
+        setupAnimationBits(*set, animationsData);
+    }
 
-        if (animationsData == nullptr || animationsDataHash != message->hash) {
-            // Stop playing animations as we are about to delete their data
-            for (uint32_t i = 0; i < animationBits.animationCount; ++i) {
-                AnimController::stop(animationBits.getAnimation(i), 255);
+    /// <summary>
+    /// Walks the sets stored after the dataset, returns the one with the given hash if any,
+    /// and otherwise where the next set would go
+    /// </summary>
+    const CachedAnimSet* findCachedSet(uint32_t hash, uint32_t* outFreeAddress)
+    {
+        *outFreeAddress = 0;
+        if (!DataSet::CheckValid()) {
+            return nullptr;
+        }
+        uint32_t address = Utils::roundUpTo4(Flash::getDataSetDataAddress() + DataSet::dataSize());
+        const uint32_t endAddress = Flash::getDataSetAddress() + Flash::getFlashByteSize(sizeof(Data) + DataSet::dataSize());
+        while (address + sizeof(CachedAnimSet) <= endAddress) {
+            auto set = (const CachedAnimSet*)address;
+            if (set->headMarker != INSTANT_ANIM_SET_VALID_KEY && set->headMarker != INSTANT_ANIM_SET_PENDING_KEY) {
+                *outFreeAddress = address;
+                break;
             }
+            if (set->headMarker == INSTANT_ANIM_SET_VALID_KEY && set->hash == hash) {
+                return set;
+            }
+            address += sizeof(CachedAnimSet) + set->dataSize;
+        }
+        return nullptr;
+    }
+
+    /// <summary>
+    /// Checks that there is erased flash for a set of the given size at the address
+    /// </summary>
+    bool canCacheSet(uint32_t address, uint32_t dataSize)
+    {
+        if (address == 0 || Flash::isBusy()) {
+            return false;
+        }
+        const uint32_t endAddress = Flash::getDataSetAddress() + Flash::getFlashByteSize(sizeof(Data) + DataSet::dataSize());
+        const uint32_t setEndAddress = address + sizeof(CachedAnimSet) + dataSize;
+        if (setEndAddress > endAddress) {
+            return false;
+        }
+        // Only a header cut short by a reset is left without a marker, sets can't go past it
+        for (uint32_t a = address; a < setEndAddress; a += 4) {
+            if (*(const uint32_t*)a != ERASED_WORD) {
+                NRF_LOG_WARNING("Interrupted instant animation in flash, until the dataset is programmed again");
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void onSetReceivedToFlash(void* context, bool result, uint32_t address, uint16_t size)
+    {
+        if (!result || size != computeDataSize(newSet)) {
+            NRF_LOG_ERROR("Failed to download instant animation");
+            newSetProgrammed(context, false, address, size);
+            return;
+        }
+
+        // Overwriting the pending marker is what makes the set valid
+        newSet.hash = Utils::computeHash((const uint8_t*)address, size);
+        newSet.headMarker = INSTANT_ANIM_SET_VALID_KEY;
+        Flash::write(nullptr, newSetAddress, &newSet.headMarker, sizeof(newSet.headMarker) + sizeof(newSet.hash), newSetProgrammed);
+    }
 
-            // We should download the data
-            clearData();
-
-            NRF_LOG_DEBUG("Animations Data to be received:");
-            NRF_LOG_DEBUG("Palette: %d * %d", message->paletteSize, sizeof(uint8_t));
-            NRF_LOG_DEBUG("RGB Keyframes: %d * %d", message->rgbKeyFrameCount, sizeof(RGBKeyframe));
-            NRF_LOG_DEBUG("RGB Tracks: %d * %d", message->rgbTrackCount, sizeof(RGBTrack));
-            NRF_LOG_DEBUG("Keyframes: %d * %d", message->keyFrameCount, sizeof(Keyframe));
-            NRF_LOG_DEBUG("Tracks: %d * %d", message->trackCount, sizeof(Track));
-            NRF_LOG_DEBUG("Animations: %d", message->animationCount);
-            NRF_LOG_DEBUG("Hash: 0x%04x", message->hash);
-
-            int paletteBufferSize = Utils::roundUpTo4(message->paletteSize);
-            int animationOffsetsBufferSize = Utils::roundUpTo4(message->animationCount * 2);
-
-            animationsDataSize =
-                paletteBufferSize +
-                message->rgbKeyFrameCount * sizeof(RGBKeyframe) +
-                message->rgbTrackCount * sizeof(RGBTrack) +
-                message->keyFrameCount * sizeof(Keyframe) +
-                message->trackCount * sizeof(Track) +
-                animationOffsetsBufferSize +
-                message->animationSize;
-
-            // Allocate anim data
-            animationsData = malloc(animationsDataSize);
-            if (animationsData != nullptr) {
-
-                // Setup pointers
-                NRF_LOG_DEBUG("Animations bufferSize: %d", animationsDataSize);
-                uint32_t address = (uint32_t)animationsData;
-                animationBits.palette = (const uint8_t*)address;
-                animationBits.paletteSize = message->paletteSize;
-                address += paletteBufferSize;
-
-                animationBits.rgbKeyframes = (const RGBKeyframe*)address;
-                animationBits.rgbKeyFrameCount = message->rgbKeyFrameCount;
-                address += message->rgbKeyFrameCount * sizeof(RGBKeyframe);
-
-                animationBits.rgbTracks = (const RGBTrack*)address;
-                animationBits.rgbTrackCount = message->rgbTrackCount;
-                address += message->rgbTrackCount * sizeof(RGBTrack);
-
-                animationBits.keyframes = (const Keyframe*)address;
-                animationBits.keyFrameCount = message->keyFrameCount;
-                address += message->keyFrameCount * sizeof(Keyframe);
-
-                animationBits.tracks = (const Track*)address;
-                animationBits.trackCount = message->trackCount;
-                address += message->trackCount * sizeof(Track);
-
-                animationBits.animationOffsets = (const uint16_t*)address;
-                animationBits.animationCount = message->animationCount;
-                address += animationOffsetsBufferSize;
-
-                animationBits.animations = (const uint8_t*)address;
-                animationBits.animationsSize = message->animationSize;
-
-                // Send Ack and receive data
-                MessageTransferInstantAnimSetAck ackMsg;
-                ackMsg.ackType = TransferInstantAnimSetAck_Download;
-                MessageService::SendMessage(&ackMsg);
-
-                // Receive all the buffers directly to flash
-                ReceiveBulkData::receive(nullptr,
-                    [](void* context, uint16_t size) -> uint8_t* {
-                        return size == animationsDataSize ? (uint8_t *)animationsData : nullptr;
-                    },
-                    [](void* context, bool result, uint8_t* data, uint16_t size) {
-                    if (result) {
-                        animationsDataHash = Utils::computeHash((uint8_t*)animationsData, size);
-                        MessageService::SendMessage(Message::MessageType_TransferInstantAnimSetFinished);
-                    }
-                    else {
-                        NRF_LOG_ERROR("Failed to download instant animation");
-                        clearData();
-                    }
-                });
+    /// <summary>
+    /// Runs with the flash programming lock held, so nothing else writes to or erases the dataset
+    /// pages until the set is either valid or left pending
+    /// </summary>
+    void programSet(Flash::ProgramFlashFuncCallback callback)
+    {
+        newSetProgrammed = callback;
+
+        // Sizes first and then the pending marker, so a marked set can always be skipped
+        Flash::write(nullptr, newSetAddress + offsetof(CachedAnimSet, paletteSize), &newSet.paletteSize,
+            sizeof(CachedAnimSet) - offsetof(CachedAnimSet, paletteSize),
+            [](void* context, bool result, uint32_t address, uint16_t size) {
+                if (!result) {
+                    newSetProgrammed(context, false, address, size);
+                    return;
+                }
+                newSet.headMarker = INSTANT_ANIM_SET_PENDING_KEY;
+                Flash::write(nullptr, newSetAddress, &newSet.headMarker, sizeof(newSet.headMarker),
+                    [](void* context, bool result, uint32_t address, uint16_t size) {
+                        if (!result) {
+                            newSet.headMarker = ERASED_WORD;
+                            newSetProgrammed(context, false, address, size);
+                            return;
+                        }
+
+                        // Send Ack and receive all the buffers directly to flash, right after the header
+                        MessageTransferInstantAnimSetAck ackMsg;
+                        ackMsg.ackType = TransferInstantAnimSetAck_Download;
+                        MessageService::SendReply(&ackMsg, transferSequence);
+                        ReceiveBulkData::receiveToFlash(newSetAddress + sizeof(CachedAnimSet), nullptr, onSetReceivedToFlash);
+                    });
+            });
+    }
+
+    void receiveToRam();
+
+    void onSetProgrammed(bool result)
+    {
+        const uint32_t address = newSetAddress;
+        newSetAddress = 0;
+        if (result) {
+            useCachedSet((const CachedAnimSet*)address);
+            MessageService::SendReply(Message::MessageType_TransferInstantAnimSetFinished, transferSequence);
+        } else if (newSet.headMarker == INSTANT_ANIM_SET_PENDING_KEY) {
+            // The app was told to download, the set stays pending and is skipped from now on
+            NRF_LOG_ERROR("Failed to program instant animation, skipped");
+        } else {
+            // Nothing was acked yet
+            NRF_LOG_ERROR("Failed to write instant animation header, downloading to RAM");
+            receiveToRam();
+        }
+    }
+
+    void receiveToRam()
+    {
+        // Allocate anim data
+        void* data = malloc(animationsDataSize);
+        if (data == nullptr) {
+            // No memory
+            MessageTransferInstantAnimSetAck ackMsg;
+            ackMsg.ackType = TransferInstantAnimSetAck_NoMemory;
+            MessageService::SendReply(&ackMsg, transferSequence);
+            return;
+        }
+        animationsData = data;
+        setupAnimationBits(newSet, animationsData);
+
+        // Send Ack and receive data
+        MessageTransferInstantAnimSetAck ackMsg;
+        ackMsg.ackType = TransferInstantAnimSetAck_Download;
+        MessageService::SendReply(&ackMsg, transferSequence);
+
+        ReceiveBulkData::receive(nullptr,
+            [](void* context, uint16_t size) -> uint8_t* {
+                return size == animationsDataSize ? (uint8_t *)animationsData : nullptr;
+            },
+            [](void* context, bool result, uint8_t* data, uint16_t size) {
+            if (result) {
+                animationsDataHash = Utils::computeHash((uint8_t*)animationsData, size);
+                MessageService::SendReply(Message::MessageType_TransferInstantAnimSetFinished, transferSequence);
             }
             else {
-                // No memory
-                MessageTransferInstantAnimSetAck ackMsg;
-                ackMsg.ackType = TransferInstantAnimSetAck_NoMemory;
-                MessageService::SendMessage(&ackMsg);
+                NRF_LOG_ERROR("Failed to download instant animation");
+                clearData();
             }
-        }
-        else {
+        });
+    }
+
+    void ReceiveInstantAnimSetHandler(const Message *msg)
+    {
+        NRF_LOG_INFO("Received request to download instant animation");
+        const MessageTransferInstantAnimSet *message = (const MessageTransferInstantAnimSet *)msg;
+        transferSequence = MessageService::getHandledSequence();
+
+        if (animationsData != nullptr && animationsDataHash == message->hash) {
             // The animation data is valid and matches the app data
             MessageTransferInstantAnimSetAck ackMsg;
             ackMsg.ackType = TransferInstantAnimSetAck_UpToDate;
             MessageService::SendMessage(&ackMsg);
+            return;
+        }
+
+        stopAnimations();
+        clearData();
+
+        uint32_t freeAddress;
+        auto cachedSet = findCachedSet(message->hash, &freeAddress);
+        if (cachedSet != nullptr) {
+            // Already stored in flash
+            NRF_LOG_DEBUG("Instant animation found in flash, hash: 0x%04x", message->hash);
+            useCachedSet(cachedSet);
+            MessageTransferInstantAnimSetAck ackMsg;
+            ackMsg.ackType = TransferInstantAnimSetAck_UpToDate;
+            MessageService::SendMessage(&ackMsg);
+            return;
+        }
+
+        // We should download the data
+        NRF_LOG_DEBUG("Animations Data to be received:");
+        NRF_LOG_DEBUG("Palette: %d * %d", message->paletteSize, sizeof(uint8_t));
+        NRF_LOG_DEBUG("RGB Keyframes: %d * %d", message->rgbKeyFrameCount, sizeof(RGBKeyframe));
+        NRF_LOG_DEBUG("RGB Tracks: %d * %d", message->rgbTrackCount, sizeof(RGBTrack));
+        NRF_LOG_DEBUG("Keyframes: %d * %d", message->keyFrameCount, sizeof(Keyframe));
+        NRF_LOG_DEBUG("Tracks: %d * %d", message->trackCount, sizeof(Track));
+        NRF_LOG_DEBUG("Animations: %d", message->animationCount);
+        NRF_LOG_DEBUG("Hash: 0x%04x", message->hash);
+
+        newSet.headMarker = ERASED_WORD;
+        newSet.hash = message->hash;
+        newSet.paletteSize = message->paletteSize;
+        newSet.rgbKeyFrameCount = message->rgbKeyFrameCount;
+        newSet.rgbTrackCount = message->rgbTrackCount;
+        newSet.keyFrameCount = message->keyFrameCount;
+        newSet.trackCount = message->trackCount;
+        newSet.animationCount = message->animationCount;
+        newSet.animationSize = message->animationSize;
+        animationsDataSize = computeDataSize(newSet);
+        newSet.dataSize = Utils::roundUpTo4(animationsDataSize);
+        NRF_LOG_DEBUG("Animations bufferSize: %d", animationsDataSize);
+
+        if (!canCacheSet(freeAddress, newSet.dataSize)) {
+            NRF_LOG_DEBUG("No room in flash for instant animation");
+            receiveToRam();
+            return;
+        }
+
+        // The ack is sent once the header is written
+        newSetAddress = freeAddress;
+        if (!Flash::programErased(programSet, onSetProgrammed)) {
+            newSetAddress = 0;
+            receiveToRam();
         }
     }
 
-    void PlayInstantAnimHandler(const Message *msg) 
+    void PlayInstantAnimHandler(const Message *msg)
     {
         const MessagePlayInstantAnim *message = (const MessagePlayInstantAnim *)msg;
         NRF_LOG_INFO("Received request to play instant animation %d", message->animation);
@@ -165,4 +378,16 @@ namespace Modules::InstantAnimationController
             NRF_LOG_DEBUG("Animation index out of bounds %d >= %d", message->animation, animationBits.getAnimationCount());
         }
     }
+
+    void onProgrammingEvent(void* context, Flash::ProgrammingEventType evt, Flash::ProgrammingRegion region)
+    {
+        // Sets in flash go away along with the dataset they follow, which can't be programmed
+        // while a set is being written to flash
+        if (region == Flash::ProgrammingRegion_DataSet && evt == Flash::ProgrammingEventType_Begin) {
+            if (animationsDataInFlash) {
+                stopAnimations();
+                clearData();
+            }
+        }
+    }
 }
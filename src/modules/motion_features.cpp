@@ -0,0 +1,92 @@
+#include "motion_features.h"
+#include "core/ring_buffer.h"
+#include <string.h>
+
+using namespace Core;
+
+#define MOTION_WINDOW_SIZE 4            // Samples, must be a power of 2
+#define MOTION_WINDOW_SHIFT 2           // log2(MOTION_WINDOW_SIZE)
+#define MAX_MAGNITUDE_TIMES1000 16000   // Clamp magnitude to the accelerometer range (16g) to keep sums in 32 bits
+#define JERK_SCALE 10                   // Jerk squares are accumulated in 1/100 g to keep sums in 32 bits
+
+namespace Modules::MotionFeatures
+{
+    // What each sample contributes to the running sums
+    struct Sample
+    {
+        int3 acc;
+        int3 direction;     // Normalized acc
+        int32_t magnitudeTimes1000;
+        int32_t jerkSq;     // Squared norm of the acceleration change, in (g/100)^2
+    };
+
+    static RingBuffer<Sample, MOTION_WINDOW_SIZE> samples;
+
+    // Running sums over the window
+    static int32_t sumMagnitude;
+    static int32_t sumMagnitudeSq;
+    static int32_t sumJerkSq;
+    static int32_t sumDirection[3];
+
+    void makeSample(const int3& acc, const int3& prevAcc, Sample* outSample) {
+        outSample->acc = acc;
+        int32_t magTimes1000 = acc.magnitudeTimes1000();
+        outSample->magnitudeTimes1000 = magTimes1000 < MAX_MAGNITUDE_TIMES1000 ? magTimes1000 : MAX_MAGNITUDE_TIMES1000;
+        if (magTimes1000 > 0) {
+            outSample->direction = acc.normalized();
+        } else {
+            // Free fall, no direction
+            outSample->direction = int3(0, 0, 0);
+        }
+        int32_t dx = ((int32_t)acc.xTimes1000 - prevAcc.xTimes1000) / JERK_SCALE;
+        int32_t dy = ((int32_t)acc.yTimes1000 - prevAcc.yTimes1000) / JERK_SCALE;
+        int32_t dz = ((int32_t)acc.zTimes1000 - prevAcc.zTimes1000) / JERK_SCALE;
+        outSample->jerkSq = dx * dx + dy * dy + dz * dz;
+    }
+
+    void addToSums(const Sample& sample, int sign) {
+        sumMagnitude += sign * sample.magnitudeTimes1000;
+        sumMagnitudeSq += sign * sample.magnitudeTimes1000 * sample.magnitudeTimes1000 / 1000;
+        sumJerkSq += sign * sample.jerkSq;
+        sumDirection[0] += sign * sample.direction.xTimes1000;
+        sumDirection[1] += sign * sample.direction.yTimes1000;
+        sumDirection[2] += sign * sample.direction.zTimes1000;
+    }
+
+    void reset(const int3& acc) {
+        sumMagnitude = 0;
+        sumMagnitudeSq = 0;
+        sumJerkSq = 0;
+        memset(sumDirection, 0, sizeof(sumDirection));
+
+        Sample sample;
+        makeSample(acc, acc, &sample);
+        for (int i = 0; i < MOTION_WINDOW_SIZE; ++i) {
+            samples.push(sample);
+            addToSums(sample, 1);
+        }
+    }
+
+    void update(const int3& acc, Features* outFeatures) {
+        Sample sample;
+        makeSample(acc, samples.last().acc, &sample);
+
+        // The oldest sample leaves the window and the new one enters it
+        addToSums(samples.first(), -1);
+        addToSums(sample, 1);
+        samples.push(sample);
+
+        outFeatures->jerkRmsTimes1000 = Utils::sqrt_i32(sumJerkSq >> MOTION_WINDOW_SHIFT) * JERK_SCALE;
+
+        // Variance is E[m^2] - E[m]^2, both terms in 1/1000 g^2
+        int32_t meanTimes1000 = sumMagnitude >> MOTION_WINDOW_SHIFT;
+        int32_t varianceTimes1000 = (sumMagnitudeSq >> MOTION_WINDOW_SHIFT) - meanTimes1000 * meanTimes1000 / 1000;
+        outFeatures->magnitudeMeanTimes1000 = meanTimes1000;
+        outFeatures->magnitudeDeviationTimes1000 = varianceTimes1000 > 0 ? Utils::sqrt_i32(varianceTimes1000 * 1000) : 0;
+
+        int32_t dx = sumDirection[0] >> MOTION_WINDOW_SHIFT;
+        int32_t dy = sumDirection[1] >> MOTION_WINDOW_SHIFT;
+        int32_t dz = sumDirection[2] >> MOTION_WINDOW_SHIFT;
+        outFeatures->orientationStabilityTimes1000 = Utils::sqrt_i32(dx * dx + dy * dy + dz * dz);
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include "core/int3.h"
+
+/// <summary>
+/// Streaming motion features computed over a short sliding window of accelerometer
+/// readings, used by the accelerometer to classify the die's motion.
+/// Each new sample updates running sums in fixed point, so the cost per sample
+/// doesn't depend on the window size.
+/// </summary>
+namespace Modules::MotionFeatures
+{
+    struct Features
+    {
+        int jerkRmsTimes1000;               // Root mean square of the norm of the acceleration change
+                                            // between samples, over the window (jerk energy)
+        int magnitudeMeanTimes1000;         // Mean of the acceleration magnitude over the window
+        int magnitudeDeviationTimes1000;    // Standard deviation of the acceleration magnitude over the window
+        int orientationStabilityTimes1000;  // Length of the mean acceleration direction, 1000 when the
+                                            // direction didn't change over the window, lower otherwise
+    };
+
+    // Fills the window with the given reading, as if the die had been still
+    void reset(const Core::int3& acc);
+
+    // Adds a reading to the window, dropping the oldest one, and computes the features
+    void update(const Core::int3& acc, Features* outFeatures);
+}
@@ -0,0 +1,238 @@
+#include "roll_trace_recorder.h"
+#include "accelerometer.h"
+#include "bluetooth/bluetooth_messages.h"
+#include "bluetooth/bluetooth_message_service.h"
+#include "bluetooth/bulk_data_transfer.h"
+#include "bluetooth/bluetooth_stack.h"
+#include "utils/utils.h"
+#include "nrf_log.h"
+#include "app_util.h"
+#include <string.h>
+
+using namespace Bluetooth;
+using namespace Utils;
+using namespace Modules::Accelerometer;
+
+#define ROLL_TRACE_BUFFER_SIZE 1024
+#define MAX_ENCODED_SAMPLE_SIZE 12      // 4 varints of up to 3 bytes each
+#define MAX_ONFACE_SAMPLES 4            // Stop recording if the die never got past handling
+#define MAX_SAMPLE_TIME_DELTA 0x1FFFFF  // Largest time delta that fits in a 3 bytes varint
+
+namespace Modules::RollTraceRecorder
+{
+    enum State
+    {
+        State_Idle = 0,
+        State_Recording,
+        State_Sending,
+    };
+
+    // Complete traces are stored back to back, oldest first, and the trace being
+    // recorded (if any) is written right after them.
+    static uint8_t buffer[ROLL_TRACE_BUFFER_SIZE];
+    static uint16_t usedSize;
+    static uint8_t traceCount;
+    static State state;
+
+    // Current trace
+    static RollTraceHeader* header;
+    static int3 previousAcc;
+    static uint32_t previousTime;
+    static bool sawRolling;
+    static uint8_t onFaceSamples;
+    static bool clearAfterSending;
+
+    void onFrameData(void* param, const AccelFrame& frame);
+    void requestRollTracesHandler(const Message* message);
+
+    void init() {
+        usedSize = 0;
+        traceCount = 0;
+        state = State_Idle;
+        header = nullptr;
+
+        Accelerometer::hookFrameData(onFrameData, nullptr);
+        MessageService::RegisterMessageHandler(Message::MessageType_RequestRollTraces, requestRollTracesHandler);
+
+        NRF_LOG_DEBUG("Roll trace recorder init");
+    }
+
+    /// <summary>
+    /// Drops the oldest complete trace, moving everything after it to the start of the buffer
+    /// </summary>
+    bool discardOldestTrace() {
+        if (traceCount == 0) {
+            return false;
+        }
+        auto oldest = (const RollTraceHeader*)buffer;
+        uint16_t oldestSize = sizeof(RollTraceHeader) + oldest->size;
+        uint16_t currentSize = header != nullptr ? sizeof(RollTraceHeader) + header->size : 0;
+        memmove(buffer, buffer + oldestSize, usedSize - oldestSize + currentSize);
+        usedSize -= oldestSize;
+        traceCount--;
+        if (header != nullptr) {
+            header = (RollTraceHeader*)(buffer + usedSize);
+        }
+        return true;
+    }
+
+    /// <summary>
+    /// Makes sure that size bytes are available after the current trace
+    /// </summary>
+    bool reserve(uint16_t size) {
+        uint16_t currentSize = header != nullptr ? sizeof(RollTraceHeader) + header->size : 0;
+        while (usedSize + currentSize + size > ROLL_TRACE_BUFFER_SIZE) {
+            if (!discardOldestTrace()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void beginTrace(const AccelFrame& frame) {
+        header = nullptr;
+        if (!reserve(sizeof(RollTraceHeader))) {
+            return;
+        }
+        header = (RollTraceHeader*)(buffer + usedSize);
+        header->size = 0;
+        header->sampleCount = 1;
+        header->startTime = frame.time;
+        header->startAcc = frame.acc;
+        header->face = frame.face;
+        header->rollState = frame.determinedRollState;
+        header->flags = RollTraceFlags_None;
+
+        previousAcc = frame.acc;
+        previousTime = frame.time;
+        sawRolling = false;
+        onFaceSamples = 0;
+        state = State_Recording;
+    }
+
+    void addSample(const AccelFrame& frame) {
+        if (header->flags & RollTraceFlags_Truncated) {
+            return;
+        }
+
+        uint8_t encoded[MAX_ENCODED_SAMPLE_SIZE];
+        int size = writeVarint(encoded, MIN(frame.time - previousTime, MAX_SAMPLE_TIME_DELTA));
+        size += writeVarint(encoded + size, zigzag(frame.acc.xTimes1000 - previousAcc.xTimes1000));
+        size += writeVarint(encoded + size, zigzag(frame.acc.yTimes1000 - previousAcc.yTimes1000));
+        size += writeVarint(encoded + size, zigzag(frame.acc.zTimes1000 - previousAcc.zTimes1000));
+
+        if (!reserve(size)) {
+            header->flags |= RollTraceFlags_Truncated;
+            return;
+        }
+
+        memcpy((uint8_t*)(header + 1) + header->size, encoded, size);
+        header->size += size;
+        header->sampleCount++;
+        previousAcc = frame.acc;
+        previousTime = frame.time;
+    }
+
+    void endTrace(const AccelFrame& frame, bool keep) {
+        if (keep) {
+            header->face = frame.face;
+            header->rollState = frame.determinedRollState;
+            usedSize += sizeof(RollTraceHeader) + header->size;
+            traceCount++;
+            NRF_LOG_DEBUG("Recorded roll trace, %d samples, %d bytes", header->sampleCount, header->size);
+        }
+        header = nullptr;
+        state = State_Idle;
+    }
+
+    void onFrameData(void* param, const AccelFrame& frame) {
+        switch (state) {
+            case State_Idle:
+                if (frame.estimatedRollState != EstimatedRollState_OnFace) {
+                    beginTrace(frame);
+                }
+                break;
+            case State_Recording:
+                {
+                    addSample(frame);
+                    if (frame.determinedRollState == RollState_Rolling) {
+                        sawRolling = true;
+                    }
+
+                    bool settled = frame.estimatedRollState == EstimatedRollState_OnFace &&
+                        (frame.determinedRollState == RollState_Rolled ||
+                        frame.determinedRollState == RollState_OnFace ||
+                        frame.determinedRollState == RollState_Crooked);
+                    if (!settled) {
+                        onFaceSamples = 0;
+                    } else if (sawRolling) {
+                        endTrace(frame, true);
+                    } else if (++onFaceSamples >= MAX_ONFACE_SAMPLES) {
+                        // Die was only bumped or handled, not worth keeping
+                        endTrace(frame, false);
+                    }
+                }
+                break;
+            case State_Sending:
+            default:
+                // Buffer must not change while it is being sent
+                break;
+        }
+    }
+
+    void onConnectionEvent(void* param, bool connected);
+
+    /// <summary>
+    /// Back to recording, once the traces are sent or can't be anymore
+    /// </summary>
+    void endSending() {
+        Bluetooth::Stack::unHook(onConnectionEvent);
+        state = State_Idle;
+    }
+
+    void onConnectionEvent(void* param, bool connected) {
+        if (!connected && state == State_Sending) {
+            // The bulk transfer won't complete, don't wait for it to resume recording
+            NRF_LOG_DEBUG("Disconnected while sending roll traces");
+            endSending();
+        }
+    }
+
+    void requestRollTracesHandler(const Message* message) {
+        auto request = (const MessageRequestRollTraces*)message;
+        if (state == State_Sending) {
+            NRF_LOG_WARNING("Roll traces already being sent");
+            return;
+        }
+
+        // Drop the trace being recorded, if any
+        header = nullptr;
+        state = State_Sending;
+        clearAfterSending = request->clear != 0;
+
+        MessageRollTraces tracesMsg;
+        tracesMsg.traceCount = traceCount;
+        tracesMsg.size = usedSize;
+        MessageService::SendMessage(&tracesMsg);
+
+        if (usedSize == 0) {
+            state = State_Idle;
+            return;
+        }
+
+        NRF_LOG_INFO("Sending %d roll traces, %d bytes", traceCount, usedSize);
+        Bluetooth::Stack::hook(onConnectionEvent, nullptr);
+        SendBulkData::send(buffer, usedSize, nullptr, [](void* context, bool result, const uint8_t* data, uint16_t size) {
+            NRF_LOG_DEBUG("Roll traces sent, result: %d", result);
+            if (state != State_Sending) {
+                // Connection was lost, recording already resumed
+                return;
+            }
+            if (result && clearAfterSending) {
+                usedSize = 0;
+                traceCount = 0;
+            }
+            endSending();
+        });
+    }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include "core/int3.h"
+
+/// <summary>
+/// Records the accelerometer readings of the last few rolls in a small RAM buffer,
+/// from the moment the die starts moving until it settles, so they can be downloaded
+/// with a single bulk transfer instead of streaming telemetry during the roll.
+///
+/// The buffer is a sequence of traces, oldest first. Each trace starts with a
+/// RollTraceHeader, followed by sampleCount - 1 encoded samples. A sample is 4 varints:
+/// the time delta (ms) since the previous sample, then the zigzag encoded x, y and z
+/// deltas from the previous acceleration (in 1/1000 g). Varints store 7 bits per byte,
+/// least significant group first, the top bit being set when more bytes follow.
+/// When the buffer is full the oldest traces are discarded to make room.
+/// </summary>
+namespace Modules::RollTraceRecorder
+{
+    enum RollTraceFlags : uint8_t
+    {
+        RollTraceFlags_None = 0,
+        RollTraceFlags_Truncated = 1 << 0,  // Trace didn't fit in the buffer, last samples are missing
+    };
+
+#pragma pack(push, 1)
+    struct RollTraceHeader
+    {
+        uint16_t size;          // Size of the encoded samples following this header, in bytes
+        uint16_t sampleCount;   // Number of samples, including the first one stored in this header
+        uint32_t startTime;     // Time of the first sample, in ms
+        Core::int3 startAcc;    // First acceleration reading
+        uint8_t face;           // Face the die settled on
+        uint8_t rollState;      // Roll state the die settled in
+        uint8_t flags;          // See RollTraceFlags
+    };
+#pragma pack(pop)
+
+    void init();
+}
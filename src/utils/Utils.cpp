@@ -224,6 +224,60 @@ for x in range(256):
         return hash;
     }
 
+    /// <summary>
+    /// Writes the varint encoding of value, returns the number of bytes written
+    /// </summary>
+    int writeVarint(uint8_t* out, uint32_t value) {
+        int count = 0;
+        while (value >= 0x80) {
+            out[count++] = (uint8_t)(value | 0x80);
+            value >>= 7;
+        }
+        out[count++] = (uint8_t)value;
+        return count;
+    }
+
+    /* CRC-16-CCITT (polynomial 0x1021), pass the previous result to continue a computation */
+    uint16_t computeCrc16(const uint8_t* data, int size, uint16_t crc) {
+        for (int i = 0; i < size; ++i) {
+            crc = (uint8_t)(crc >> 8) | (crc << 8);
+            crc ^= data[i];
+            crc ^= (uint8_t)(crc & 0xFF) >> 4;
+            crc ^= (crc << 8) << 4;
+            crc ^= ((crc & 0xFF) << 4) << 1;
+        }
+        return crc;
+    }
+
+    // CRC-32 (same as zlib) lookup table, one entry per nibble to keep it small in flash
+    static const uint32_t crc32Table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+    };
+
+    /// <summary>
+    /// Computes the CRC-32 of the data, reading a whole word at a time when the data is aligned
+    /// </summary>
+    uint32_t computeCrc32(const uint8_t* data, int size) {
+        uint32_t crc = 0xFFFFFFFF;
+        int i = 0;
+        if (((uintptr_t)data & 3) == 0) {
+            // Little endian, so this is the same as processing the 4 bytes in order
+            for (; i + 4 <= size; i += 4) {
+                crc ^= *(const uint32_t*)(data + i);
+                for (int n = 0; n < 8; ++n) {
+                    crc = (crc >> 4) ^ crc32Table[crc & 0xF];
+                }
+            }
+        }
+        for (; i < size; ++i) {
+            crc ^= data[i];
+            crc = (crc >> 4) ^ crc32Table[crc & 0xF];
+            crc = (crc >> 4) ^ crc32Table[crc & 0xF];
+        }
+        return ~crc;
+    }
+
     // Originals: https://github.com/andyherbert/lz1
     
     uint32_t lz77_compress (uint8_t *uncompressed_text, uint32_t uncompressed_size, uint8_t *compressed_text)
@@ -243,7 +297,7 @@ for x in range(256):
             {
                 look_behind = coding_pos - temp_pointer_pos;
                 look_ahead = coding_pos;
-                for(temp_pointer_length = 0; uncompressed_text[look_ahead++] == uncompressed_text[look_behind++]; ++temp_pointer_length)
+                for(temp_pointer_length = 0; look_ahead < uncompressed_size && uncompressed_text[look_ahead++] == uncompressed_text[look_behind++]; ++temp_pointer_length)
                     if(temp_pointer_length == 15)
                         break;
                 if(temp_pointer_length > pointer_length)
@@ -265,8 +319,8 @@ for x in range(256):
                 output_pointer = (pointer_pos << 4) | pointer_length;
                 output_lookahead_ref = coding_pos;
             }
-            *((uint32_t *) (compressed_text + compressed_pointer)) = output_pointer;
-            compressed_pointer += 2;
+            *(compressed_text + compressed_pointer++) = output_pointer & 0xFF;
+            *(compressed_text + compressed_pointer++) = output_pointer >> 8;
             *(compressed_text + compressed_pointer++) = *(uncompressed_text + output_lookahead_ref);
             output_size += 3;
         }
@@ -276,27 +330,101 @@ for x in range(256):
 
     uint32_t lz77_decompress (uint8_t *compressed_text, uint8_t *uncompressed_text)
     {
-        uint8_t pointer_length;
-        uint16_t input_pointer, pointer_pos;
-        uint32_t compressed_pointer, coding_pos, pointer_offset, uncompressed_size;
-        
-        uncompressed_size = *((uint32_t *) compressed_text);
-        compressed_pointer = 4;
-        
-        for(coding_pos = 0; coding_pos < uncompressed_size; ++coding_pos)
-        {
-            input_pointer = *((uint32_t *) (compressed_text + compressed_pointer));
-            compressed_pointer += 2;
-            pointer_pos = input_pointer >> 4;
-            pointer_length = input_pointer & 15;
-            if(pointer_pos)
-                for(pointer_offset = coding_pos - pointer_pos; pointer_length > 0; --pointer_length)
-                    uncompressed_text[coding_pos++] = uncompressed_text[pointer_offset++];
-            *(uncompressed_text + coding_pos) = *(compressed_text + compressed_pointer++);
+        // The whole output is in RAM, so the history is the output buffer itself
+        LZ77Decoder decoder;
+        decoder.begin(uncompressed_text);
+        decoder.decode(compressed_text, 4);
+        compressed_text += 4;
+        decoder.setOutput(uncompressed_text, decoder.getUncompressedSize());
+        while (!decoder.isDone() && !decoder.hasFailed()) {
+            compressed_text += decoder.decode(compressed_text, 3);
         }
-        
-        return coding_pos;
-    }	
+        return decoder.getOutputLength();
+    }
+
+    void LZ77Decoder::begin(const uint8_t* theHistory) {
+        history = theHistory;
+        output = nullptr;
+        outputCapacity = 0;
+        outputStart = 0;
+        position = 0;
+        uncompressedSize = 0;
+        token = 0;
+        matchLength = 0;
+        headerBytes = 0;
+        phase = Phase_Header;
+    }
+
+    void LZ77Decoder::setOutput(uint8_t* buffer, uint32_t capacity) {
+        output = buffer;
+        outputCapacity = capacity;
+        outputStart = position;
+    }
+
+    uint32_t LZ77Decoder::decode(const uint8_t* input, uint32_t inputSize) {
+        uint32_t consumed = 0;
+        while (true) {
+            switch (phase) {
+                case Phase_Header:
+                    // Little endian uncompressed size
+                    if (consumed == inputSize) {
+                        return consumed;
+                    }
+                    uncompressedSize |= (uint32_t)input[consumed++] << (8 * headerBytes);
+                    headerBytes++;
+                    if (headerBytes == 4) {
+                        phase = uncompressedSize == 0 ? Phase_Done : Phase_TokenLow;
+                    }
+                    break;
+                case Phase_TokenLow:
+                    if (consumed == inputSize) {
+                        return consumed;
+                    }
+                    token = input[consumed++];
+                    phase = Phase_TokenHigh;
+                    break;
+                case Phase_TokenHigh:
+                    if (consumed == inputSize) {
+                        return consumed;
+                    }
+                    token |= (uint16_t)input[consumed++] << 8;
+                    // The length is meaningless without a distance
+                    matchLength = (token >> 4) != 0 ? (token & 15) : 0;
+                    if (matchLength > 0 && ((token >> 4) > position || position + matchLength >= uncompressedSize)) {
+                        // Points before the start of the data or past its end
+                        phase = Phase_Error;
+                        return consumed;
+                    }
+                    phase = Phase_Match;
+                    break;
+                case Phase_Match:
+                    while (matchLength > 0) {
+                        if (isOutputFull()) {
+                            return consumed;
+                        }
+                        // Copy from the window if we can, otherwise from where the older output went
+                        uint32_t from = position - (token >> 4);
+                        output[position - outputStart] = from >= outputStart ? output[from - outputStart] : history[from];
+                        position++;
+                        matchLength--;
+                    }
+                    phase = Phase_Literal;
+                    break;
+                case Phase_Literal:
+                    if (consumed == inputSize || isOutputFull()) {
+                        return consumed;
+                    }
+                    output[position - outputStart] = input[consumed++];
+                    position++;
+                    phase = position == uncompressedSize ? Phase_Done : Phase_TokenLow;
+                    break;
+                case Phase_Done:
+                case Phase_Error:
+                default:
+                    return consumed;
+            }
+        }
+    }
 
     uint8_t interpolateIntensity(uint8_t intensity1, int time1, uint8_t intensity2, int time2, int time) {
         int scaledPercent = (time - time1) * scaler / (time2 - time1);
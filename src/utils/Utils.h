@@ -36,7 +36,62 @@ namespace Utils
     uint32_t lz77_compress (uint8_t *uncompressed_text, uint32_t uncompressed_size, uint8_t *compressed_text);
     uint32_t lz77_decompress (uint8_t *compressed_text, uint8_t *uncompressed_text);
 
+    /// <summary>
+    /// Incremental decoder for the lz77_compress format. The compressed data can be fed
+    /// in pieces of any size, and the decoded bytes go to an output window provided by
+    /// the caller, so the RAM needed doesn't depend on the size of the data.
+    /// Matches may point up to 4095 bytes back, before the start of the current window,
+    /// so history must point to where the earlier output was moved (i.e. flash).
+    /// </summary>
+    struct LZ77Decoder
+    {
+        void begin(const uint8_t* history);
+
+        // Decoded bytes are written to buffer, starting at the current output position
+        void setOutput(uint8_t* buffer, uint32_t capacity);
+
+        // Returns how many input bytes were used, stops early when the output window is full
+        uint32_t decode(const uint8_t* input, uint32_t inputSize);
+
+        bool isDone() const { return phase == Phase_Done; }
+        bool hasFailed() const { return phase == Phase_Error; }
+        bool isOutputFull() const { return position - outputStart == outputCapacity; }
+        bool hasSize() const { return phase > Phase_Header; }
+        uint32_t getUncompressedSize() const { return uncompressedSize; }
+        uint32_t getOutputOffset() const { return outputStart; }
+        uint32_t getOutputLength() const { return position - outputStart; }
+
+    private:
+        enum Phase : uint8_t
+        {
+            Phase_Header = 0,
+            Phase_TokenLow,
+            Phase_TokenHigh,
+            Phase_Match,
+            Phase_Literal,
+            Phase_Done,
+            Phase_Error
+        };
+
+        const uint8_t* history;
+        uint8_t* output;
+        uint32_t outputCapacity;
+        uint32_t outputStart;       // Position of output[0] in the uncompressed data
+        uint32_t position;          // Number of bytes decoded so far
+        uint32_t uncompressedSize;
+        uint16_t token;
+        uint16_t matchLength;
+        uint8_t headerBytes;
+        Phase phase;
+    };
+
     uint32_t computeHash(const uint8_t* data, int size);
+    uint16_t computeCrc16(const uint8_t* data, int size, uint16_t crc = 0xFFFF);
+    uint32_t computeCrc32(const uint8_t* data, int size);
+
+    // Variable length encoding of integers, 7 bits per byte, least significant first
+    int writeVarint(uint8_t* out, uint32_t value);
+    constexpr uint32_t zigzag(int32_t value) { return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31); }
 
     uint8_t interpolateIntensity(uint8_t intensity1, int time1, uint8_t intensity2, int time2, int time);
     uint32_t modulateColor(uint32_t color, uint8_t intensity);
@@ -0,0 +1,256 @@
+// Host test of the custom advertising data: what the die advertises is decoded with the
+// scanner side of the format, in and out of broadcast mode, and a scanner that only sees
+// some of the advertisements must still recover the roll results or know how many it missed.
+
+#include "test.h"
+#include "bluetooth/bluetooth_custom_advertising_data.h"
+#include "bluetooth/bluetooth_advertising_format.h"
+#include "bluetooth/bluetooth_message_service.h"
+#include "bluetooth/bluetooth_stack.h"
+#include "config/board_config.h"
+#include "config/settings.h"
+#include "drivers_nrf/timers.h"
+#include "modules/accelerometer.h"
+#include "modules/battery_controller.h"
+#include "nordic_common.h"
+#include <string.h>
+#include <vector>
+
+TEST_MAIN_STATE
+
+using namespace Bluetooth;
+using namespace Bluetooth::AdvertisingFormat;
+using namespace Modules;
+using namespace DriversNRF;
+using namespace Config;
+
+#define ROLL_COUNT 2000
+
+typedef std::vector<uint8_t> Bytes;
+
+static uint32_t randomState = 1;
+
+uint32_t randomInt(uint32_t max) {
+    randomState = randomState * 1664525 + 1013904223;
+    return (randomState >> 8) % max;
+}
+
+namespace Bluetooth::CustomAdvertisingDataHandler
+{
+    void idleCallback(void* param);
+}
+
+namespace FakeDie
+{
+    Board board = {};
+    bool storedBroadcastMode = false;
+    int acks = 0;
+    Bytes advertised;
+    int now = 0;
+    MessageService::MessageHandler broadcastModeHandler = nullptr;
+    Accelerometer::RollStateClientMethod rollStateHandler = nullptr;
+    Timers::DelayedCallback flush = nullptr;
+}
+
+namespace Bluetooth::Stack
+{
+    void updateCustomAdvertisingData(uint8_t* data, uint16_t size) { FakeDie::advertised.assign(data, data + size); }
+    uint32_t getAdvertisingReconfigurationCount() { return 0; }
+    void burstAdvertising() {}
+    void idleAdvertising() {}
+    void resumeAdvertising() {}
+}
+
+namespace Bluetooth::MessageService
+{
+    void RegisterMessageHandler(Message::MessageType msgType, MessageHandler handler) {
+        if (msgType == Message::MessageType_SetBroadcastMode) {
+            FakeDie::broadcastModeHandler = handler;
+        }
+    }
+    bool SendReply(Message::MessageType msgType, int16_t sequence) {
+        if (msgType == Message::MessageType_SetBroadcastModeAck) {
+            FakeDie::acks++;
+        }
+        return true;
+    }
+    int16_t getHandledSequence() { return MESSAGE_NO_SEQUENCE; }
+}
+
+namespace Config::BoardManager
+{
+    const Board* getBoard() { return &FakeDie::board; }
+}
+
+namespace Config::SettingsManager
+{
+    DiceVariants::DieType getDieType() { return DiceVariants::DieType_D20; }
+    DiceVariants::Colorway getColorway() { return DiceVariants::Colorway_Onyx_Black; }
+    bool getBroadcastMode() { return FakeDie::storedBroadcastMode; }
+    void programBroadcastMode(bool enabled, SettingsWrittenCallback callback) {
+        FakeDie::storedBroadcastMode = enabled;
+        callback(true);
+    }
+}
+
+namespace Modules::Accelerometer
+{
+    int currentFace() { return 19; }
+    RollState currentRollState() { return RollState_OnFace; }
+    void hookRollState(RollStateClientMethod method, void* param) { FakeDie::rollStateHandler = method; }
+    void unHookRollState(RollStateClientMethod client) { FakeDie::rollStateHandler = nullptr; }
+}
+
+namespace Modules::BatteryController
+{
+    uint8_t getLevelPercent() { return 75; }
+    BatteryState getBatteryState() { return BatteryState_Charging; }
+    void hookBatteryState(BatteryStateChangeHandler method, void* param) {}
+    void unHookBatteryState(BatteryStateChangeHandler client) {}
+    void hookLevel(BatteryLevelChangeHandler method, void* param) {}
+    void unHookLevel(BatteryLevelChangeHandler method) {}
+}
+
+namespace DriversNRF::Timers
+{
+    int millis() { return FakeDie::now; }
+    bool setDelayedCallback(DelayedCallback callback, void* param, int periodMs) {
+        if (callback != CustomAdvertisingDataHandler::idleCallback) {
+            FakeDie::flush = callback;
+        }
+        return true;
+    }
+    bool cancelDelayedCallback(DelayedCallback callback) {
+        if (callback == FakeDie::flush) {
+            FakeDie::flush = nullptr;
+        }
+        return true;
+    }
+}
+
+DieState scan() {
+    DieState state;
+    CHECK(decode(FakeDie::advertised.data(), FakeDie::advertised.size(), state));
+    return state;
+}
+
+void setBroadcastMode(bool enabled) {
+    MessageSetBroadcastMode msg;
+    msg.enabled = enabled ? 1 : 0;
+    FakeDie::broadcastModeHandler(&msg);
+}
+
+void restartAdvertising() {
+    CustomAdvertisingDataHandler::stop();
+    CustomAdvertisingDataHandler::start();
+}
+
+/// <summary>
+/// Rolls the die, the advertising data may be updated several times in between
+/// </summary>
+void roll(uint8_t face) {
+    FakeDie::now += 100;
+    FakeDie::rollStateHandler(nullptr, Accelerometer::RollState_OnFace, 0, Accelerometer::RollState_Rolling, 3);
+    FakeDie::now += 1000;
+    if (FakeDie::flush != nullptr) {
+        auto flush = FakeDie::flush;
+        FakeDie::flush = nullptr;
+        flush(nullptr);
+    }
+    FakeDie::rollStateHandler(nullptr, Accelerometer::RollState_Rolling, 3, Accelerometer::RollState_Rolled, face);
+}
+
+void testBaseData() {
+    FakeDie::board.ledCount = 20;
+    CustomAdvertisingDataHandler::init();
+    CustomAdvertisingDataHandler::start();
+    CHECK_EQ(FakeDie::advertised.size(), BaseDataSize);
+    auto state = scan();
+    CHECK_EQ(state.ledCount, 20);
+    CHECK_EQ(state.dieType, DiceVariants::DieType_D20);
+    CHECK_EQ(state.colorway, DiceVariants::Colorway_Onyx_Black);
+    CHECK_EQ(state.rollState, Accelerometer::RollState_OnFace);
+    CHECK_EQ(state.currentFace, 19);
+    CHECK_EQ(state.batteryLevelPercent, 75);
+    CHECK(state.charging);
+    CHECK(!state.hasRollHistory);
+
+    // Nothing about rolls in the base data
+    roll(4);
+    state = scan();
+    CHECK_EQ(state.currentFace, 4);
+    CHECK_EQ(state.rollState, Accelerometer::RollState_Rolled);
+    CHECK_EQ(countNewRolls(state, state), 0);
+
+    // Other sizes are rejected
+    CHECK(!decode(FakeDie::advertised.data(), BaseDataSize - 1, state));
+    CHECK(!decode(FakeDie::advertised.data(), BroadcastDataSize + 1, state));
+}
+
+void testBroadcastModeIsStored() {
+    setBroadcastMode(true);
+    CHECK_EQ(FakeDie::acks, 1);
+    CHECK(FakeDie::storedBroadcastMode);
+
+    // Applied the next time advertising starts
+    restartAdvertising();
+    CHECK_EQ(FakeDie::advertised.size(), BroadcastDataSize);
+    auto state = scan();
+    CHECK(state.hasRollHistory);
+    CHECK_EQ(state.rollCounter, 1);
+    CHECK_EQ(state.rollHistory[0], 4);
+    CHECK_EQ(state.rollHistory[1], ADV_ROLL_HISTORY_EMPTY);
+
+    // Survives a reboot
+    CustomAdvertisingDataHandler::stop();
+    CustomAdvertisingDataHandler::init();
+    CustomAdvertisingDataHandler::start();
+    CHECK_EQ(FakeDie::advertised.size(), BroadcastDataSize);
+    CHECK_EQ(scan().rollCounter, 0);
+}
+
+void testScannerFollowsRolls() {
+    // The scanner catches some of the advertisements only
+    std::vector<uint8_t> faces;
+    auto previous = scan();
+    size_t seen = 0;
+    int recovered = 0;
+    int missed = 0;
+    for (int i = 0; i < ROLL_COUNT; ++i) {
+        faces.push_back(randomInt(20));
+        roll(faces.back());
+        if (randomInt(3) != 0) {
+            continue;
+        }
+
+        auto current = scan();
+        int newRolls = countNewRolls(previous, current);
+        CHECK_EQ(newRolls, (int)(faces.size() - seen));
+        for (int j = 0; j < MIN(newRolls, ADV_ROLL_HISTORY_SIZE); ++j) {
+            CHECK_EQ(current.rollHistory[j], faces[faces.size() - 1 - j]);
+            recovered++;
+        }
+        missed += MAX(0, newRolls - ADV_ROLL_HISTORY_SIZE);
+        seen = faces.size();
+        previous = current;
+    }
+    printf("  %d rolls, %d recovered, %d known to be missed\n", (int)seen, recovered, missed);
+    CHECK_EQ(recovered + missed, (int)seen);
+    CHECK(ROLL_COUNT > 255);
+}
+
+void testDisableBroadcastMode() {
+    setBroadcastMode(false);
+    CHECK(!FakeDie::storedBroadcastMode);
+    restartAdvertising();
+    CHECK_EQ(FakeDie::advertised.size(), BaseDataSize);
+    CustomAdvertisingDataHandler::stop();
+}
+
+int main() {
+    testBaseData();
+    testBroadcastModeIsStored();
+    testScannerFollowsRolls();
+    testDisableBroadcastMode();
+    return Test::report("advertising_data_test");
+}
@@ -0,0 +1,640 @@
+// Host test of the windowed bulk transfers. The die's sender and receiver talk to each other
+// over a fake link that delays messages and, like a busy app, may reorder and drop them. Every selective ack is checked
+// against the chunks that actually reached the receiver, and every transfer must complete
+// with the data intact. Transfers to flash go to a fake flash that completes writes later,
+// with the heap limited like on the die.
+
+#include "test.h"
+#include "bluetooth/bulk_data_transfer.h"
+#include "bluetooth/bluetooth_messages.h"
+#include "bluetooth/bluetooth_message_service.h"
+#include "bluetooth/bluetooth_stack.h"
+#include "bluetooth/connection_profiles.h"
+#include "drivers_nrf/timers.h"
+#include "drivers_nrf/flash.h"
+#include "utils/Utils.h"
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <set>
+#include <vector>
+
+TEST_MAIN_STATE
+
+using namespace Bluetooth;
+using namespace DriversNRF;
+
+#define MAX_TIMERS 8
+#define LINK_LATENCY_MS 15          // About two connection intervals
+#define LINK_JITTER_MS 15           // Enough for messages to overtake each other, when allowed
+#define MAX_TRANSFER_MS 600000
+#define RANDOM_TRANSFERS 40
+#define MAX_TRANSFER_SIZE 3000
+#define FLASH_PAGE_SIZE 4096
+#define FLASH_SIZE (4 * FLASH_PAGE_SIZE)
+#define FLASH_WRITE_US_PER_WORD 41
+#define DEBUG_HEAP_SIZE 2600
+
+typedef std::vector<uint8_t> Bytes;
+
+static uint32_t randomState = 1;
+
+uint32_t randomInt(uint32_t max) {
+    randomState = randomState * 1664525 + 1013904223;
+    return (randomState >> 8) % max;
+}
+
+namespace FakeLink
+{
+    struct Packet
+    {
+        int deliverAt;
+        Bytes data;
+    };
+
+    int nowMs = 0;
+    int lossPercent = 0;
+    bool reorder = false;
+    int lastDeliverAt = 0;
+    uint16_t maxPayloadSize = NRF_SDH_BLE_GATT_MAX_MTU_SIZE - 3;
+    std::vector<Packet> inFlight;
+    MessageService::MessageHandler handlers[Message::MessageType_Count];
+    uint16_t handledSize = 0;
+    int sentCount = 0;
+
+    // What the receiver told the sender, and what reached the receiver
+    int windowSize = 0;
+    int chunkSize = 0;
+    std::set<int> deliveredChunks;
+    std::set<int> ackedChunks;
+
+    void reset(int loss, bool allowReorder = false) {
+        lossPercent = loss;
+        reorder = allowReorder;
+        inFlight.clear();
+        sentCount = 0;
+        windowSize = chunkSize = 0;
+        deliveredChunks.clear();
+        ackedChunks.clear();
+    }
+
+    /// <summary>
+    /// A windowed ack must only report chunks that were delivered, and never forget one
+    /// </summary>
+    void checkAck(const MessageBulkDataAck* ack) {
+        std::set<int> chunks;
+        int received = (ack->offset + chunkSize - 1) / chunkSize;
+        for (int chunk = 0; chunk < received; ++chunk) {
+            chunks.insert(chunk);
+        }
+        for (int bit = 0; bit < 16; ++bit) {
+            if (ack->receivedMask & (1 << bit)) {
+                chunks.insert(received + 1 + bit);
+            }
+        }
+        CHECK(windowSize > 0 && (ack->receivedMask >> (windowSize - 1)) == 0);
+        for (int chunk : ackedChunks) {
+            CHECK(chunks.count(chunk) == 1);
+        }
+        for (int chunk : chunks) {
+            CHECK(deliveredChunks.count(chunk) == 1);
+        }
+        ackedChunks = chunks;
+    }
+
+    void send(const uint8_t* data, int size) {
+        // Messages sent while handling a sequenced request get a sequence byte
+        CHECK(size + MESSAGE_SEQUENCE_SIZE <= maxPayloadSize);
+        auto msg = (const Message*)data;
+        if (msg->type == Message::MessageType_BulkSetupAck && size == sizeof(MessageBulkSetupAck)) {
+            windowSize = ((const MessageBulkSetupAck*)msg)->windowSize;
+            chunkSize = ((const MessageBulkSetupAck*)msg)->chunkSize;
+        } else if (msg->type == Message::MessageType_BulkDataAck && size == sizeof(MessageBulkDataAck)) {
+            checkAck((const MessageBulkDataAck*)msg);
+        }
+        sentCount++;
+        if ((int)randomInt(100) >= lossPercent) {
+            // BLE itself delivers in order
+            int deliverAt = nowMs + LINK_LATENCY_MS + (int)randomInt(LINK_JITTER_MS + 1);
+            if (!reorder) {
+                deliverAt = MAX(deliverAt, lastDeliverAt);
+            }
+            lastDeliverAt = deliverAt;
+            inFlight.push_back({ deliverAt, Bytes(data, data + size) });
+        }
+    }
+
+    int nextDeliveryTime() {
+        int next = INT32_MAX;
+        for (auto& packet : inFlight) {
+            next = MIN(next, packet.deliverAt);
+        }
+        return next;
+    }
+
+    void deliverDue() {
+        for (size_t i = 0; i < inFlight.size();) {
+            if (inFlight[i].deliverAt > nowMs) {
+                ++i;
+                continue;
+            }
+            Bytes data = inFlight[i].data;
+            inFlight.erase(inFlight.begin() + i);
+            auto msg = (const Message*)data.data();
+            if (msg->type == Message::MessageType_BulkData && chunkSize > 0) {
+                deliveredChunks.insert(((const MessageBulkData*)msg)->offset / chunkSize);
+            }
+            auto handler = handlers[msg->type];
+            if (handler != nullptr) {
+                handledSize = data.size();
+                handler(msg);
+            }
+            // Handlers may have sent messages, start over
+            i = 0;
+        }
+    }
+}
+
+namespace Bluetooth::MessageService
+{
+    bool SendMessage(Message::MessageType msgType) {
+        uint8_t type = msgType;
+        FakeLink::send(&type, 1);
+        return true;
+    }
+    bool SendMessage(const Message* msg, int msgSize) {
+        FakeLink::send((const uint8_t*)msg, msgSize);
+        return true;
+    }
+    void RegisterMessageHandler(Message::MessageType msgType, MessageHandler handler) {
+        if (FakeLink::handlers[msgType] == nullptr) {
+            FakeLink::handlers[msgType] = handler;
+        }
+    }
+    void UnregisterMessageHandler(Message::MessageType msgType) { FakeLink::handlers[msgType] = nullptr; }
+    uint16_t getHandledMessageSize() { return FakeLink::handledSize; }
+}
+
+namespace Bluetooth::Stack
+{
+    uint16_t getMaxPayloadSize() { return FakeLink::maxPayloadSize; }
+}
+
+namespace Bluetooth::ConnectionProfiles
+{
+    void notifyTransfer() {}
+}
+
+namespace FakeTimers
+{
+    struct Timer
+    {
+        app_timer_timeout_handler_t handler;
+        void* context;
+        int fireAt; // -1 when stopped
+    };
+    Timer timers[MAX_TIMERS];
+    int timerCount = 0;
+
+    int nextFireTime() {
+        int next = INT32_MAX;
+        for (int i = 0; i < timerCount; ++i) {
+            if (timers[i].fireAt >= 0) {
+                next = MIN(next, timers[i].fireAt);
+            }
+        }
+        return next;
+    }
+
+    void fireDue() {
+        for (int i = 0; i < timerCount; ++i) {
+            if (timers[i].fireAt >= 0 && timers[i].fireAt <= FakeLink::nowMs) {
+                timers[i].fireAt = -1;
+                timers[i].handler(timers[i].context);
+            }
+        }
+    }
+}
+
+namespace DriversNRF::Timers
+{
+    void createTimer(app_timer_id_t const * p_timer_id, app_timer_mode_t mode, app_timer_timeout_handler_t timeout_handler) {
+        // Timers are recreated with a new handler, keep the same slot
+        intptr_t index = (intptr_t)*p_timer_id;
+        if (index == 0) {
+            index = ++FakeTimers::timerCount;
+            *const_cast<app_timer_id_t*>(p_timer_id) = (app_timer_id_t)index;
+        }
+        FakeTimers::timers[index - 1] = { timeout_handler, nullptr, -1 };
+    }
+    void startTimer(app_timer_id_t timer_id, uint32_t timeout_ms, void * p_context) {
+        auto& timer = FakeTimers::timers[(intptr_t)timer_id - 1];
+        timer.context = p_context;
+        timer.fireAt = FakeLink::nowMs + timeout_ms;
+    }
+    void stopTimer(app_timer_id_t timer_id) {
+        FakeTimers::timers[(intptr_t)timer_id - 1].fireAt = -1;
+    }
+    int millis() { return FakeLink::nowMs; }
+}
+
+namespace FakeFlash
+{
+    struct Write
+    {
+        uint32_t address;
+        const uint8_t* data;
+        uint32_t size;
+        Flash::FlashCallback callback;
+        void* context;
+        int doneAt;
+    };
+
+    uint8_t memory[FLASH_SIZE] __attribute__ ((aligned (FLASH_PAGE_SIZE)));
+    std::vector<Write> pending;
+    int writeCount = 0;
+    int failingWrite = -1;      // Index of the write that fails, if any
+    int usPerWord = FLASH_WRITE_US_PER_WORD;
+    uint32_t writtenEnd = 0;    // End of the last write, transfers write in order
+
+    uint32_t address() {
+        return (uint32_t)(uintptr_t)memory;
+    }
+
+    void erase() {
+        memset(memory, 0xFF, sizeof(memory));
+        pending.clear();
+        writeCount = 0;
+        writtenEnd = address();
+    }
+
+    int nextDoneTime() {
+        return pending.empty() ? INT32_MAX : pending.front().doneAt;
+    }
+
+    /// <summary>
+    /// Completes the writes due, in order. Like fstorage, the data is only read then,
+    /// so the caller's buffer must stay untouched until the callback
+    /// </summary>
+    void completeDue() {
+        while (!pending.empty() && pending.front().doneAt <= FakeLink::nowMs) {
+            Write write = pending.front();
+            pending.erase(pending.begin());
+            CHECK(write.address >= writtenEnd);
+            writtenEnd = write.address + write.size;
+            if (writeCount++ == failingWrite) {
+                write.callback(write.context, false, write.address, write.size);
+                continue;
+            }
+            uint8_t* target = &memory[write.address - address()];
+            for (uint32_t i = 0; i < write.size; ++i) {
+                // Programming can only clear bits
+                CHECK((target[i] & write.data[i]) == write.data[i]);
+                target[i] &= write.data[i];
+            }
+            write.callback(write.context, true, write.address, write.size);
+        }
+    }
+}
+
+namespace DriversNRF::Flash
+{
+    void write(void* context, uint32_t flashAddress, const void* data, uint32_t size, FlashCallback callback) {
+        CHECK(flashAddress % 4 == 0 && size % 4 == 0);
+        CHECK(flashAddress >= FakeFlash::address() && flashAddress + size <= FakeFlash::address() + FLASH_SIZE);
+        int startMs = FakeFlash::pending.empty() ? FakeLink::nowMs : FakeFlash::pending.back().doneAt;
+        int durationMs = 1 + size / 4 * FakeFlash::usPerWord / 1000;
+        FakeFlash::pending.push_back({ flashAddress, (const uint8_t*)data, size, callback, context, startMs + durationMs });
+    }
+    uint32_t getPageSize() { return FLASH_PAGE_SIZE; }
+}
+
+// The heap is shared with the SoftDevice and small, larger allocations fail
+namespace FakeHeap
+{
+    size_t largestBlock = SIZE_MAX;
+    size_t largestAllocation = 0;
+}
+
+extern "C" void* __real_malloc(size_t size);
+extern "C" void* __wrap_malloc(size_t size) {
+    if (size > FakeHeap::largestBlock) {
+        return nullptr;
+    }
+    FakeHeap::largestAllocation = MAX(FakeHeap::largestAllocation, size);
+    return __real_malloc(size);
+}
+
+namespace Transfer
+{
+    bool sendDone;
+    bool sendResult;
+    bool receiveDone;
+    bool receiveResult;
+    Bytes received;
+
+    void onSent(void* context, bool result, const uint8_t* data, uint16_t size) {
+        sendDone = true;
+        sendResult = result;
+    }
+
+    uint8_t* allocate(void* context, uint16_t size) {
+        return (uint8_t*)malloc(size);
+    }
+
+    void onReceived(void* context, bool result, uint8_t* data, uint16_t size) {
+        receiveDone = true;
+        receiveResult = result;
+        if (result) {
+            received.assign(data, data + size);
+        }
+        free(data);
+    }
+
+    /// <summary>
+    /// Runs the link and the timers until both ends are done, returns the duration in ms
+    /// </summary>
+    int run() {
+        int startMs = FakeLink::nowMs;
+        while (!(sendDone && receiveDone) && FakeLink::nowMs - startMs < MAX_TRANSFER_MS) {
+            FakeLink::deliverDue();
+            FakeTimers::fireDue();
+            FakeFlash::completeDue();
+            int next = MIN(MIN(FakeLink::nextDeliveryTime(), FakeTimers::nextFireTime()), FakeFlash::nextDoneTime());
+            if (next == INT32_MAX) {
+                break;
+            }
+            FakeLink::nowMs = MAX(next, FakeLink::nowMs);
+        }
+        return FakeLink::nowMs - startMs;
+    }
+
+    /// <summary>
+    /// Transfers the data and checks the outcome, returns the duration in ms.
+    /// Both ends give up after MAX_RETRY_COUNT timeouts in a row, which may happen on a very
+    /// lossy link. The sender must then never believe a failed transfer succeeded.
+    /// </summary>
+    int transfer(const Bytes& data, bool mayFail = false) {
+        sendDone = receiveDone = false;
+        received.clear();
+        ReceiveBulkData::receive(nullptr, allocate, onReceived);
+        SendBulkData::send(data.data(), data.size(), nullptr, onSent);
+        int duration = run();
+        CHECK(sendDone && receiveDone);
+        if (!mayFail) {
+            CHECK(sendResult && receiveResult);
+        }
+        if (sendResult) {
+            CHECK(receiveResult);
+        }
+        if (receiveResult) {
+            CHECK(received == data);
+        }
+        return duration;
+    }
+
+    void onReceivedToFlash(void* context, bool result, uint32_t address, uint16_t size) {
+        receiveDone = true;
+        receiveResult = result;
+        if (result) {
+            CHECK_EQ(address, FakeFlash::address());
+            received.assign(FakeFlash::memory, FakeFlash::memory + size);
+        }
+    }
+
+    /// <summary>
+    /// Sends the data, compressed or not, to the fake flash. Returns the duration in ms.
+    /// </summary>
+    int transferToFlash(const Bytes& data, bool compressed, uint32_t expectedSize, bool mayFail = false) {
+        Bytes sent = data;
+        if (compressed) {
+            sent.resize(4 + 3 * data.size());
+            sent.resize(Utils::lz77_compress(const_cast<uint8_t*>(data.data()), data.size(), sent.data()));
+        }
+        FakeFlash::erase();
+        FakeHeap::largestAllocation = 0;
+        sendDone = receiveDone = false;
+        received.clear();
+        if (compressed) {
+            ReceiveBulkData::receiveToFlashDecompressed(FakeFlash::address(), expectedSize, nullptr, onReceivedToFlash);
+        } else {
+            ReceiveBulkData::receiveToFlash(FakeFlash::address(), nullptr, onReceivedToFlash);
+        }
+        SendBulkData::send(sent.data(), sent.size(), nullptr, onSent);
+        int duration = run();
+        CHECK(sendDone && receiveDone);
+        CHECK(FakeFlash::pending.empty());
+        if (!mayFail) {
+            CHECK(sendResult && receiveResult);
+        }
+        if (receiveResult) {
+            CHECK(received == data);
+        }
+        return duration;
+    }
+}
+
+Bytes makeData(int size) {
+    Bytes data(size);
+    for (auto& b : data) {
+        b = randomInt(256);
+    }
+    return data;
+}
+
+/// <summary>
+/// Something like an animation dataset: a palette, then runs of similar keyframes and tracks
+/// </summary>
+Bytes makeDataSetLikeData(int size) {
+    Bytes data;
+    for (int i = 0; i < 16 * 3; ++i) {
+        data.push_back(randomInt(256));
+    }
+    while ((int)data.size() < size) {
+        int count = 2 + randomInt(10);
+        int step = 20 + 20 * randomInt(5);
+        for (int k = 0; k < count && (int)data.size() < size; ++k) {
+            // Time in 20ms steps and a palette index
+            uint16_t keyframe = ((k * step / 20) << 7) | randomInt(16);
+            data.push_back(keyframe & 0xFF);
+            data.push_back(keyframe >> 8);
+        }
+        for (int t = 0; t < 8 && (int)data.size() < size; ++t) {
+            data.push_back(t == 0 ? count : (t == 4 ? 0xFF : 0));
+        }
+    }
+    data.resize(size & ~3);
+    return data;
+}
+
+void testLossless() {
+    FakeLink::reset(0);
+    auto data = makeData(2048);
+    int duration = Transfer::transfer(data);
+    CHECK_EQ(FakeLink::windowSize, 8);
+    CHECK(FakeLink::chunkSize > 0 && FakeLink::chunkSize % 4 == 0);
+    printf("  lossless: %d bytes in %dms, %d messages\n", (int)data.size(), duration, FakeLink::sentCount);
+}
+
+void testChunkSizes() {
+    // Chunks fill the notification payload of the connection, minus the MessageBulkData
+    // header and the sequence byte, rounded down to words. Every message is checked against the payload in FakeLink::send()
+    const uint16_t payloadSizes[] = { 20, 27, 64, 100, NRF_SDH_BLE_GATT_MAX_MTU_SIZE - 3 };
+    for (auto payloadSize : payloadSizes) {
+        FakeLink::reset(0);
+        FakeLink::maxPayloadSize = payloadSize;
+        auto data = makeData(1500);
+        int duration = Transfer::transfer(data);
+        int expected = MIN((payloadSize - MESSAGE_SEQUENCE_SIZE - (int)offsetof(MessageBulkData, data)) & ~3, MAX_BULK_DATA_SIZE);
+        CHECK_EQ(FakeLink::chunkSize, expected);
+        printf("  payload %d: %d bytes chunks, %d bytes in %dms, %d messages\n",
+            payloadSize, FakeLink::chunkSize, (int)data.size(), duration, FakeLink::sentCount);
+    }
+    FakeLink::maxPayloadSize = NRF_SDH_BLE_GATT_MAX_MTU_SIZE - 3;
+}
+
+void testLossyTransfers() {
+    // Losing one message in 20 must not fail a transfer, one in 5 may
+    const int lossPercents[] = { 5, 20 };
+    for (int loss : lossPercents) {
+        int totalMs = 0;
+        int totalBytes = 0;
+        int failures = 0;
+        for (int i = 0; i < RANDOM_TRANSFERS; ++i) {
+            FakeLink::reset(loss, true);
+            auto data = makeData(1 + randomInt(MAX_TRANSFER_SIZE));
+            totalMs += Transfer::transfer(data, loss > 5);
+            if (Transfer::sendResult) {
+                totalBytes += data.size();
+            } else {
+                failures++;
+            }
+        }
+        printf("  %d%% loss: %d transfers, %d failed, %d bytes in %dms\n", loss, RANDOM_TRANSFERS, failures, totalBytes, totalMs);
+    }
+}
+
+void testDecompressionToFlash() {
+    // The decompression buffer falls back to smaller blocks when the heap is short
+    const size_t heapLimits[] = { SIZE_MAX, DEBUG_HEAP_SIZE, 600 };
+    for (auto heapLimit : heapLimits) {
+        FakeLink::reset(0);
+        FakeHeap::largestBlock = heapLimit;
+        auto data = makeDataSetLikeData(6000);
+        int duration = Transfer::transferToFlash(data, true, data.size());
+        CHECK(FakeHeap::largestAllocation <= heapLimit);
+        printf("  decompressing with a %d bytes heap: %d bytes buffer, %d flash writes, %dms\n",
+            heapLimit == SIZE_MAX ? -1 : (int)heapLimit, (int)FakeHeap::largestAllocation, FakeFlash::writeCount, duration);
+    }
+
+    // Not even the smallest buffer
+    FakeLink::reset(0);
+    FakeHeap::largestBlock = 200;
+    Transfer::transferToFlash(makeDataSetLikeData(1000), true, 1000, true);
+    CHECK(!Transfer::receiveResult && !Transfer::sendResult);
+    FakeHeap::largestBlock = SIZE_MAX;
+
+    // The data must decompress to the size of the dataset, no more, no less
+    auto data = makeDataSetLikeData(2000);
+    const int sizeErrors[] = { -4, 4 };
+    for (int error : sizeErrors) {
+        FakeLink::reset(0);
+        Transfer::transferToFlash(data, true, data.size() + error, true);
+        CHECK(!Transfer::receiveResult);
+    }
+
+    // Lossy link and random data, which doesn't compress
+    FakeLink::reset(5, true);
+    data = makeData(1024);
+    Transfer::transferToFlash(data, true, data.size());
+}
+
+void testStagingToFlash() {
+    // Two staging blocks make a page, or less when the heap is short
+    const size_t heapLimits[] = { SIZE_MAX, DEBUG_HEAP_SIZE, 600 };
+    for (auto heapLimit : heapLimits) {
+        FakeLink::reset(0);
+        FakeHeap::largestBlock = heapLimit;
+        auto data = makeData(6000);
+        int duration = Transfer::transferToFlash(data, false, 0);
+        CHECK(FakeHeap::largestAllocation <= heapLimit);
+        int blockSize = FakeHeap::largestAllocation / 2;
+        CHECK(blockSize >= MAX_BULK_DATA_SIZE);
+        CHECK_EQ(FakeFlash::writeCount, (int)(data.size() + blockSize - 1) / blockSize);
+        printf("  staging with a %d bytes heap: %d bytes blocks, %d flash writes, %dms\n",
+            heapLimit == SIZE_MAX ? -1 : (int)heapLimit, blockSize, FakeFlash::writeCount, duration);
+    }
+
+    // Not even two of the smallest blocks
+    FakeLink::reset(0);
+    FakeHeap::largestBlock = 400;
+    Transfer::transferToFlash(makeData(1000), false, 0, true);
+    CHECK(!Transfer::receiveResult && !Transfer::sendResult);
+    CHECK_EQ(FakeFlash::writeCount, 0);
+    FakeHeap::largestBlock = SIZE_MAX;
+
+    // Chunks arriving while their block is written are held, then staged
+    for (int i = 0; i < RANDOM_TRANSFERS / 4; ++i) {
+        FakeLink::reset(5, true);
+        FakeHeap::largestBlock = randomInt(2) == 0 ? SIZE_MAX : 600;
+        Transfer::transferToFlash(makeData(1 + randomInt(MAX_TRANSFER_SIZE)), false, 0);
+    }
+    FakeHeap::largestBlock = SIZE_MAX;
+
+    // Whichever write fails, the transfer fails, and nothing is written after it
+    auto data = makeData(3000);
+    FakeLink::reset(0);
+    FakeHeap::largestBlock = 600;
+    Transfer::transferToFlash(data, false, 0);
+    const int writeCount = FakeFlash::writeCount;
+    for (int failing = 0; failing < writeCount; ++failing) {
+        FakeLink::reset(0);
+        FakeFlash::failingWrite = failing;
+        Transfer::transferToFlash(data, false, 0, true);
+        CHECK(!Transfer::receiveResult);
+        CHECK_EQ(FakeFlash::writeCount, failing + 1);
+    }
+    FakeFlash::failingWrite = -1;
+    FakeHeap::largestBlock = SIZE_MAX;
+    FakeLink::reset(0);
+    Transfer::transferToFlash(data, false, 0);
+
+    // Upload throughput as the flash gets slower, the radio keeps going while blocks are written
+    const int usPerWords[] = { FLASH_WRITE_US_PER_WORD, 4 * FLASH_WRITE_US_PER_WORD, 16 * FLASH_WRITE_US_PER_WORD };
+    data = makeData(8000);
+    for (int usPerWord : usPerWords) {
+        FakeFlash::usPerWord = usPerWord;
+        FakeLink::reset(0);
+        int duration = Transfer::transferToFlash(data, false, 0);
+        printf("  flash writing %dus per word: %d bytes in %dms, %d bytes/s\n",
+            usPerWord, (int)data.size(), duration, (int)(data.size() * 1000 / duration));
+    }
+    FakeFlash::usPerWord = FLASH_WRITE_US_PER_WORD;
+}
+
+void benchmarkCompression() {
+    const int sizes[] = { 1000, 4000, 8000 };
+    for (int size : sizes) {
+        auto data = makeDataSetLikeData(size);
+        FakeLink::reset(0);
+        int rawMs = Transfer::transferToFlash(data, false, 0);
+        int rawMessages = FakeLink::sentCount;
+        FakeLink::reset(0);
+        int compressedMs = Transfer::transferToFlash(data, true, data.size());
+        int compressedMessages = FakeLink::sentCount;
+        Bytes compressed(4 + 3 * data.size());
+        int compressedSize = Utils::lz77_compress(data.data(), data.size(), compressed.data());
+        printf("  %d bytes dataset: %d bytes compressed (%d%%), raw %dms %d messages, compressed %dms %d messages\n",
+            (int)data.size(), compressedSize, compressedSize * 100 / (int)data.size(), rawMs, rawMessages, compressedMs, compressedMessages);
+    }
+}
+
+int main() {
+    testLossless();
+    testChunkSizes();
+    testLossyTransfers();
+    testDecompressionToFlash();
+    testStagingToFlash();
+    benchmarkCompression();
+    return Test::report("bulk_transfer_test");
+}
@@ -0,0 +1,115 @@
+// Host test of the dataset CRC32: it must match the standard (zlib) CRC-32 whatever the size
+// and alignment of the data, since the word at a time path is only taken on aligned data.
+// Also reports the throughput of the CRC32 and of the original byte hash on dataset sizes.
+
+#include "test.h"
+#include "utils/Utils.h"
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+TEST_MAIN_STATE
+
+#define RANDOM_ROUNDS 2000
+#define MAX_DATA_SIZE 300
+#define BENCHMARK_BYTES (16 * 1024 * 1024)
+
+typedef std::vector<uint8_t> Bytes;
+
+static uint32_t randomState = 1;
+
+uint32_t randomInt(uint32_t max) {
+    randomState = randomState * 1664525 + 1013904223;
+    return (randomState >> 8) % max;
+}
+
+/// <summary>
+/// Bit at a time CRC-32, reflected 0x04C11DB7 polynomial
+/// </summary>
+uint32_t referenceCrc32(const uint8_t* data, int size) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (int i = 0; i < size; ++i) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+uint32_t crc32(const char* text) {
+    return Utils::computeCrc32((const uint8_t*)text, strlen(text));
+}
+
+void testKnownValues() {
+    CHECK_EQ(crc32(""), 0x00000000);
+    CHECK_EQ(crc32("a"), 0xE8B7BE43);
+    CHECK_EQ(crc32("123456789"), 0xCBF43926);
+    CHECK_EQ(crc32("The quick brown fox jumps over the lazy dog"), 0x414FA339);
+
+    // The byte hash reported to the app is unchanged
+    CHECK_EQ(Utils::computeHash((const uint8_t*)"", 0), 5381);
+    CHECK_EQ(Utils::computeHash((const uint8_t*)"123456789", 9), 0x3BABEA14);
+}
+
+void testAlignments() {
+    // Word aligned storage, the data starts at every offset within a word
+    std::vector<uint32_t> words(MAX_DATA_SIZE / 4 + 2);
+    auto buffer = (uint8_t*)words.data();
+    for (int round = 0; round < RANDOM_ROUNDS; ++round) {
+        int offset = randomInt(4);
+        int size = randomInt(MAX_DATA_SIZE + 1);
+        for (int i = 0; i < size; ++i) {
+            buffer[offset + i] = randomInt(256);
+        }
+        if (!CHECK_EQ(Utils::computeCrc32(buffer + offset, size), referenceCrc32(buffer + offset, size))) {
+            printf("  offset %d, size %d\n", offset, size);
+            break;
+        }
+    }
+
+    // Any change to the data is detected
+    uint8_t* data = buffer;
+    const int size = MAX_DATA_SIZE;
+    const uint32_t crc = Utils::computeCrc32(data, size);
+    for (int round = 0; round < RANDOM_ROUNDS; ++round) {
+        int index = randomInt(size);
+        uint8_t bit = 1 << randomInt(8);
+        data[index] ^= bit;
+        CHECK(Utils::computeCrc32(data, size) != crc);
+        data[index] ^= bit;
+    }
+    CHECK_EQ(Utils::computeCrc32(data, size), crc);
+}
+
+template <typename Func>
+double measureMBps(const Bytes& data, Func func) {
+    volatile uint32_t sink = 0;
+    int count = BENCHMARK_BYTES / data.size();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; ++i) {
+        sink = sink + func(data.data(), data.size());
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return BENCHMARK_BYTES / (1024.0 * 1024.0) / elapsed.count();
+}
+
+void benchmark() {
+    // Host numbers, only their ratio says something about the die
+    for (int kb : { 1, 4, 16 }) {
+        Bytes data(kb * 1024);
+        for (auto& byte : data) {
+            byte = randomInt(256);
+        }
+        double crc = measureMBps(data, Utils::computeCrc32);
+        double hash = measureMBps(data, Utils::computeHash);
+        printf("  %2d KB: crc32 %.0f MB/s, byte hash %.0f MB/s\n", kb, crc, hash);
+    }
+}
+
+int main() {
+    testKnownValues();
+    testAlignments();
+    benchmark();
+    return Test::report("crc32_test");
+}
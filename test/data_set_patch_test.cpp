@@ -0,0 +1,471 @@
+// Host test of the dataset patches: the app side builds patches from the manifest the die
+// sends, the die assembles them in RAM and programs the result over the current dataset.
+// Patches that don't describe the new data, or don't match its hash or CRC, must never
+// reach the flash, and a bad write must not be committed.
+
+#include "test.h"
+#include "data_set/data_set.h"
+#include "data_set/data_set_data.h"
+#include "drivers_nrf/flash.h"
+#include "bluetooth/bluetooth_message_service.h"
+#include "utils/Utils.h"
+#include "nordic_common.h"
+#include <string.h>
+#include <vector>
+
+TEST_MAIN_STATE
+
+using namespace Bluetooth;
+using namespace DriversNRF;
+
+namespace DataSet
+{
+    void RequestDataSetManifestHandler(const Message* msg);
+    void ReceiveDataSetPatchHandler(const Message* msg);
+}
+
+#define SLOT_SIZE 4096
+#define RANDOM_PATCHES 500
+#define MAX_DATA_SIZE 3800
+
+typedef std::vector<uint8_t> Bytes;
+
+static uint32_t randomState = 1;
+
+uint32_t randomInt(uint32_t max) {
+    randomState = randomState * 1664525 + 1013904223;
+    return (randomState >> 8) % max;
+}
+
+namespace FakeHeap
+{
+    size_t largestBlock = SIZE_MAX;
+}
+
+extern "C" void* __real_malloc(size_t size);
+extern "C" void* __wrap_malloc(size_t size) {
+    return size > FakeHeap::largestBlock ? nullptr : __real_malloc(size);
+}
+
+/// <summary>
+/// The dataset page, written like NOR flash: erasing sets all the bits, writing only clears them
+/// </summary>
+namespace FakeFlash
+{
+    uint8_t slot[SLOT_SIZE] __attribute__ ((aligned (4096)));
+    uint32_t committedSize = 0; // Size written in the header, 0 if there is no valid header
+    bool busy = false;
+    bool programming = false;
+    bool corruptWrites = false;
+    int programCount = 0;
+
+    uint32_t address() {
+        return (uint32_t)(uintptr_t)slot;
+    }
+
+    void program(const Bytes& data) {
+        memset(slot, 0xFF, SLOT_SIZE);
+        memcpy(slot, data.data(), data.size());
+        committedSize = data.size();
+    }
+
+    Bytes content() {
+        return Bytes(slot, slot + committedSize);
+    }
+}
+
+namespace FakeDataSet
+{
+    uint32_t newSize = 0;       // What the layout of the next transfer message describes
+    uint32_t size = 0;
+    uint32_t hash = 0;
+    Bytes defaults;
+    int defaultsCount = 0;
+}
+
+namespace DriversNRF::Flash
+{
+    static DataSet::Data newHeader;
+    static ProgramFlashNotification onFinished;
+
+    uint32_t getDataSetDataAddress() { return FakeFlash::address(); }
+    bool isBusy() { return FakeFlash::busy || FakeFlash::programming; }
+
+    void write(void* context, uint32_t flashAddress, const void* data, uint32_t size, FlashCallback callback) {
+        CHECK(flashAddress % 4 == 0 && size % 4 == 0);
+        CHECK(flashAddress >= FakeFlash::address() && flashAddress + size <= FakeFlash::address() + SLOT_SIZE);
+        auto dst = (uint8_t*)(uintptr_t)flashAddress;
+        auto src = (const uint8_t*)data;
+        for (uint32_t i = 0; i < size; ++i) {
+            dst[i] &= src[i];
+        }
+        if (FakeFlash::corruptWrites && size > 0) {
+            dst[randomInt(size)] ^= 1 << randomInt(8);
+        }
+        callback(context, true, flashAddress, size);
+    }
+
+    bool programDataSet(const DataSet::Data& data, ProgramFlashFunc programFlashFunc, ProgramFlashNotification onProgramFinished) {
+        if (FakeFlash::programming) {
+            return false;
+        }
+        FakeFlash::programming = true;
+        FakeFlash::programCount++;
+        newHeader = data;
+        onFinished = onProgramFinished;
+
+        // A single slot, the current data is gone from here on
+        memset(FakeFlash::slot, 0xFF, SLOT_SIZE);
+        FakeFlash::committedSize = 0;
+        programFlashFunc([](void* context, bool result, uint32_t address, uint16_t size) {
+            if (result) {
+                FakeFlash::committedSize = DataSet::computeDataSetDataSize(&newHeader);
+            }
+            FakeFlash::programming = false;
+            onFinished(result);
+        });
+        return true;
+    }
+}
+
+namespace DataSet
+{
+    uint32_t dataSize() { return FakeDataSet::size; }
+    uint32_t dataHash() { return FakeDataSet::hash; }
+    uint32_t availableDataSize() { return SLOT_SIZE - sizeof(Data); }
+    bool CheckValid() { return FakeFlash::committedSize > 0; }
+
+    void setupDataLayout(Data& newData, const MessageTransferAnimSet* message) {
+        newData.conditionCount = FakeDataSet::newSize;
+    }
+
+    uint32_t computeDataSetDataSize(const Data* newData) {
+        return newData->conditionCount;
+    }
+
+    void refreshSizeAndHash() {
+        FakeDataSet::size = FakeFlash::committedSize;
+        FakeDataSet::hash = CheckValid() ? Utils::computeHash(FakeFlash::slot, FakeDataSet::size) : 0;
+    }
+
+    void ProgramDefaultDataSet(DataSetWrittenCallback callback) {
+        FakeDataSet::defaultsCount++;
+        FakeFlash::program(FakeDataSet::defaults);
+        callback(true);
+    }
+}
+
+/// <summary>
+/// The messages sent by the die, and the bulk transfers, completed as soon as they start
+/// </summary>
+namespace FakeApp
+{
+    std::vector<Bytes> messages;
+    Bytes manifest;
+    ReceiveBulkData::receiveAllocator allocator = nullptr;
+    ReceiveBulkData::receiveResultCallback onReceived = nullptr;
+
+    void reset() {
+        messages.clear();
+        allocator = nullptr;
+        onReceived = nullptr;
+    }
+
+    // Result of the last message of the given type, -1 if there is none
+    int getResult(Message::MessageType type) {
+        for (int i = messages.size() - 1; i >= 0; --i) {
+            if (messages[i][0] == type) {
+                return messages[i][1];
+            }
+        }
+        return -1;
+    }
+
+    void deliver(const Bytes& records, bool result = true) {
+        if (!CHECK(onReceived != nullptr)) {
+            return;
+        }
+        auto callback = onReceived;
+        onReceived = nullptr;
+        uint8_t* data = allocator(nullptr, records.size());
+        if (data == nullptr) {
+            callback(nullptr, false, nullptr, 0);
+            return;
+        }
+        memcpy(data, records.data(), records.size());
+        callback(nullptr, result, data, records.size());
+    }
+}
+
+namespace Bluetooth::MessageService
+{
+    bool SendMessage(const Message* msg, int msgSize) {
+        auto data = (const uint8_t*)msg;
+        FakeApp::messages.push_back(Bytes(data, data + msgSize));
+        return true;
+    }
+    bool SendReply(const Message* msg, int msgSize, int16_t sequence) {
+        return SendMessage(msg, msgSize);
+    }
+    int16_t getHandledSequence() { return MESSAGE_NO_SEQUENCE; }
+}
+
+namespace Bluetooth::SendBulkData
+{
+    void send(const uint8_t* theData, uint16_t theSize, void* context, sendResultCallback callback) {
+        FakeApp::manifest.assign(theData, theData + theSize);
+        callback(context, true, theData, theSize);
+    }
+}
+
+namespace Bluetooth::ReceiveBulkData
+{
+    void receive(void* context, receiveAllocator allocator, receiveResultCallback callback) {
+        FakeApp::allocator = allocator;
+        FakeApp::onReceived = callback;
+    }
+}
+
+Bytes makeData(int size) {
+    Bytes data(size);
+    for (auto& byte : data) {
+        byte = randomInt(256);
+    }
+    return data;
+}
+
+/// <summary>
+/// A few changed ranges, and maybe a different size
+/// </summary>
+Bytes modify(const Bytes& data) {
+    Bytes modified = data;
+    int edits = randomInt(4);
+    for (int i = 0; i < edits && !modified.empty(); ++i) {
+        int offset = randomInt(modified.size());
+        int length = 1 + randomInt(40);
+        length = MIN(length, (int)modified.size() - offset);
+        for (int j = 0; j < length; ++j) {
+            modified[offset + j] = randomInt(256);
+        }
+    }
+    if (randomInt(3) == 0) {
+        int size = modified.size() + randomInt(600) - 300;
+        modified.resize(MAX(1, MIN(MAX_DATA_SIZE, size)), 0x5A);
+    }
+    return modified;
+}
+
+Bytes requestManifest() {
+    FakeApp::reset();
+    FakeApp::manifest.clear();
+    DataSet::RequestDataSetManifestHandler(nullptr);
+    if (CHECK_EQ(FakeApp::messages.size(), 1)) {
+        auto msg = (const MessageDataSetManifest*)FakeApp::messages[0].data();
+        CHECK_EQ(msg->dataSize, FakeDataSet::size);
+        CHECK_EQ(msg->dataHash, FakeDataSet::hash);
+        CHECK_EQ(msg->blockSize, DATA_SET_BLOCK_SIZE);
+        CHECK_EQ(msg->blockCount * sizeof(uint16_t), FakeApp::manifest.size());
+    }
+    return FakeApp::manifest;
+}
+
+/// <summary>
+/// What the app does: sends the blocks which CRC isn't in the manifest
+/// </summary>
+Bytes makeRecords(const Bytes& manifest, uint32_t currentSize, const Bytes& newData) {
+    Bytes records;
+    uint16_t blockCount = (newData.size() + DATA_SET_BLOCK_SIZE - 1) / DATA_SET_BLOCK_SIZE;
+    for (uint16_t i = 0; i < blockCount; ++i) {
+        uint32_t offset = i * DATA_SET_BLOCK_SIZE;
+        uint32_t length = MIN(DATA_SET_BLOCK_SIZE, newData.size() - offset);
+        bool unchanged = offset + length <= currentSize && (i + 1) * sizeof(uint16_t) <= manifest.size() &&
+            MIN(DATA_SET_BLOCK_SIZE, currentSize - offset) == length;
+        if (unchanged) {
+            uint16_t crc;
+            memcpy(&crc, &manifest[i * sizeof(uint16_t)], sizeof(uint16_t));
+            unchanged = crc == Utils::computeCrc16(&newData[offset], length);
+        }
+        if (!unchanged) {
+            records.push_back(i & 0xFF);
+            records.push_back(i >> 8);
+            records.insert(records.end(), newData.begin() + offset, newData.begin() + offset + length);
+        }
+    }
+    return records;
+}
+
+/// <summary>
+/// Sends the patch message, returns the ack result
+/// </summary>
+int startPatch(const Bytes& newData, uint16_t patchSize, uint32_t hash, uint32_t crc) {
+    FakeApp::reset();
+    FakeDataSet::newSize = newData.size();
+    MessageTransferAnimSetPatch msg;
+    msg.patchSize = patchSize;
+    msg.dataHash = hash;
+    msg.dataCrc = crc;
+    DataSet::ReceiveDataSetPatchHandler(&msg);
+    return FakeApp::getResult(Message::MessageType_TransferAnimSetAck);
+}
+
+/// <summary>
+/// Applies the patch, returns the finished result, -1 if the patch wasn't accepted
+/// </summary>
+int applyPatch(const Bytes& newData, const Bytes& records, uint32_t hash, uint32_t crc) {
+    if (startPatch(newData, records.size(), hash, crc) != 1) {
+        return -1;
+    }
+    if (!records.empty()) {
+        FakeApp::deliver(records);
+    }
+    return FakeApp::getResult(Message::MessageType_TransferAnimSetPatchFinished);
+}
+
+int applyPatch(const Bytes& newData, const Bytes& records) {
+    return applyPatch(newData, records, Utils::computeHash(newData.data(), newData.size()),
+        Utils::computeCrc32(newData.data(), newData.size()));
+}
+
+void setCurrentData(const Bytes& data) {
+    FakeFlash::program(data);
+    DataSet::refreshSizeAndHash();
+}
+
+void testRandomPatches() {
+    setCurrentData(makeData(1 + randomInt(MAX_DATA_SIZE)));
+    int patchBytes = 0;
+    int fullBytes = 0;
+    for (int i = 0; i < RANDOM_PATCHES; ++i) {
+        Bytes newData = i % 50 == 0 ? makeData(1 + randomInt(MAX_DATA_SIZE)) : modify(FakeFlash::content());
+        auto records = makeRecords(requestManifest(), FakeDataSet::size, newData);
+        CHECK_EQ(applyPatch(newData, records), 1);
+        CHECK(FakeFlash::content() == newData);
+        CHECK_EQ(FakeDataSet::hash, Utils::computeHash(newData.data(), newData.size()));
+        patchBytes += records.size();
+        fullBytes += newData.size();
+    }
+    printf("  %d patches, %d bytes sent instead of %d\n", RANDOM_PATCHES, patchBytes, fullBytes);
+    CHECK(patchBytes < fullBytes / 2);
+}
+
+/// <summary>
+/// The patch is applied with broken records, nothing must be programmed
+/// </summary>
+void checkRejected(const Bytes& newData, const Bytes& records, uint32_t hash, uint32_t crc) {
+    auto current = FakeFlash::content();
+    int programCount = FakeFlash::programCount;
+    CHECK_EQ(applyPatch(newData, records, hash, crc), 0);
+    CHECK_EQ(FakeFlash::programCount, programCount);
+    CHECK(FakeFlash::content() == current);
+}
+
+void checkRejected(const Bytes& newData, const Bytes& records) {
+    checkRejected(newData, records, Utils::computeHash(newData.data(), newData.size()),
+        Utils::computeCrc32(newData.data(), newData.size()));
+}
+
+void testBadPatchesAreRejected() {
+    setCurrentData(makeData(2000));
+    auto newData = FakeFlash::content();
+    newData[10] ^= 1;
+    newData[1500] ^= 1;
+    newData.resize(2300, 0x5A);
+    auto records = makeRecords(requestManifest(), FakeDataSet::size, newData);
+    uint32_t hash = Utils::computeHash(newData.data(), newData.size());
+    uint32_t crc = Utils::computeCrc32(newData.data(), newData.size());
+    uint32_t recordSize = sizeof(uint16_t) + DATA_SET_BLOCK_SIZE;
+
+    // Blocks 0, 5, 7 and 8
+    CHECK_EQ(records.size(), 3 * recordSize + sizeof(uint16_t) + 2300 - 8 * DATA_SET_BLOCK_SIZE);
+
+    // Wrong hash or CRC
+    checkRejected(newData, records, hash + 1, crc);
+    checkRejected(newData, records, hash, crc + 1);
+
+    // Out of order
+    Bytes swapped(records.begin() + recordSize, records.begin() + 2 * recordSize);
+    swapped.insert(swapped.end(), records.begin(), records.begin() + recordSize);
+    swapped.insert(swapped.end(), records.begin() + 2 * recordSize, records.end());
+    checkRejected(newData, swapped);
+
+    // Truncated last record
+    checkRejected(newData, Bytes(records.begin(), records.end() - 1));
+
+    // A block past the end of the current data is missing
+    checkRejected(newData, Bytes(records.begin(), records.begin() + 3 * recordSize));
+
+    // Left over records
+    Bytes extra = records;
+    extra.push_back(9);
+    extra.push_back(0);
+    extra.insert(extra.end(), 4, 0);
+    checkRejected(newData, extra);
+
+    // Bulk transfer failed
+    int programCount = FakeFlash::programCount;
+    CHECK_EQ(startPatch(newData, records.size(), hash, crc), 1);
+    FakeApp::deliver(records, false);
+    CHECK_EQ(FakeApp::getResult(Message::MessageType_TransferAnimSetPatchFinished), 0);
+    CHECK_EQ(FakeFlash::programCount, programCount);
+
+    // And it still applies afterwards
+    CHECK_EQ(applyPatch(newData, records), 1);
+    CHECK(FakeFlash::content() == newData);
+}
+
+void testPatchRefused() {
+    setCurrentData(makeData(3000));
+    auto newData = FakeFlash::content();
+    newData[100] ^= 1;
+    auto records = makeRecords(requestManifest(), FakeDataSet::size, newData);
+    uint32_t hash = Utils::computeHash(newData.data(), newData.size());
+    uint32_t crc = Utils::computeCrc32(newData.data(), newData.size());
+
+    // Flash in use
+    FakeFlash::busy = true;
+    CHECK_EQ(startPatch(newData, records.size(), hash, crc), 0);
+    FakeFlash::busy = false;
+
+    // Not enough RAM for the patched data, the app sends the dataset whole
+    FakeHeap::largestBlock = 2000;
+    CHECK_EQ(startPatch(newData, records.size(), hash, crc), 0);
+    FakeHeap::largestBlock = SIZE_MAX;
+
+    // Doesn't fit in the slot
+    CHECK_EQ(startPatch(Bytes(SLOT_SIZE), records.size(), hash, crc), 0);
+
+    // Already patching
+    CHECK_EQ(startPatch(newData, records.size(), hash, crc), 1);
+    auto onReceived = FakeApp::onReceived;
+    auto allocator = FakeApp::allocator;
+    CHECK_EQ(startPatch(newData, records.size(), hash, crc), 0);
+    FakeApp::onReceived = onReceived;
+    FakeApp::allocator = allocator;
+    FakeApp::deliver(records);
+    CHECK_EQ(FakeApp::getResult(Message::MessageType_TransferAnimSetPatchFinished), 1);
+    CHECK(FakeFlash::content() == newData);
+}
+
+void testBadWriteIsNotCommitted() {
+    FakeDataSet::defaults = makeData(500);
+    setCurrentData(makeData(1000));
+    auto newData = modify(FakeFlash::content());
+    auto records = makeRecords(requestManifest(), FakeDataSet::size, newData);
+
+    FakeFlash::corruptWrites = true;
+    CHECK_EQ(applyPatch(newData, records), 0);
+    FakeFlash::corruptWrites = false;
+
+    // The slot was erased, so the defaults are put back
+    CHECK_EQ(FakeDataSet::defaultsCount, 1);
+    CHECK(FakeFlash::content() == FakeDataSet::defaults);
+    CHECK_EQ(FakeDataSet::hash, Utils::computeHash(FakeDataSet::defaults.data(), FakeDataSet::defaults.size()));
+}
+
+int main() {
+    testRandomPatches();
+    testBadPatchesAreRejected();
+    testPatchRefused();
+    testBadWriteIsNotCommitted();
+    return Test::report("data_set_patch_test");
+}
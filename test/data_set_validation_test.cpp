@@ -0,0 +1,584 @@
+// Host fuzz test of the dataset validation: random valid datasets must be accepted, sequences
+// that end up playing themselves must be rejected, and whatever mutated dataset is accepted
+// must only have references that stay within its data, checked by walking all of them here.
+
+#include "test.h"
+#include "data_set/data_set.h"
+#include "data_set/data_set_data.h"
+#include "animations/animation_keyframed.h"
+#include "animations/animation_gradientpattern.h"
+#include "animations/animation_gradient.h"
+#include "animations/animation_noise.h"
+#include "animations/animation_cycle.h"
+#include "animations/animation_normals.h"
+#include "animations/animation_sequence.h"
+#include "animations/animation_worm.h"
+#include "animations/animation_simple.h"
+#include "animations/animation_rainbow.h"
+#include "animations/animation_blinkid.h"
+#include "behaviors/condition.h"
+#include "behaviors/action.h"
+#include "behaviors/behavior.h"
+#include <string.h>
+#include <vector>
+
+TEST_MAIN_STATE
+
+using namespace DataSet;
+using namespace Behaviors;
+
+#define DATA_SIZE 4096
+#define VALID_DATASETS 500
+#define MUTATIONS 20000
+#define MAX_ANIMATIONS 24
+
+typedef std::vector<uint8_t> Bytes;
+
+static uint32_t randomState = 1;
+
+uint32_t randomInt(uint32_t max) {
+    randomState = randomState * 1664525 + 1013904223;
+    return (randomState >> 8) % max;
+}
+
+namespace FakeDataSet
+{
+    uint8_t data[DATA_SIZE] __attribute__ ((aligned (4)));
+    uint32_t size = 0;
+}
+
+namespace DataSet
+{
+    uint32_t computeDataSetDataSize(const Data* newData) { return FakeDataSet::size; }
+    uint32_t availableDataSize() { return DATA_SIZE; }
+}
+
+/// <summary>
+/// Lays out a random valid dataset in FakeDataSet::data, in the same order as the app does
+/// </summary>
+struct Builder
+{
+    Data header;
+    uint32_t size = 0;
+
+    template <typename T>
+    T* allocate(uint32_t count) {
+        auto ptr = (T*)(FakeDataSet::data + size);
+        size = (size + count * sizeof(T) + 3) & ~3;
+        return ptr;
+    }
+
+    void build() {
+        memset(&header, 0, sizeof(header));
+        memset(FakeDataSet::data, 0, sizeof(FakeDataSet::data));
+        size = 0;
+        header.headMarker = ANIMATION_SET_VALID_KEY;
+        header.version = ANIMATION_SET_VERSION;
+        header.tailMarker = ANIMATION_SET_VALID_KEY;
+
+        auto& bits = header.animationBits;
+        bits.paletteSize = 3 * randomInt(16);
+        auto palette = allocate<uint8_t>(bits.paletteSize);
+        for (uint32_t i = 0; i < bits.paletteSize; ++i) {
+            palette[i] = randomInt(256);
+        }
+        bits.palette = palette;
+
+        bits.rgbKeyFrameCount = 1 + randomInt(32);
+        auto rgbKeyframes = allocate<RGBKeyframe>(bits.rgbKeyFrameCount);
+        bits.rgbKeyframes = rgbKeyframes;
+        bits.rgbTrackCount = 1 + randomInt(8);
+        auto rgbTracks = allocate<RGBTrack>(bits.rgbTrackCount);
+        for (uint32_t i = 0; i < bits.rgbTrackCount; ++i) {
+            rgbTracks[i].keyframesOffset = randomInt(bits.rgbKeyFrameCount);
+            rgbTracks[i].keyFrameCount = randomInt(bits.rgbKeyFrameCount - rgbTracks[i].keyframesOffset + 1);
+        }
+        bits.rgbTracks = rgbTracks;
+        bits.keyFrameCount = 1 + randomInt(32);
+        bits.keyframes = allocate<Keyframe>(bits.keyFrameCount);
+        bits.trackCount = 1 + randomInt(8);
+        auto tracks = allocate<Track>(bits.trackCount);
+        for (uint32_t i = 0; i < bits.trackCount; ++i) {
+            tracks[i].keyframesOffset = randomInt(bits.keyFrameCount);
+            tracks[i].keyFrameCount = randomInt(bits.keyFrameCount - tracks[i].keyframesOffset + 1);
+        }
+        bits.tracks = tracks;
+
+        // Sequences only play animations that come before them, so there is no cycle
+        bits.animationCount = 1 + randomInt(MAX_ANIMATIONS);
+        auto animationOffsets = allocate<uint16_t>(bits.animationCount);
+        auto animations = FakeDataSet::data + size;
+        uint32_t offset = 0;
+        for (uint32_t i = 0; i < bits.animationCount; ++i) {
+            animationOffsets[i] = offset;
+            auto anim = (Animation*)(animations + offset);
+            uint32_t animSize = 0;
+            switch (i == 0 ? randomInt(3) : randomInt(6)) {
+                case 0:
+                    anim->type = Animation_Simple;
+                    animSize = sizeof(AnimationSimple);
+                    break;
+                case 1:
+                    {
+                        auto keyframed = (AnimationKeyframed*)anim;
+                        keyframed->type = Animation_Keyframed;
+                        keyframed->tracksOffset = randomInt(bits.rgbTrackCount);
+                        keyframed->trackCount = randomInt(bits.rgbTrackCount - keyframed->tracksOffset + 1);
+                        animSize = sizeof(AnimationKeyframed);
+                    }
+                    break;
+                case 2:
+                    {
+                        auto pattern = (AnimationGradientPattern*)anim;
+                        pattern->type = Animation_GradientPattern;
+                        pattern->tracksOffset = randomInt(bits.trackCount);
+                        pattern->trackCount = randomInt(bits.trackCount - pattern->tracksOffset + 1);
+                        pattern->gradientTrackOffset = randomInt(bits.rgbTrackCount);
+                        animSize = sizeof(AnimationGradientPattern);
+                    }
+                    break;
+                case 3:
+                    {
+                        auto gradient = (AnimationGradient*)anim;
+                        gradient->type = Animation_Gradient;
+                        gradient->gradientTrackOffset = randomInt(bits.rgbTrackCount);
+                        animSize = sizeof(AnimationGradient);
+                    }
+                    break;
+                default:
+                    {
+                        auto sequence = (AnimationSequence*)anim;
+                        sequence->type = Animation_Sequence;
+                        sequence->animationCount = randomInt(MAX_SEQ_ANIMATIONS + 1);
+                        for (int j = 0; j < sequence->animationCount; ++j) {
+                            sequence->animations[j].animationIndex = randomInt(i);
+                            sequence->animations[j].animationDelay = randomInt(1000);
+                        }
+                        animSize = sizeof(AnimationSequence);
+                    }
+                    break;
+            }
+            offset += (animSize + 3) & ~3;
+        }
+        bits.animationOffsets = animationOffsets;
+        bits.animations = allocate<uint8_t>(offset);
+        bits.animationsSize = offset;
+
+        header.conditionCount = 1 + randomInt(8);
+        auto conditionsOffsets = allocate<uint16_t>(header.conditionCount);
+        auto conditions = FakeDataSet::data + size;
+        offset = 0;
+        for (uint32_t i = 0; i < header.conditionCount; ++i) {
+            conditionsOffsets[i] = offset;
+            auto condition = (Condition*)(conditions + offset);
+            if (randomInt(2) == 0) {
+                condition->type = Condition_Rolled;
+                offset += (sizeof(ConditionRolled) + 3) & ~3;
+            } else {
+                condition->type = Condition_HelloGoodbye;
+                offset += (sizeof(ConditionHelloGoodbye) + 3) & ~3;
+            }
+        }
+        header.conditionsOffsets = conditionsOffsets;
+        header.conditions = (const Condition*)allocate<uint8_t>(offset);
+        header.conditionsSize = offset;
+
+        header.actionCount = 1 + randomInt(8);
+        auto actionsOffsets = allocate<uint16_t>(header.actionCount);
+        auto actions = FakeDataSet::data + size;
+        offset = 0;
+        for (uint32_t i = 0; i < header.actionCount; ++i) {
+            actionsOffsets[i] = offset;
+            if (randomInt(4) != 0) {
+                auto play = (ActionPlayAnimation*)(actions + offset);
+                play->type = Action_PlayAnimation;
+                play->animIndex = randomInt(bits.animationCount);
+                offset += (sizeof(ActionPlayAnimation) + 3) & ~3;
+            } else {
+                ((Action*)(actions + offset))->type = Action_RunOnDevice;
+                offset += (sizeof(ActionRunOnDevice) + 3) & ~3;
+            }
+        }
+        header.actionsOffsets = actionsOffsets;
+        header.actions = (const Action*)allocate<uint8_t>(offset);
+        header.actionsSize = offset;
+
+        header.ruleCount = 1 + randomInt(8);
+        auto rules = allocate<Rule>(header.ruleCount);
+        for (uint32_t i = 0; i < header.ruleCount; ++i) {
+            rules[i].condition = randomInt(header.conditionCount);
+            rules[i].actionOffset = randomInt(header.actionCount);
+            rules[i].actionCount = randomInt(header.actionCount - rules[i].actionOffset + 1);
+        }
+        header.rules = rules;
+        auto behavior = allocate<Behavior>(1);
+        behavior->rulesOffset = randomInt(header.ruleCount);
+        behavior->rulesCount = randomInt(header.ruleCount - behavior->rulesOffset + 1);
+        header.behavior = behavior;
+
+        FakeDataSet::size = size;
+    }
+
+    bool validate() const {
+        return validateData(&header, (uint32_t)(uintptr_t)FakeDataSet::data);
+    }
+
+    const Animation* animation(uint32_t index) const {
+        auto& bits = header.animationBits;
+        return (const Animation*)(bits.animations + bits.animationOffsets[index]);
+    }
+
+    /// <summary>
+    /// Returns the index of an animation of the given type, or -1
+    /// </summary>
+    int find(AnimationType type, int other = -1) const {
+        for (uint32_t i = 0; i < header.animationBits.animationCount; ++i) {
+            if (animation(i)->type == type && (int)i != other) {
+                return i;
+            }
+        }
+        return -1;
+    }
+};
+
+/// <summary>
+/// Whether the object lies within the dataset data
+/// </summary>
+bool inData(const void* ptr, uint32_t size) {
+    auto address = (const uint8_t*)ptr;
+    return address >= FakeDataSet::data && address + size <= FakeDataSet::data + FakeDataSet::size;
+}
+
+enum Visit : uint8_t
+{
+    Visit_None = 0,
+    Visit_Started,
+    Visit_Done,
+};
+
+/// <summary>
+/// Depth first search of the animations a sequence plays, false if it comes back to one being visited
+/// </summary>
+bool sequenceEnds(const AnimationBits& bits, uint32_t index, std::vector<Visit>& visits) {
+    if (visits[index] != Visit_None) {
+        return visits[index] == Visit_Done;
+    }
+    visits[index] = Visit_Started;
+    auto anim = (const Animation*)(bits.animations + bits.animationOffsets[index]);
+    if (anim->type == Animation_Sequence) {
+        auto sequence = (const AnimationSequence*)anim;
+        for (int i = 0; i < sequence->animationCount; ++i) {
+            if (!sequenceEnds(bits, sequence->animations[i].animationIndex, visits)) {
+                return false;
+            }
+        }
+    }
+    visits[index] = Visit_Done;
+    return true;
+}
+
+/// <summary>
+/// Follows every reference the firmware follows without checking it, stops at the first one out of the data
+/// </summary>
+bool walk(const Data& data) {
+    auto& bits = data.animationBits;
+    auto rgbTracksOk = [&](uint32_t offset, uint32_t count) {
+        for (uint32_t i = offset; i < offset + count; ++i) {
+            if (!inData(&bits.rgbTracks[i], sizeof(RGBTrack)) ||
+                !inData(bits.rgbKeyframes + bits.rgbTracks[i].keyframesOffset, bits.rgbTracks[i].keyFrameCount * sizeof(RGBKeyframe))) {
+                return false;
+            }
+        }
+        return true;
+    };
+    auto tracksOk = [&](uint32_t offset, uint32_t count) {
+        for (uint32_t i = offset; i < offset + count; ++i) {
+            if (!inData(&bits.tracks[i], sizeof(Track)) ||
+                !inData(bits.keyframes + bits.tracks[i].keyframesOffset, bits.tracks[i].keyFrameCount * sizeof(Keyframe))) {
+                return false;
+            }
+        }
+        return true;
+    };
+    if (!inData(bits.palette, bits.paletteSize) || !rgbTracksOk(0, bits.rgbTrackCount) || !tracksOk(0, bits.trackCount)) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < bits.animationCount; ++i) {
+        if (!inData(&bits.animationOffsets[i], sizeof(uint16_t))) {
+            return false;
+        }
+        auto anim = (const Animation*)(bits.animations + bits.animationOffsets[i]);
+        bool ok = inData(anim, sizeof(Animation));
+        switch (ok ? anim->type : Animation_Unknown) {
+            case Animation_Simple:
+                ok = inData(anim, sizeof(AnimationSimple));
+                break;
+            case Animation_Rainbow:
+                ok = inData(anim, sizeof(AnimationRainbow));
+                break;
+            case Animation_BlinkId:
+                ok = inData(anim, sizeof(AnimationBlinkId));
+                break;
+            case Animation_Keyframed:
+                {
+                    auto keyframed = (const AnimationKeyframed*)anim;
+                    ok = inData(anim, sizeof(AnimationKeyframed)) && rgbTracksOk(keyframed->tracksOffset, keyframed->trackCount);
+                }
+                break;
+            case Animation_GradientPattern:
+                {
+                    auto pattern = (const AnimationGradientPattern*)anim;
+                    ok = inData(anim, sizeof(AnimationGradientPattern)) && tracksOk(pattern->tracksOffset, pattern->trackCount) &&
+                        rgbTracksOk(pattern->gradientTrackOffset, 1);
+                }
+                break;
+            case Animation_Gradient:
+                ok = inData(anim, sizeof(AnimationGradient)) && rgbTracksOk(((const AnimationGradient*)anim)->gradientTrackOffset, 1);
+                break;
+            case Animation_Noise:
+                {
+                    auto noise = (const AnimationNoise*)anim;
+                    ok = inData(anim, sizeof(AnimationNoise)) && rgbTracksOk(noise->overallGradientTrackOffset, 1) &&
+                        rgbTracksOk(noise->individualGradientTrackOffset, 1);
+                }
+                break;
+            case Animation_Cycle:
+                ok = inData(anim, sizeof(AnimationCycle)) && rgbTracksOk(((const AnimationCycle*)anim)->gradientTrackOffset, 1);
+                break;
+            case Animation_Normals:
+                {
+                    auto normals = (const AnimationNormals*)anim;
+                    ok = inData(anim, sizeof(AnimationNormals)) && rgbTracksOk(normals->gradientOverTime, 1) &&
+                        rgbTracksOk(normals->gradientAlongAxis, 1) && rgbTracksOk(normals->gradientAlongAngle, 1);
+                }
+                break;
+            case Animation_Sequence:
+                {
+                    auto sequence = (const AnimationSequence*)anim;
+                    ok = inData(anim, sizeof(AnimationSequence)) && sequence->animationCount <= MAX_SEQ_ANIMATIONS;
+                    for (int j = 0; ok && j < sequence->animationCount; ++j) {
+                        ok = sequence->animations[j].animationIndex < bits.animationCount;
+                    }
+                }
+                break;
+            case Animation_Worm:
+                ok = inData(anim, sizeof(AnimationWorm)) && rgbTracksOk(((const AnimationWorm*)anim)->gradientTrackOffset, 1);
+                break;
+            default:
+                ok = false;
+                break;
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+    std::vector<Visit> visits(bits.animationCount, Visit_None);
+    for (uint32_t i = 0; i < bits.animationCount; ++i) {
+        if (!sequenceEnds(bits, i, visits)) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < data.conditionCount; ++i) {
+        if (!inData(&data.conditionsOffsets[i], sizeof(uint16_t))) {
+            return false;
+        }
+        // Conditions are all smaller than the biggest one
+        auto condition = (const uint8_t*)data.conditions + data.conditionsOffsets[i];
+        if (!inData(condition, sizeof(Condition)) ||
+            (((const Condition*)condition)->type == Condition_Rolled && !inData(condition, sizeof(ConditionRolled)))) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < data.actionCount; ++i) {
+        if (!inData(&data.actionsOffsets[i], sizeof(uint16_t))) {
+            return false;
+        }
+        auto action = (const Action*)((const uint8_t*)data.actions + data.actionsOffsets[i]);
+        if (!inData(action, sizeof(Action))) {
+            return false;
+        }
+        if (action->type == Action_PlayAnimation && (!inData(action, sizeof(ActionPlayAnimation)) ||
+            ((const ActionPlayAnimation*)action)->animIndex >= bits.animationCount)) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < data.ruleCount; ++i) {
+        auto& rule = data.rules[i];
+        if (!inData(&rule, sizeof(Rule)) || rule.condition >= data.conditionCount ||
+            rule.actionOffset + rule.actionCount > data.actionCount) {
+            return false;
+        }
+    }
+    return inData(data.behavior, sizeof(Behavior)) &&
+        data.behavior->rulesOffset + data.behavior->rulesCount <= data.ruleCount;
+}
+
+void testValidDataSets() {
+    Builder builder;
+    for (int i = 0; i < VALID_DATASETS; ++i) {
+        builder.build();
+        if (!CHECK(builder.validate()) || !CHECK(walk(builder.header))) {
+            break;
+        }
+    }
+
+    // Markers and version
+    builder.build();
+    builder.header.version++;
+    CHECK(!builder.validate());
+    builder.header.version--;
+    builder.header.tailMarker = 0;
+    CHECK(!builder.validate());
+}
+
+void testSequenceCycles() {
+    int cycles = 0;
+    Builder builder;
+    while (cycles < 100) {
+        builder.build();
+        int first = builder.find(Animation_Sequence);
+        int second = builder.find(Animation_Sequence, first);
+        if (second < 0) {
+            continue;
+        }
+        auto a = (AnimationSequence*)builder.animation(first);
+        auto b = (AnimationSequence*)builder.animation(second);
+
+        // Plays itself
+        a->animationCount = 1 + randomInt(MAX_SEQ_ANIMATIONS);
+        a->animations[randomInt(a->animationCount)].animationIndex = first;
+        CHECK(!builder.validate());
+        CHECK(!walk(builder.header));
+
+        // Plays a sequence that plays it back
+        for (int i = 0; i < a->animationCount; ++i) {
+            a->animations[i].animationIndex = second;
+        }
+        b->animationCount = 1 + randomInt(MAX_SEQ_ANIMATIONS);
+        b->animations[randomInt(b->animationCount)].animationIndex = first;
+        CHECK(!builder.validate());
+
+        // Both playing the same animation is fine
+        int simple = builder.find(Animation_Simple);
+        if (simple >= 0) {
+            for (int i = 0; i < b->animationCount; ++i) {
+                b->animations[i].animationIndex = simple;
+            }
+            CHECK(builder.validate());
+            CHECK(walk(builder.header));
+        }
+        cycles++;
+    }
+
+    // A long chain of sequences isn't a cycle
+    builder.build();
+    auto& bits = builder.header.animationBits;
+    for (uint32_t i = 1; i < bits.animationCount; ++i) {
+        auto anim = (AnimationSequence*)builder.animation(i);
+        if (anim->type == Animation_Sequence) {
+            anim->animationCount = 1;
+            anim->animations[0].animationIndex = i - 1;
+        }
+    }
+    CHECK(builder.validate());
+    CHECK(walk(builder.header));
+}
+
+void mutateWord(uint32_t& word) {
+    switch (randomInt(3)) {
+        case 0: word += (int)randomInt(9) - 4; break;
+        case 1: word ^= 1 << randomInt(32); break;
+        default: word = randomInt(DATA_SIZE); break;
+    }
+}
+
+/// <summary>
+/// Like on the die, pointers are 32 bits addresses
+/// </summary>
+template <typename T>
+void mutatePointer(const T*& ptr) {
+    uint32_t address = (uint32_t)(uintptr_t)ptr;
+    if (randomInt(3) == 0) {
+        address = (uint32_t)(uintptr_t)FakeDataSet::data + randomInt(DATA_SIZE);
+    } else {
+        mutateWord(address);
+    }
+    ptr = (const T*)(uintptr_t)address;
+}
+
+/// <summary>
+/// Changes a random field of the header, or random bytes of the data
+/// </summary>
+void mutate(Builder& builder) {
+    auto& header = builder.header;
+    auto& bits = header.animationBits;
+    if (randomInt(4) == 0) {
+        switch (randomInt(25)) {
+            case 0: mutatePointer(bits.palette); break;
+            case 1: mutateWord(bits.paletteSize); break;
+            case 2: mutatePointer(bits.rgbKeyframes); break;
+            case 3: mutateWord(bits.rgbKeyFrameCount); break;
+            case 4: mutatePointer(bits.rgbTracks); break;
+            case 5: mutateWord(bits.rgbTrackCount); break;
+            case 6: mutatePointer(bits.keyframes); break;
+            case 7: mutateWord(bits.keyFrameCount); break;
+            case 8: mutatePointer(bits.tracks); break;
+            case 9: mutateWord(bits.trackCount); break;
+            case 10: mutatePointer(bits.animationOffsets); break;
+            case 11: mutateWord(bits.animationCount); break;
+            case 12: mutatePointer(bits.animations); break;
+            case 13: mutateWord(bits.animationsSize); break;
+            case 14: mutatePointer(header.conditionsOffsets); break;
+            case 15: mutateWord(header.conditionCount); break;
+            case 16: mutatePointer(header.conditions); break;
+            case 17: mutateWord(header.conditionsSize); break;
+            case 18: mutatePointer(header.actionsOffsets); break;
+            case 19: mutateWord(header.actionCount); break;
+            case 20: mutatePointer(header.actions); break;
+            case 21: mutateWord(header.actionsSize); break;
+            case 22: mutatePointer(header.rules); break;
+            case 23: mutateWord(header.ruleCount); break;
+            default: mutatePointer(header.behavior); break;
+        }
+    } else {
+        int count = 1 + randomInt(4);
+        for (int i = 0; i < count; ++i) {
+            uint32_t index = randomInt(builder.size);
+            if (randomInt(2) == 0) {
+                FakeDataSet::data[index] ^= 1 << randomInt(8);
+            } else {
+                FakeDataSet::data[index] = randomInt(256);
+            }
+        }
+    }
+}
+
+void testMutations() {
+    Builder builder;
+    int accepted = 0;
+    for (int i = 0; i < MUTATIONS; ++i) {
+        builder.build();
+        int count = 1 + randomInt(3);
+        for (int j = 0; j < count; ++j) {
+            mutate(builder);
+        }
+        if (builder.validate()) {
+            accepted++;
+            if (!CHECK(walk(builder.header))) {
+                printf("  mutation %d accepted with a reference out of the data\n", i);
+                break;
+            }
+        }
+    }
+    printf("  %d mutated datasets, %d accepted\n", MUTATIONS, accepted);
+    CHECK(accepted < MUTATIONS);
+}
+
+int main() {
+    testValidDataSets();
+    testSequenceCycles();
+    testMutations();
+    return Test::report("data_set_validation_test");
+}
@@ -0,0 +1,125 @@
+// Host test of the default dataset: the image built at compile time and patched with the top
+// face of the die must program exactly what the original builder did, header and data, for
+// every die layout. The original builder is kept in default_data_set_reference.cpp.
+
+#include "test.h"
+#include "data_set/data_set.h"
+#include "data_set/data_set_data.h"
+#include "drivers_nrf/flash.h"
+#include "config/settings.h"
+#include "config/dice_variants.h"
+#include <string.h>
+#include <vector>
+
+TEST_MAIN_STATE
+
+using namespace DriversNRF;
+using namespace Config;
+
+#define DATA_SIZE 1024
+
+typedef std::vector<uint8_t> Bytes;
+
+namespace DataSet
+{
+    void ProgramReferenceDataSet(DataSetWrittenCallback callback);
+}
+
+namespace FakeFlash
+{
+    alignas(4) uint8_t data[DATA_SIZE];
+    uint32_t size = 0;          // Size of the last write
+    DataSet::Data header;       // Last header programmed
+    int finished = 0;
+    bool result = false;
+}
+
+namespace FakeSettings
+{
+    DiceVariants::Layout layout = {};
+}
+
+namespace DriversNRF::Flash
+{
+    uint32_t getDataSetDataAddress() { return (uint32_t)(uintptr_t)FakeFlash::data; }
+
+    void write(void* context, uint32_t flashAddress, const void* data, uint32_t size, FlashCallback callback) {
+        CHECK(flashAddress == getDataSetDataAddress() && size <= DATA_SIZE);
+        memcpy((void*)(uintptr_t)flashAddress, data, size);
+        FakeFlash::size = size;
+        callback(context, true, flashAddress, size);
+    }
+
+    bool programDataSet(const DataSet::Data& newData, ProgramFlashFunc programFlashFunc, ProgramFlashNotification onProgramFinished) {
+        // Like the driver, only commit what validates
+        memcpy(&FakeFlash::header, &newData, sizeof(DataSet::Data));
+        memset(FakeFlash::data, 0xFF, DATA_SIZE);
+        FakeFlash::size = 0;
+        programFlashFunc([](void* context, bool result, uint32_t address, uint16_t size) {});
+        onProgramFinished(DataSet::validateData(&FakeFlash::header, getDataSetDataAddress()));
+        return true;
+    }
+}
+
+namespace DataSet
+{
+    uint32_t computeDataSetDataSize(const Data* newData) { return FakeFlash::size; }
+    uint32_t availableDataSize() { return DATA_SIZE; }
+}
+
+namespace Config::SettingsManager
+{
+    const DiceVariants::Layout* getLayout() { return &FakeSettings::layout; }
+}
+
+namespace Config::DiceVariants
+{
+    // A different top face for each layout, and a PD6 that lights several LEDs
+    uint8_t Layout::getTopFace() const { return layoutType * 2 + 1; }
+    uint32_t Layout::getTopFaceMask() const { return layoutType == DieLayoutType_PD6 ? 0b111111 << 15 : 1 << getTopFace(); }
+}
+
+struct Programmed
+{
+    Bytes header;
+    Bytes data;
+};
+
+Programmed program(void (*programFunc)(DataSet::DataSetWrittenCallback)) {
+    FakeFlash::finished = 0;
+    FakeFlash::result = false;
+    programFunc([](bool success) {
+        FakeFlash::finished++;
+        FakeFlash::result = success;
+    });
+    CHECK_EQ(FakeFlash::finished, 1);
+    CHECK(FakeFlash::result);
+    auto header = (const uint8_t*)&FakeFlash::header;
+    return { Bytes(header, header + sizeof(DataSet::Data)), Bytes(FakeFlash::data, FakeFlash::data + FakeFlash::size) };
+}
+
+void testSameAsReference() {
+    int layouts = 0;
+    for (int type = DiceVariants::DieLayoutType_D4; type <= DiceVariants::DieLayoutType_D00; ++type) {
+        FakeSettings::layout.layoutType = (DiceVariants::LEDLayoutType)type;
+        auto reference = program(DataSet::ProgramReferenceDataSet);
+        auto image = program(DataSet::ProgramDefaultDataSet);
+        CHECK(reference.data.size() > 0);
+        CHECK_EQ(image.data.size(), reference.data.size());
+        if (!CHECK(image.data == reference.data) || !CHECK(image.header == reference.header)) {
+            printf("  layout %d\n", type);
+        }
+
+        // The top face animations do light the top face
+        auto topFaceMask = FakeSettings::layout.getTopFaceMask();
+        CHECK(topFaceMask != 0);
+        CHECK(memmem(image.data.data(), image.data.size(), &topFaceMask, sizeof(topFaceMask)) != nullptr);
+        layouts++;
+    }
+    printf("  %d layouts, %d bytes of default data\n", layouts, (int)FakeFlash::size);
+}
+
+int main() {
+    testSameAsReference();
+    return Test::report("default_data_set_test");
+}
@@ -0,0 +1,328 @@
+// Host test of the flash regions: the settings and the dataset are programmed on their own,
+// through the real Flash driver over the RAM backed fstorage stub. Programming one region must
+// leave the content of the other byte for byte, the dataset header must be the last thing
+// written, and only one region may be programmed at a time, nor written while it is.
+
+#include "test.h"
+#include "drivers_nrf/flash.h"
+#include "config/settings.h"
+#include "data_set/data_set.h"
+#include "data_set/data_set_data.h"
+#include "utils/Utils.h"
+#include "nrf_fstorage.h"
+#include <string.h>
+#include <vector>
+
+TEST_MAIN_STATE
+
+using namespace DriversNRF;
+using namespace Config;
+
+#define RANDOM_ROUNDS 200
+
+typedef std::vector<uint8_t> Bytes;
+
+static uint32_t randomState = 1;
+
+uint32_t randomInt(uint32_t max) {
+    randomState = randomState * 1664525 + 1013904223;
+    return (randomState >> 8) % max;
+}
+
+Bytes randomBytes(uint32_t size) {
+    Bytes bytes(size);
+    for (auto& byte : bytes) {
+        byte = randomInt(256);
+    }
+    return bytes;
+}
+
+namespace FakeDataSet
+{
+    uint32_t size = 0;      // Data size described by the header being programmed
+    bool valid = true;      // Result of validateData()
+    Bytes data;             // What the program function writes
+}
+
+namespace DataSet
+{
+    uint32_t computeDataSetDataSize(const Data* newData) { return FakeDataSet::size; }
+    bool validateData(const Data* data, uint32_t dataAddress) { return FakeDataSet::valid; }
+    uint32_t availableDataSize() { return Flash::getFlashEndAddress() - Flash::getDataSetDataAddress(); }
+}
+
+namespace FakeClient
+{
+    struct Event
+    {
+        Flash::ProgrammingEventType type;
+        Flash::ProgrammingRegion region;
+    };
+    std::vector<Event> events;
+    int finished = 0;
+    bool result = false;
+
+    void onProgrammingEvent(void* param, Flash::ProgrammingEventType type, Flash::ProgrammingRegion region) {
+        events.push_back({ type, region });
+    }
+
+    void onProgramFinished(bool success) {
+        finished++;
+        result = success;
+    }
+
+    void reset() {
+        events.clear();
+        finished = 0;
+        result = false;
+    }
+}
+
+Bytes snapshot(uint32_t start, uint32_t end) {
+    return Bytes((const uint8_t*)(uintptr_t)start, (const uint8_t*)(uintptr_t)end);
+}
+
+Bytes settingsRegion() {
+    return snapshot(Flash::getSettingsStartAddress(), Flash::getSettingsEndAddress());
+}
+
+Bytes dataSetContent() {
+    // The erased space after the data may receive a copy of the settings being programmed
+    return snapshot(Flash::getDataSetAddress(), Flash::getDataSetDataAddress() + FakeDataSet::size);
+}
+
+const DataSet::Data* activeHeader() {
+    return (const DataSet::Data*)(uintptr_t)Flash::getDataSetAddress();
+}
+
+bool isHeaderValid(const DataSet::Data* header) {
+    return header->headMarker == ANIMATION_SET_VALID_KEY && header->tailMarker == ANIMATION_SET_VALID_KEY;
+}
+
+bool startSettings(const Settings& settings, const Bytes& records) {
+    return Flash::programSettings(settings, records.data(), records.size(), FakeClient::onProgramFinished);
+}
+
+DataSet::Data makeHeader() {
+    DataSet::Data header;
+    memset(&header, 0, sizeof(header));
+    header.headMarker = ANIMATION_SET_VALID_KEY;
+    header.version = ANIMATION_SET_VERSION;
+    header.tailMarker = ANIMATION_SET_VALID_KEY;
+    return header;
+}
+
+bool startDataSet(uint32_t size) {
+    DataSet::Data header = makeHeader();
+    FakeDataSet::size = size;
+    FakeDataSet::data = randomBytes(size);
+    return Flash::programDataSet(header, [](Flash::ProgramFlashFuncCallback callback) {
+        Flash::write(nullptr, Flash::getDataSetDataAddress(), FakeDataSet::data.data(), FakeDataSet::data.size(), callback);
+    }, FakeClient::onProgramFinished);
+}
+
+Settings randomSettings() {
+    Settings settings;
+    auto bytes = randomBytes(sizeof(Settings));
+    memcpy(&settings, bytes.data(), sizeof(Settings));
+    return settings;
+}
+
+uint32_t maxDataSize() {
+    // Flash writes are made of words
+    return (DataSet::availableDataSize() - 1) & ~3;
+}
+
+uint32_t randomDataSize() {
+    return 4 + 4 * randomInt(maxDataSize() / 4);
+}
+
+void testLayout() {
+    const uint32_t pageSize = Flash::getPageSize();
+    CHECK_EQ(Flash::getSettingsStartAddress(), Stubs::flashAddress());
+    CHECK_EQ(Flash::getSettingsRecordsAddress(), Flash::getSettingsStartAddress() + sizeof(Settings));
+    CHECK_EQ(Flash::getSettingsEndAddress() % pageSize, 0);
+    CHECK(Flash::getSettingsEndAddress() > Flash::getSettingsRecordsAddress());
+
+    // The dataset starts on its own page, right after the settings, and takes the rest of the flash
+    CHECK_EQ(Flash::getDataSetAddress(), Flash::getSettingsEndAddress());
+    CHECK_EQ(Flash::getDataSetDataAddress(), Flash::getDataSetAddress() + sizeof(DataSet::Data));
+    CHECK(Flash::getDataSetAddress() < Flash::getFlashEndAddress());
+
+    // With the 2 pages of the release layout, only one is left for the dataset
+    CHECK_EQ(Stubs::flashPageCount, 2);
+    CHECK_EQ(DataSet::availableDataSize(), pageSize - sizeof(DataSet::Data));
+    CHECK(!Flash::isBusy());
+}
+
+void testSettingsLeaveDataSet() {
+    // Start from a committed dataset
+    FakeClient::reset();
+    CHECK(startDataSet(maxDataSize()));
+    Stubs::runFlash();
+    CHECK(FakeClient::result);
+    const Bytes dataSet = dataSetContent();
+
+    FakeClient::reset();
+    Settings settings = randomSettings();
+    Bytes records = randomBytes(64);
+    CHECK(startSettings(settings, records));
+    CHECK(Flash::isBusy());
+    Stubs::runFlash();
+    CHECK_EQ(FakeClient::finished, 1);
+    CHECK(FakeClient::result);
+    CHECK(!Flash::isBusy());
+
+    CHECK(dataSetContent() == dataSet);
+    CHECK(memcmp((const void*)(uintptr_t)Flash::getSettingsStartAddress(), &settings, sizeof(Settings)) == 0);
+    CHECK(snapshot(Flash::getSettingsRecordsAddress(), Flash::getSettingsRecordsAddress() + records.size()) == records);
+
+    // The rest of the settings page is erased, ready for more records
+    Bytes rest = snapshot(Flash::getSettingsRecordsAddress() + records.size(), Flash::getSettingsEndAddress());
+    CHECK(rest == Bytes(rest.size(), 0xFF));
+
+    if (CHECK_EQ(FakeClient::events.size(), 2)) {
+        CHECK_EQ(FakeClient::events[0].type, Flash::ProgrammingEventType_Begin);
+        CHECK_EQ(FakeClient::events[0].region, Flash::ProgrammingRegion_Settings);
+        CHECK_EQ(FakeClient::events[1].type, Flash::ProgrammingEventType_End);
+        CHECK_EQ(FakeClient::events[1].region, Flash::ProgrammingRegion_Settings);
+    }
+}
+
+void testDataSetLeavesSettings() {
+    const Bytes settings = settingsRegion();
+
+    FakeClient::reset();
+    CHECK(startDataSet(randomDataSize()));
+    Stubs::runFlash();
+    CHECK(FakeClient::result);
+    CHECK(settingsRegion() == settings);
+
+    auto header = activeHeader();
+    CHECK(isHeaderValid(header));
+    CHECK(snapshot(Flash::getDataSetDataAddress(), Flash::getDataSetDataAddress() + FakeDataSet::size) == FakeDataSet::data);
+    CHECK_EQ(header->dataCrc, Utils::computeCrc32(FakeDataSet::data.data(), FakeDataSet::size));
+    if (CHECK_EQ(FakeClient::events.size(), 2)) {
+        CHECK(FakeClient::events[0].region != Flash::ProgrammingRegion_Settings);
+    }
+}
+
+void testHeaderWrittenLast() {
+    // Whenever the power is cut, the header is either the previous one or the complete new one
+    FakeClient::reset();
+    CHECK(startDataSet(randomDataSize()));
+    while (Stubs::runFlash(1) > 0) {
+        if (FakeClient::finished == 0) {
+            CHECK(!isHeaderValid(activeHeader()));
+        }
+    }
+    CHECK(FakeClient::result);
+    CHECK(isHeaderValid(activeHeader()));
+
+    // An invalid dataset is never committed
+    FakeClient::reset();
+    FakeDataSet::valid = false;
+    CHECK(startDataSet(randomDataSize()));
+    Stubs::runFlash();
+    FakeDataSet::valid = true;
+    CHECK_EQ(FakeClient::finished, 1);
+    CHECK(!FakeClient::result);
+    CHECK(!isHeaderValid(activeHeader()));
+    CHECK(!Flash::isBusy());
+}
+
+void testOneRegionAtATime() {
+    // Too big for the dataset region
+    FakeClient::reset();
+    uint32_t size = FakeDataSet::size;
+    FakeDataSet::size = DataSet::availableDataSize();
+    CHECK(!Flash::programDataSet(makeHeader(), nullptr, FakeClient::onProgramFinished));
+    FakeDataSet::size = size;
+    CHECK_EQ(FakeClient::events.size(), 0);
+
+    for (int round = 0; round < RANDOM_ROUNDS; ++round) {
+        FakeClient::reset();
+        const Bytes settings = settingsRegion();
+        const Bytes dataSet = dataSetContent();
+        bool settingsFirst = randomInt(2) == 0;
+        Settings newSettings = randomSettings();
+        Bytes records = randomBytes(4 * randomInt(32));
+        if (settingsFirst) {
+            CHECK(startSettings(newSettings, records));
+        } else {
+            CHECK(startDataSet(randomDataSize()));
+        }
+
+        // Anything else is refused until the first programming is finished
+        Stubs::runFlash(randomInt(3));
+        if (FakeClient::finished == 0) {
+            CHECK(Flash::isBusy());
+            CHECK(!startSettings(randomSettings(), records));
+            CHECK(!Flash::programDataSet(makeHeader(), [](Flash::ProgramFlashFuncCallback callback) {
+                CHECK(false);
+            }, FakeClient::onProgramFinished));
+        }
+        Stubs::runFlash();
+        CHECK_EQ(FakeClient::finished, 1);
+        CHECK(FakeClient::result);
+        CHECK_EQ(FakeClient::events.size(), 2);
+        if (settingsFirst) {
+            CHECK(dataSetContent() == dataSet);
+        } else {
+            CHECK(settingsRegion() == settings);
+        }
+    }
+    CHECK_EQ(Stubs::flashErrorCount, 0);
+}
+
+void testProgramErased() {
+    // Writes that take their time, i.e. received data, hold the lock until they call back
+    static Flash::ProgramFlashFuncCallback pending;
+    static Bytes data;
+    FakeClient::reset();
+    const Bytes settings = settingsRegion();
+    const Bytes dataSet = dataSetContent();
+    const uint32_t address = Utils::roundUpTo4(Flash::getDataSetDataAddress() + FakeDataSet::size);
+    data = randomBytes(4 * (1 + randomInt(16)));
+    CHECK(Flash::programErased([](Flash::ProgramFlashFuncCallback callback) {
+        pending = callback;
+    }, FakeClient::onProgramFinished));
+    CHECK(Flash::isBusy());
+    CHECK(!Flash::programErased([](Flash::ProgramFlashFuncCallback callback) {
+        CHECK(false);
+    }, FakeClient::onProgramFinished));
+    CHECK(!startSettings(randomSettings(), Bytes()));
+    CHECK(!Flash::programDataSet(makeHeader(), [](Flash::ProgramFlashFuncCallback callback) {
+        CHECK(false);
+    }, FakeClient::onProgramFinished));
+    CHECK(!Flash::programWrite(address, data.data(), data.size(), FakeClient::onProgramFinished));
+
+    Flash::write(nullptr, address, data.data(), data.size(), [](void* context, bool result, uint32_t address, uint16_t size) {
+        CHECK(Flash::isBusy());
+        pending(context, result, address, size);
+    });
+    Stubs::runFlash();
+    CHECK_EQ(FakeClient::finished, 1);
+    CHECK(FakeClient::result);
+    CHECK(!Flash::isBusy());
+    CHECK(snapshot(address, address + data.size()) == data);
+    CHECK(dataSetContent() == dataSet);
+    CHECK(settingsRegion() == settings);
+
+    // Nothing was erased, clients aren't notified
+    CHECK_EQ(FakeClient::events.size(), 0);
+}
+
+int main() {
+    Stubs::eraseFlash();
+    Flash::init();
+    Flash::hookProgrammingEvent(FakeClient::onProgrammingEvent, nullptr);
+    testLayout();
+    testSettingsLeaveDataSet();
+    testDataSetLeavesSettings();
+    testHeaderWrittenLast();
+    testOneRegionAtATime();
+    testProgramErased();
+    printf("  %d flash operations\n", (int)Stubs::flashOperationCount);
+    return Test::report("flash_regions_test");
+}
@@ -0,0 +1,410 @@
+// Host test of the I2C transaction queue, against a fake TWIM peripheral that models
+// the bus timing. Blocking transfers are run from the contexts where the TWI interrupt
+// can't preempt the caller, which must poll the interrupt handler instead of hanging.
+
+#include "test.h"
+#include "drivers_nrf/i2c.h"
+#include "drivers_nrf/scheduler.h"
+#include "config/board_config.h"
+#include "nrf_drv_twi.h"
+#include "app_util_platform.h"
+#include <string.h>
+
+TEST_MAIN_STATE
+
+using namespace DriversNRF;
+
+namespace DriversNRF::I2C
+{
+    bool canWaitForInterrupt();
+}
+
+#define TWI_IRQ SPIM0_SPIS0_TWIM0_TWIS0_SPI0_TWI0_IRQn
+#define DEVICE_ADDRESS 0x0E
+#define POLL_US 0.1f        // One iteration of the busy-wait loop, a handful of cycles at 64MHz
+#define MAX_SCRIPTED_ERRORS 8
+
+extern "C" void SPIM0_SPIS0_TWIM0_TWIS0_SPI0_TWI0_IRQHandler(void);
+
+namespace FakeTwi
+{
+    float nowUs = 0.0f;
+    bool initialized = false;
+    bool enabled = false;
+    nrf_drv_twi_frequency_t frequency;
+    nrf_drv_twi_evt_handler_t handler = nullptr;
+
+    bool busy = false;
+    float doneAtUs = 0.0f;
+    nrf_drv_twi_xfer_desc_t current;
+    nrf_drv_twi_evt_type_t currentResult;
+    bool eventPending = false;
+
+    nrf_drv_twi_evt_type_t errors[MAX_SCRIPTED_ERRORS];
+    int errorCount = 0;
+
+    int xferCount = 0;
+    int initCount = 0;
+    int uninitCount = 0;
+    bool inHandler = false;
+    bool reinitFromHandler = false;
+
+    void reset() {
+        nowUs = 0.0f;
+        initialized = enabled = busy = eventPending = false;
+        errorCount = xferCount = initCount = uninitCount = 0;
+        inHandler = reinitFromHandler = false;
+        Stubs::irqEnabled[TWI_IRQ] = false;
+        Stubs::irqPending[TWI_IRQ] = false;
+        Stubs::interruptPriority = APP_IRQ_PRIORITY_THREAD;
+        Stubs::primask = 0;
+    }
+
+    void scriptError(nrf_drv_twi_evt_type_t error) {
+        errors[errorCount++] = error;
+    }
+
+    uint32_t frequencyHz(nrf_drv_twi_frequency_t f) {
+        return f == NRF_DRV_TWI_FREQ_400K ? 400000 : (f == NRF_DRV_TWI_FREQ_250K ? 250000 : 100000);
+    }
+
+    /// <summary>
+    /// SCL periods for a transfer: 9 per byte (8 bits + ack) including the address bytes,
+    /// one for each start, repeated start and stop condition.
+    /// </summary>
+    uint32_t clockCount(size_t txSize, size_t rxSize, bool stop) {
+        uint32_t clocks = 0;
+        if (txSize > 0) {
+            clocks += 1 + 9 + 9 * txSize;
+        }
+        if (rxSize > 0) {
+            clocks += 1 + 9 + 9 * rxSize;
+        }
+        return clocks + (stop ? 1 : 0);
+    }
+
+    float busTimeUs(nrf_drv_twi_frequency_t f, size_t txSize, size_t rxSize) {
+        return clockCount(txSize, rxSize, true) * 1000000.0f / frequencyHz(f);
+    }
+
+    /// <summary>
+    /// Ends the transfer in progress once its bus time is up, and raises the interrupt
+    /// </summary>
+    void update() {
+        if (busy && nowUs >= doneAtUs) {
+            busy = false;
+            if (currentResult == NRF_DRV_TWI_EVT_DONE) {
+                // The device returns the register addresses as data
+                uint8_t reg = current.type == NRF_DRV_TWI_XFER_TXRX ? current.p_primary_buf[0] : 0;
+                uint8_t* rx = current.type == NRF_DRV_TWI_XFER_TXRX ? current.p_secondary_buf :
+                    (current.type == NRF_DRV_TWI_XFER_RX ? current.p_primary_buf : nullptr);
+                size_t rxSize = current.type == NRF_DRV_TWI_XFER_TXRX ? current.secondary_length : current.primary_length;
+                for (size_t i = 0; rx != nullptr && i < rxSize; ++i) {
+                    rx[i] = reg + i;
+                }
+            }
+            eventPending = true;
+            NVIC_SetPendingIRQ(TWI_IRQ);
+        }
+    }
+
+    /// <summary>
+    /// Lets time pass for code that is preempted by the TWI interrupt
+    /// </summary>
+    void advance(float us) {
+        float end = nowUs + us;
+        while (nowUs < end) {
+            nowUs += POLL_US;
+            update();
+            if (Stubs::irqPending[TWI_IRQ] && Stubs::irqEnabled[TWI_IRQ] && Stubs::primask == 0 &&
+                Stubs::interruptPriority > APP_IRQ_PRIORITY_HIGH) {
+                NVIC_ClearPendingIRQ(TWI_IRQ);
+                SPIM0_SPIS0_TWIM0_TWIS0_SPI0_TWI0_IRQHandler();
+            }
+        }
+    }
+
+    void onPoll() {
+        nowUs += POLL_US;
+        update();
+    }
+}
+
+extern "C" void SPIM0_SPIS0_TWIM0_TWIS0_SPI0_TWI0_IRQHandler(void) {
+    using namespace FakeTwi;
+    if (!eventPending || !initialized) {
+        return;
+    }
+    eventPending = false;
+    nrf_drv_twi_evt_t evt;
+    evt.type = currentResult;
+    evt.xfer_desc = current;
+
+    uint8_t priority = Stubs::interruptPriority;
+    Stubs::interruptPriority = APP_IRQ_PRIORITY_HIGH;
+    inHandler = true;
+    handler(&evt, nullptr);
+    inHandler = false;
+    Stubs::interruptPriority = priority;
+}
+
+ret_code_t nrf_drv_twi_init(nrf_drv_twi_t const* p_instance, nrf_drv_twi_config_t const* p_config, nrf_drv_twi_evt_handler_t event_handler, void* p_context) {
+    using namespace FakeTwi;
+    if (initialized) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    reinitFromHandler |= inHandler;
+    initialized = true;
+    frequency = p_config->frequency;
+    handler = event_handler;
+    initCount++;
+    Stubs::irqEnabled[TWI_IRQ] = true;
+    return NRF_SUCCESS;
+}
+
+void nrf_drv_twi_uninit(nrf_drv_twi_t const* p_instance) {
+    using namespace FakeTwi;
+    reinitFromHandler |= inHandler;
+    initialized = enabled = busy = eventPending = false;
+    uninitCount++;
+    Stubs::irqEnabled[TWI_IRQ] = false;
+    Stubs::irqPending[TWI_IRQ] = false;
+}
+
+void nrf_drv_twi_enable(nrf_drv_twi_t const* p_instance) {
+    FakeTwi::enabled = FakeTwi::initialized;
+}
+
+void nrf_drv_twi_disable(nrf_drv_twi_t const* p_instance) {
+    FakeTwi::enabled = false;
+}
+
+ret_code_t nrf_drv_twi_xfer(nrf_drv_twi_t const* p_instance, nrf_drv_twi_xfer_desc_t const* p_xfer_desc, uint32_t flags) {
+    using namespace FakeTwi;
+    if (!enabled) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    if (busy || eventPending) {
+        return NRF_ERROR_BUSY;
+    }
+    busy = true;
+    current = *p_xfer_desc;
+    xferCount++;
+    if (errorCount > 0) {
+        currentResult = errors[0];
+        memmove(errors, errors + 1, --errorCount * sizeof(errors[0]));
+        // The device doesn't ack its address
+        doneAtUs = nowUs + busTimeUs(frequency, 0, 0) + 9 * 1000000.0f / frequencyHz(frequency);
+    } else {
+        currentResult = NRF_DRV_TWI_EVT_DONE;
+        size_t txSize = p_xfer_desc->type == NRF_DRV_TWI_XFER_RX ? 0 : p_xfer_desc->primary_length;
+        size_t rxSize = p_xfer_desc->type == NRF_DRV_TWI_XFER_TXRX ? p_xfer_desc->secondary_length :
+            (p_xfer_desc->type == NRF_DRV_TWI_XFER_RX ? p_xfer_desc->primary_length : 0);
+        doneAtUs = nowUs + clockCount(txSize, rxSize, !(flags & NRF_DRV_TWI_FLAG_TX_NO_STOP)) * 1000000.0f / frequencyHz(frequency);
+    }
+    return NRF_SUCCESS;
+}
+
+namespace DriversNRF::Scheduler
+{
+    #define MAX_SCHEDULED 8
+    app_sched_event_handler_t scheduled[MAX_SCHEDULED];
+    int scheduledCount = 0;
+
+    bool push(const void* eventData, uint16_t size, app_sched_event_handler_t handler) {
+        if (scheduledCount == MAX_SCHEDULED) {
+            return false;
+        }
+        scheduled[scheduledCount++] = handler;
+        return true;
+    }
+
+    void update() {
+        while (scheduledCount > 0) {
+            auto handler = scheduled[0];
+            memmove(scheduled, scheduled + 1, --scheduledCount * sizeof(scheduled[0]));
+            handler(nullptr, 0);
+        }
+    }
+}
+
+namespace Config::BoardManager
+{
+    const Board* getBoard() {
+        static Board board = {};
+        return &board;
+    }
+}
+
+struct AsyncResult
+{
+    bool done;
+    bool result;
+};
+
+void onAsyncDone(void* context, bool result) {
+    auto r = (AsyncResult*)context;
+    r->done = true;
+    r->result = result;
+}
+
+void start() {
+    FakeTwi::reset();
+    Scheduler::scheduledCount = 0;
+    Stubs::onPollPendingIRQ = FakeTwi::onPoll;
+    I2C::init();
+}
+
+bool checkRegisterData(const uint8_t* data, uint8_t reg, int len) {
+    for (int i = 0; i < len; ++i) {
+        if (data[i] != (uint8_t)(reg + i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// <summary>
+/// Reads the 6 bytes of acceleration data at the current bus speed, blocking from an
+/// interrupt and then asynchronously, and reports how long the CPU was held by each.
+/// </summary>
+void measureAccelerationRead(const char* label) {
+    const uint8_t reg = 0x06;
+    const float busUs = FakeTwi::busTimeUs(FakeTwi::frequency, 1, 6);
+
+    // Blocking, from an interrupt at the TWI priority (e.g. the accelerometer data ready pin)
+    uint8_t data[6] = {};
+    Stubs::interruptPriority = APP_IRQ_PRIORITY_HIGH;
+    float startUs = FakeTwi::nowUs;
+    I2C::readRegisters(DEVICE_ADDRESS, reg, data, 6);
+    float blockingUs = FakeTwi::nowUs - startUs;
+    Stubs::interruptPriority = APP_IRQ_PRIORITY_THREAD;
+    CHECK(checkRegisterData(data, reg, 6));
+    CHECK(blockingUs >= busUs && blockingUs < busUs + 2 * POLL_US);
+
+    // Asynchronous, from the main loop
+    memset(data, 0, sizeof(data));
+    AsyncResult r = { false, false };
+    startUs = FakeTwi::nowUs;
+    CHECK(I2C::readRegistersAsync(DEVICE_ADDRESS, reg, data, 6, onAsyncDone, &r));
+    float asyncUs = FakeTwi::nowUs - startUs;
+    CHECK(!r.done);
+    FakeTwi::advance(busUs + 2 * POLL_US);
+    CHECK(r.done && r.result);
+    CHECK(checkRegisterData(data, reg, 6));
+    CHECK(asyncUs == 0.0f);
+
+    printf("  %s: 6 bytes read, %u SCL periods, bus %.1fus, CPU held %.1fus blocking vs %.1fus async\n",
+        label, FakeTwi::clockCount(1, 6, true), busUs, blockingUs, asyncUs);
+}
+
+void testBusTiming() {
+    start();
+    CHECK(FakeTwi::frequency == NRF_DRV_TWI_FREQ_400K);
+    measureAccelerationRead("400kHz");
+
+    // Two address NACKs (the transfer and its retry) to fall back to standard mode
+    FakeTwi::scriptError(NRF_DRV_TWI_EVT_ADDRESS_NACK);
+    FakeTwi::scriptError(NRF_DRV_TWI_EVT_ADDRESS_NACK);
+    AsyncResult r = { false, false };
+    uint8_t data[6];
+    I2C::readRegistersAsync(DEVICE_ADDRESS, 0x06, data, 6, onAsyncDone, &r);
+    FakeTwi::advance(1000.0f);
+    Scheduler::update();
+    CHECK(FakeTwi::frequency == NRF_DRV_TWI_FREQ_100K);
+    measureAccelerationRead("100kHz");
+}
+
+void testPolledContexts() {
+    start();
+    CHECK(I2C::canWaitForInterrupt());
+
+    // Same priority as the TWI interrupt
+    Stubs::interruptPriority = APP_IRQ_PRIORITY_HIGH;
+    CHECK(!I2C::canWaitForInterrupt());
+    CHECK_EQ(I2C::readRegister(DEVICE_ADDRESS, 0x0F), 0x0F);
+
+    // Higher priority
+    Stubs::interruptPriority = APP_IRQ_PRIORITY_HIGHEST;
+    CHECK(!I2C::canWaitForInterrupt());
+    CHECK_EQ(I2C::readRegister(DEVICE_ADDRESS, 0x1B), 0x1B);
+
+    // Critical region in the main loop
+    Stubs::interruptPriority = APP_IRQ_PRIORITY_THREAD;
+    CRITICAL_REGION_ENTER();
+    CHECK(!I2C::canWaitForInterrupt());
+    CHECK_EQ(I2C::readRegister(DEVICE_ADDRESS, 0x21), 0x21);
+    CRITICAL_REGION_EXIT();
+    CHECK(I2C::canWaitForInterrupt());
+
+    // Blocking write queued behind an asynchronous read still in progress
+    uint8_t data[6];
+    AsyncResult r = { false, false };
+    I2C::readRegistersAsync(DEVICE_ADDRESS, 0x06, data, 6, onAsyncDone, &r);
+    Stubs::interruptPriority = APP_IRQ_PRIORITY_LOW;
+    CRITICAL_REGION_ENTER();
+    CHECK(I2C::write(DEVICE_ADDRESS, 0x1B));
+    CRITICAL_REGION_EXIT();
+    CHECK(r.done && r.result);
+    CHECK_EQ(FakeTwi::xferCount, 5);
+}
+
+void testFallbackDeferred() {
+    start();
+    FakeTwi::scriptError(NRF_DRV_TWI_EVT_ADDRESS_NACK);
+    FakeTwi::scriptError(NRF_DRV_TWI_EVT_DATA_NACK);
+
+    uint8_t data[6];
+    AsyncResult r1 = { false, false };
+    AsyncResult r2 = { false, false };
+    I2C::readRegistersAsync(DEVICE_ADDRESS, 0x06, data, 6, onAsyncDone, &r1);
+    FakeTwi::advance(500.0f);
+
+    // The transfer failed twice, the fallback waits for the scheduler
+    CHECK(r1.done && !r1.result);
+    CHECK_EQ(FakeTwi::xferCount, 2);
+    CHECK_EQ(FakeTwi::uninitCount, 0);
+    CHECK_EQ(Scheduler::scheduledCount, 1);
+
+    // Nothing starts at 400kHz meanwhile
+    I2C::readRegistersAsync(DEVICE_ADDRESS, 0x06, data, 6, onAsyncDone, &r2);
+    FakeTwi::advance(500.0f);
+    CHECK(!r2.done);
+    CHECK_EQ(FakeTwi::xferCount, 2);
+
+    Scheduler::update();
+    CHECK_EQ(FakeTwi::uninitCount, 1);
+    CHECK_EQ(FakeTwi::initCount, 2);
+    CHECK(FakeTwi::frequency == NRF_DRV_TWI_FREQ_100K);
+    CHECK(!FakeTwi::reinitFromHandler);
+    FakeTwi::advance(1000.0f);
+    CHECK(r2.done && r2.result);
+}
+
+void testFallbackWhileBlocking() {
+    start();
+    FakeTwi::scriptError(NRF_DRV_TWI_EVT_ADDRESS_NACK);
+    FakeTwi::scriptError(NRF_DRV_TWI_EVT_ADDRESS_NACK);
+
+    // The scheduler doesn't run while an interrupt waits, the blocking call applies the fallback
+    Stubs::interruptPriority = APP_IRQ_PRIORITY_HIGH;
+    uint8_t value = 0;
+    CHECK(!I2C::read(DEVICE_ADDRESS, &value));
+    CHECK(I2C::write(DEVICE_ADDRESS, 0x1B));
+    CHECK_EQ(FakeTwi::uninitCount, 1);
+    CHECK(FakeTwi::frequency == NRF_DRV_TWI_FREQ_100K);
+    CHECK(!FakeTwi::reinitFromHandler);
+    Stubs::interruptPriority = APP_IRQ_PRIORITY_THREAD;
+
+    // And the scheduled one has nothing left to do
+    Scheduler::update();
+    CHECK_EQ(FakeTwi::uninitCount, 1);
+}
+
+int main() {
+    testBusTiming();
+    testPolledContexts();
+    testFallbackDeferred();
+    testFallbackWhileBlocking();
+    return Test::report("i2c_test");
+}
@@ -0,0 +1,579 @@
+// Host test of the key value store, through the real Flash driver over the RAM backed fstorage stub.
+// Records crafted by hand check how the log is parsed, random writes are checked against a model,
+// and the power is cut after every flash operation of appends and compactions: after the reboot
+// the settings must be intact and each key must hold its previous value or the new one. Once there
+// is no room left for copies of the settings, compactions go on and fall back to the last copy.
+
+#include "test.h"
+#include "config/key_value_store.h"
+#include "config/settings.h"
+#include "drivers_nrf/flash.h"
+#include "data_set/data_set.h"
+#include "data_set/data_set_data.h"
+#include "utils/Utils.h"
+#include "nrf_fstorage.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <vector>
+
+TEST_MAIN_STATE
+
+using namespace DriversNRF;
+using namespace Config;
+
+#define TEST_SETTINGS_KEY 0x15E77165
+#define RANDOM_WRITES 600
+#define POWER_CUT_WRITES 1000
+#define NO_ROOM_WRITES 300
+#define MAX_VALUE_SIZE 200
+#define MAX_POWER_CUT_VALUE_SIZE 400  // Bigger values, so that the cuts often land in compactions
+#define MAX_COMPACTION_OPERATIONS 7    // Backup settings, records and footer, erase, settings, records, done marker
+
+typedef std::vector<uint8_t> Bytes;
+
+static uint32_t randomState = 1;
+
+uint32_t randomInt(uint32_t max) {
+    randomState = randomState * 1664525 + 1013904223;
+    return (randomState >> 8) % max;
+}
+
+Bytes randomBytes(uint32_t size) {
+    Bytes bytes(size);
+    for (auto& byte : bytes) {
+        byte = randomInt(256);
+    }
+    return bytes;
+}
+
+namespace Config::KeyValueStore
+{
+    void onProgrammingEvent(void* context, Flash::ProgrammingEventType evt, Flash::ProgrammingRegion region);
+}
+
+namespace Config::SettingsManager
+{
+    Settings const * const getSettings() {
+        auto settings = (const Settings*)(uintptr_t)Flash::getSettingsStartAddress();
+        if (settings->headMarker != TEST_SETTINGS_KEY || settings->tailMarker != TEST_SETTINGS_KEY) {
+            return nullptr;
+        }
+        return settings;
+    }
+
+    bool checkValid() {
+        return getSettings() != nullptr;
+    }
+}
+
+namespace FakeDataSet
+{
+    uint32_t size = 0;
+    Bytes data;
+}
+
+namespace DataSet
+{
+    uint32_t computeDataSetDataSize(const Data* newData) { return FakeDataSet::size; }
+    bool validateData(const Data* data, uint32_t dataAddress) { return true; }
+    uint32_t availableDataSize() { return Flash::getFlashEndAddress() - Flash::getDataSetDataAddress(); }
+}
+
+namespace FakeClient
+{
+    int finished = 0;
+    bool result = false;
+
+    void onFinished(bool success) {
+        finished++;
+        result = success;
+    }
+
+    void reset() {
+        finished = 0;
+        result = false;
+    }
+}
+
+/// <summary>
+/// What the store should return for each key, empty if nothing was written
+/// </summary>
+struct Model
+{
+    Bytes values[KeyValueStore::Key_Count];
+};
+
+Bytes padded(const Bytes& value) {
+    Bytes bytes = value;
+    bytes.resize(Utils::roundUpTo4(value.size()), 0);
+    return bytes;
+}
+
+bool readMatches(KeyValueStore::Key key, const Bytes& value) {
+    uint16_t size = 0;
+    auto data = (const uint8_t*)KeyValueStore::read(key, &size);
+    if (value.empty()) {
+        return data == nullptr;
+    }
+    return data != nullptr && Bytes(data, data + size) == padded(value);
+}
+
+/// <summary>
+/// Size of the records once compacted with the new value
+/// </summary>
+uint32_t compactedSize(const Model& model, KeyValueStore::Key key, const Bytes& value) {
+    uint32_t size = 4 + Utils::roundUpTo4(value.size());
+    for (int i = 0; i < KeyValueStore::Key_Count; ++i) {
+        if (i != key && !model.values[i].empty()) {
+            size += 4 + Utils::roundUpTo4(model.values[i].size());
+        }
+    }
+    return size;
+}
+
+bool checkModel(const Model& model) {
+    bool ok = true;
+    for (int i = 0; i < KeyValueStore::Key_Count; ++i) {
+        ok &= CHECK(readMatches((KeyValueStore::Key)i, model.values[i]));
+    }
+    return ok;
+}
+
+Bytes settingsImage() {
+    auto start = (const uint8_t*)(uintptr_t)Flash::getSettingsStartAddress();
+    return Bytes(start, start + sizeof(Settings));
+}
+
+Settings makeSettings() {
+    Settings settings;
+    auto bytes = randomBytes(sizeof(Settings));
+    memcpy(&settings, bytes.data(), sizeof(Settings));
+    settings.headMarker = TEST_SETTINGS_KEY;
+    settings.tailMarker = TEST_SETTINGS_KEY;
+    return settings;
+}
+
+/// <summary>
+/// Writes a record straight to the flash, the way the store lays them out
+/// </summary>
+uint32_t craftRecord(uint32_t offset, uint8_t key, const Bytes& value, bool badCrc = false, uint8_t sizeInWords = 0) {
+    Bytes data = padded(value);
+    uint16_t crc = Utils::computeCrc16(data.data(), data.size(), Utils::computeCrc16(&key, 1));
+    uint8_t header[4] = { key, (uint8_t)(sizeInWords != 0 ? sizeInWords : data.size() / 4), 0, 0 };
+    if (badCrc) {
+        crc ^= 1;
+    }
+    memcpy(header + 2, &crc, sizeof(crc));
+    auto dst = (uint8_t*)(uintptr_t)(Flash::getSettingsRecordsAddress() + offset);
+    memcpy(dst, header, sizeof(header));
+    memcpy(dst + sizeof(header), data.data(), data.size());
+    return offset + sizeof(header) + data.size();
+}
+
+void craftSettings(const Settings& settings) {
+    Stubs::eraseFlash();
+    memcpy((void*)(uintptr_t)Flash::getSettingsStartAddress(), &settings, sizeof(Settings));
+}
+
+bool startWrite(KeyValueStore::Key key, const Bytes& value) {
+    return KeyValueStore::write(key, value.data(), value.size(), FakeClient::onFinished);
+}
+
+/// <summary>
+/// Same as the die booting: the store indexes the records, then an interrupted settings programming is finished
+/// </summary>
+bool reboot() {
+    Flash::unhookProgrammingEvent(KeyValueStore::onProgrammingEvent);
+    Flash::init();
+    KeyValueStore::init();
+    FakeClient::reset();
+    if (!Flash::restoreSettings(FakeClient::onFinished)) {
+        return false;
+    }
+    Stubs::runFlash();
+    CHECK_EQ(FakeClient::finished, 1);
+    CHECK(FakeClient::result);
+    // Only once
+    CHECK(!Flash::restoreSettings(FakeClient::onFinished));
+    return true;
+}
+
+bool startDataSet(uint32_t size) {
+    DataSet::Data header;
+    memset(&header, 0, sizeof(header));
+    header.headMarker = ANIMATION_SET_VALID_KEY;
+    header.version = ANIMATION_SET_VERSION;
+    header.tailMarker = ANIMATION_SET_VALID_KEY;
+    FakeDataSet::size = size;
+    FakeDataSet::data = randomBytes(size);
+    return Flash::programDataSet(header, [](Flash::ProgramFlashFuncCallback callback) {
+        Flash::write(nullptr, Flash::getDataSetDataAddress(), FakeDataSet::data.data(), FakeDataSet::data.size(), callback);
+    }, FakeClient::onFinished);
+}
+
+/// <summary>
+/// Programs a small dataset, which erases the settings copies and makes room for new ones
+/// </summary>
+void reprogramDataSet() {
+    FakeClient::reset();
+    CHECK(startDataSet(4 + 4 * randomInt(64)));
+    Stubs::runFlash();
+    CHECK(FakeClient::result);
+}
+
+Bytes randomValue() {
+    return randomBytes(1 + randomInt(MAX_VALUE_SIZE));
+}
+
+/// <summary>
+/// Writes the value, reprogramming the dataset first if there is no room left to back up the settings
+/// </summary>
+void writeValue(Model& model, KeyValueStore::Key key, const Bytes& value) {
+    if (!startWrite(key, value)) {
+        reprogramDataSet();
+        FakeClient::reset();
+        CHECK(startWrite(key, value));
+    }
+    Stubs::runFlash();
+    CHECK(FakeClient::result);
+    model.values[key] = value;
+}
+
+void testParsing() {
+    const Settings settings = makeSettings();
+    const Bytes first = randomBytes(5);
+    const Bytes second = randomBytes(12);
+    const Bytes other = randomBytes(30);
+
+    // The latest valid record of each key wins, bad CRCs and unknown keys are skipped over
+    craftSettings(settings);
+    uint32_t offset = craftRecord(0, KeyValueStore::Key_Name, first);
+    offset = craftRecord(offset, KeyValueStore::Key_FaceNormals, other);
+    offset = craftRecord(offset, KeyValueStore::Key_Name, second);
+    offset = craftRecord(offset, KeyValueStore::Key_Name, randomBytes(8), true);
+    offset = craftRecord(offset, KeyValueStore::Key_Count, randomBytes(4));
+    offset = craftRecord(offset, KeyValueStore::Key_DesignAndColor, randomBytes(4), true);
+    reboot();
+    Model model;
+    model.values[KeyValueStore::Key_Name] = second;
+    model.values[KeyValueStore::Key_FaceNormals] = other;
+    checkModel(model);
+    uint16_t size = 0;
+    KeyValueStore::read(KeyValueStore::Key_Name, &size);
+    CHECK_EQ(size, 12);
+    KeyValueStore::read(KeyValueStore::Key_FaceNormals, &size);
+    CHECK_EQ(size, 32);
+    CHECK(KeyValueStore::read(KeyValueStore::Key_Count) == nullptr);
+
+    // New records go after the skipped ones
+    const Bytes appended = randomBytes(7);
+    uint32_t compactions = KeyValueStore::getCompactionCount();
+    writeValue(model, KeyValueStore::Key_BroadcastMode, appended);
+    checkModel(model);
+    CHECK_EQ(KeyValueStore::getCompactionCount(), compactions);
+    CHECK_EQ(((const uint8_t*)(uintptr_t)(Flash::getSettingsRecordsAddress() + offset))[0], KeyValueStore::Key_BroadcastMode);
+    reboot();
+    checkModel(model);
+
+    // A record running past the page can't be skipped, the page is full and the next write compacts it
+    const uint32_t recordsSize = Flash::getSettingsEndAddress() - Flash::getSettingsRecordsAddress();
+    craftSettings(settings);
+    model = Model();
+    offset = craftRecord(0, KeyValueStore::Key_Name, first);
+    model.values[KeyValueStore::Key_Name] = first;
+    while (recordsSize - offset >= 4 + 0xFF * 4) {
+        model.values[KeyValueStore::Key_BroadcastMode] = randomBytes(4);
+        offset = craftRecord(offset, KeyValueStore::Key_BroadcastMode, model.values[KeyValueStore::Key_BroadcastMode]);
+    }
+    craftRecord(offset, KeyValueStore::Key_FaceNormals, other, false, 0xFF);
+    reboot();
+    checkModel(model);
+    writeValue(model, KeyValueStore::Key_DesignAndColor, second);
+    CHECK_EQ(KeyValueStore::getCompactionCount(), compactions + 1);
+    CHECK(settingsImage() == Bytes((const uint8_t*)&settings, (const uint8_t*)&settings + sizeof(Settings)));
+    reboot();
+    checkModel(model);
+
+    // Records after invalid settings are ignored, and can't be compacted without settings to keep
+    Settings invalid = settings;
+    invalid.tailMarker = 0;
+    craftSettings(invalid);
+    craftRecord(0, KeyValueStore::Key_Name, first);
+    reboot();
+    checkModel(Model());
+    FakeClient::reset();
+    CHECK(!startWrite(KeyValueStore::Key_Name, first));
+    Stubs::runFlash();
+    CHECK_EQ(FakeClient::finished, 0);
+
+    // Invalid writes
+    craftSettings(settings);
+    reboot();
+    CHECK(!startWrite(KeyValueStore::Key_Count, first));
+    CHECK(!startWrite(KeyValueStore::Key_Name, Bytes()));
+    CHECK(!startWrite(KeyValueStore::Key_Name, Bytes(0xFF * 4 + 1)));
+    CHECK_EQ(Stubs::flashErrorCount, 0);
+}
+
+void testRandomWrites() {
+    craftSettings(makeSettings());
+    const Bytes settings = settingsImage();
+    reboot();
+    Model model;
+    uint32_t compactions = KeyValueStore::getCompactionCount();
+    for (int i = 0; i < RANDOM_WRITES; ++i) {
+        FakeClient::reset();
+        auto key = (KeyValueStore::Key)randomInt(KeyValueStore::Key_Count);
+        writeValue(model, key, randomValue());
+        CHECK_EQ(FakeClient::finished, 1);
+        if (!checkModel(model)) {
+            break;
+        }
+        if (randomInt(20) == 0) {
+            CHECK(!reboot());
+            checkModel(model);
+        }
+    }
+    CHECK(settingsImage() == settings);
+    printf("  %d compactions over %d writes\n", (int)(KeyValueStore::getCompactionCount() - compactions), RANDOM_WRITES);
+    CHECK(KeyValueStore::getCompactionCount() > compactions + 10);
+}
+
+void testLockedWhileProgramming() {
+    craftSettings(makeSettings());
+    reboot();
+    Model model;
+
+    // No append while the dataset is programmed
+    FakeClient::reset();
+    CHECK(startDataSet(64));
+    CHECK(!startWrite(KeyValueStore::Key_Name, randomValue()));
+    Stubs::runFlash();
+    CHECK_EQ(FakeClient::finished, 1);
+    checkModel(model);
+
+    // And no programming while a record is appended
+    FakeClient::reset();
+    const Bytes value = randomValue();
+    CHECK(startWrite(KeyValueStore::Key_Name, value));
+    CHECK(Flash::isBusy());
+    CHECK(!startDataSet(64));
+    CHECK(!startWrite(KeyValueStore::Key_FaceNormals, randomValue()));
+    Stubs::runFlash();
+    CHECK_EQ(FakeClient::finished, 1);
+    CHECK(FakeClient::result);
+    model.values[KeyValueStore::Key_Name] = value;
+    checkModel(model);
+
+    // Compacting needs room for a copy of the settings, the store keeps working once the dataset is programmed again
+    FakeClient::reset();
+    CHECK(startDataSet((DataSet::availableDataSize() - 1) & ~3));
+    Stubs::runFlash();
+    CHECK(FakeClient::result);
+    uint32_t compactions = KeyValueStore::getCompactionCount();
+    auto key = KeyValueStore::Key_Name;
+    Bytes next;
+    bool refused = false;
+    for (int i = 0; i < 100 && !refused; ++i) {
+        key = (KeyValueStore::Key)randomInt(KeyValueStore::Key_Count);
+        next = randomValue();
+        FakeClient::reset();
+        refused = !startWrite(key, next);
+        if (!refused) {
+            Stubs::runFlash();
+            model.values[key] = next;
+        }
+    }
+    CHECK(refused);
+    CHECK_EQ(KeyValueStore::getCompactionCount(), compactions);
+    checkModel(model);
+    reprogramDataSet();
+    writeValue(model, key, next);
+    CHECK_EQ(KeyValueStore::getCompactionCount(), compactions + 1);
+    checkModel(model);
+}
+
+/// <summary>
+/// Starts the write in a child process and cuts the power after the given number of flash operations,
+/// the flash is then as the child left it. Returns false if the write was refused, the flash is unchanged then.
+/// </summary>
+bool writeAndCutPower(KeyValueStore::Key key, const Bytes& value, int operations) {
+    int fds[2];
+    if (!CHECK(pipe(fds) == 0)) {
+        return false;
+    }
+    const uint32_t size = Stubs::flashPageCount * STUB_FLASH_PAGE_SIZE;
+    const int failures = Test::failures;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        uint8_t started = startWrite(key, value) ? 1 : 0;
+        Stubs::runFlash(operations);
+        Stubs::powerCut();
+        bool sent = write(fds[1], &started, 1) == 1;
+        for (uint32_t offset = 0; sent && offset < size; ) {
+            ssize_t count = write(fds[1], Stubs::flash + offset, size - offset);
+            sent = count > 0;
+            offset += count;
+        }
+        close(fds[1]);
+        fflush(stdout);
+        _exit(sent ? Test::failures - failures : 1);
+    }
+    close(fds[1]);
+    uint8_t started = 0;
+    Bytes image(size);
+    uint32_t received = 0;
+    if (read(fds[0], &started, 1) == 1) {
+        while (received < size) {
+            ssize_t count = read(fds[0], image.data() + received, size - received);
+            if (count <= 0) {
+                break;
+            }
+            received += count;
+        }
+    }
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    if (!CHECK_EQ(received, size)) {
+        return false;
+    }
+    memcpy(Stubs::flash, image.data(), size);
+    return started != 0;
+}
+
+void testPowerCuts() {
+    craftSettings(makeSettings());
+    const Bytes settings = settingsImage();
+    reboot();
+    Model model;
+    int restores = 0;
+    int newValues = 0;
+    for (int i = 0; i < POWER_CUT_WRITES; ++i) {
+        auto key = (KeyValueStore::Key)randomInt(KeyValueStore::Key_Count);
+        const Bytes value = randomBytes(1 + randomInt(MAX_POWER_CUT_VALUE_SIZE));
+        int operations = randomInt(MAX_COMPACTION_OPERATIONS + 1);
+        if (!Flash::canBackupSettings(compactedSize(model, key, value))) {
+            // Make room, a compaction without a new copy could fall back to older values
+            reprogramDataSet();
+        }
+        CHECK(writeAndCutPower(key, value, operations));
+        if (reboot()) {
+            restores++;
+        }
+
+        // The settings are never lost, the key holds either value
+        CHECK(settingsImage() == settings);
+        if (readMatches(key, value)) {
+            model.values[key] = value;
+            newValues++;
+        }
+        if (!checkModel(model)) {
+            break;
+        }
+
+        // And the store keeps working
+        if (randomInt(4) == 0) {
+            FakeClient::reset();
+            writeValue(model, (KeyValueStore::Key)randomInt(KeyValueStore::Key_Count), randomValue());
+            checkModel(model);
+        }
+    }
+    printf("  %d power cuts, %d new values kept, %d settings restored\n", POWER_CUT_WRITES, newValues, restores);
+    CHECK(restores > 10);
+    CHECK(newValues > 0 && newValues < POWER_CUT_WRITES);
+}
+
+/// <summary>
+/// Whether the key holds nothing or one of the values it was given
+/// </summary>
+bool heldBefore(KeyValueStore::Key key, const std::vector<Bytes>& history) {
+    uint16_t size = 0;
+    auto data = (const uint8_t*)KeyValueStore::read(key, &size);
+    if (data == nullptr) {
+        return true;
+    }
+    for (auto& value : history) {
+        if (Bytes(data, data + size) == padded(value)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void testNoRoomForCopies() {
+    craftSettings(makeSettings());
+    const Bytes settings = settingsImage();
+    reboot();
+
+    // Leave room for a couple of copies only
+    FakeClient::reset();
+    CHECK(startDataSet((DataSet::availableDataSize() - 3000) & ~3));
+    Stubs::runFlash();
+    CHECK(FakeClient::result);
+
+    // Compactions go on once the copies have used up the room
+    Model model;
+    std::vector<Bytes> history[KeyValueStore::Key_Count];
+    int noRoom = 0;
+    for (int i = 0; i < NO_ROOM_WRITES; ++i) {
+        auto key = (KeyValueStore::Key)randomInt(KeyValueStore::Key_Count);
+        const Bytes value = randomBytes(1 + randomInt(MAX_POWER_CUT_VALUE_SIZE));
+        const bool canBackup = Flash::canBackupSettings(compactedSize(model, key, value));
+        const uint32_t compactions = KeyValueStore::getCompactionCount();
+        FakeClient::reset();
+        if (!CHECK(startWrite(key, value))) {
+            break;
+        }
+        Stubs::runFlash();
+        CHECK(FakeClient::result);
+        if (!canBackup && KeyValueStore::getCompactionCount() > compactions) {
+            noRoom++;
+        }
+        model.values[key] = value;
+        history[key].push_back(value);
+        if (!checkModel(model)) {
+            break;
+        }
+    }
+    CHECK(noRoom > 10);
+
+    // Cut short, they leave the records of the last copy, each key holds one of its values
+    int restores = 0;
+    for (int i = 0; i < NO_ROOM_WRITES; ++i) {
+        auto key = (KeyValueStore::Key)randomInt(KeyValueStore::Key_Count);
+        const Bytes value = randomBytes(1 + randomInt(MAX_POWER_CUT_VALUE_SIZE));
+        history[key].push_back(value);
+        CHECK(writeAndCutPower(key, value, randomInt(MAX_COMPACTION_OPERATIONS + 1)));
+        if (reboot()) {
+            restores++;
+        }
+        CHECK(settingsImage() == settings);
+        bool ok = true;
+        for (int k = 0; k < KeyValueStore::Key_Count; ++k) {
+            ok &= CHECK(heldBefore((KeyValueStore::Key)k, history[k]));
+        }
+        if (!ok) {
+            break;
+        }
+    }
+    printf("  %d compactions without room for a copy, %d power cuts fell back to the last one\n", noRoom, restores);
+    CHECK(restores > 0);
+}
+
+int main() {
+    Stubs::eraseFlash();
+    Flash::init();
+    KeyValueStore::init();
+    testParsing();
+    testRandomWrites();
+    testLockedWhileProgramming();
+    testPowerCuts();
+    testNoRoomForCopies();
+    printf("  %d flash operations\n", (int)Stubs::flashOperationCount);
+    return Test::report("key_value_store_test");
+}
@@ -0,0 +1,155 @@
+// Host test of the incremental LZ77 decoder: compressed data is fed in random pieces and
+// decoded through random output windows, the way the bulk transfer decompresses to flash,
+// and corrupted streams must be rejected without writing outside the window.
+
+#include "test.h"
+#include "utils/Utils.h"
+#include "nordic_common.h"
+#include <string.h>
+#include <vector>
+
+TEST_MAIN_STATE
+
+#define ROUND_TRIPS 300
+#define CORRUPTIONS 3000
+#define MAX_DATA_SIZE 6000
+#define GUARD_SIZE 16
+#define GUARD_BYTE 0xA5
+
+typedef std::vector<uint8_t> Bytes;
+
+static uint32_t randomState = 1;
+
+uint32_t randomInt(uint32_t max) {
+    randomState = randomState * 1664525 + 1013904223;
+    return (randomState >> 8) % max;
+}
+
+Bytes compress(const Bytes& data) {
+    Bytes compressed(4 + 3 * data.size());
+    compressed.resize(Utils::lz77_compress(const_cast<uint8_t*>(data.data()), data.size(), compressed.data()));
+    return compressed;
+}
+
+/// <summary>
+/// Data with repeats at all distances, up to and past the 4095 bytes the format can reach back
+/// </summary>
+Bytes makeData(int size) {
+    Bytes data;
+    while ((int)data.size() < size) {
+        if (data.size() > 0 && randomInt(3) != 0) {
+            int distance = 1 + randomInt(MIN((int)data.size(), 5000));
+            int length = 1 + randomInt(40);
+            for (int i = 0; i < length; ++i) {
+                data.push_back(data[data.size() - distance]);
+            }
+        } else {
+            data.push_back(randomInt(256));
+        }
+    }
+    data.resize(size);
+    return data;
+}
+
+/// <summary>
+/// Decodes like the bulk transfer does: the window is moved to "flash" when full,
+/// matches reaching before the window read from there. Returns false if the decoder failed.
+/// </summary>
+bool decode(const Bytes& compressed, Bytes& flash, int windowSize, bool checkGuard) {
+    Utils::LZ77Decoder decoder;
+    // Each 3 bytes token decodes to 16 bytes at most
+    flash.assign(16 * compressed.size() / 3 + 16, 0);
+    Bytes window(windowSize + GUARD_SIZE, GUARD_BYTE);
+    decoder.begin(flash.data());
+    decoder.setOutput(window.data(), windowSize);
+
+    size_t offset = 0;
+    while (!decoder.isDone() && !decoder.hasFailed()) {
+        uint32_t pieceSize = 1 + randomInt(150);
+        pieceSize = MIN(pieceSize, compressed.size() - offset);
+        uint32_t used = decoder.decode(&compressed[offset], pieceSize);
+        offset += used;
+        if (decoder.isOutputFull() || decoder.isDone()) {
+            if (decoder.getOutputOffset() + decoder.getOutputLength() > flash.size()) {
+                return false;
+            }
+            memcpy(&flash[decoder.getOutputOffset()], window.data(), decoder.getOutputLength());
+            if (!decoder.isDone()) {
+                decoder.setOutput(window.data(), windowSize);
+            }
+        } else if (used < pieceSize || offset == compressed.size()) {
+            // Ran out of input, or stopped for no reason
+            break;
+        }
+        if (checkGuard) {
+            for (int i = 0; i < GUARD_SIZE; ++i) {
+                CHECK_EQ(window[windowSize + i], GUARD_BYTE);
+            }
+        }
+    }
+    if (decoder.isDone()) {
+        flash.resize(decoder.getUncompressedSize());
+        return true;
+    }
+    return false;
+}
+
+void testEmpty() {
+    Bytes compressed = compress(Bytes());
+    Utils::LZ77Decoder decoder;
+    decoder.begin(nullptr);
+    CHECK_EQ(decoder.decode(compressed.data(), compressed.size()), 4);
+    CHECK(decoder.isDone());
+    CHECK_EQ(decoder.getUncompressedSize(), 0);
+}
+
+void testRoundTrips() {
+    int totalSize = 0;
+    int totalCompressed = 0;
+    for (int i = 0; i < ROUND_TRIPS; ++i) {
+        auto data = makeData(1 + randomInt(MAX_DATA_SIZE));
+        auto compressed = compress(data);
+        int windowSize = 4 * (1 + randomInt(1024));
+        Bytes flash;
+        CHECK(decode(compressed, flash, windowSize, true));
+        CHECK(flash == data);
+
+        // And all at once, with the whole output in RAM
+        Bytes output(data.size() + 3);
+        CHECK_EQ(Utils::lz77_decompress(compressed.data(), output.data()), data.size());
+        CHECK(memcmp(output.data(), data.data(), data.size()) == 0);
+
+        totalSize += data.size();
+        totalCompressed += compressed.size();
+    }
+    printf("  %d round trips, %d bytes compressed to %d\n", ROUND_TRIPS, totalSize, totalCompressed);
+}
+
+void testCorruptedStreams() {
+    int rejected = 0;
+    for (int i = 0; i < CORRUPTIONS; ++i) {
+        auto data = makeData(1 + randomInt(2000));
+        auto compressed = compress(data);
+        int flips = 1 + randomInt(4);
+        for (int f = 0; f < flips; ++f) {
+            compressed[randomInt(compressed.size())] ^= 1 << randomInt(8);
+        }
+        if (randomInt(4) == 0) {
+            compressed.resize(randomInt(compressed.size()));
+        }
+        // Must not write past the window, whatever the outcome
+        Bytes flash;
+        if (!decode(compressed, flash, 4 * (1 + randomInt(128)), true)) {
+            rejected++;
+        }
+    }
+    printf("  %d corrupted streams, %d rejected\n", CORRUPTIONS, rejected);
+    CHECK(rejected > 0);
+}
+
+int main() {
+    testEmpty();
+    testRoundTrips();
+    testCorruptedStreams();
+    return Test::report("lz77_test");
+}
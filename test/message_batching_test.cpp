@@ -0,0 +1,449 @@
+// Host test of the message service batching: small messages sent during a pass must come
+// out as batches no larger than the connection payload, unpack to the same messages in the
+// same order, and received batches must be handed to the handlers one message at a time.
+// Over a link that takes a few packets per connection event, batching must at least double
+// the messages per second that get through, and nothing may be reordered behind the queue.
+// Fast handlers must not overtake queued messages, and slow ones are queued only for a while.
+
+#include "test.h"
+#include "bluetooth/bluetooth_message_service.h"
+#include "bluetooth/bluetooth_stack.h"
+#include "bluetooth/connection_profiles.h"
+#include "drivers_nrf/timers.h"
+#include <string.h>
+#include <vector>
+
+TEST_MAIN_STATE
+
+using namespace Bluetooth;
+
+namespace Bluetooth::MessageService
+{
+    void onMessageReceived(const uint8_t* data, uint16_t len);
+}
+
+#define DEFAULT_PAYLOAD_SIZE 20 // Default ATT MTU of 23 minus the header
+#define LARGE_PAYLOAD_SIZE 125
+#define RANDOM_PASSES 5000
+#define CONNECTION_INTERVAL_MS 30
+#define MAX_PACKETS_PER_EVENT 4 // What a phone typically takes per connection event
+#define SUSTAINED_SECONDS 10
+#define BURST_PERIOD_MS 10      // A few small messages at a time, more than the link carries unbatched
+#define BURST_SIZE 4
+
+typedef std::vector<uint8_t> Bytes;
+
+namespace FakeStack
+{
+    bool connected = true;
+    uint16_t maxPayloadSize = DEFAULT_PAYLOAD_SIZE;
+    std::vector<Bytes> notifications;
+    Stack::ConnectionEventMethod connectionHandler = nullptr;
+    int maxPacketsPerEvent = 0;     // Notifications the link takes per connection event, 0 for no limit
+    int eventPackets = 0;           // Taken since the last connection event
+
+    void reset(uint16_t payloadSize) {
+        connected = true;
+        maxPayloadSize = payloadSize;
+        notifications.clear();
+        maxPacketsPerEvent = 0;
+        eventPackets = 0;
+    }
+
+    void connectionEvent() {
+        eventPackets = 0;
+    }
+}
+
+namespace Bluetooth::Stack
+{
+    SendResult send(uint16_t handle, const uint8_t* data, uint16_t len) {
+        if (!FakeStack::connected) {
+            return SendResult_NotConnected;
+        }
+        if (FakeStack::maxPacketsPerEvent != 0 && FakeStack::eventPackets >= FakeStack::maxPacketsPerEvent) {
+            // Like the SoftDevice queue, full until the next connection event
+            return SendResult_Busy;
+        }
+        FakeStack::eventPackets++;
+        FakeStack::notifications.push_back(Bytes(data, data + len));
+        return SendResult_Ok;
+    }
+    bool isConnected() { return FakeStack::connected; }
+    uint16_t getMaxPayloadSize() { return FakeStack::maxPayloadSize; }
+    void hook(ConnectionEventMethod method, void* param) { FakeStack::connectionHandler = method; }
+}
+
+namespace Bluetooth::ConnectionProfiles
+{
+    void notifyActivity() {}
+}
+
+namespace FakeTime
+{
+    uint32_t ticks = 0; // In microseconds
+}
+
+namespace DriversNRF::Timers
+{
+    void createTimer(app_timer_id_t const * p_timer_id, app_timer_mode_t mode, app_timer_timeout_handler_t timeout_handler) {}
+    void startTimer(app_timer_id_t timer_id, uint32_t timeout_ms, void * p_context) {}
+    void stopTimer(app_timer_id_t timer_id) {}
+    uint32_t ticks() { return FakeTime::ticks; }
+    uint32_t ticksToMicros(uint32_t ticks) { return ticks; }
+}
+
+static uint32_t randomState = 1;
+
+uint32_t randomInt(uint32_t max) {
+    randomState = randomState * 1664525 + 1013904223;
+    return (randomState >> 8) % max;
+}
+
+Bytes makeMessage(uint8_t id, uint16_t size) {
+    // The type byte must not look like a batch or a sequenced message
+    Bytes message(size);
+    message[0] = Message::MessageType_Telemetry;
+    for (uint16_t i = 1; i < size; ++i) {
+        message[i] = id + i * 7;
+    }
+    return message;
+}
+
+void send(const Bytes& message) {
+    MessageService::SendMessage((const Message*)message.data(), message.size());
+}
+
+void receive(const Bytes& data) {
+    MessageService::onMessageReceived(data.data(), data.size());
+    MessageService::update();
+}
+
+void setBatching(bool enable) {
+    MessageSetBatching msg;
+    msg.enable = enable ? 1 : 0;
+    receive(Bytes((const uint8_t*)&msg, (const uint8_t*)&msg + sizeof(msg)));
+}
+
+/// <summary>
+/// Splits the notifications back into messages, checking the batch format along the way
+/// </summary>
+std::vector<Bytes> unpack(const std::vector<Bytes>& notifications) {
+    std::vector<Bytes> messages;
+    for (auto& notification : notifications) {
+        CHECK(notification.size() <= FakeStack::maxPayloadSize);
+        if (notification[0] == Message::MessageType_Batch) {
+            size_t offset = 1;
+            int count = 0;
+            while (offset < notification.size()) {
+                size_t size = notification[offset];
+                if (!CHECK(offset + 1 + size <= notification.size())) {
+                    break;
+                }
+                messages.push_back(Bytes(&notification[offset + 1], &notification[offset + 1 + size]));
+                offset += 1 + size;
+                count++;
+            }
+            // A batch of one is sent as the message itself
+            CHECK(count > 1);
+        } else {
+            messages.push_back(notification);
+        }
+    }
+    return messages;
+}
+
+void testDisabledByDefault() {
+    FakeStack::reset(LARGE_PAYLOAD_SIZE);
+    send(makeMessage(1, 4));
+    send(makeMessage(2, 4));
+    MessageService::update();
+    CHECK_EQ(FakeStack::notifications.size(), 2);
+    CHECK(FakeStack::notifications[0] == makeMessage(1, 4));
+}
+
+void testBatchingAck() {
+    FakeStack::reset(LARGE_PAYLOAD_SIZE);
+    setBatching(true);
+    if (CHECK_EQ(FakeStack::notifications.size(), 1)) {
+        auto ack = (const MessageSetBatchingAck*)FakeStack::notifications[0].data();
+        CHECK_EQ(ack->type, Message::MessageType_SetBatchingAck);
+        CHECK_EQ(ack->enabled, 1);
+        CHECK_EQ(ack->maxBatchSize, LARGE_PAYLOAD_SIZE);
+    }
+}
+
+void testSmallMessagesAreBatched() {
+    FakeStack::reset(LARGE_PAYLOAD_SIZE);
+    setBatching(true);
+    FakeStack::notifications.clear();
+
+    std::vector<Bytes> sent;
+    for (int i = 0; i < 10; ++i) {
+        sent.push_back(makeMessage(i, 3 + i));
+        send(sent.back());
+    }
+    // Nothing goes out until the end of the pass
+    CHECK_EQ(FakeStack::notifications.size(), 0);
+    MessageService::update();
+    CHECK_EQ(FakeStack::notifications.size(), 1);
+    CHECK(unpack(FakeStack::notifications) == sent);
+
+    // A lone message isn't wrapped
+    FakeStack::notifications.clear();
+    send(makeMessage(20, 5));
+    MessageService::update();
+    CHECK_EQ(FakeStack::notifications.size(), 1);
+    CHECK(FakeStack::notifications[0] == makeMessage(20, 5));
+}
+
+void testRandomPassesKeepOrder() {
+    // Batches are sized on the negotiated payload, whatever it is
+    const uint16_t payloadSizes[] = { DEFAULT_PAYLOAD_SIZE, 64, LARGE_PAYLOAD_SIZE };
+    int batches = 0;
+    for (auto payloadSize : payloadSizes) {
+        FakeStack::reset(payloadSize);
+        setBatching(true);
+        FakeStack::notifications.clear();
+
+        std::vector<Bytes> sent;
+        uint8_t nextId = 0;
+        for (int pass = 0; pass < RANDOM_PASSES; ++pass) {
+            int count = randomInt(6);
+            for (int i = 0; i < count; ++i) {
+                // Mostly small messages, now and then one too big to be batched
+                uint16_t size = randomInt(10) == 0 ? 1 + randomInt(payloadSize) : 1 + randomInt(12);
+                sent.push_back(makeMessage(nextId++, size));
+                send(sent.back());
+            }
+            MessageService::update();
+        }
+        for (auto& notification : FakeStack::notifications) {
+            if (notification[0] == Message::MessageType_Batch) {
+                batches++;
+            }
+        }
+        CHECK(unpack(FakeStack::notifications) == sent);
+        printf("  payload %d: %d messages in %d notifications\n", payloadSize, (int)sent.size(), (int)FakeStack::notifications.size());
+    }
+    CHECK(batches > 0);
+}
+
+/// <summary>
+/// Whether the messages were all sent, in the same order, some may have been dropped in between
+/// </summary>
+bool isSubsequence(const std::vector<Bytes>& messages, const std::vector<Bytes>& sent) {
+    size_t next = 0;
+    for (auto& message : messages) {
+        while (next < sent.size() && sent[next] != message) {
+            next++;
+        }
+        if (next == sent.size()) {
+            return false;
+        }
+        next++;
+    }
+    return true;
+}
+
+/// <summary>
+/// Messages per second that make it through the link, when more are sent than it can carry
+/// </summary>
+int sustainedRate(bool batching) {
+    FakeStack::reset(DEFAULT_PAYLOAD_SIZE);
+    setBatching(batching);
+    FakeStack::notifications.clear();
+    FakeStack::maxPacketsPerEvent = MAX_PACKETS_PER_EVENT;
+
+    // One main loop pass per millisecond
+    std::vector<Bytes> sent;
+    uint8_t nextId = 0;
+    for (int ms = 0; ms < SUSTAINED_SECONDS * 1000; ++ms) {
+        if (ms % CONNECTION_INTERVAL_MS == 0) {
+            FakeStack::connectionEvent();
+        }
+        if (ms % BURST_PERIOD_MS == 0) {
+            for (int i = 0; i < BURST_SIZE; ++i) {
+                sent.push_back(makeMessage(nextId++, 1 + randomInt(8)));
+                send(sent.back());
+            }
+        }
+        MessageService::update();
+    }
+
+    // The messages that don't fit in the queue are dropped, the others keep their order
+    auto delivered = unpack(FakeStack::notifications);
+    CHECK(isSubsequence(delivered, sent));
+
+    // Drop what is still queued before the next test
+    FakeStack::connected = false;
+    MessageService::update();
+    return delivered.size() / SUSTAINED_SECONDS;
+}
+
+void testSustainedRate() {
+    int unbatched = sustainedRate(false);
+    int batched = sustainedRate(true);
+    CHECK(batched >= unbatched * 2);
+    printf("  %d packets every %dms: %d messages/s unbatched, %d batched\n",
+        MAX_PACKETS_PER_EVENT, CONNECTION_INTERVAL_MS, unbatched, batched);
+}
+
+void testReconnectDisablesBatching() {
+    FakeStack::reset(LARGE_PAYLOAD_SIZE);
+    setBatching(true);
+    FakeStack::connectionHandler(nullptr, false);
+    FakeStack::connectionHandler(nullptr, true);
+    FakeStack::notifications.clear();
+    send(makeMessage(1, 4));
+    send(makeMessage(2, 4));
+    MessageService::update();
+    CHECK_EQ(FakeStack::notifications.size(), 2);
+}
+
+std::vector<Bytes> handled;
+
+void recordHandler(const Message* msg) {
+    auto data = (const uint8_t*)msg;
+    handled.push_back(Bytes(data, data + MessageService::getHandledMessageSize()));
+}
+
+void testReceivedBatchesAreUnpacked() {
+    MessageService::RegisterMessageHandler(Message::MessageType_RequestTelemetry, recordHandler);
+
+    Bytes first = { Message::MessageType_RequestTelemetry, 1 };
+    Bytes second = { Message::MessageType_RequestTelemetry, 2, 3, 4 };
+    Bytes batch = { Message::MessageType_Batch };
+    batch.push_back(first.size());
+    batch.insert(batch.end(), first.begin(), first.end());
+    batch.push_back(second.size());
+    batch.insert(batch.end(), second.begin(), second.end());
+
+    handled.clear();
+    receive(batch);
+    CHECK_EQ(handled.size(), 2);
+    CHECK(handled.size() == 2 && handled[0] == first && handled[1] == second);
+
+    // A truncated batch delivers what is complete and drops the rest
+    handled.clear();
+    Bytes truncated(batch.begin(), batch.end() - 1);
+    receive(truncated);
+    CHECK(handled.size() == 1 && handled[0] == first);
+
+    // Batches can't be nested
+    handled.clear();
+    Bytes nested = { Message::MessageType_Batch, (uint8_t)batch.size() };
+    nested.insert(nested.end(), batch.begin(), batch.end());
+    receive(nested);
+    CHECK_EQ(handled.size(), 0);
+
+    MessageService::UnregisterMessageHandler(Message::MessageType_RequestTelemetry);
+}
+
+void replyHandler(const Message* msg) {
+    // The largest message that fits with the sequence byte, then one that doesn't
+    send(makeMessage(1, FakeStack::maxPayloadSize - MESSAGE_SEQUENCE_SIZE));
+    send(makeMessage(2, FakeStack::maxPayloadSize));
+}
+
+void testSequencedRepliesFit() {
+    MessageService::RegisterMessageHandler(Message::MessageType_RequestTelemetry, replyHandler);
+    const uint16_t payloadSizes[] = { DEFAULT_PAYLOAD_SIZE, LARGE_PAYLOAD_SIZE };
+    for (auto payloadSize : payloadSizes) {
+        FakeStack::reset(payloadSize);
+        Bytes request = { Message::MessageType_RequestTelemetry | MESSAGE_SEQUENCE_FLAG, 42 };
+        receive(request);
+        if (CHECK_EQ(FakeStack::notifications.size(), 2)) {
+            for (auto& notification : FakeStack::notifications) {
+                CHECK(notification.size() <= payloadSize);
+            }
+            auto& tagged = FakeStack::notifications[0];
+            CHECK_EQ(tagged[0], Message::MessageType_Telemetry | MESSAGE_SEQUENCE_FLAG);
+            CHECK_EQ(tagged[1], 42);
+            CHECK_EQ(tagged.size(), payloadSize);
+
+            // Sent without the sequence rather than not at all
+            CHECK(FakeStack::notifications[1] == makeMessage(2, payloadSize));
+        }
+    }
+    MessageService::UnregisterMessageHandler(Message::MessageType_RequestTelemetry);
+}
+
+void testFastHandlersKeepOrder() {
+    MessageService::RegisterMessageHandler(Message::MessageType_WhoAreYou, recordHandler);
+    MessageService::RegisterFastMessageHandler(Message::MessageType_RequestTelemetry, recordHandler);
+    FakeStack::reset(LARGE_PAYLOAD_SIZE);
+    Bytes queued = { Message::MessageType_WhoAreYou };
+    Bytes fast = { Message::MessageType_RequestTelemetry, 1 };
+
+    // Handled as soon as received when nothing is waiting
+    handled.clear();
+    MessageService::onMessageReceived(fast.data(), fast.size());
+    CHECK(handled.size() == 1 && handled[0] == fast);
+
+    // Otherwise behind the queued messages
+    handled.clear();
+    MessageService::onMessageReceived(queued.data(), queued.size());
+    MessageService::onMessageReceived(fast.data(), fast.size());
+    CHECK_EQ(handled.size(), 0);
+    MessageService::update();
+    CHECK(handled.size() == 2 && handled[0] == queued && handled[1] == fast);
+
+    MessageService::UnregisterMessageHandler(Message::MessageType_WhoAreYou);
+    MessageService::UnregisterMessageHandler(Message::MessageType_RequestTelemetry);
+}
+
+static uint32_t handlerDurationUs = 0;
+
+void slowHandler(const Message* msg) {
+    recordHandler(msg);
+    FakeTime::ticks += handlerDurationUs;
+}
+
+void testSlowFastHandlersAreQueuedForAWhile() {
+    MessageService::RegisterFastMessageHandler(Message::MessageType_RequestTelemetry, slowHandler);
+    Bytes fast = { Message::MessageType_RequestTelemetry, 2 };
+    auto receiveFast = [&]() {
+        handled.clear();
+        MessageService::onMessageReceived(fast.data(), fast.size());
+        return handled.size() == 1;
+    };
+
+    // Over budget now and then, still called right away
+    handlerDurationUs = 2000;
+    CHECK(receiveFast());
+    handlerDurationUs = 10;
+    CHECK(receiveFast());
+
+    // Over budget too often, queued
+    handlerDurationUs = 2000;
+    int fastCalls = 0;
+    for (int i = 0; i < 10; ++i) {
+        fastCalls += receiveFast() ? 1 : 0;
+        MessageService::update();
+    }
+    CHECK_EQ(fastCalls, 3);
+
+    // And called right away again once its queued calls are quick
+    handlerDurationUs = 10;
+    CHECK(!receiveFast());
+    MessageService::update();
+    CHECK_EQ(handled.size(), 1);
+    CHECK(receiveFast());
+    MessageService::UnregisterMessageHandler(Message::MessageType_RequestTelemetry);
+}
+
+int main() {
+    MessageService::init();
+    testDisabledByDefault();
+    testBatchingAck();
+    testSmallMessagesAreBatched();
+    testRandomPassesKeepOrder();
+    testSustainedRate();
+    testReconnectDisablesBatching();
+    testReceivedBatchesAreUnpacked();
+    testSequencedRepliesFit();
+    testFastHandlersKeepOrder();
+    testSlowFastHandlersAreQueuedForAWhile();
+    return Test::report("message_batching_test");
+}
@@ -0,0 +1,139 @@
+// Host test of the circular Bluetooth message queue: random enqueue / dequeue sequences
+// are checked against a reference FIFO, with message sizes that force wrapping often.
+
+#include "test.h"
+#include "bluetooth/bluetooth_message_queue.h"
+#include <string.h>
+#include <deque>
+#include <vector>
+
+TEST_MAIN_STATE
+
+using namespace Bluetooth;
+
+#define QUEUE_SIZE 128
+#define MAX_MESSAGE_SIZE 40
+#define STEP_COUNT 200000
+
+static uint32_t randomState = 1;
+
+uint32_t randomInt(uint32_t max) {
+    randomState = randomState * 1664525 + 1013904223;
+    return (randomState >> 8) % max;
+}
+
+std::vector<uint8_t> makeMessage(uint8_t id, uint16_t size) {
+    std::vector<uint8_t> message(size);
+    for (uint16_t i = 0; i < size; ++i) {
+        message[i] = id + i * 7;
+    }
+    return message;
+}
+
+void testEmpty() {
+    MessageQueue<QUEUE_SIZE> queue;
+    uint16_t size = 0;
+    CHECK(queue.peek(&size) == nullptr);
+    CHECK_EQ(queue.count(), 0);
+}
+
+void testFillAndDrain() {
+    // Records are the size plus the message, padded to 2 bytes
+    MessageQueue<QUEUE_SIZE> queue;
+    auto message = makeMessage(1, 13);
+    int enqueued = 0;
+    while (queue.tryEnqueue((const Message*)message.data(), message.size())) {
+        enqueued++;
+    }
+    CHECK_EQ(enqueued, QUEUE_SIZE / 16);
+    CHECK_EQ(queue.count(), enqueued);
+
+    for (int i = 0; i < enqueued; ++i) {
+        uint16_t size = 0;
+        auto msg = queue.peek(&size);
+        CHECK(msg != nullptr && size == message.size() && memcmp(msg, message.data(), size) == 0);
+        queue.pop();
+    }
+    CHECK_EQ(queue.count(), 0);
+
+    // A message the size of the whole buffer fits in an empty queue
+    auto big = makeMessage(2, QUEUE_SIZE - sizeof(uint16_t));
+    CHECK(queue.tryEnqueue((const Message*)big.data(), big.size()));
+    CHECK(!queue.tryEnqueue((const Message*)message.data(), 1));
+    queue.clear();
+    CHECK_EQ(queue.count(), 0);
+}
+
+void testRandomAgainstReference() {
+    MessageQueue<QUEUE_SIZE> queue;
+    std::deque<std::vector<uint8_t>> reference;
+    int referenceBytes = 0;
+    uint8_t nextId = 0;
+    int enqueueFailures = 0;
+    int wraps = 0;
+    const uint8_t* lastAddress = nullptr;
+
+    for (int step = 0; step < STEP_COUNT; ++step) {
+        if (randomInt(100) < 55) {
+            auto message = makeMessage(nextId, 1 + randomInt(MAX_MESSAGE_SIZE));
+            bool ok = queue.tryEnqueue((const Message*)message.data(), message.size());
+            if (ok) {
+                reference.push_back(message);
+                referenceBytes += (sizeof(uint16_t) + message.size() + 1) & ~1;
+                nextId++;
+            } else {
+                // An empty queue always has room, otherwise the free space may be split in two
+                enqueueFailures++;
+                CHECK(!reference.empty());
+                CHECK(referenceBytes > 0);
+            }
+        } else {
+            uint16_t size = 0;
+            auto msg = (const uint8_t*)queue.peek(&size);
+            if (reference.empty()) {
+                CHECK(msg == nullptr);
+            } else if (CHECK(msg != nullptr)) {
+                auto& expected = reference.front();
+                CHECK_EQ(size, expected.size());
+                CHECK(memcmp(msg, expected.data(), size) == 0);
+                if (lastAddress != nullptr && msg < lastAddress) {
+                    wraps++;
+                }
+                lastAddress = msg;
+                referenceBytes -= (sizeof(uint16_t) + size + 1) & ~1;
+                reference.pop_front();
+                queue.pop();
+            }
+        }
+        CHECK_EQ(queue.count(), (int)reference.size());
+    }
+    printf("  %d steps, %d wraps, %d enqueues refused\n", STEP_COUNT, wraps, enqueueFailures);
+    CHECK(wraps > 1000);
+}
+
+bool acceptAll(const Message* msg, uint16_t size) {
+    return true;
+}
+
+bool refuseAll(const Message* msg, uint16_t size) {
+    return false;
+}
+
+void testTryDequeue() {
+    MessageQueue<QUEUE_SIZE> queue;
+    auto message = makeMessage(3, 10);
+    queue.tryEnqueue((const Message*)message.data(), message.size());
+    CHECK(!queue.tryDequeue(refuseAll));
+    CHECK_EQ(queue.count(), 1);
+    CHECK(queue.tryDequeue(acceptAll));
+    CHECK_EQ(queue.count(), 0);
+    CHECK(!queue.tryDequeue(acceptAll));
+}
+
+int main() {
+    testEmpty();
+    testFillAndDrain();
+    testRandomAgainstReference();
+    testTryDequeue();
+    return Test::report("message_queue_test");
+}
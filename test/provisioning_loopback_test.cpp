@@ -0,0 +1,258 @@
+// Host loopback test of provisioning a die over a 30ms connection: the app runs the factory
+// script either one request at a time, waiting for each reply, or with all the requests in
+// flight, matching the replies by their sequence byte. The message service, the settings and
+// the key value store are the real ones over the RAM backed flash, so the SetName ack is only
+// sent from the flash write callback. Every reply must carry the sequence of its request, and
+// pipelining must cut the provisioning time.
+
+#include "test.h"
+#include "bluetooth/bluetooth_message_service.h"
+#include "bluetooth/bluetooth_messages.h"
+#include "bluetooth/bluetooth_stack.h"
+#include "bluetooth/connection_profiles.h"
+#include "config/settings.h"
+#include "config/value_store.h"
+#include "config/dice_variants.h"
+#include "config/board_config.h"
+#include "drivers_nrf/flash.h"
+#include "drivers_nrf/timers.h"
+#include "nrf_fstorage.h"
+#include <string.h>
+#include <deque>
+#include <vector>
+
+TEST_MAIN_STATE
+
+using namespace Bluetooth;
+using namespace Config;
+using namespace DriversNRF;
+
+namespace Bluetooth::MessageService
+{
+    void onMessageReceived(const uint8_t* data, uint16_t len);
+}
+
+#define CONNECTION_INTERVAL_MS 30
+#define MAX_PACKETS_PER_EVENT 4 // Each way, what a phone typically fits in a connection event
+#define MAX_EVENTS 100
+
+typedef std::vector<uint8_t> Bytes;
+
+/// <summary>
+/// The connection: the app writes and the die notifications are exchanged at connection events
+/// </summary>
+namespace FakeLink
+{
+    std::deque<Bytes> toDie;
+    std::deque<Bytes> toApp;
+    uint32_t timeMs = 0;
+
+    void reset() {
+        toDie.clear();
+        toApp.clear();
+        timeMs = 0;
+    }
+}
+
+namespace Bluetooth::Stack
+{
+    SendResult send(uint16_t handle, const uint8_t* data, uint16_t len) {
+        // Like the SoftDevice queue, full until the next connection event
+        if (FakeLink::toApp.size() >= MAX_PACKETS_PER_EVENT) {
+            return SendResult_Busy;
+        }
+        FakeLink::toApp.push_back(Bytes(data, data + len));
+        return SendResult_Ok;
+    }
+    bool isConnected() { return true; }
+    uint16_t getMaxPayloadSize() { return 20; }
+    void hook(ConnectionEventMethod method, void* param) {}
+    void resetOnDisconnect() {}
+}
+
+namespace Bluetooth::ConnectionProfiles
+{
+    void notifyActivity() {}
+}
+
+namespace DriversNRF::Timers
+{
+    void createTimer(app_timer_id_t const * p_timer_id, app_timer_mode_t mode, app_timer_timeout_handler_t timeout_handler) {}
+    void startTimer(app_timer_id_t timer_id, uint32_t timeout_ms, void * p_context) {}
+    void stopTimer(app_timer_id_t timer_id) {}
+    uint32_t ticks() { return FakeLink::timeMs * 1000; }
+    uint32_t ticksToMicros(uint32_t ticks) { return ticks; }
+}
+
+namespace FakeDie
+{
+    Board board = {};
+    Core::int3 faceNormals[MAX_LED_COUNT] = {};
+    DiceVariants::Layout layout = { DiceVariants::DieLayoutType_D20, 20, 20, 3, faceNormals };
+}
+
+namespace Config::BoardManager
+{
+    const Board* getBoard() { return &FakeDie::board; }
+}
+
+namespace Config::DiceVariants
+{
+    DieType estimateDieTypeFromBoard() { return DieType_D20; }
+    LEDLayoutType getLayoutType(DieType dieType, BoardModel boardModel) { return DieLayoutType_D20; }
+    const Layout* getLayout(LEDLayoutType layoutType) { return &FakeDie::layout; }
+}
+
+namespace Config::ValueStore
+{
+    uint32_t readValue(ValueType typeStart, ValueType typeEnd) { return -1; }
+}
+
+namespace Pixel
+{
+    uint32_t getDeviceID() { return 0x12345678; }
+    uint32_t getBuildTimestamp() { return 0; }
+}
+
+namespace DataSet
+{
+    uint32_t computeDataSetDataSize(const Data* newData) { return 0; }
+}
+
+/// <summary>
+/// The other handlers of the script reply right away, like their firmware counterparts
+/// </summary>
+namespace FakeHandlers
+{
+    void requestRollState(const Message* msg) { MessageService::SendMessage(Message::MessageType_RollState); }
+    void requestTelemetry(const Message* msg) { MessageService::SendMessage(Message::MessageType_Telemetry); }
+    void blink(const Message* msg) { MessageService::SendMessage(Message::MessageType_BlinkAck); }
+    void storeValue(const Message* msg) { MessageService::SendMessage(Message::MessageType_StoreValueAck); }
+}
+
+struct Request
+{
+    Bytes message;
+    Message::MessageType reply;
+};
+
+template <typename Msg>
+Request makeRequest(const Msg& msg, Message::MessageType reply) {
+    return { Bytes((const uint8_t*)&msg, (const uint8_t*)&msg + sizeof(Msg)), reply };
+}
+
+std::vector<Request> makeScript(const char* name) {
+    MessageSetName nameMsg;
+    strncpy(nameMsg.name, name, MAX_NAME_LENGTH);
+    nameMsg.name[MAX_NAME_LENGTH] = '\0';
+    return {
+        makeRequest(Message(Message::MessageType_RequestRollState), Message::MessageType_RollState),
+        makeRequest(MessageRequestTelemetry(), Message::MessageType_Telemetry),
+        makeRequest(MessageBlink(), Message::MessageType_BlinkAck),
+        makeRequest(nameMsg, Message::MessageType_SetNameAck),
+        makeRequest(MessageStoreValue(), Message::MessageType_StoreValueAck),
+        makeRequest(Message(Message::MessageType_RequestRollState), Message::MessageType_RollState),
+    };
+}
+
+Bytes withSequence(const Bytes& message, uint8_t sequence) {
+    Bytes sequenced = message;
+    sequenced[0] |= MESSAGE_SEQUENCE_FLAG;
+    sequenced.insert(sequenced.begin() + sizeof(Message), sequence);
+    return sequenced;
+}
+
+/// <summary>
+/// Runs the script and returns how long it took, in milliseconds
+/// </summary>
+uint32_t provision(const std::vector<Request>& script, bool pipelined) {
+    FakeLink::reset();
+    int sent = 0;
+    int replied = 0;
+    if (pipelined) {
+        for (; sent < (int)script.size(); ++sent) {
+            FakeLink::toDie.push_back(withSequence(script[sent].message, sent));
+        }
+    } else {
+        FakeLink::toDie.push_back(script[sent++].message);
+    }
+
+    int events = 0;
+    while (replied < (int)script.size() && events < MAX_EVENTS) {
+        // Connection event, the writes and notifications queued since the last one go through
+        for (int i = 0; i < MAX_PACKETS_PER_EVENT && !FakeLink::toDie.empty(); ++i) {
+            auto& write = FakeLink::toDie.front();
+            MessageService::onMessageReceived(write.data(), write.size());
+            FakeLink::toDie.pop_front();
+        }
+        auto notifications = FakeLink::toApp;
+        FakeLink::toApp.clear();
+        for (auto& notification : notifications) {
+            uint8_t type = notification[0] & ~MESSAGE_SEQUENCE_FLAG;
+            if (pipelined) {
+                // Replies may come in any order, the sequence tells which request they answer
+                if (!CHECK(notification[0] & MESSAGE_SEQUENCE_FLAG) || !CHECK(notification.size() > sizeof(Message))) {
+                    continue;
+                }
+                int sequence = notification[sizeof(Message)];
+                if (CHECK(sequence < (int)script.size()) && !CHECK_EQ((int)type, (int)script[sequence].reply)) {
+                    printf("  reply to request %d\n", sequence);
+                }
+            } else {
+                CHECK(!(notification[0] & MESSAGE_SEQUENCE_FLAG));
+                CHECK_EQ((int)type, (int)script[replied].reply);
+                if (sent < (int)script.size()) {
+                    FakeLink::toDie.push_back(script[sent++].message);
+                }
+            }
+            replied++;
+        }
+
+        // The die main loop until the next event, the flash is written in the meantime
+        MessageService::update();
+        Stubs::runFlash();
+        MessageService::update();
+        FakeLink::timeMs += CONNECTION_INTERVAL_MS;
+        events++;
+    }
+    CHECK_EQ(replied, (int)script.size());
+    CHECK(FakeLink::toApp.empty());
+    return FakeLink::timeMs;
+}
+
+void testProvisioningTime() {
+    auto serializedScript = makeScript("Pixel Serial");
+    auto serializedTime = provision(serializedScript, false);
+    CHECK(strcmp(SettingsManager::getName(), "Pixel Serial") == 0);
+
+    auto pipelinedScript = makeScript("Pixel Pipelined");
+    auto pipelinedTime = provision(pipelinedScript, true);
+    CHECK(strcmp(SettingsManager::getName(), "Pixel Pipelined") == 0);
+
+    // Two intervals per request one at a time, against a couple for the whole script
+    CHECK(pipelinedTime * 2 <= serializedTime);
+    printf("  %d requests at %dms: %dms one at a time, %dms pipelined\n",
+        (int)serializedScript.size(), CONNECTION_INTERVAL_MS, (int)serializedTime, (int)pipelinedTime);
+}
+
+void initDie() {
+    Stubs::eraseFlash();
+    Flash::init();
+    MessageService::init();
+    static bool initialized;
+    initialized = false;
+    SettingsManager::init([] { initialized = true; });
+    Stubs::runFlash();
+    CHECK(initialized);
+
+    MessageService::RegisterMessageHandler(Message::MessageType_RequestRollState, FakeHandlers::requestRollState);
+    MessageService::RegisterMessageHandler(Message::MessageType_RequestTelemetry, FakeHandlers::requestTelemetry);
+    MessageService::RegisterMessageHandler(Message::MessageType_Blink, FakeHandlers::blink);
+    MessageService::RegisterMessageHandler(Message::MessageType_StoreValue, FakeHandlers::storeValue);
+}
+
+int main() {
+    initDie();
+    testProvisioningTime();
+    return Test::report("provisioning_loopback_test");
+}
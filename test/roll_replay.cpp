@@ -0,0 +1,571 @@
+// Replays labeled accelerometer traces through the roll classifier (Modules::Accelerometer)
+// and reports, for each configuration of the settings, how long it takes to detect rolls
+// and how often it detects rolls that didn't happen.
+//
+// Usage: roll_replay [--jerk-rms N] [--magnitude-deviation N] [--orientation-change N] [trace.csv ...]
+// The thresholds are the candidate values of the motion feature settings, compared against the
+// classifier with those checks disabled. Without trace files, built-in synthetic traces are used.
+//
+// Trace files have one reading per line: time (ms), x, y, z (1/1000 g), label
+// where the label is the ground truth for that reading: still, handling or rolling.
+// Traces downloaded with the roll trace recorder can be converted to this format and labeled
+// by hand (e.g. from a video of the rolls). Lines starting with # are ignored.
+
+#include "test.h"
+#include "modules/accelerometer.h"
+#include "drivers_hw/accel_chip.h"
+#include "config/settings.h"
+#include "config/dice_variants.h"
+#include "bluetooth/bluetooth_message_service.h"
+#include "bluetooth/bluetooth_stack.h"
+#include "drivers_nrf/flash.h"
+#include "drivers_nrf/gpiote.h"
+#include "drivers_nrf/timers.h"
+#include "config/board_config.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <string>
+
+TEST_MAIN_STATE
+
+using namespace Modules;
+using namespace Modules::Accelerometer;
+using namespace Core;
+
+#define SAMPLE_PERIOD_MS 160        // The accelerometer runs at 6.25Hz
+#ifndef MAX_ACCELERATION_FRAMES
+#define MAX_ACCELERATION_FRAMES 3   // Window of the classifier, same default as accelerometer.cpp
+#endif
+#define DETECTION_GRACE_MS 1000     // A roll detected this long after the die stopped still counts
+
+enum Label
+{
+    Label_Still = 0,
+    Label_Handling,
+    Label_Rolling,
+};
+
+struct Reading
+{
+    uint32_t time;
+    int3 acc;
+    Label label;
+};
+
+struct Trace
+{
+    std::string name;
+    std::vector<Reading> readings;
+};
+
+// Firmware stubs
+static Config::Settings settings;
+static Config::RollThresholds rollThresholds;
+static const int3 d6Normals[] = {
+    int3(0, 0, 1000), int3(1000, 0, 0), int3(0, 1000, 0),
+    int3(0, -1000, 0), int3(-1000, 0, 0), int3(0, 0, -1000),
+};
+static const Config::DiceVariants::Layout d6Layout = { (Config::DiceVariants::LEDLayoutType)0, 6, 6, 4, d6Normals };
+static uint32_t currentTime = 0;
+static int3 currentAcc;
+static DriversHW::AccelChip::AccelClientMethod accelClient = nullptr;
+
+namespace Config::SettingsManager
+{
+    Config::Settings const * const getSettings() { return &settings; }
+    const Config::RollThresholds* getRollThresholds() { return &rollThresholds; }
+    const Core::int3* getFaceNormals() { return d6Normals; }
+    DiceVariants::DieType getDieType() { return DiceVariants::DieType_D6; }
+    const DiceVariants::Layout* getLayout() { return &d6Layout; }
+    void programCalibrationData(const Core::int3* newNormals, int count, SettingsWrittenCallback callback) {}
+}
+
+namespace Config::BoardManager
+{
+    const Board* getBoard() {
+        static Board board = {};
+        return &board;
+    }
+}
+
+namespace DriversHW::AccelChip
+{
+    void init(InitCallback callback) { callback(true); }
+    void read(Core::int3* outAccel) { *outAccel = currentAcc; }
+    void enableInterrupt() {}
+    void enableDataInterrupt() {}
+    void disableInterrupt() {}
+    void disableDataInterrupt() {}
+    void clearInterrupt() {}
+    void lowPower() {}
+    void hook(AccelClientMethod method, void* param) { accelClient = method; }
+    void unHook(AccelClientMethod client) { accelClient = nullptr; }
+    void unHookWithParam(void* param) { accelClient = nullptr; }
+}
+
+namespace DriversNRF
+{
+    namespace Timers
+    {
+        int millis() { return currentTime; }
+    }
+    namespace Flash
+    {
+        void hookProgrammingEvent(ProgrammingEventMethod method, void* param) {}
+    }
+    namespace GPIOTE
+    {
+        void enableInterrupt(uint32_t pin, nrf_gpio_pin_pull_t pull, nrf_gpiote_polarity_t polarity, PinHandler handler) {}
+        void disableInterrupt(uint32_t pin) {}
+    }
+}
+
+namespace Bluetooth
+{
+    namespace MessageService
+    {
+        void RegisterMessageHandler(Message::MessageType msgType, MessageHandler handler) {}
+        void NotifyUser(const char* text, bool ok, bool cancel, uint8_t timeout_s, NotifyUserCallback callback) {}
+    }
+    namespace Stack
+    {
+        void hook(ConnectionEventMethod method, void* param) {}
+        void unHook(ConnectionEventMethod client) {}
+    }
+}
+
+// Synthetic traces
+
+static uint32_t randomState = 1;
+
+float randomFloat(float min, float max) {
+    randomState = randomState * 1664525 + 1013904223;
+    return min + (max - min) * (randomState >> 8) / (float)(1 << 24);
+}
+
+struct Vec
+{
+    float x, y, z;
+};
+
+Vec rotate(Vec v, Vec axis, float angle) {
+    // Rodrigues' rotation formula, axis is normalized
+    float c = cosf(angle);
+    float s = sinf(angle);
+    float dot = v.x * axis.x + v.y * axis.y + v.z * axis.z;
+    Vec cross = { axis.y * v.z - axis.z * v.y, axis.z * v.x - axis.x * v.z, axis.x * v.y - axis.y * v.x };
+    return {
+        v.x * c + cross.x * s + axis.x * dot * (1 - c),
+        v.y * c + cross.y * s + axis.y * dot * (1 - c),
+        v.z * c + cross.z * s + axis.z * dot * (1 - c) };
+}
+
+Vec randomAxis() {
+    Vec a = { randomFloat(-1, 1), randomFloat(-1, 1), randomFloat(-1, 1) };
+    float n = sqrtf(a.x * a.x + a.y * a.y + a.z * a.z);
+    return { a.x / n, a.y / n, a.z / n };
+}
+
+/// <summary>
+/// Appends readings of the die moving as described: each sample, the gravity direction rotates
+/// by the given angle (degrees) and the magnitude is scaled by a random factor in the given range
+/// </summary>
+void addMotion(Trace& trace, Vec& gravity, int sampleCount, float minAngle, float maxAngle,
+    float minMagnitude, float maxMagnitude, float noise, Label label) {
+    uint32_t time = trace.readings.empty() ? 0 : trace.readings.back().time;
+    for (int i = 0; i < sampleCount; ++i) {
+        gravity = rotate(gravity, randomAxis(), randomFloat(minAngle, maxAngle) * (float)M_PI / 180.0f);
+        float magnitude = randomFloat(minMagnitude, maxMagnitude);
+        time += SAMPLE_PERIOD_MS;
+        Reading r;
+        r.time = time;
+        r.acc = int3(
+            (int)(gravity.x * magnitude + randomFloat(-noise, noise)),
+            (int)(gravity.y * magnitude + randomFloat(-noise, noise)),
+            (int)(gravity.z * magnitude + randomFloat(-noise, noise)));
+        r.label = label;
+        trace.readings.push_back(r);
+    }
+}
+
+void addStill(Trace& trace, Vec& gravity, int sampleCount) {
+    // Snap to the closest face, the die lands flat
+    float ax = fabsf(gravity.x), ay = fabsf(gravity.y), az = fabsf(gravity.z);
+    if (ax >= ay && ax >= az) {
+        gravity = { gravity.x > 0 ? 1000.0f : -1000.0f, 0, 0 };
+    } else if (ay >= az) {
+        gravity = { 0, gravity.y > 0 ? 1000.0f : -1000.0f, 0 };
+    } else {
+        gravity = { 0, 0, gravity.z > 0 ? 1000.0f : -1000.0f };
+    }
+    addMotion(trace, gravity, sampleCount, 0, 0, 1.0f, 1.0f, 10, Label_Still);
+}
+
+std::vector<Trace> makeSyntheticTraces() {
+    std::vector<Trace> traces;
+    Vec gravity = { 0, 0, 1000 };
+    randomState = 1;
+
+    // Picked up, shaken a bit, thrown and tumbling to a stop
+    for (int i = 0; i < 20; ++i) {
+        Trace t;
+        t.name = "synthetic throw";
+        addStill(t, gravity, 10);
+        addMotion(t, gravity, 8, 5, 20, 0.9f, 1.1f, 60, Label_Handling);
+        addMotion(t, gravity, 6, 60, 180, 0.3f, 2.5f, 100, Label_Rolling);
+        addMotion(t, gravity, 3, 20, 60, 0.7f, 1.4f, 50, Label_Rolling);
+        addStill(t, gravity, 12);
+        traces.push_back(t);
+    }
+
+    // Nudged or dropped from low, a short tumble of one or two faces
+    for (int i = 0; i < 20; ++i) {
+        Trace t;
+        t.name = "synthetic short roll";
+        addStill(t, gravity, 10);
+        addMotion(t, gravity, 3, 25, 50, 0.6f, 1.6f, 40, Label_Rolling);
+        addStill(t, gravity, 12);
+        traces.push_back(t);
+    }
+
+    // Turned over in the hand, looked at and put back down
+    for (int i = 0; i < 20; ++i) {
+        Trace t;
+        t.name = "synthetic handling";
+        addStill(t, gravity, 10);
+        addMotion(t, gravity, 25, 3, 18, 0.85f, 1.15f, 60, Label_Handling);
+        addStill(t, gravity, 12);
+        traces.push_back(t);
+    }
+
+    // Carried around, in a pocket or a bag
+    for (int i = 0; i < 10; ++i) {
+        Trace t;
+        t.name = "synthetic carried";
+        addStill(t, gravity, 5);
+        addMotion(t, gravity, 40, 2, 10, 0.7f, 1.3f, 80, Label_Handling);
+        addStill(t, gravity, 12);
+        traces.push_back(t);
+    }
+    return traces;
+}
+
+// Trace files
+
+bool parseLabel(const char* text, Label* outLabel) {
+    while (*text == ' ' || *text == '\t') {
+        text++;
+    }
+    if (strncmp(text, "still", 5) == 0 || *text == '0') {
+        *outLabel = Label_Still;
+    } else if (strncmp(text, "handling", 8) == 0 || *text == '1') {
+        *outLabel = Label_Handling;
+    } else if (strncmp(text, "rolling", 7) == 0 || *text == '2') {
+        *outLabel = Label_Rolling;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool loadTrace(const char* path, Trace* outTrace) {
+    FILE* file = fopen(path, "r");
+    if (file == nullptr) {
+        printf("Can't open %s\n", path);
+        return false;
+    }
+    outTrace->name = path;
+    char line[256];
+    int lineNumber = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        lineNumber++;
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') {
+            continue;
+        }
+        unsigned time;
+        int x, y, z;
+        int consumed = 0;
+        Reading r;
+        if (sscanf(line, "%u,%d,%d,%d,%n", &time, &x, &y, &z, &consumed) < 4 || consumed == 0 ||
+            !parseLabel(line + consumed, &r.label)) {
+            printf("%s:%d: invalid reading\n", path, lineNumber);
+            ok = false;
+            break;
+        }
+        r.time = time;
+        r.acc = int3(x, y, z);
+        outTrace->readings.push_back(r);
+    }
+    fclose(file);
+    return ok && !outTrace->readings.empty();
+}
+
+// Replay
+
+struct Results
+{
+    int rollCount;
+    int detectedCount;
+    uint32_t totalLatencyMs;
+    uint32_t maxLatencyMs;
+    int falseRollCount;
+    uint32_t notRollingMs;
+    int predictedCount;
+    int confirmedCount;
+    uint32_t totalLeadMs;   // How much earlier than the Rolled state the confirmed predictions came
+};
+
+static std::vector<AccelFrame> frames;
+static uint32_t predictionTime;
+
+void onFrame(void* param, const AccelFrame& frame) {
+    frames.push_back(frame);
+}
+
+void onProvisionalRoll(void* param, ProvisionalRollEvent event, int face) {
+    auto results = (Results*)param;
+    switch (event) {
+        case ProvisionalRollEvent_Predicted:
+            results->predictedCount++;
+            predictionTime = currentTime;
+            break;
+        case ProvisionalRollEvent_Confirmed:
+            {
+                // Confirmations come with the Rolled state
+                uint32_t lead = currentTime - predictionTime;
+                results->confirmedCount++;
+                results->totalLeadMs += lead;
+                CHECK(lead > 0);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Time intervals of the ground truth rolls
+struct Segment
+{
+    uint32_t start;
+    uint32_t end;
+    bool detected;
+};
+
+void replay(const Trace& trace, Results& results) {
+    // Start from the first reading, as if the die had been lying there
+    currentTime = trace.readings[0].time;
+    currentAcc = trace.readings[0].acc;
+    Accelerometer::stop();
+    Accelerometer::start();
+    frames.clear();
+    Accelerometer::hookProvisionalRoll(onProvisionalRoll, &results);
+
+    int3 previousAcc = currentAcc;
+    for (size_t i = 1; i < trace.readings.size(); ++i) {
+        currentTime = trace.readings[i].time;
+        currentAcc = trace.readings[i].acc;
+        accelClient(nullptr, currentAcc);
+
+        // The thresholds still apply to the largest change on a single axis
+        int3 d = currentAcc - previousAcc;
+        int expected = MAX(abs(d.xTimes1000), MAX(abs(d.yTimes1000), abs(d.zTimes1000)));
+        CHECK_EQ(frames.back().agitationTimes1000, expected);
+        previousAcc = currentAcc;
+    }
+    Accelerometer::unHookProvisionalRoll(onProvisionalRoll);
+
+    std::vector<Segment> segments;
+    for (size_t i = 1; i < trace.readings.size(); ++i) {
+        auto& r = trace.readings[i];
+        if (r.label == Label_Rolling) {
+            if (trace.readings[i - 1].label != Label_Rolling) {
+                segments.push_back({ r.time, r.time, false });
+            }
+            segments.back().end = r.time;
+        } else {
+            results.notRollingMs += r.time - trace.readings[i - 1].time;
+        }
+    }
+
+    RollState previousState = RollState_OnFace;
+    for (auto& frame : frames) {
+        if (frame.determinedRollState == RollState_Rolling && previousState != RollState_Rolling) {
+            bool matched = false;
+            for (auto& s : segments) {
+                if (frame.time >= s.start && frame.time <= s.end + DETECTION_GRACE_MS) {
+                    if (!s.detected) {
+                        s.detected = true;
+                        uint32_t latency = frame.time - s.start;
+                        results.totalLatencyMs += latency;
+                        results.maxLatencyMs = MAX(results.maxLatencyMs, latency);
+                    }
+                    matched = true;
+                }
+            }
+            if (!matched) {
+                results.falseRollCount++;
+            }
+        }
+        previousState = frame.determinedRollState;
+    }
+    for (auto& s : segments) {
+        results.rollCount++;
+        results.detectedCount += s.detected ? 1 : 0;
+    }
+}
+
+/// <summary>
+/// What the classifier should decide from the last frames of the window, each one counted as
+/// agitated or not with the threshold in use when it was added
+/// </summary>
+RollState recountWindow(const std::vector<bool>& agitated) {
+    const int n = MAX_ACCELERATION_FRAMES;
+    int onFace = 0, handling = 0, rolling = 0, agitatedCount = 0;
+    for (size_t i = frames.size() - n; i < frames.size(); ++i) {
+        onFace += frames[i].estimatedRollState == EstimatedRollState_OnFace ? 1 : 0;
+        handling += frames[i].estimatedRollState == EstimatedRollState_Handling ? 1 : 0;
+        rolling += frames[i].estimatedRollState == EstimatedRollState_Rolling ? 1 : 0;
+        agitatedCount += agitated[i] ? 1 : 0;
+    }
+    RollState previous = frames[frames.size() - 2].determinedRollState;
+    if (onFace == n) {
+        // Always on a face for a D6
+        return previous == RollState_Rolling ? RollState_Rolled : RollState_OnFace;
+    } else if (handling == n) {
+        return RollState_Handling;
+    } else if (rolling >= n - 1 && agitatedCount > 0) {
+        return RollState_Rolling;
+    }
+    return previous;
+}
+
+void testWindowCounts(const std::vector<Trace>& traces) {
+    // The app may program new thresholds at any time, frames already in the window
+    // must leave it counted the way they entered it
+    int checked = 0;
+    int failures = 0;
+    for (auto& trace : traces) {
+        currentTime = trace.readings[0].time;
+        currentAcc = trace.readings[0].acc;
+        Accelerometer::stop();
+        Accelerometer::start();
+        frames.clear();
+        std::vector<bool> agitated;
+        for (size_t i = 1; i < trace.readings.size() && failures < 10; ++i) {
+            if (randomFloat(0, 1) < 0.2f) {
+                settings.upperThresholdTimes1000 = (int)randomFloat(200, 1500);
+            }
+            int threshold = settings.upperThresholdTimes1000;
+            currentTime = trace.readings[i].time;
+            currentAcc = trace.readings[i].acc;
+            accelClient(nullptr, currentAcc);
+            agitated.push_back(frames.back().agitationTimes1000 > threshold);
+            if (frames.size() <= MAX_ACCELERATION_FRAMES) {
+                // The window still holds the frame it was started with
+                continue;
+            }
+            RollState expected = recountWindow(agitated);
+            if (!CHECK_EQ(frames.back().determinedRollState, expected)) {
+                printf("  %s, reading %d\n", trace.name.c_str(), (int)i);
+                failures++;
+            }
+            checked++;
+        }
+    }
+    settings.upperThresholdTimes1000 = 750;
+    printf("  %d frames of a %d frame window checked against a recount\n", checked, MAX_ACCELERATION_FRAMES);
+}
+
+void setDefaultSettings() {
+    // Same values as SettingsManager::setDefaultParameters()
+    memset(&settings, 0, sizeof(settings));
+    settings.faceThresholdTimes1000 = 800;
+    settings.fallingThresholdTimes1000 = 100;
+    settings.lowerThresholdTimes1000 = 100;
+    settings.middleThresholdTimes1000 = 300;
+    settings.upperThresholdTimes1000 = 750;
+    // Same as SettingsManager::getRollThresholds() without a record in the key value store
+    memset(&rollThresholds, 0, sizeof(rollThresholds));
+}
+
+void printResults(const char* config, const char* traceName, const Results& r) {
+    printf("  %-9s %-22s rolls %3d, detected %3d, latency avg %4ums max %4ums, false rolls %2d (%.2f/min), "
+        "predictions %3d, confirmed %3d, %3ums early\n",
+        config, traceName, r.rollCount, r.detectedCount,
+        r.detectedCount > 0 ? r.totalLatencyMs / r.detectedCount : 0, r.maxLatencyMs,
+        r.falseRollCount, r.notRollingMs > 0 ? r.falseRollCount * 60000.0f / r.notRollingMs : 0.0f,
+        r.predictedCount, r.confirmedCount, r.confirmedCount > 0 ? r.totalLeadMs / r.confirmedCount : 0);
+}
+
+Results replayAll(const char* config, const std::vector<Trace>& traces) {
+    Results total = {};
+    size_t i = 0;
+    while (i < traces.size()) {
+        // Traces with the same name are reported together
+        Results results = {};
+        size_t j = i;
+        for (; j < traces.size() && traces[j].name == traces[i].name; ++j) {
+            replay(traces[j], results);
+        }
+        printResults(config, traces[i].name.c_str(), results);
+        total.rollCount += results.rollCount;
+        total.detectedCount += results.detectedCount;
+        total.totalLatencyMs += results.totalLatencyMs;
+        total.maxLatencyMs = MAX(total.maxLatencyMs, results.maxLatencyMs);
+        total.falseRollCount += results.falseRollCount;
+        total.notRollingMs += results.notRollingMs;
+        total.predictedCount += results.predictedCount;
+        total.confirmedCount += results.confirmedCount;
+        total.totalLeadMs += results.totalLeadMs;
+        i = j;
+    }
+    printResults(config, "all", total);
+    return total;
+}
+
+int main(int argc, char** argv) {
+    int jerkRms = 150;
+    int magnitudeDeviation = 50;
+    int orientationChange = 200;
+    std::vector<Trace> traces;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--jerk-rms") == 0 && i + 1 < argc) {
+            jerkRms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--magnitude-deviation") == 0 && i + 1 < argc) {
+            magnitudeDeviation = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--orientation-change") == 0 && i + 1 < argc) {
+            orientationChange = atoi(argv[++i]);
+        } else {
+            Trace t;
+            if (!loadTrace(argv[i], &t)) {
+                return 1;
+            }
+            traces.push_back(t);
+        }
+    }
+    if (traces.empty()) {
+        traces = makeSyntheticTraces();
+    }
+
+    setDefaultSettings();
+    Accelerometer::init([](bool result) {});
+    Accelerometer::hookFrameData(onFrame, nullptr);
+
+    Results baseline = replayAll("baseline", traces);
+
+    rollThresholds.jerkRmsTimes1000 = jerkRms;
+    rollThresholds.magnitudeDeviationTimes1000 = magnitudeDeviation;
+    rollThresholds.orientationChangeTimes1000 = orientationChange;
+    printf("  features: jerk RMS >= %d and (magnitude deviation >= %d or orientation change >= %d)\n",
+        jerkRms, magnitudeDeviation, orientationChange);
+    Results features = replayAll("features", traces);
+
+    // The motion features can only turn handling into rolling, never the other way around
+    CHECK(features.detectedCount >= baseline.detectedCount);
+
+    testWindowCounts(traces);
+    return Test::report("roll_replay");
+}
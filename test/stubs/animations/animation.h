@@ -0,0 +1,3 @@
+#pragma once
+// The sources include Animation.h by its lower case name, which only works on case insensitive file systems
+#include "animations/Animation.h"
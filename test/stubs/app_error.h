@@ -0,0 +1,9 @@
+#pragma once
+// Host stub of the nRF5 SDK error handling
+
+#include "sdk_errors.h"
+#include "nordic_common.h"
+
+#define APP_ERROR_CHECK(x) do { (void)(x); } while (0)
+#define APP_ERROR_HANDLER(x) do { (void)(x); } while (0)
+#define ASSERT(x) do { (void)(x); } while (0)
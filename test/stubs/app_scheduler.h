@@ -0,0 +1,6 @@
+#pragma once
+// Host stub of the nRF5 SDK scheduler types
+
+#include <stdint.h>
+
+typedef void (*app_sched_event_handler_t)(void* p_event_data, uint16_t event_size);
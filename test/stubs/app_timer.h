@@ -0,0 +1,17 @@
+#pragma once
+// Host stub of the nRF5 SDK app timer types
+
+#include <stdint.h>
+#include "sdk_errors.h"
+
+typedef enum
+{
+    APP_TIMER_MODE_SINGLE_SHOT,
+    APP_TIMER_MODE_REPEATED,
+} app_timer_mode_t;
+
+typedef struct app_timer_t* app_timer_id_t;
+typedef void (*app_timer_timeout_handler_t)(void* p_context);
+
+#define APP_TIMER_DEF(timer_id) static app_timer_id_t timer_id
+#define APP_TIMER_TICKS(ms) (ms)
@@ -0,0 +1,47 @@
+#pragma once
+// Host stub of the nRF5 SDK platform utilities and of the few Cortex-M intrinsics the
+// firmware uses. Interrupt state is simulated by the variables in the Stubs namespace,
+// tests change them to pretend they run from an interrupt or a critical region.
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sdk_errors.h"
+#include "nordic_common.h"
+
+#define APP_IRQ_PRIORITY_HIGHEST 0
+#define APP_IRQ_PRIORITY_HIGH    2
+#define APP_IRQ_PRIORITY_MID     4
+#define APP_IRQ_PRIORITY_LOW     6
+#define APP_IRQ_PRIORITY_LOWEST  7
+#define APP_IRQ_PRIORITY_THREAD  15
+
+typedef enum
+{
+    SPIM0_SPIS0_TWIM0_TWIS0_SPI0_TWI0_IRQn = 3,
+    IRQn_Count = 32,
+} IRQn_Type;
+
+namespace Stubs
+{
+    extern uint8_t interruptPriority;   // Priority of the running code, APP_IRQ_PRIORITY_THREAD in main
+    extern uint32_t primask;
+    extern bool irqEnabled[IRQn_Count];
+    extern bool irqPending[IRQn_Count];
+    extern void (*onPollPendingIRQ)(); // Lets a fake peripheral make progress while the firmware busy-waits
+}
+
+inline uint8_t current_int_priority_get() { return Stubs::interruptPriority; }
+inline uint32_t __get_PRIMASK() { return Stubs::primask; }
+inline void __set_PRIMASK(uint32_t mask) { Stubs::primask = mask; }
+inline uint32_t NVIC_GetEnableIRQ(IRQn_Type irq) { return Stubs::irqEnabled[irq]; }
+inline void NVIC_SetPendingIRQ(IRQn_Type irq) { Stubs::irqPending[irq] = true; }
+inline uint32_t NVIC_GetPendingIRQ(IRQn_Type irq) {
+    if (Stubs::onPollPendingIRQ != nullptr) {
+        Stubs::onPollPendingIRQ();
+    }
+    return Stubs::irqPending[irq];
+}
+inline void NVIC_ClearPendingIRQ(IRQn_Type irq) { Stubs::irqPending[irq] = false; }
+
+#define CRITICAL_REGION_ENTER() { uint32_t __primask = __get_PRIMASK(); __set_PRIMASK(1);
+#define CRITICAL_REGION_EXIT() __set_PRIMASK(__primask); }
@@ -0,0 +1,67 @@
+#pragma once
+// Host stub of the SoftDevice BLE types, only the few the firmware sources touch
+
+#include <stdint.h>
+#include "sdk_errors.h"
+
+#define BLE_CONN_HANDLE_INVALID 0xFFFF
+#define BLE_GATTS_SRVC_TYPE_PRIMARY 0x01
+
+enum
+{
+    BLE_GAP_EVT_CONNECTED = 0x10,
+    BLE_GAP_EVT_DISCONNECTED,
+    BLE_GATTS_EVT_WRITE = 0x50,
+    BLE_GATTS_EVT_HVN_TX_COMPLETE = 0x57,
+};
+
+typedef struct
+{
+    uint8_t uuid128[16];
+} ble_uuid128_t;
+
+typedef struct
+{
+    uint16_t uuid;
+    uint8_t type;
+} ble_uuid_t;
+
+typedef struct
+{
+    uint16_t value_handle;
+    uint16_t user_desc_handle;
+    uint16_t cccd_handle;
+    uint16_t sccd_handle;
+} ble_gatts_char_handles_t;
+
+typedef struct
+{
+    uint16_t handle;
+    uint16_t len;
+    uint8_t data[1];
+} ble_gatts_evt_write_t;
+
+typedef struct
+{
+    uint16_t evt_id;
+    uint16_t evt_len;
+} ble_evt_hdr_t;
+
+typedef struct
+{
+    ble_evt_hdr_t header;
+    union
+    {
+        struct
+        {
+            uint16_t conn_handle;
+            union
+            {
+                ble_gatts_evt_write_t write;
+            } params;
+        } gatts_evt;
+    } evt;
+} ble_evt_t;
+
+inline uint32_t sd_ble_uuid_vs_add(ble_uuid128_t const* p_vs_uuid, uint8_t* p_uuid_type) { *p_uuid_type = 2; return NRF_SUCCESS; }
+inline uint32_t sd_ble_gatts_service_add(uint8_t type, ble_uuid_t const* p_uuid, uint16_t* p_handle) { *p_handle = 1; return NRF_SUCCESS; }
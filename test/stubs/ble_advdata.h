@@ -0,0 +1,2 @@
+#pragma once
+// Host stub, the sources under test only include it
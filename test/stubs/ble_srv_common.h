@@ -0,0 +1,41 @@
+#pragma once
+// Host stub of the SDK BLE service helpers
+
+#include "ble.h"
+
+typedef enum
+{
+    SEC_NO_ACCESS = 0,
+    SEC_OPEN = 1,
+} security_req_t;
+
+typedef struct
+{
+    uint8_t broadcast : 1;
+    uint8_t read : 1;
+    uint8_t write_wo_resp : 1;
+    uint8_t write : 1;
+    uint8_t notify : 1;
+    uint8_t indicate : 1;
+    uint8_t auth_signed_wr : 1;
+} ble_gatt_char_props_t;
+
+typedef struct
+{
+    uint16_t uuid;
+    uint8_t uuid_type;
+    uint16_t max_len;
+    uint16_t init_len;
+    uint8_t* p_init_value;
+    bool is_var_len;
+    ble_gatt_char_props_t char_props;
+    security_req_t read_access;
+    security_req_t write_access;
+    security_req_t cccd_write_access;
+} ble_add_char_params_t;
+
+inline uint32_t characteristic_add(uint16_t service_handle, ble_add_char_params_t* p_char_props, ble_gatts_char_handles_t* p_char_handle) {
+    static uint16_t nextHandle = 0x10;
+    p_char_handle->value_handle = nextHandle++;
+    return NRF_SUCCESS;
+}
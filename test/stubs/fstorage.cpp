@@ -0,0 +1,111 @@
+// RAM backed flash behind the host stub of the fstorage, see nrf_fstorage.h
+
+#include "nrf_fstorage.h"
+#include "nrf_fstorage_sd.h"
+#include "nrf_soc.h"
+#include <string.h>
+#include <deque>
+
+nrf_fstorage_api_t nrf_fstorage_sd;
+
+namespace Stubs
+{
+    NRF_FICR_Type ficr = { STUB_FLASH_PAGE_SIZE, 48, { 0x12345678, 0x9ABCDEF0 } };
+    NRF_UICR_Type uicr;
+
+    uint8_t flash[STUB_FLASH_PAGE_SIZE * STUB_FLASH_MAX_PAGES] __attribute__ ((aligned (STUB_FLASH_PAGE_SIZE)));
+    uint32_t flashPageCount = 2;
+    uint32_t flashOperationCount = 0;
+    uint32_t flashErrorCount = 0;
+
+    static const nrf_fstorage_info_t flashInfo = { STUB_FLASH_PAGE_SIZE, 4, true, false };
+    static nrf_fstorage_t const * instance = nullptr;
+    static std::deque<nrf_fstorage_evt_t> pending;
+
+    uint32_t flashAddress() {
+        return (uint32_t)(uintptr_t)flash;
+    }
+
+    void eraseFlash() {
+        memset(flash, 0xFF, sizeof(flash));
+    }
+
+    int runFlash(int maxOperations) {
+        int count = 0;
+        while (!pending.empty() && count != maxOperations) {
+            nrf_fstorage_evt_t evt = pending.front();
+            pending.pop_front();
+            auto dst = (uint8_t*)(uintptr_t)evt.addr;
+            if (evt.id == NRF_FSTORAGE_EVT_ERASE_RESULT) {
+                memset(dst, 0xFF, evt.len * STUB_FLASH_PAGE_SIZE);
+            } else if (evt.id == NRF_FSTORAGE_EVT_WRITE_RESULT) {
+                auto src = (const uint8_t*)evt.p_src;
+                for (uint32_t i = 0; i < evt.len; ++i) {
+                    dst[i] &= src[i];
+                }
+            }
+            flashOperationCount++;
+            count++;
+            // Like the SoftDevice, the operation is done when the handler is called
+            instance->evt_handler(&evt);
+        }
+        return count;
+    }
+
+    void powerCut() {
+        pending.clear();
+    }
+
+    static ret_code_t queue(nrf_fstorage_evt_id_t id, uint32_t addr, void const * src, uint32_t len) {
+        nrf_fstorage_evt_t evt = { id, NRF_SUCCESS, addr, src, len, nullptr };
+        pending.push_back(evt);
+        return NRF_SUCCESS;
+    }
+
+    static ret_code_t refuse() {
+        flashErrorCount++;
+        return Stubs::refuse();
+    }
+
+    static bool inRange(nrf_fstorage_t const * p_fs, uint32_t addr, uint32_t len) {
+        return addr >= p_fs->start_addr && addr + len <= p_fs->end_addr;
+    }
+}
+
+ret_code_t nrf_fstorage_init(nrf_fstorage_t * p_fs, nrf_fstorage_api_t * p_api, void * p_param) {
+    p_fs->p_api = p_api;
+    p_fs->p_flash_info = &Stubs::flashInfo;
+    p_fs->start_addr = Stubs::flashAddress();
+    p_fs->end_addr = p_fs->start_addr + Stubs::flashPageCount * STUB_FLASH_PAGE_SIZE;
+    Stubs::instance = p_fs;
+    Stubs::pending.clear();
+    return NRF_SUCCESS;
+}
+
+ret_code_t nrf_fstorage_read(nrf_fstorage_t const * p_fs, uint32_t src, void * p_dest, uint32_t len) {
+    if (!Stubs::inRange(p_fs, src, len)) {
+        return Stubs::refuse();
+    }
+    // Synchronous, without an event, like the SoftDevice backend
+    memcpy(p_dest, (const void*)(uintptr_t)src, len);
+    return NRF_SUCCESS;
+}
+
+ret_code_t nrf_fstorage_write(nrf_fstorage_t const * p_fs, uint32_t dest, void const * p_src, uint32_t len, void * p_param) {
+    if (!Stubs::inRange(p_fs, dest, len) || dest % 4 != 0 || len % 4 != 0 || len == 0) {
+        return Stubs::refuse();
+    }
+    // The data isn't copied, it must stay valid until the operation completes
+    return Stubs::queue(NRF_FSTORAGE_EVT_WRITE_RESULT, dest, p_src, len);
+}
+
+ret_code_t nrf_fstorage_erase(nrf_fstorage_t const * p_fs, uint32_t page_addr, uint32_t len, void * p_param) {
+    if (!Stubs::inRange(p_fs, page_addr, len * STUB_FLASH_PAGE_SIZE) || page_addr % STUB_FLASH_PAGE_SIZE != 0 || len == 0) {
+        return Stubs::refuse();
+    }
+    return Stubs::queue(NRF_FSTORAGE_EVT_ERASE_RESULT, page_addr, nullptr, len);
+}
+
+bool nrf_fstorage_is_busy(nrf_fstorage_t const * p_fs) {
+    return !Stubs::pending.empty();
+}
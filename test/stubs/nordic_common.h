@@ -0,0 +1,6 @@
+#pragma once
+// Host stub of the nRF5 SDK common macros
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define UNUSED_PARAMETER(x) (void)(x)
@@ -0,0 +1,7 @@
+#pragma once
+// Host stub of the nRF5 SDK delays
+
+#include <stdint.h>
+
+inline void nrf_delay_ms(uint32_t ms) {}
+inline void nrf_delay_us(uint32_t us) {}
@@ -0,0 +1,16 @@
+#pragma once
+// Host stub of the nRF5 SDK GPIOTE driver types
+
+typedef enum
+{
+    NRF_GPIOTE_POLARITY_LOTOHI = 1,
+    NRF_GPIOTE_POLARITY_HITOLO,
+    NRF_GPIOTE_POLARITY_TOGGLE,
+} nrf_gpiote_polarity_t;
+
+typedef enum
+{
+    NRF_GPIO_PIN_NOPULL,
+    NRF_GPIO_PIN_PULLDOWN,
+    NRF_GPIO_PIN_PULLUP = 3,
+} nrf_gpio_pin_pull_t;
@@ -0,0 +1,7 @@
+#pragma once
+// Host stub of the nRF5 SDK watchdog driver header, only its types are needed
+
+#include <stdint.h>
+#include "sdk_errors.h"
+
+typedef uint32_t nrf_drv_wdt_channel_id;
@@ -0,0 +1,84 @@
+#pragma once
+// Host stub of the nRF5 SDK flash storage. The storage range is mapped onto Stubs::flash,
+// which behaves like NOR flash: erasing sets all the bits of a page, writing only clears them.
+// Operations are queued like with the SoftDevice backend, and complete one at a time when
+// the test calls Stubs::runFlash(). Stubs::powerCut() drops the queued operations instead.
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sdk_errors.h"
+
+// Set by the firmware Makefile, the stub ignores it and uses the address of Stubs::flash
+#ifndef FSTORAGE_START
+#define FSTORAGE_START 0x26000
+#endif
+
+#define STUB_FLASH_PAGE_SIZE 4096
+#define STUB_FLASH_MAX_PAGES 4
+
+typedef enum
+{
+    NRF_FSTORAGE_EVT_READ_RESULT,
+    NRF_FSTORAGE_EVT_WRITE_RESULT,
+    NRF_FSTORAGE_EVT_ERASE_RESULT,
+} nrf_fstorage_evt_id_t;
+
+typedef struct
+{
+    nrf_fstorage_evt_id_t id;
+    ret_code_t result;
+    uint32_t addr;
+    void const * p_src;
+    uint32_t len;
+    void * p_param;
+} nrf_fstorage_evt_t;
+
+typedef void (*nrf_fstorage_evt_handler_t)(nrf_fstorage_evt_t * p_evt);
+
+typedef struct
+{
+    uint32_t erase_unit;
+    uint32_t program_unit;
+    bool rmap;
+    bool wmap;
+} nrf_fstorage_info_t;
+
+typedef struct nrf_fstorage_api_s
+{
+    int unused;
+} nrf_fstorage_api_t;
+
+typedef struct
+{
+    nrf_fstorage_api_t const * p_api;
+    nrf_fstorage_info_t const * p_flash_info;
+    nrf_fstorage_evt_handler_t evt_handler;
+    uint32_t start_addr;
+    uint32_t end_addr;
+} nrf_fstorage_t;
+
+#define NRF_FSTORAGE_DEF(inst) inst
+
+ret_code_t nrf_fstorage_init(nrf_fstorage_t * p_fs, nrf_fstorage_api_t * p_api, void * p_param);
+ret_code_t nrf_fstorage_read(nrf_fstorage_t const * p_fs, uint32_t src, void * p_dest, uint32_t len);
+ret_code_t nrf_fstorage_write(nrf_fstorage_t const * p_fs, uint32_t dest, void const * p_src, uint32_t len, void * p_param);
+ret_code_t nrf_fstorage_erase(nrf_fstorage_t const * p_fs, uint32_t page_addr, uint32_t len, void * p_param);
+bool nrf_fstorage_is_busy(nrf_fstorage_t const * p_fs);
+
+namespace Stubs
+{
+    extern uint8_t flash[STUB_FLASH_PAGE_SIZE * STUB_FLASH_MAX_PAGES];
+    extern uint32_t flashPageCount;     // Pages mapped by the next nrf_fstorage_init()
+    extern uint32_t flashOperationCount; // Writes and erases completed so far
+    extern uint32_t flashErrorCount;    // Operations refused for a bad address or size
+
+    uint32_t flashAddress();
+    void eraseFlash();
+
+    // Completes up to maxOperations queued operations (all of them by default),
+    // including the ones queued by the event handlers. Returns how many were completed.
+    int runFlash(int maxOperations = -1);
+
+    // Drops the queued operations, as if the power was cut before they could complete
+    void powerCut();
+}
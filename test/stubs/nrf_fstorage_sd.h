@@ -0,0 +1,6 @@
+#pragma once
+// Host stub of the SoftDevice fstorage backend
+
+#include "nrf_fstorage.h"
+
+extern nrf_fstorage_api_t nrf_fstorage_sd;
@@ -0,0 +1,14 @@
+#pragma once
+// Host stub of the nRF5 SDK logger, logs are dropped
+
+#include "nordic_common.h"
+
+#define NRF_LOG_INFO(...) do {} while (0)
+#define NRF_LOG_DEBUG(...) do {} while (0)
+#define NRF_LOG_WARNING(...) do {} while (0)
+#define NRF_LOG_ERROR(...) do {} while (0)
+#define NRF_LOG_HEXDUMP_INFO(...) do {} while (0)
+#define NRF_LOG_HEXDUMP_DEBUG(...) do {} while (0)
+#define NRF_LOG_ERROR_STRING_GET(x) ""
+#define NRF_LOG_FLOAT_MARKER "%d.%02d"
+#define NRF_LOG_FLOAT(x) (int)(x), (int)(((x) - (int)(x)) * 100)
@@ -0,0 +1,2 @@
+#pragma once
+// Host stub of the nRF5 SDK power management
@@ -0,0 +1,2 @@
+#pragma once
+// Host stub of the SoftDevice handler, nothing the tested sources use
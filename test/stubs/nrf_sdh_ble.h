@@ -0,0 +1,6 @@
+#pragma once
+// Host stub of the SoftDevice handler BLE observers, tests call the observers directly
+
+#include "ble.h"
+
+#define NRF_SDH_BLE_OBSERVER(_name, _prio, _handler, _context) static const void* _name = (const void*)_handler
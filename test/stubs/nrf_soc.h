@@ -0,0 +1,29 @@
+#pragma once
+// Host stub of the SoftDevice SoC API and of the few configuration registers the firmware reads
+
+#include <stdint.h>
+#include "sdk_errors.h"
+
+typedef struct
+{
+    uint32_t CODEPAGESIZE;
+    uint32_t CODESIZE;
+    uint32_t DEVICEID[2];
+} NRF_FICR_Type;
+
+typedef struct
+{
+    uint32_t NRFFW[15];
+    uint32_t CUSTOMER[32];
+} NRF_UICR_Type;
+
+namespace Stubs
+{
+    extern NRF_FICR_Type ficr;
+    extern NRF_UICR_Type uicr;
+}
+
+#define NRF_FICR (&Stubs::ficr)
+#define NRF_UICR (&Stubs::uicr)
+
+inline uint32_t sd_app_evt_wait() { return NRF_SUCCESS; }
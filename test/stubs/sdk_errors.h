@@ -0,0 +1,15 @@
+#pragma once
+// Host stub of the nRF5 SDK error codes
+
+#include <stdint.h>
+
+typedef uint32_t ret_code_t;
+
+#define NRF_SUCCESS             0
+#define NRF_ERROR_INTERNAL      3
+#define NRF_ERROR_NO_MEM        4
+#define NRF_ERROR_NOT_FOUND     5
+#define NRF_ERROR_INVALID_STATE 8
+#define NRF_ERROR_INVALID_ADDR  16
+#define NRF_ERROR_BUSY          17
+#define NRF_ERROR_RESOURCES     19
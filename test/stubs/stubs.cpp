@@ -0,0 +1,12 @@
+// State behind the host stubs of the SDK
+
+#include "app_util_platform.h"
+
+namespace Stubs
+{
+    uint8_t interruptPriority = APP_IRQ_PRIORITY_THREAD;
+    uint32_t primask = 0;
+    bool irqEnabled[IRQn_Count];
+    bool irqPending[IRQn_Count];
+    void (*onPollPendingIRQ)() = nullptr;
+}
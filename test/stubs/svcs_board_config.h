@@ -0,0 +1,30 @@
+#pragma once
+// Host stub of the board description shared with the bootloader
+
+#include <stdint.h>
+
+enum class BoardModel : uint8_t
+{
+    Unsupported,
+    D,
+    PD,
+    D20V15,
+};
+
+struct Board
+{
+    uint8_t model;
+    uint32_t accInterruptPin;
+    uint32_t chargingStatePin;
+    uint32_t coilSensePin;
+    uint32_t debugLedIndex;
+    uint32_t ledCount;
+    uint32_t ledPowerPin;
+    uint32_t ledReturnPin;
+    uint32_t ntcSensePin;
+    uint32_t progPin;
+    uint32_t vbatSensePin;
+    uint32_t i2cClockPin;
+    uint32_t i2cDataPin;
+    uint32_t ledDataPin;
+};
@@ -0,0 +1,3 @@
+#pragma once
+// The sources include Utils.h by its lower case name, which only works on case insensitive file systems
+#include "utils/Utils.h"
@@ -0,0 +1,357 @@
+// Host test of the telemetry stream: accelerometer frames go through the stream encoder
+// and the messages it sends are decoded back, the way the app does, to the same frames
+// and slow fields. Also reports how many bytes a frame takes compared to MessageTelemetry.
+
+#include "test.h"
+#include "bluetooth/telemetry.h"
+#include "bluetooth/bluetooth_messages.h"
+#include "bluetooth/bluetooth_message_service.h"
+#include "bluetooth/bluetooth_stack.h"
+#include "bluetooth/connection_profiles.h"
+#include "drivers_hw/battery.h"
+#include "drivers_hw/coil.h"
+#include "modules/accelerometer.h"
+#include "modules/battery_controller.h"
+#include "modules/leds.h"
+#include "modules/temperature.h"
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+TEST_MAIN_STATE
+
+using namespace Bluetooth;
+using namespace Modules;
+
+#define FRAME_INTERVAL_MS 10
+#define FRAME_COUNT 20000
+#define SLOW_FIELDS_SIZE 16
+
+typedef std::vector<uint8_t> Bytes;
+
+static uint32_t randomState = 1;
+
+uint32_t randomInt(uint32_t max) {
+    randomState = randomState * 1664525 + 1013904223;
+    return (randomState >> 8) % max;
+}
+
+namespace FakeDie
+{
+    uint16_t maxPayloadSize = 20;
+    Accelerometer::FrameDataClientMethod frameHandler = nullptr;
+    std::vector<Bytes> messages;
+
+    // Slow fields
+    uint8_t batteryLevelPercent = 80;
+    uint16_t voltageMilli = 3900;
+    int32_t vCoilTimes1000 = 100;
+    uint8_t ledCurrent = 0;
+    int16_t mcuTempTimes100 = 2500;
+}
+
+namespace Bluetooth::MessageService
+{
+    bool isConnected() { return true; }
+    bool SendMessage(const Message* msg, int msgSize) {
+        auto data = (const uint8_t*)msg;
+        FakeDie::messages.push_back(Bytes(data, data + msgSize));
+        return true;
+    }
+    void RegisterMessageHandler(Message::MessageType msgType, MessageHandler handler) {}
+}
+
+namespace Bluetooth::Stack
+{
+    uint16_t getMaxPayloadSize() { return FakeDie::maxPayloadSize; }
+    void hook(ConnectionEventMethod method, void* param) {}
+    void unHook(ConnectionEventMethod client) {}
+    void hookRssi(RssiEventMethod method, void* param) {}
+    void unHookRssi(RssiEventMethod client) {}
+}
+
+namespace Bluetooth::ConnectionProfiles
+{
+    void holdInteractive() {}
+    void releaseInteractive() {}
+}
+
+namespace Modules::Accelerometer
+{
+    void hookFrameData(FrameDataClientMethod method, void* param) { FakeDie::frameHandler = method; }
+    void unHookFrameData(FrameDataClientMethod client) { FakeDie::frameHandler = nullptr; }
+}
+
+namespace Modules::Temperature
+{
+    int16_t getMCUTemperatureTimes100() { return FakeDie::mcuTempTimes100; }
+    int16_t getNTCTemperatureTimes100() { return 2400; }
+    bool hookTemperatureChange(TemperatureChangeClientMethod method, void* param) { return true; }
+    void unHookTemperatureChange(TemperatureChangeClientMethod client) {}
+}
+
+namespace Modules::BatteryController
+{
+    State getState() { return State_Ok; }
+    BatteryState getBatteryState() { return BatteryState_Ok; }
+    uint8_t getLevelPercent() { return FakeDie::batteryLevelPercent; }
+    uint16_t getVoltageMilli() { return FakeDie::voltageMilli; }
+    ControllerOverrideMode getControllerOverrideMode() { return ControllerOverrideMode_Default; }
+    void setUpdateRate(UpdateRate rate) {}
+    void unHookControllerState(BatteryControllerStateChangeHandler client) {}
+}
+
+namespace DriversHW::Battery
+{
+    bool checkCharging() { return false; }
+}
+
+namespace DriversHW::Coil
+{
+    int32_t getVCoilTimes1000() { return FakeDie::vCoilTimes1000; }
+    int32_t getVCoilMinTimes1000() { return FakeDie::vCoilTimes1000; }
+    int32_t getVCoilMaxTimes1000() { return FakeDie::vCoilTimes1000; }
+}
+
+namespace Modules::LEDs
+{
+    uint8_t computeCurrentEstimate() { return FakeDie::ledCurrent; }
+}
+
+namespace DriversNRF::Timers
+{
+    int millis() { return 0; }
+}
+
+struct DecodedFrame
+{
+    uint32_t time;
+    int x, y, z;
+    uint8_t face;
+    uint8_t rollState;
+    int confidence;
+    uint8_t slowFields[SLOW_FIELDS_SIZE]; // As last sent when the frame was
+};
+
+/// <summary>
+/// The app side of MessageTelemetryStream, slow fields carry over from message to message
+/// </summary>
+namespace Decoder
+{
+    const uint8_t slowFieldGroupSizes[] = { 6, 3, 2, 4, 1 };
+    uint8_t slowFields[SLOW_FIELDS_SIZE];
+
+    uint32_t readVarint(const Bytes& data, size_t& offset) {
+        uint32_t value = 0;
+        for (int shift = 0; offset < data.size(); shift += 7) {
+            uint8_t byte = data[offset++];
+            value |= (uint32_t)(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+        CHECK(!"truncated varint");
+        return value;
+    }
+
+    int32_t unzigzag(uint32_t value) {
+        return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+    }
+
+    void decode(const Bytes& message, std::vector<DecodedFrame>& frames) {
+        auto header = (const MessageTelemetryStream*)message.data();
+        CHECK_EQ(header->type, Message::MessageType_TelemetryStream);
+        size_t offset = offsetof(MessageTelemetryStream, data);
+        int fieldOffset = 0;
+        for (int i = 0; i < 5; ++i) {
+            if (header->fieldMask & (1 << i)) {
+                memcpy(&slowFields[fieldOffset], &message[offset], slowFieldGroupSizes[i]);
+                offset += slowFieldGroupSizes[i];
+            }
+            fieldOffset += slowFieldGroupSizes[i];
+        }
+
+        DecodedFrame frame = {};
+        frame.time = header->baseTime;
+        for (int i = 0; i < header->frameCount; ++i) {
+            uint32_t timeAndFlags = readVarint(message, offset);
+            if (i == 0) {
+                // Each message decodes on its own
+                CHECK_EQ(timeAndFlags & 3, 3);
+            }
+            frame.time += timeAndFlags >> TelemetryStreamFrameFlags_Count;
+            frame.x += unzigzag(readVarint(message, offset));
+            frame.y += unzigzag(readVarint(message, offset));
+            frame.z += unzigzag(readVarint(message, offset));
+            if (timeAndFlags & TelemetryStreamFrameFlags_FaceChanged) {
+                frame.face = message[offset++];
+                frame.rollState = message[offset++];
+            }
+            if (timeAndFlags & TelemetryStreamFrameFlags_ConfidenceChanged) {
+                frame.confidence += unzigzag(readVarint(message, offset));
+            }
+            memcpy(frame.slowFields, slowFields, SLOW_FIELDS_SIZE);
+            frames.push_back(frame);
+        }
+        CHECK_EQ(offset, message.size());
+    }
+}
+
+/// <summary>
+/// A die mostly at rest on a face with a bit of noise, rolled now and then
+/// </summary>
+std::vector<Accelerometer::AccelFrame> makeFrames(int count, bool rolling) {
+    std::vector<Accelerometer::AccelFrame> frames;
+    Accelerometer::AccelFrame frame = {};
+    frame.time = 1000;
+    frame.acc = Core::int3(0, 0, 1000);
+    frame.face = 1;
+    frame.determinedRollState = Accelerometer::RollState_OnFace;
+    frame.faceConfidenceTimes1000 = 1000;
+    int rollFrames = 0;
+    for (int i = 0; i < count; ++i) {
+        if (rolling && rollFrames == 0 && randomInt(300) == 0) {
+            rollFrames = 50 + randomInt(150);
+        }
+        if (rollFrames > 0) {
+            rollFrames--;
+            frame.acc.xTimes1000 += randomInt(1201) - 600;
+            frame.acc.yTimes1000 += randomInt(1201) - 600;
+            frame.acc.zTimes1000 += randomInt(1201) - 600;
+            frame.faceConfidenceTimes1000 = randomInt(1000);
+            frame.determinedRollState = Accelerometer::RollState_Rolling;
+            if (randomInt(10) == 0) {
+                frame.face = randomInt(20);
+            }
+            if (rollFrames == 0) {
+                frame.acc = Core::int3(0, 0, 1000);
+                frame.determinedRollState = Accelerometer::RollState_Rolled;
+                frame.faceConfidenceTimes1000 = 1000;
+            }
+        } else {
+            frame.acc.xTimes1000 = randomInt(7) - 3;
+            frame.acc.yTimes1000 = randomInt(7) - 3;
+            frame.acc.zTimes1000 = 1000 + randomInt(7) - 3;
+        }
+        frame.time += FRAME_INTERVAL_MS + randomInt(2);
+        frames.push_back(frame);
+    }
+    return frames;
+}
+
+/// <summary>
+/// Streams the frames and checks they decode to the same values, returns the bytes sent
+/// </summary>
+int streamFrames(const std::vector<Accelerometer::AccelFrame>& frames, uint16_t payloadSize, uint16_t maxLatencyMs) {
+    FakeDie::maxPayloadSize = payloadSize;
+    FakeDie::messages.clear();
+    Telemetry::startStream(maxLatencyMs);
+    for (auto& frame : frames) {
+        FakeDie::frameHandler(nullptr, frame);
+    }
+    Telemetry::stop();
+
+    std::vector<DecodedFrame> decoded;
+    int bytes = 0;
+    for (auto& message : FakeDie::messages) {
+        CHECK(message.size() <= payloadSize);
+        Decoder::decode(message, decoded);
+        bytes += message.size();
+    }
+    if (!CHECK_EQ(decoded.size(), frames.size())) {
+        return bytes;
+    }
+    for (size_t i = 0; i < frames.size(); ++i) {
+        auto& frame = frames[i];
+        auto& result = decoded[i];
+        bool same = result.time == frame.time &&
+            result.x == frame.acc.xTimes1000 && result.y == frame.acc.yTimes1000 && result.z == frame.acc.zTimes1000 &&
+            result.face == frame.face && result.rollState == frame.determinedRollState &&
+            result.confidence == frame.faceConfidenceTimes1000;
+        if (!CHECK(same)) {
+            printf("  frame %d: time %u/%u\n", (int)i, result.time, frame.time);
+            break;
+        }
+    }
+    return bytes;
+}
+
+void testRoundTrips() {
+    const uint16_t payloadSizes[] = { 20, 64, MAX_TELEMETRY_STREAM_DATA_SIZE + 7 };
+    for (auto payloadSize : payloadSizes) {
+        for (int rolling = 0; rolling < 2; ++rolling) {
+            auto frames = makeFrames(FRAME_COUNT, rolling);
+            int bytes = streamFrames(frames, payloadSize, 0);
+            printf("  payload %3d, %-7s: %.2f bytes per frame, %d for MessageTelemetry\n", payloadSize,
+                rolling ? "rolling" : "at rest", (float)bytes / frames.size(), (int)sizeof(MessageTelemetry));
+            // The 7 bytes header weighs a lot with the default MTU
+            CHECK(bytes < (int)(frames.size() * sizeof(MessageTelemetry)) / (payloadSize > 20 ? 4 : 2));
+        }
+    }
+}
+
+void testLongGaps() {
+    // Deltas too long for a frame start new messages, timestamps must not drift
+    auto frames = makeFrames(200, true);
+    uint32_t gaps[] = { 0x7FFFF, 0x80000, 3600 * 1000, 0x7FFFFFFF };
+    for (int i = 0; i < 4; ++i) {
+        for (size_t j = 40 * (i + 1); j < frames.size(); ++j) {
+            frames[j].time += gaps[i];
+        }
+    }
+    streamFrames(frames, 64, 0);
+    CHECK(FakeDie::messages.size() >= 4);
+}
+
+void testMaxLatency() {
+    auto frames = makeFrames(1000, false);
+    streamFrames(frames, MAX_TELEMETRY_STREAM_DATA_SIZE + 7, 50);
+    for (auto& message : FakeDie::messages) {
+        // Frames are about 10ms apart
+        auto header = (const MessageTelemetryStream*)message.data();
+        CHECK(header->frameCount <= 6);
+    }
+}
+
+void testSlowFields() {
+    auto frames = makeFrames(3000, false);
+    FakeDie::maxPayloadSize = 64;
+    FakeDie::messages.clear();
+    Telemetry::startStream(0);
+    for (size_t i = 0; i < frames.size(); ++i) {
+        if (i == 1000) {
+            FakeDie::batteryLevelPercent = 79;
+        }
+        FakeDie::frameHandler(nullptr, frames[i]);
+    }
+    Telemetry::stop();
+
+    // All of them in the first message, then only what changed
+    std::vector<DecodedFrame> decoded;
+    int withFields = 0;
+    for (size_t i = 0; i < FakeDie::messages.size(); ++i) {
+        auto header = (const MessageTelemetryStream*)FakeDie::messages[i].data();
+        if (i == 0) {
+            CHECK_EQ(header->fieldMask, 0x1F);
+        } else if (header->fieldMask != 0) {
+            withFields++;
+        }
+        Decoder::decode(FakeDie::messages[i], decoded);
+    }
+    CHECK_EQ(withFields, 1);
+    if (CHECK_EQ(decoded.size(), frames.size())) {
+        CHECK_EQ(decoded.front().slowFields[0], 80);
+        CHECK_EQ(decoded.back().slowFields[0], 79);
+        int16_t mcuTemp;
+        memcpy(&mcuTemp, &decoded.back().slowFields[11], sizeof(int16_t));
+        CHECK_EQ(mcuTemp, FakeDie::mcuTempTimes100);
+    }
+}
+
+int main() {
+    testRoundTrips();
+    testLongGaps();
+    testMaxLatency();
+    testSlowFields();
+    return Test::report("telemetry_stream_test");
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+// Minimal assertions for the host tests, a failed check is reported and counted
+// and the test binary exits with the number of failures.
+
+#include <stdio.h>
+#include <stdint.h>
+
+namespace Test
+{
+    extern int failures;
+    extern int checks;
+
+    inline bool check(bool condition, const char* expr, const char* file, int line)
+    {
+        checks++;
+        if (!condition) {
+            failures++;
+            printf("%s:%d: CHECK failed: %s\n", file, line, expr);
+        }
+        return condition;
+    }
+
+    inline int report(const char* name)
+    {
+        printf("%s: %d checks, %d failures\n", name, checks, failures);
+        return failures;
+    }
+}
+
+#define TEST_MAIN_STATE int Test::failures = 0; int Test::checks = 0;
+#define CHECK(expr) Test::check((expr), #expr, __FILE__, __LINE__)
+#define CHECK_EQ(a, b) Test::check((a) == (b), #a " == " #b, __FILE__, __LINE__)